@@ -0,0 +1,245 @@
+// Microbenchmarks for the hot paths of the C++ client
+//
+// Covers envelope building and serialization, for single messages and
+// multicasts, inbound scanning, parsing and handler lookup the way
+// RegistryConnection::on_message and UAP_Client::dispatch do it, intent
+// table lookups, and message id and timestamp generation. Nothing here
+// touches the network.
+//
+// Dependencies: those of uap_client.hpp, plus Google Benchmark
+// (https://github.com/google/benchmark)
+
+#include <benchmark/benchmark.h>
+
+#include "../uap_client.hpp"
+
+namespace {
+
+json sample_payload(size_t fields) {
+    json payload = json::object();
+    for (size_t i = 0; i < fields; ++i) {
+        payload["field" + std::to_string(i)] = {{"value", static_cast<double>(i) * 1.5}, {"unit", "celsius"}};
+    }
+    return payload;
+}
+
+// A text frame as the registry would deliver it
+std::string sample_frame(const std::string& intent, size_t fields) {
+    std::string frame;
+    write_raw_envelope(frame, generate_uuid(), "python_client", "cpp_client", intent,
+                       sample_payload(fields).dump(), wall_clock_ns());
+    return frame;
+}
+
+// Same envelope UAP_Client::make_envelope builds for send_message
+void BM_EnvelopeBuildDump(benchmark::State& state) {
+    json payload = sample_payload(static_cast<size_t>(state.range(0)));
+    OutboundFrame frame;
+    for (auto _ : state) {
+        int64_t ts_ns = wall_clock_ns();
+        json envelope = {
+            {"id", next_message_id().str()},
+            {"sender", "cpp_client"},
+            {"recipient", "python_client"},
+            {"intent", "sensor_reading"},
+            {"payload", payload},
+            {"timestamp", to_timestamp(ts_ns)},
+            {"ts_ns", ts_ns}
+        };
+        encode_envelope(envelope, WireEncoding::json, frame);
+        benchmark::DoNotOptimize(frame.data.data());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * frame.data.size()));
+}
+BENCHMARK(BM_EnvelopeBuildDump)->Arg(1)->Arg(16);
+
+void BM_EnvelopeEncodeCbor(benchmark::State& state) {
+    json envelope = json::parse(sample_frame("sensor_reading", static_cast<size_t>(state.range(0))));
+    OutboundFrame frame;
+    for (auto _ : state) {
+        encode_envelope(envelope, WireEncoding::cbor, frame);
+        benchmark::DoNotOptimize(frame.data.data());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * frame.data.size()));
+}
+BENCHMARK(BM_EnvelopeEncodeCbor)->Arg(1)->Arg(16);
+
+// send_raw's path: payload text spliced into a hand-written envelope
+void BM_RawEnvelope(benchmark::State& state) {
+    std::string payload = sample_payload(static_cast<size_t>(state.range(0))).dump();
+    std::string out;
+    for (auto _ : state) {
+        write_raw_envelope(out, next_message_id().view(), "cpp_client", "python_client", "sensor_reading",
+                           payload, wall_clock_ns());
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * out.size()));
+}
+BENCHMARK(BM_RawEnvelope)->Arg(1)->Arg(16);
+
+// A multicast to 1000 recipients without registry fan-out: the payload is
+// encoded once and every frame shares it (1), or each recipient gets its own
+// send_message envelope (0)
+void BM_MulticastEncode(benchmark::State& state) {
+    json payload = sample_payload(16);
+    bool shared_payload = state.range(0) != 0;
+    std::vector<OutboundFrame> frames(1000);
+    for (auto _ : state) {
+        SharedPayload shared(payload);
+        int64_t ts_ns = wall_clock_ns();
+        for (size_t i = 0; i < frames.size(); ++i) {
+            json envelope = {
+                {"id", next_message_id().str()},
+                {"sender", "cpp_client"},
+                {"recipient", "robot_" + std::to_string(i)},
+                {"intent", "config"},
+                {"timestamp", to_timestamp(ts_ns)},
+                {"ts_ns", ts_ns}
+            };
+            if (shared_payload) {
+                encode_envelope(envelope, WireEncoding::json, frames[i]);
+                reopen_envelope(frames[i].data, WireEncoding::json);
+                frames[i].tail = shared.tail(WireEncoding::json);
+            } else {
+                envelope["payload"] = payload;
+                encode_envelope(envelope, WireEncoding::json, frames[i]);
+            }
+        }
+        benchmark::DoNotOptimize(frames.data());
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * frames.size()));
+}
+BENCHMARK(BM_MulticastEncode)->Arg(0)->Arg(1);
+
+// Routing fields only; the payload stays unparsed
+void BM_InboundScan(benchmark::State& state) {
+    std::string frame = sample_frame("sensor_reading", static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        InboundMessage message{std::string(frame)};
+        benchmark::DoNotOptimize(message.intent().data());
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * frame.size()));
+}
+BENCHMARK(BM_InboundScan)->Arg(1)->Arg(16);
+
+// Frame arrival to handler return, with the handler reading the payload
+// through scratch_payload(); range(1) selects the per-connection arena (1)
+// or plain heap parsing (0)
+void BM_InboundParseDispatch(benchmark::State& state) {
+    std::string frame = sample_frame("sensor_reading", static_cast<size_t>(state.range(0)));
+    std::unique_ptr<MessageArena> arena;
+    if (state.range(1)) {
+        arena.reset(new MessageArena(64 * 1024));
+    }
+    
+    using Handler = std::function<void(const InboundMessage&)>;
+    IntentTable<Handler> handlers;
+    size_t seen = 0;
+    handlers.insert_or_assign("sensor_reading", [&seen](const InboundMessage& message) {
+        seen += message.scratch_payload().size();
+    });
+    for (int i = 0; i < 32; ++i) {
+        handlers.insert_or_assign("intent_" + std::to_string(i), [](const InboundMessage&) {});
+    }
+    
+    for (auto _ : state) {
+        {
+            InboundMessage message(std::string(frame), arena.get());
+            if (const Handler* handler = handlers.find(message.intent())) {
+                (*handler)(message);
+            }
+        }
+        if (arena) {
+            arena->reset();
+        }
+    }
+    benchmark::DoNotOptimize(seen);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * frame.size()));
+}
+BENCHMARK(BM_InboundParseDispatch)->ArgsProduct({{1, 16}, {0, 1}});
+
+// A batch frame of range(0) envelopes, unpacked as UAP_Client::on_inbound does
+void BM_InboundBatch(benchmark::State& state) {
+    json messages = json::array();
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        messages.push_back(json::parse(sample_frame("sensor_reading", 4)));
+    }
+    std::string frame = json{{"type", "batch"}, {"messages", messages}}.dump();
+    MessageArena arena(64 * 1024);
+    size_t seen = 0;
+    for (auto _ : state) {
+        {
+            InboundMessage batch(std::string(frame), &arena);
+            for (const inbound_json& envelope : batch.scratch_document()["messages"]) {
+                InboundMessage element = InboundMessage::copy_of(envelope, &arena);
+                seen += element.scratch_payload().size();
+            }
+        }
+        arena.reset();
+    }
+    benchmark::DoNotOptimize(seen);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_InboundBatch)->Arg(8)->Arg(64);
+
+void BM_IntentLookup(benchmark::State& state) {
+    IntentTable<int> table;
+    std::vector<std::string> intents;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        intents.push_back("intent_" + std::to_string(i));
+        table.insert_or_assign(intents.back(), static_cast<int>(i));
+    }
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(table.find(intents[i]));
+        if (++i == intents.size()) {
+            i = 0;
+        }
+    }
+}
+BENCHMARK(BM_IntentLookup)->Arg(8)->Arg(1024);
+
+void BM_StaticIntentLookup(benchmark::State& state) {
+    constexpr StaticIntent intent{"sensor_reading"};
+    IntentTable<int> table;
+    table.insert_or_assign(intent.name, intent.hash, 1);
+    for (int i = 0; i < 64; ++i) {
+        table.insert_or_assign("intent_" + std::to_string(i), i);
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(table.find(intent.name, intent.hash));
+    }
+}
+BENCHMARK(BM_StaticIntentLookup);
+
+void BM_MessageId(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(next_message_id());
+    }
+}
+BENCHMARK(BM_MessageId)->ThreadRange(1, 4);
+
+void BM_MessageIdString(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(generate_uuid());
+    }
+}
+BENCHMARK(BM_MessageIdString);
+
+void BM_WallClock(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(wall_clock_ns());
+    }
+}
+BENCHMARK(BM_WallClock);
+
+void BM_Timestamp(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(to_timestamp(wall_clock_ns()));
+    }
+}
+BENCHMARK(BM_Timestamp);
+
+}  // namespace
+
+BENCHMARK_MAIN();
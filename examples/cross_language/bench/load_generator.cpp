@@ -0,0 +1,225 @@
+// Load generator for the C++ client
+//
+// Connects N clients to a registry. Each sends M messages per second to the
+// next client in the ring, and every receiver records the latency from the
+// moment a message was scheduled to be sent until its handler ran. Scheduling
+// is open-loop, so a stalled sender shows up as latency rather than as a
+// lower send rate. Prints throughput and latency percentiles at the end.
+//
+// Usage:
+//   load_generator [--registry ws://localhost:8000] [--clients 4] [--rate 1000]
+//                  [--duration 10] [--warmup 2] [--payload 64] [--pool 1]
+//                  [--encoding json|cbor|msgpack]
+//
+// Latencies compare wall clocks, so all clients should run on one host
+// (they do, being one process); the registry may be anywhere.
+
+#include "../uap_client.hpp"
+
+namespace {
+
+struct LoadOptions {
+    std::string registry_url = "ws://localhost:8000";
+    size_t clients = 4;
+    uint64_t rate = 1000;
+    uint64_t duration_s = 10;
+    uint64_t warmup_s = 2;
+    size_t payload_bytes = 64;
+    size_t pool_size = 1;
+    WireEncoding encoding = WireEncoding::json;
+};
+
+void usage() {
+    std::cerr << "usage: load_generator [--registry URL] [--clients N] [--rate MSGS_PER_S]\n"
+                 "                      [--duration S] [--warmup S] [--payload BYTES] [--pool N]\n"
+                 "                      [--encoding json|cbor|msgpack]\n";
+}
+
+// Returns false on a malformed command line
+bool parse_args(int argc, char** argv, LoadOptions& options) {
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--help" || arg == "-h" || i + 1 >= argc) {
+                return false;
+            }
+            std::string value = argv[++i];
+            if (arg == "--registry") {
+                options.registry_url = value;
+            } else if (arg == "--clients") {
+                options.clients = std::stoul(value);
+            } else if (arg == "--rate") {
+                options.rate = std::stoull(value);
+            } else if (arg == "--duration") {
+                options.duration_s = std::stoull(value);
+            } else if (arg == "--warmup") {
+                options.warmup_s = std::stoull(value);
+            } else if (arg == "--payload") {
+                options.payload_bytes = std::stoul(value);
+            } else if (arg == "--pool") {
+                options.pool_size = std::stoul(value);
+            } else if (arg == "--encoding") {
+                auto encoding = parse_encoding(value);
+                if (!encoding) {
+                    return false;
+                }
+                options.encoding = *encoding;
+            } else {
+                return false;
+            }
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return options.clients > 0 && options.rate > 0 && options.duration_s > 0 && options.pool_size > 0;
+}
+
+std::string format_us(uint64_t ns) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.1f", static_cast<double>(ns) / 1000.0);
+    return text;
+}
+
+// What every receiver shares
+struct LoadResults {
+    LatencyHistogram latency;
+    std::atomic<uint64_t> received{0};
+    std::atomic<uint64_t> measured{0};
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> failed{0};
+};
+
+constexpr StaticIntent kLoadMessage{"load_message"};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    LoadOptions load;
+    if (!parse_args(argc, argv, load)) {
+        usage();
+        return 2;
+    }
+    set_log_level(LogLevel::warn);
+    
+    UAP_ClientOptions options;
+    options.pool_size = load.pool_size;
+    options.encodings = {load.encoding};
+    if (load.encoding != WireEncoding::json) {
+        options.encodings.push_back(WireEncoding::json);
+    }
+    
+    LoadResults results;
+    const std::string run_id = generate_uuid().substr(0, 8);
+    std::vector<std::unique_ptr<UAP_Client>> clients;
+    std::vector<std::string> entity_ids;
+    for (size_t i = 0; i < load.clients; ++i) {
+        entity_ids.push_back("load_" + run_id + "_" + std::to_string(i));
+        clients.emplace_back(new UAP_Client(entity_ids.back(), load.registry_url, options));
+        
+        // Messages scheduled during the warmup only count toward throughput
+        clients.back()->register_message_handler(kLoadMessage, [&results](const InboundMessage& message) {
+            int64_t now_ns = wall_clock_ns();
+            results.received.fetch_add(1, std::memory_order_relaxed);
+            const json& payload = message.payload();
+            auto scheduled = payload.find("scheduled_ns");
+            auto warmup = payload.find("warmup");
+            if (scheduled == payload.end() || !scheduled->is_number_integer() ||
+                (warmup != payload.end() && warmup->is_boolean() && warmup->get<bool>())) {
+                return;
+            }
+            int64_t latency = now_ns - scheduled->get<int64_t>();
+            results.latency.record(latency > 0 ? static_cast<uint64_t>(latency) : 0);
+            results.measured.fetch_add(1, std::memory_order_relaxed);
+        });
+    }
+    
+    for (size_t i = 0; i < clients.size(); ++i) {
+        if (!clients[i]->connect()) {
+            log(LogLevel::error, "Client " + entity_ids[i] + " failed to connect to " + load.registry_url);
+            return 1;
+        }
+    }
+    
+    // Every sender keeps to its own schedule of rate sends per second
+    const std::chrono::nanoseconds interval(1000000000ull / load.rate);
+    const auto start = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+    const auto measure_from = start + std::chrono::seconds(load.warmup_s);
+    const auto stop = measure_from + std::chrono::seconds(load.duration_s);
+    const int64_t steady_to_wall_ns = wall_clock_ns() -
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    const std::string padding(load.payload_bytes, 'x');
+    
+    std::vector<std::thread> senders;
+    for (size_t i = 0; i < clients.size(); ++i) {
+        senders.emplace_back([&, i]() {
+            UAP_Client& client = *clients[i];
+            const std::string& recipient = entity_ids[(i + 1) % entity_ids.size()];
+            std::string payload;
+            for (uint64_t seq = 0;; ++seq) {
+                auto scheduled = start + seq * interval;
+                if (scheduled >= stop) {
+                    break;
+                }
+                std::this_thread::sleep_until(scheduled);
+                int64_t scheduled_ns = steady_to_wall_ns +
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(scheduled.time_since_epoch()).count();
+                payload = "{\"seq\":" + std::to_string(seq) + ",\"scheduled_ns\":" + std::to_string(scheduled_ns) +
+                          ",\"warmup\":" + (scheduled < measure_from ? "true" : "false") + ",\"pad\":\"" + padding + "\"}";
+                if (client.send_raw(recipient, kLoadMessage.name, payload)) {
+                    results.sent.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    results.failed.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        });
+    }
+    
+    std::this_thread::sleep_until(measure_from);
+    uint64_t received_at_start = results.received.load();
+    std::this_thread::sleep_until(stop);
+    uint64_t received_in_window = results.received.load() - received_at_start;
+    for (auto& sender : senders) {
+        sender.join();
+    }
+    
+    // Give messages still in flight a moment to land
+    uint64_t expected = results.sent.load();
+    for (int i = 0; i < 200 && results.received.load() < expected; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    
+    uint64_t reconnects = 0;
+    uint64_t dropped = 0;
+    HistogramSnapshot enqueue_to_wire;
+    for (auto& client : clients) {
+        ClientStats stats = client->stats();
+        reconnects += stats.reconnects;
+        dropped += stats.dropped;
+        enqueue_to_wire.merge(stats.enqueue_to_wire);
+        client->disconnect();
+    }
+    
+    HistogramSnapshot latency = results.latency.snapshot();
+    double offered = static_cast<double>(load.rate) * static_cast<double>(load.clients);
+    double throughput = static_cast<double>(received_in_window) / static_cast<double>(load.duration_s);
+    
+    std::cout << "clients " << load.clients << ", " << load.rate << " msg/s each, " << load.duration_s
+              << " s after " << load.warmup_s << " s warmup, " << load.payload_bytes << " B padding, "
+              << encoding_name(load.encoding) << ", pool " << load.pool_size << "\n";
+    std::cout << "sent " << results.sent.load() << ", received " << results.received.load()
+              << ", failed " << results.failed.load() << ", dropped " << dropped
+              << ", reconnects " << reconnects << "\n";
+    std::cout << "throughput " << static_cast<uint64_t>(throughput) << " msg/s (offered "
+              << static_cast<uint64_t>(offered) << ")\n";
+    std::cout << "latency us  p50 " << format_us(latency.percentile(0.5))
+              << "  p90 " << format_us(latency.percentile(0.9))
+              << "  p99 " << format_us(latency.percentile(0.99))
+              << "  p99.9 " << format_us(latency.percentile(0.999))
+              << "  max " << format_us(latency.max)
+              << "  (" << results.measured.load() << " samples)\n";
+    std::cout << "enqueue_to_wire us  p50 " << format_us(enqueue_to_wire.percentile(0.5))
+              << "  p99 " << format_us(enqueue_to_wire.percentile(0.99))
+              << "  max " << format_us(enqueue_to_wire.max) << "\n";
+    
+    return results.failed.load() == 0 && results.received.load() >= expected ? 0 : 1;
+}
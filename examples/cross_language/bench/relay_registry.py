@@ -0,0 +1,174 @@
+"""
+Minimal registry relay for load testing the C++ client.
+
+Speaks just enough of the registry handshake (see docs/core_protocol.md) to
+route JSON text frames between entities: registrations are acknowledged with
+the JSON encoding and the relay's clock, batch frames are split per
+recipient, envelopes addressed to "*" are fanned out, and each entity only
+gets the intents it subscribed to. With --shm it also pairs entities that
+registered the same host_id with transport_offer frames, so the
+shared-memory transport can be measured. Subscriptions, fan-out and
+transport pairing are ProtocolCore's; the relay keeps no state of its own
+beyond the live connections and is not a substitute for the real registry.
+
+Needs the regennexus package importable (the bench image sets PYTHONPATH).
+"""
+
+import argparse
+import asyncio
+import json
+import logging
+import time
+
+import websockets
+
+from regennexus.protocol.protocol_core import Message, ProtocolCore
+
+logger = logging.getLogger("relay_registry")
+
+# entity_id -> connections of that entity, in registration order
+connections = {}
+
+# The registered entities, their subscriptions and same-host transports
+core = ProtocolCore(security_level=1)
+offer_shm = False
+
+
+class RelayEntity:
+    """A registered entity as far as ProtocolCore's routing needs: its id."""
+
+    def __init__(self, entity_id):
+        self.id = entity_id
+
+
+def routing_message(envelope):
+    """The fields of an envelope ProtocolCore.accepts() looks at, as a Message."""
+    message = Message(envelope.get("sender"), envelope.get("recipient"), None,
+                      intent=envelope.get("intent"),
+                      metadata={"reply_to": envelope.get("reply_to")})
+    message.id = envelope.get("id") or ""
+    return message
+
+
+def pick_connection(recipient, sender):
+    """Choose one of recipient's connections, keeping each sender on one."""
+    pool = connections.get(recipient)
+    if not pool:
+        return None
+    return pool[hash(sender) % len(pool)]
+
+
+async def fan_out(envelope, text=None):
+    """Deliver an envelope addressed to "*" to ProtocolCore.fanout_recipients(),
+    serializing it once for all of them."""
+    sender = envelope.get("sender")
+    recipients = core.fanout_recipients(envelope)
+    # Recipients get it without the list
+    if envelope.pop("recipients", None) is not None or text is None:
+        text = json.dumps(envelope)
+    message = routing_message(envelope)
+    for recipient in recipients:
+        if not core.accepts(recipient, message):
+            continue
+        connection = pick_connection(recipient, sender)
+        if connection is None:
+            continue
+        try:
+            await connection.send(text)
+        except websockets.ConnectionClosed:
+            pass
+
+
+async def forward(envelope, text=None):
+    """Send an envelope to its recipient; text is its serialized form if known.
+
+    Awaiting the send applies the recipient's backpressure to the sender.
+    """
+    if envelope.get("recipient") == "*":
+        await fan_out(envelope, text)
+        return
+    recipient = envelope.get("recipient")
+    if not core.accepts(recipient, routing_message(envelope)):
+        return
+    connection = pick_connection(recipient, envelope.get("sender"))
+    if connection is None:
+        return
+    try:
+        await connection.send(text if text is not None else json.dumps(envelope))
+    except websockets.ConnectionClosed:
+        pass
+
+
+async def send_control(outgoing):
+    """Send the (recipient, frame) pairs a ProtocolCore helper returned."""
+    for entity_id, frame in outgoing:
+        for connection in connections.get(entity_id, []):
+            try:
+                await connection.send(json.dumps(frame))
+            except websockets.ConnectionClosed:
+                pass
+
+
+async def handle(websocket):
+    entity_id = None
+    try:
+        async for frame in websocket:
+            if isinstance(frame, bytes):
+                # Only JSON is negotiated, so binary frames are unexpected
+                continue
+            message = json.loads(frame)
+            message_type = message.get("type")
+            if message_type == "registration":
+                entity_id = message.get("entity_id")
+                if entity_id not in connections:
+                    await core.register_entity(RelayEntity(entity_id))
+                connections.setdefault(entity_id, []).append(websocket)
+                await websocket.send(json.dumps({
+                    "type": "registration_ack",
+                    "encoding": "json",
+                    "fanout": True,
+                    "ts_ns": time.time_ns(),
+                }))
+                logger.info("Registered %s", entity_id)
+                core.apply_subscription_frame(entity_id, message)
+                if offer_shm:
+                    await send_control(core.register_transports(entity_id, message))
+            elif message_type in ("subscribe", "unsubscribe"):
+                if entity_id is not None:
+                    core.apply_subscription_frame(entity_id, message)
+            elif message_type == "batch":
+                for envelope in message.get("messages", []):
+                    await forward(envelope)
+            else:
+                await forward(message, frame)
+    except websockets.ConnectionClosed:
+        pass
+    finally:
+        if entity_id is not None:
+            pool = connections.get(entity_id, [])
+            if websocket in pool:
+                pool.remove(websocket)
+            if not pool:
+                connections.pop(entity_id, None)
+                await send_control(await core.unregister_entity(entity_id))
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=8000)
+    parser.add_argument("--shm", action="store_true",
+                        help="offer shared memory between entities on the same host")
+    args = parser.parse_args()
+
+    global offer_shm
+    offer_shm = args.shm
+
+    logging.basicConfig(level=logging.INFO)
+    async with websockets.serve(handle, args.host, args.port, max_size=None):
+        logger.info("Relay registry listening on %s:%d", args.host, args.port)
+        await asyncio.Future()
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
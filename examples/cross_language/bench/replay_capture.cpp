@@ -0,0 +1,220 @@
+// Replays a frame capture through the C++ client's dispatch
+//
+// Reads a capture written by a client with UAP_ClientOptions::capture_path
+// set, registers a handler for every intent the capture's traffic carries,
+// and feeds the inbound frames back through a fresh, unconnected client:
+// at the recorded pace, N times faster, or as fast as dispatch takes them.
+// Each handler does a fixed amount of busy work, standing in for the real
+// one. Prints throughput, wire-to-handler latency and handler durations, so
+// a change to parsing or dispatch can be measured against recorded traffic
+// instead of a synthetic load.
+//
+// Usage:
+//   replay_capture CAPTURE [--speed 1|N|max] [--pool 1] [--workers 0]
+//                  [--work-us 0] [--dictionary PATH]
+//
+// --pool should match the recording client's pool size, so each frame lands
+// on the connection it was read from; --dictionary is needed for captures
+// of compressed connections.
+
+#include "../uap_client.hpp"
+
+namespace {
+
+struct ReplayOptions {
+    std::string capture_path;
+    double speed = 1.0;
+    size_t pool_size = 1;
+    size_t workers = 0;
+    uint64_t work_us = 0;
+    std::string dictionary_path;
+};
+
+void usage() {
+    std::cerr << "usage: replay_capture CAPTURE [--speed 1|N|max] [--pool N] [--workers N]\n"
+                 "                      [--work-us US] [--dictionary PATH]\n";
+}
+
+// Returns false on a malformed command line
+bool parse_args(int argc, char** argv, ReplayOptions& options) {
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--help" || arg == "-h") {
+                return false;
+            }
+            if (arg.rfind("--", 0) != 0) {
+                if (!options.capture_path.empty()) {
+                    return false;
+                }
+                options.capture_path = arg;
+                continue;
+            }
+            if (i + 1 >= argc) {
+                return false;
+            }
+            std::string value = argv[++i];
+            if (arg == "--speed") {
+                options.speed = value == "max" ? 0.0 : std::stod(value);
+            } else if (arg == "--pool") {
+                options.pool_size = std::stoul(value);
+            } else if (arg == "--workers") {
+                options.workers = std::stoul(value);
+            } else if (arg == "--work-us") {
+                options.work_us = std::stoull(value);
+            } else if (arg == "--dictionary") {
+                options.dictionary_path = value;
+            } else {
+                return false;
+            }
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return !options.capture_path.empty() && options.speed >= 0 && options.pool_size > 0;
+}
+
+std::string format_us(uint64_t ns) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.1f", static_cast<double>(ns) / 1000.0);
+    return text;
+}
+
+// Intents named by a decoded frame: envelopes and batches carry them, the
+// registration lists the subscribed ones and intern definitions name the
+// ones binary envelopes only refer to by handle
+void collect_intents(const json& document, std::set<std::string>& intents) {
+    if (!document.is_object()) {
+        return;
+    }
+    auto intent = document.find("intent");
+    if (intent != document.end() && intent->is_string()) {
+        intents.insert(intent->get<std::string>());
+    }
+    auto messages = document.find("messages");
+    if (messages != document.end() && messages->is_array()) {
+        for (const json& element : *messages) {
+            collect_intents(element, intents);
+        }
+    }
+    auto interning = document.find("interning");
+    const json& definitions = interning != document.end() && interning->is_object() ? *interning : document;
+    auto names = definitions.find("intents");
+    if (names != definitions.end() && names->is_object()) {
+        for (const auto& [name, handle] : names->items()) {
+            intents.insert(name);
+        }
+    } else if (names != definitions.end() && names->is_array()) {
+        for (const json& name : *names) {
+            if (name.is_string()) {
+                intents.insert(name.get<std::string>());
+            }
+        }
+    }
+}
+
+// One pass over the capture, decoding every frame the way a connection would
+std::set<std::string> capture_intents(const std::string& path,
+                                      const std::vector<std::shared_ptr<const CompressionDictionary>>& dictionaries,
+                                      size_t& inbound_frames) {
+    std::set<std::string> intents;
+    FrameCompressor compressor;
+    CaptureReader reader(path);
+    CaptureReader::Frame frame;
+    while (reader.next(frame)) {
+        if (frame.direction == CaptureDirection::inbound) {
+            ++inbound_frames;
+        }
+        try {
+            std::string data(frame.data);
+            if (frame.opcode == websocketpp::frame::opcode::binary && is_compressed_frame(data)) {
+                data = compressor.decompress(data, dictionaries);
+            }
+            json document = frame.opcode == websocketpp::frame::opcode::text || (!data.empty() && data[0] == '{')
+                          ? json::parse(data) : decode_binary_envelope(data);
+            if (frame.direction == CaptureDirection::inbound || document.value("type", "") == "registration") {
+                collect_intents(document, intents);
+            }
+        } catch (const std::exception& e) {
+            log(LogLevel::debug, "Skipped undecodable frame: " + std::string(e.what()));
+        }
+    }
+    return intents;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    ReplayOptions replay;
+    if (!parse_args(argc, argv, replay)) {
+        usage();
+        return 2;
+    }
+    set_log_level(LogLevel::warn);
+    
+    UAP_ClientOptions options;
+    options.pool_size = replay.pool_size;
+    options.dispatch_workers = replay.workers;
+    options.offline_buffer_capacity = 0;
+    if (!replay.dictionary_path.empty()) {
+        try {
+            options.compression_dictionaries.push_back(CompressionDictionary::load(replay.dictionary_path));
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Cannot load dictionary: " + std::string(e.what()));
+            return 1;
+        }
+    }
+    
+    size_t inbound_frames = 0;
+    std::set<std::string> intents;
+    try {
+        intents = capture_intents(replay.capture_path, options.compression_dictionaries, inbound_frames);
+    } catch (const std::exception& e) {
+        log(LogLevel::error, "Cannot read " + replay.capture_path + ": " + e.what());
+        return 1;
+    }
+    
+    UAP_Client client("replay_" + generate_uuid().substr(0, 8), "ws://localhost:0", options);
+    std::atomic<uint64_t> handled{0};
+    const uint64_t work_ns = replay.work_us * 1000;
+    for (const std::string& intent : intents) {
+        client.register_message_handler(intent, [&handled, work_ns](const InboundMessage&) {
+            uint64_t until = monotonic_ns() + work_ns;
+            while (monotonic_ns() < until) {
+            }
+            handled.fetch_add(1, std::memory_order_relaxed);
+        });
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    if (!client.replay(replay.capture_path, replay.speed)) {
+        return 1;
+    }
+    // Lets handlers already handed to dispatch workers finish
+    client.disconnect();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    ClientStats stats = client.stats();
+    char speed[32];
+    std::snprintf(speed, sizeof(speed), "%gx", replay.speed);
+    std::cout << replay.capture_path << ": " << inbound_frames << " inbound frames, " << intents.size()
+              << " intents, speed " << (replay.speed > 0 ? speed : "max")
+              << ", pool " << replay.pool_size << ", workers " << replay.workers
+              << ", " << replay.work_us << " us work\n";
+    std::cout << "handled " << handled.load() << " messages in " << elapsed << " s ("
+              << static_cast<uint64_t>(static_cast<double>(handled.load()) / elapsed) << " msg/s), expired "
+              << stats.expired_inbound << "\n";
+    std::cout << "wire_to_handler us  p50 " << format_us(stats.wire_to_handler.percentile(0.5))
+              << "  p99 " << format_us(stats.wire_to_handler.percentile(0.99))
+              << "  p99.9 " << format_us(stats.wire_to_handler.percentile(0.999))
+              << "  max " << format_us(stats.wire_to_handler.max) << "\n";
+    for (const auto& [intent, duration] : stats.handler_duration) {
+        if (duration.count == 0) {
+            continue;
+        }
+        std::cout << "handler " << intent << " us  p50 " << format_us(duration.percentile(0.5))
+                  << "  p99 " << format_us(duration.percentile(0.99))
+                  << "  (" << duration.count << " calls)\n";
+    }
+    return 0;
+}
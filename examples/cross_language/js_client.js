@@ -42,10 +42,13 @@ class UAP_Client {
         this.connected = true;
         this.reconnectAttempts = 0;
         
-        // Register with the registry
+        // Register with the registry; the capabilities list this client in
+        // its directory
         const registrationMessage = {
           type: 'registration',
-          entity_id: this.entityId
+          entity_id: this.entityId,
+          entity_type: 'client',
+          capabilities: ['cpp_message', 'python_message']
         };
         
         this.ws.send(JSON.stringify(registrationMessage));
@@ -62,11 +62,12 @@ async def main():
             "message": "Hello from Python to C++!"
         }
         
-        # Send response back to C++ client
+        # Send response back to C++ client; reply_to lets its request() match it
         await client.send_message(
             recipient=message.sender,
             intent="python_response",
-            payload=response_data
+            payload=response_data,
+            reply_to=message.id
         )
         
         logger.info(f"Sent response to C++ client")
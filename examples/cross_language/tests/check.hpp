@@ -0,0 +1,87 @@
+// Minimal checks for the C++ client unit tests
+//
+// Each test_*.cpp is a standalone program: TEST(name) defines a case,
+// CHECK() records a failure and carries on, and run_tests() runs every case
+// and returns the process exit status. run_tests.sh builds and runs them all.
+
+#pragma once
+
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace uap_test {
+
+struct TestCase {
+    const char* name;
+    std::function<void()> body;
+};
+
+inline std::vector<TestCase>& registry() {
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+struct Registrar {
+    Registrar(const char* name, std::function<void()> body) {
+        registry().push_back({name, std::move(body)});
+    }
+};
+
+inline void fail(const char* file, int line, const std::string& what) {
+    std::cerr << file << ":" << line << ": CHECK failed: " << what << "\n";
+    ++failures();
+}
+
+inline int run_tests() {
+    for (const TestCase& test : registry()) {
+        int before = failures();
+        try {
+            test.body();
+        } catch (const std::exception& e) {
+            std::cerr << test.name << ": unexpected exception: " << e.what() << "\n";
+            ++failures();
+        }
+        std::cout << (failures() == before ? "[ ok ] " : "[FAIL] ") << test.name << "\n";
+    }
+    return failures() == 0 ? 0 : 1;
+}
+
+}  // namespace uap_test
+
+#define UAP_TEST_CAT2(a, b) a##b
+#define UAP_TEST_CAT(a, b) UAP_TEST_CAT2(a, b)
+
+#define TEST(name)                                                                     \
+    static void name();                                                                \
+    static ::uap_test::Registrar UAP_TEST_CAT(registrar_, name)(#name, name);          \
+    static void name()
+
+#define CHECK(condition)                                                               \
+    do {                                                                               \
+        if (!(condition)) {                                                            \
+            ::uap_test::fail(__FILE__, __LINE__, #condition);                          \
+        }                                                                              \
+    } while (0)
+
+#define CHECK_THROWS(expression)                                                       \
+    do {                                                                               \
+        bool threw = false;                                                            \
+        try {                                                                          \
+            (void)(expression);                                                        \
+        } catch (...) {                                                                \
+            threw = true;                                                              \
+        }                                                                              \
+        if (!threw) {                                                                  \
+            ::uap_test::fail(__FILE__, __LINE__, "expected exception from " #expression); \
+        }                                                                              \
+    } while (0)
+
+#define TEST_MAIN() \
+    int main() { return ::uap_test::run_tests(); }
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Builds and runs the C++ client unit tests. Run from anywhere; extra
+# compiler flags (include paths, sanitizers) can be passed in CXXFLAGS and
+# extra libraries in LDFLAGS.
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+out=${TEST_BUILD_DIR:-$(mktemp -d)}
+status=0
+
+for source in "$here"/test_*.cpp; do
+    name=$(basename "$source" .cpp)
+    echo "== $name"
+    ${CXX:-g++} -std=c++20 -O1 -g $CXXFLAGS "$source" -o "$out/$name" \
+        $LDFLAGS -lpthread -lssl -lcrypto -lzstd
+    "$out/$name" || status=1
+done
+
+exit $status
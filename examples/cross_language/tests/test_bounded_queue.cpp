@@ -0,0 +1,144 @@
+// BoundedQueue: capacity rounding, full and empty rings, cursor wrap-around
+// and buffer recycling through swapped cells
+
+#include <thread>
+
+#include "../uap_client.hpp"
+#include "check.hpp"
+
+TEST(capacity_rounds_up_to_power_of_two) {
+    CHECK(BoundedQueue<int>(0).capacity() == 2);
+    CHECK(BoundedQueue<int>(3).capacity() == 4);
+    CHECK(BoundedQueue<int>(8).capacity() == 8);
+    CHECK(BoundedQueue<int>(9).capacity() == 16);
+}
+
+TEST(empty_queue_pops_nothing) {
+    BoundedQueue<int> queue(4);
+    int value = 7;
+    CHECK(queue.empty());
+    CHECK(!queue.try_pop(value));
+    CHECK(value == 7);
+}
+
+TEST(full_queue_rejects_push) {
+    BoundedQueue<int> queue(4);
+    for (int i = 0; i < 4; ++i) {
+        int value = i;
+        CHECK(queue.try_push(std::move(value)));
+    }
+    CHECK(queue.size() == 4);
+
+    int extra = 99;
+    CHECK(!queue.try_push(std::move(extra)));
+    CHECK(extra == 99);
+    CHECK(queue.size() == 4);
+
+    // One pop frees exactly one cell
+    int value = -1;
+    CHECK(queue.try_pop(value));
+    CHECK(value == 0);
+    CHECK(queue.try_push(std::move(extra)));
+    int another = 100;
+    CHECK(!queue.try_push(std::move(another)));
+}
+
+TEST(order_survives_many_wraps) {
+    BoundedQueue<int> queue(4);
+    int next_in = 0;
+    int next_out = 0;
+    // Interleave so head and tail go around the ring many times at
+    // different offsets
+    for (int round = 0; round < 100; ++round) {
+        for (int i = 0; i < 1 + round % 4; ++i) {
+            int value = next_in;
+            if (queue.try_push(std::move(value))) {
+                ++next_in;
+            }
+        }
+        for (int i = 0; i < 1 + (round + 2) % 4; ++i) {
+            int value = -1;
+            if (!queue.try_pop(value)) {
+                break;
+            }
+            CHECK(value == next_out);
+            ++next_out;
+        }
+    }
+    int value = -1;
+    while (queue.try_pop(value)) {
+        CHECK(value == next_out);
+        ++next_out;
+    }
+    CHECK(next_out == next_in);
+    CHECK(next_in > 100);
+    CHECK(queue.empty());
+}
+
+TEST(cells_hand_back_previous_storage) {
+    BoundedQueue<std::string> queue(2);
+    std::string first(64, 'a');
+    CHECK(queue.try_push(std::move(first)));
+    // The fresh cell held an empty string, which the producer gets back
+    CHECK(first.empty());
+
+    std::string out(128, 'x');
+    const char* out_buffer = out.data();
+    CHECK(queue.try_pop(out));
+    CHECK(out == std::string(64, 'a'));
+
+    // The consumer's old buffer stayed in the cell; after the ring wraps a
+    // producer receives it for reuse
+    std::string second = "b";
+    CHECK(queue.try_push(std::move(second)));
+    std::string third = "c";
+    CHECK(queue.try_push(std::move(third)));
+    CHECK(third.data() == out_buffer);
+}
+
+TEST(concurrent_producers_deliver_everything_once) {
+    constexpr int kProducers = 4;
+    constexpr int kPerProducer = 20000;
+    BoundedQueue<int> queue(64);
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; ++p) {
+        producers.emplace_back([&queue, p]() {
+            for (int i = 0; i < kPerProducer; ++i) {
+                int value = p * kPerProducer + i;
+                while (!queue.try_push(std::move(value))) {
+                    value = p * kPerProducer + i;
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    std::vector<int> last(kProducers, -1);
+    std::vector<bool> seen(kProducers * kPerProducer, false);
+    int received = 0;
+    bool ordered = true;
+    bool unique = true;
+    while (received < kProducers * kPerProducer) {
+        int value = -1;
+        if (!queue.try_pop(value)) {
+            std::this_thread::yield();
+            continue;
+        }
+        int producer = value / kPerProducer;
+        // Each producer's own values stay in order
+        ordered = ordered && value > last[producer];
+        last[producer] = value;
+        unique = unique && !seen[value];
+        seen[value] = true;
+        ++received;
+    }
+    for (std::thread& producer : producers) {
+        producer.join();
+    }
+    CHECK(ordered);
+    CHECK(unique);
+    CHECK(queue.empty());
+}
+
+TEST_MAIN()
@@ -0,0 +1,102 @@
+// CapabilityIndex: snapshots and deltas from the registry's directory,
+// including frames that arrive late, twice or out of order
+
+#include "../uap_client.hpp"
+#include "check.hpp"
+
+namespace {
+
+json entity(std::vector<std::string> capabilities) {
+    return json{{"entity_type", "client"}, {"capabilities", capabilities}};
+}
+
+json snapshot(uint64_t version, json entities) {
+    return json{{"type", "directory"}, {"version", version}, {"snapshot", true}, {"entities", entities}};
+}
+
+json delta(uint64_t version, json entities) {
+    return json{{"type", "directory"}, {"version", version}, {"entities", entities}};
+}
+
+std::vector<std::string> with(const CapabilityIndex& index, const std::string& capability) {
+    std::vector<std::string> capabilities{capability};
+    return index.load()->find_entities(capabilities);
+}
+
+}  // namespace
+
+TEST(snapshot_then_deltas) {
+    CapabilityIndex index;
+    CHECK(!index.load()->synced());
+    
+    // Deltas before the first snapshot are covered by it
+    CHECK(!index.apply(delta(1, {{"early", entity({"camera"})}})));
+    CHECK(index.load()->find_entities({}).empty());
+    
+    CHECK(!index.apply(snapshot(4, {{"a", entity({"camera"})}, {"b", entity({"gpio"})}})));
+    CHECK(index.load()->synced());
+    CHECK(index.load()->version() == 4);
+    CHECK(with(index, "camera") == std::vector<std::string>{"a"});
+    
+    CHECK(!index.apply(delta(5, {{"c", entity({"camera", "gpio"})}, {"b", nullptr}})));
+    CHECK(index.load()->version() == 5);
+    CHECK((with(index, "camera") == std::vector<std::string>{"a", "c"}));
+    CHECK(with(index, "gpio") == std::vector<std::string>{"c"});
+    
+    // The same delta from another pooled connection is skipped
+    CHECK(!index.apply(delta(5, {{"c", nullptr}})));
+    CHECK(with(index, "gpio") == std::vector<std::string>{"c"});
+}
+
+TEST(lost_delta_asks_for_one_sync) {
+    CapabilityIndex index;
+    index.apply(snapshot(1, json::object()));
+    CHECK(index.apply(delta(3, {{"a", entity({"camera"})}})));
+    // Already asked
+    CHECK(!index.apply(delta(4, {{"a", entity({"camera"})}})));
+    CHECK(index.load()->version() == 1);
+    
+    CHECK(!index.apply(snapshot(4, {{"a", entity({"camera"})}})));
+    CHECK(index.load()->version() == 4);
+    CHECK(index.apply(delta(6, json::object())));
+}
+
+TEST(stale_snapshot_is_dropped) {
+    CapabilityIndex index;
+    index.apply(snapshot(7, {{"a", entity({"camera"})}}));
+    index.apply(delta(8, {{"b", entity({"camera"})}}));
+    
+    // Sent before delta 8 but delivered after it
+    CHECK(!index.apply(snapshot(7, {{"a", entity({"camera"})}})));
+    CHECK(index.load()->version() == 8);
+    CHECK((with(index, "camera") == std::vector<std::string>{"a", "b"}));
+    
+    // The current version again is harmless
+    CHECK(!index.apply(snapshot(8, {{"a", entity({"camera"})}, {"b", entity({"camera"})}})));
+    CHECK((with(index, "camera") == std::vector<std::string>{"a", "b"}));
+}
+
+TEST(desync_accepts_a_restarted_registry) {
+    CapabilityIndex index;
+    index.apply(snapshot(40, {{"a", entity({"camera"})}}));
+    index.desync();
+    // Still answers lookups until the next snapshot
+    CHECK(with(index, "camera") == std::vector<std::string>{"a"});
+    
+    CHECK(!index.apply(snapshot(2, {{"z", entity({"camera"})}})));
+    CHECK(index.load()->version() == 2);
+    CHECK(with(index, "camera") == std::vector<std::string>{"z"});
+    
+    // Back to normal ordering afterwards
+    CHECK(!index.apply(snapshot(1, json::object())));
+    CHECK(index.load()->version() == 2);
+}
+
+TEST(malformed_frames_are_ignored) {
+    CapabilityIndex index;
+    CHECK(!index.apply(json{{"type", "directory"}, {"entities", json::object()}}));
+    CHECK(!index.apply(json{{"type", "directory"}, {"version", -1}, {"snapshot", true}, {"entities", json::object()}}));
+    CHECK(!index.load()->synced());
+}
+
+TEST_MAIN()
@@ -0,0 +1,182 @@
+// CaptureReader: files cut short at every length, captures left open by a
+// crash, and files that are not captures at all
+
+#include <filesystem>
+#include <fstream>
+
+#include "../uap_client.hpp"
+#include "check.hpp"
+
+namespace {
+
+struct Record {
+    CaptureDirection direction;
+    websocketpp::frame::opcode::value opcode;
+    size_t connection;
+    std::string data;
+};
+
+std::string temp_path(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / ("uap_test_" + std::to_string(::getpid()) + "_" + name)).string();
+}
+
+std::vector<Record> sample_records() {
+    std::vector<Record> records;
+    for (size_t i = 0; i < 12; ++i) {
+        // Lengths around the 8-byte padding, including empty frames
+        std::string data(i * 5, static_cast<char>('a' + i));
+        records.push_back({i % 2 ? CaptureDirection::outbound : CaptureDirection::inbound,
+                           i % 3 ? websocketpp::frame::opcode::text : websocketpp::frame::opcode::binary,
+                           i % 4, data});
+    }
+    return records;
+}
+
+void write_capture(const std::string& path, const std::vector<Record>& records) {
+    FrameCapture capture(path, 1 << 16);
+    uint64_t now = monotonic_ns();
+    for (size_t i = 0; i < records.size(); ++i) {
+        capture.record(records[i].direction, records[i].opcode, records[i].connection, records[i].data, now + i);
+    }
+}
+
+std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string& path, std::string_view bytes) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+// Reads every frame, checking each against records in order; returns how many
+bool read_prefix(const std::string& path, const std::vector<Record>& records, size_t& count) {
+    CaptureReader reader(path);
+    CaptureReader::Frame frame;
+    count = 0;
+    bool matches = true;
+    while (reader.next(frame)) {
+        if (count >= records.size()) {
+            return false;
+        }
+        const Record& expected = records[count];
+        matches = matches && frame.direction == expected.direction && frame.opcode == expected.opcode &&
+                  frame.connection == expected.connection && frame.data == expected.data;
+        ++count;
+    }
+    return matches;
+}
+
+const size_t kHeaderBytes = 32;
+
+}  // namespace
+
+TEST(closed_capture_reads_back_every_record) {
+    std::string path = temp_path("closed.cap");
+    std::vector<Record> records = sample_records();
+    write_capture(path, records);
+
+    size_t count = 0;
+    CHECK(read_prefix(path, records, count));
+    CHECK(count == records.size());
+
+    CaptureReader reader(path);
+    CaptureReader::Frame first;
+    CaptureReader::Frame again;
+    CHECK(reader.next(first));
+    CHECK(reader.started_wall_ns() > 0);
+    while (reader.next(again)) {
+    }
+    reader.rewind();
+    CHECK(reader.next(again));
+    CHECK(again.data == first.data && again.at_ns == first.at_ns);
+    std::filesystem::remove(path);
+}
+
+TEST(truncated_capture_yields_whole_records_only) {
+    std::string path = temp_path("whole.cap");
+    std::string cut = temp_path("cut.cap");
+    std::vector<Record> records = sample_records();
+    write_capture(path, records);
+    std::string bytes = read_file(path);
+
+    // Every length from just the header up, so cuts land inside record
+    // headers, inside frame bytes and inside padding
+    bool prefixes = true;
+    size_t previous = 0;
+    for (size_t length = kHeaderBytes; length <= bytes.size(); ++length) {
+        write_file(cut, std::string_view(bytes).substr(0, length));
+        size_t count = 0;
+        prefixes = prefixes && read_prefix(cut, records, count) && count >= previous;
+        previous = count;
+    }
+    CHECK(prefixes);
+    CHECK(previous == records.size());
+    std::filesystem::remove(path);
+    std::filesystem::remove(cut);
+}
+
+TEST(capture_left_open_ends_at_the_first_zero_word) {
+    std::string path = temp_path("open.cap");
+    std::string copy = temp_path("crashed.cap");
+    std::vector<Record> records = sample_records();
+    {
+        FrameCapture capture(path, 1 << 16);
+        for (const Record& record : records) {
+            capture.record(record.direction, record.opcode, record.connection, record.data);
+        }
+        // What a crash leaves: the mapped pages, no length in the header and
+        // the unused rest of the file still zero
+        write_file(copy, read_file(path));
+    }
+    std::string bytes = read_file(copy);
+    uint64_t used = 0;
+    std::memcpy(&used, bytes.data() + 24, sizeof(used));
+    CHECK(used == 0);
+    CHECK(bytes.size() == kHeaderBytes + (1 << 16));
+
+    size_t count = 0;
+    CHECK(read_prefix(copy, records, count));
+    CHECK(count == records.size());
+
+    // The same file cut short as well
+    write_file(copy, std::string_view(bytes).substr(0, kHeaderBytes + 100));
+    CHECK(read_prefix(copy, records, count));
+    CHECK(count > 0 && count < records.size());
+    std::filesystem::remove(path);
+    std::filesystem::remove(copy);
+}
+
+TEST(full_capture_drops_what_does_not_fit) {
+    std::string path = temp_path("full.cap");
+    {
+        FrameCapture capture(path, 64);
+        capture.record(CaptureDirection::inbound, websocketpp::frame::opcode::text, 0, std::string(40, 'x'));
+        capture.record(CaptureDirection::inbound, websocketpp::frame::opcode::text, 0, std::string(40, 'y'));
+        capture.record(CaptureDirection::inbound, websocketpp::frame::opcode::text, 0, "small");
+        CHECK(capture.records() == 1);
+        CHECK(capture.dropped() == 2);
+    }
+    CaptureReader reader(path);
+    CaptureReader::Frame frame;
+    CHECK(reader.next(frame));
+    CHECK(frame.data == std::string(40, 'x'));
+    CHECK(!reader.next(frame));
+    std::filesystem::remove(path);
+}
+
+TEST(files_that_are_not_captures_are_rejected) {
+    std::string path = temp_path("bogus.cap");
+    CHECK_THROWS(CaptureReader(temp_path("missing.cap")));
+
+    write_file(path, "");
+    CHECK_THROWS(CaptureReader(path));
+    write_file(path, std::string(kHeaderBytes - 1, '\0'));
+    CHECK_THROWS(CaptureReader(path));
+    write_file(path, std::string(kHeaderBytes + 64, 'z'));
+    CHECK_THROWS(CaptureReader(path));
+    std::filesystem::remove(path);
+}
+
+TEST_MAIN()
@@ -0,0 +1,167 @@
+// EnvelopeScanner: escaped strings, nested objects skipped as raw spans,
+// numeric fields and malformed frames
+
+#include "../uap_client.hpp"
+#include "check.hpp"
+
+namespace {
+
+struct Scanned {
+    std::string frame;
+    std::string decoded;
+    EnvelopeScanner::Result fields;
+    bool ok = false;
+
+    explicit Scanned(std::string text) : frame(std::move(text)) {
+        ok = EnvelopeScanner::scan(frame, fields, decoded);
+    }
+
+    std::string get(const Span& span, bool is_decoded) const {
+        if (!span.present) {
+            return "<absent>";
+        }
+        const std::string& source = is_decoded ? decoded : frame;
+        return source.substr(span.offset, span.length);
+    }
+
+    std::string intent() const { return get(fields.intent, fields.intent_decoded); }
+    std::string sender() const { return get(fields.sender, fields.sender_decoded); }
+    std::string recipient() const { return get(fields.recipient, fields.recipient_decoded); }
+    std::string payload() const { return get(fields.payload, false); }
+};
+
+}  // namespace
+
+TEST(plain_fields_point_into_the_frame) {
+    Scanned s(R"({"sender":"a","recipient":"b","intent":"ping","id":"1","type":"message"})");
+    CHECK(s.ok);
+    CHECK(s.sender() == "a");
+    CHECK(s.recipient() == "b");
+    CHECK(s.intent() == "ping");
+    CHECK(!s.fields.sender_decoded);
+    CHECK(s.decoded.empty());
+    CHECK(!s.fields.payload.present);
+}
+
+TEST(escaped_strings_are_decoded_into_the_side_buffer) {
+    Scanned s(R"({"sender":"a\"b\\c\/d","intent":"line\nbreak\ttab","recipient":"plain"})");
+    CHECK(s.ok);
+    CHECK(s.fields.sender_decoded);
+    CHECK(s.sender() == "a\"b\\c/d");
+    CHECK(s.fields.intent_decoded);
+    CHECK(s.intent() == "line\nbreak\ttab");
+    CHECK(!s.fields.recipient_decoded);
+    CHECK(s.recipient() == "plain");
+}
+
+TEST(unicode_escapes_become_utf8) {
+    Scanned s(R"({"sender":"caf\u00e9 \u20AC \ud83d\ude00 \u0041"})");
+    CHECK(s.ok);
+    CHECK(s.sender() == "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80 A");
+}
+
+TEST(escaped_keys_still_match_field_names) {
+    Scanned s(R"({"int\u0065nt":"ping","s\u0065nder":"x"})");
+    CHECK(s.ok);
+    CHECK(s.intent() == "ping");
+    CHECK(s.sender() == "x");
+}
+
+TEST(nested_payload_is_reported_verbatim) {
+    std::string payload = R"({"text":"}{\"][","list":[1,{"intent":"inner"},[]],"empty":{}})";
+    Scanned s(R"({"payload":)" + payload + R"(,"intent":"outer","sender":"s"})");
+    CHECK(s.ok);
+    CHECK(s.payload() == payload);
+    // Fields inside the payload never leak to the top level
+    CHECK(s.intent() == "outer");
+    CHECK(s.sender() == "s");
+    CHECK(json::parse(s.payload()) == json::parse(payload));
+}
+
+TEST(scalar_and_string_payloads) {
+    CHECK(Scanned(R"({"payload":42})").payload() == "42");
+    CHECK(Scanned(R"({"payload":null,"intent":"i"})").payload() == "null");
+    CHECK(Scanned(R"({"payload":"a \"quoted\" }"})").payload() == R"("a \"quoted\" }")");
+}
+
+TEST(unknown_nested_fields_are_skipped) {
+    Scanned s(R"({"metadata":{"sender":"nope","deep":[[{"x":"]"}]]},"sender":"yes"})");
+    CHECK(s.ok);
+    CHECK(s.sender() == "yes");
+}
+
+TEST(non_string_routing_fields_are_skipped) {
+    Scanned s(R"({"intent":{"name":"x"},"sender":7,"recipient":"r"})");
+    CHECK(s.ok);
+    CHECK(!s.fields.intent.present);
+    CHECK(!s.fields.sender.present);
+    CHECK(s.recipient() == "r");
+}
+
+TEST(whitespace_is_tolerated) {
+    Scanned s(" {\n \"sender\" :\t\"a\" ,\r\n \"payload\" : [ 1 , 2 ] } \n");
+    CHECK(s.ok);
+    CHECK(s.sender() == "a");
+    CHECK(s.payload() == "[ 1 , 2 ]");
+}
+
+TEST(numeric_fields) {
+    Scanned s(R"({"ts_ns":1700000000123456789,"ttl":1.5,"encrypted":true})");
+    CHECK(s.ok);
+    CHECK(s.fields.has_ts_ns && s.fields.ts_ns == 1700000000123456789);
+    CHECK(s.fields.has_ttl && s.fields.ttl_ns == 1500000000);
+    CHECK(s.fields.encrypted);
+    CHECK(s.fields.expires_ns() == std::optional<int64_t>(1700000000123456789 + 1500000000));
+
+    // A float timestamp is not taken as ts_ns but still skipped cleanly
+    Scanned f(R"({"ts_ns":1.5,"sender":"a"})");
+    CHECK(f.ok);
+    CHECK(!f.fields.has_ts_ns);
+    CHECK(f.sender() == "a");
+    CHECK(!f.fields.expires_ns());
+}
+
+TEST(huge_ttl_saturates) {
+    Scanned s(R"({"ts_ns":1700000000123456789,"ttl":1e300,"sender":"a"})");
+    CHECK(s.ok);
+    CHECK(s.fields.has_ttl && s.fields.ttl_ns == std::numeric_limits<int64_t>::max());
+    CHECK(s.fields.expires_ns() == std::optional<int64_t>(std::numeric_limits<int64_t>::max()));
+    CHECK(s.sender() == "a");
+
+    // Out of range for a double: skipped like any other value
+    Scanned beyond(R"({"ttl":1e400,"sender":"a"})");
+    CHECK(beyond.ok);
+    CHECK(!beyond.fields.has_ttl);
+    CHECK(beyond.sender() == "a");
+}
+
+TEST(negative_ttl_is_ignored) {
+    Scanned s(R"({"ts_ns":1700000000123456789,"ttl":-5,"sender":"a"})");
+    CHECK(s.ok);
+    CHECK(!s.fields.has_ttl);
+    CHECK(!s.fields.expires_ns());
+    CHECK(s.sender() == "a");
+}
+
+TEST(empty_object) {
+    Scanned s("{}");
+    CHECK(s.ok);
+    CHECK(!s.fields.intent.present);
+}
+
+TEST(malformed_frames_are_rejected) {
+    CHECK(!Scanned("").ok);
+    CHECK(!Scanned("[]").ok);
+    CHECK(!Scanned(R"({"sender":"a")").ok);
+    CHECK(!Scanned(R"({"sender":"a"} trailing)").ok);
+    CHECK(!Scanned(R"({"sender":"unterminated})").ok);
+    CHECK(!Scanned(R"({"payload":{"a":[1,2})").ok);
+    CHECK(!Scanned(R"({"payload":{"a":"}"})").ok);
+    CHECK(!Scanned(R"({"sender":"bad \q escape"})").ok);
+    CHECK(!Scanned(R"({"sender":"\u12"})").ok);
+    CHECK(!Scanned(R"({"sender":"\ud83d alone"})").ok);
+    CHECK(!Scanned(R"({"sender" "a"})").ok);
+    CHECK(!Scanned(R"({"sender":"a",})").ok);
+}
+
+TEST_MAIN()
@@ -0,0 +1,132 @@
+// IntentTable: lookups, colliding hashes and probe runs, backward-shift
+// erase and growth, checked against std::map
+
+#include <map>
+#include <random>
+
+#include "../uap_client.hpp"
+#include "check.hpp"
+
+TEST(insert_find_assign) {
+    IntentTable<int> table;
+    CHECK(table.find("ping") == nullptr);
+    table.insert_or_assign("ping", 1);
+    table.insert_or_assign("pong", 2);
+    CHECK(table.size() == 2);
+    CHECK(table.find("ping") && *table.find("ping") == 1);
+    CHECK(table.find("pong") && *table.find("pong") == 2);
+
+    table.insert_or_assign("ping", 3);
+    CHECK(table.size() == 2);
+    CHECK(*table.find("ping") == 3);
+}
+
+TEST(static_intent_hash_matches_runtime) {
+    constexpr StaticIntent kPing{"ping"};
+    IntentTable<int> table;
+    table.insert_or_assign("ping", 5);
+    const int* value = table.find(kPing.name, kPing.hash);
+    CHECK(value && *value == 5);
+}
+
+TEST(equal_hashes_are_told_apart_by_name) {
+    IntentTable<int> table;
+    const uint64_t hash = 42;
+    table.insert_or_assign("a", hash, 1);
+    table.insert_or_assign("b", hash, 2);
+    table.insert_or_assign("c", hash, 3);
+    CHECK(table.size() == 3);
+    CHECK(*table.find("a", hash) == 1);
+    CHECK(*table.find("b", hash) == 2);
+    CHECK(*table.find("c", hash) == 3);
+    CHECK(table.find("d", hash) == nullptr);
+}
+
+TEST(erase_inside_probe_run_keeps_later_entries_reachable) {
+    IntentTable<int> table;
+    // Same home slot (16 slots, low bits equal), different full hashes
+    table.insert_or_assign("a", 0x10, 1);
+    table.insert_or_assign("b", 0x20, 2);
+    table.insert_or_assign("c", 0x30, 3);
+    // Homed one slot later, so it lands behind the run
+    table.insert_or_assign("d", 0x01, 4);
+
+    CHECK(table.erase("a", 0x10));
+    CHECK(!table.erase("a", 0x10));
+    CHECK(table.find("a", 0x10) == nullptr);
+    CHECK(*table.find("b", 0x20) == 2);
+    CHECK(*table.find("c", 0x30) == 3);
+    CHECK(*table.find("d", 0x01) == 4);
+
+    CHECK(table.erase("c", 0x30));
+    CHECK(*table.find("b", 0x20) == 2);
+    CHECK(*table.find("d", 0x01) == 4);
+    CHECK(table.size() == 2);
+}
+
+TEST(probe_run_wraps_past_the_last_slot) {
+    IntentTable<int> table;
+    // All homed at the last of 16 slots, so the run continues at slot 0
+    table.insert_or_assign("x", 0x0f, 1);
+    table.insert_or_assign("y", 0x1f, 2);
+    table.insert_or_assign("z", 0x2f, 3);
+    // Homed at slot 0, pushed behind the wrapped run
+    table.insert_or_assign("w", 0x00, 4);
+
+    CHECK(table.erase("x", 0x0f));
+    CHECK(*table.find("y", 0x1f) == 2);
+    CHECK(*table.find("z", 0x2f) == 3);
+    CHECK(*table.find("w", 0x00) == 4);
+    CHECK(table.erase("y", 0x1f));
+    CHECK(*table.find("z", 0x2f) == 3);
+    CHECK(*table.find("w", 0x00) == 4);
+}
+
+TEST(growth_keeps_every_entry) {
+    IntentTable<int> table;
+    for (int i = 0; i < 1000; ++i) {
+        table.insert_or_assign("intent." + std::to_string(i), i);
+    }
+    CHECK(table.size() == 1000);
+    bool all = true;
+    for (int i = 0; i < 1000; ++i) {
+        const int* value = table.find("intent." + std::to_string(i));
+        all = all && value && *value == i;
+    }
+    CHECK(all);
+
+    size_t visited = 0;
+    table.for_each([&](std::string_view, int) { ++visited; });
+    CHECK(visited == 1000);
+}
+
+TEST(random_operations_match_std_map) {
+    // A narrow hash keeps probe runs long and full of collisions
+    auto narrow = [](const std::string& intent) { return intent_hash(intent) & 0x3f; };
+    IntentTable<int> table;
+    std::map<std::string, int> model;
+    std::mt19937 rng(7);
+    bool matches = true;
+    for (int step = 0; step < 20000; ++step) {
+        std::string intent = "i" + std::to_string(rng() % 200);
+        uint64_t hash = narrow(intent);
+        if (rng() % 3 == 0) {
+            bool erased = table.erase(intent, hash);
+            matches = matches && erased == (model.erase(intent) == 1);
+        } else {
+            int value = static_cast<int>(rng());
+            table.insert_or_assign(intent, hash, value);
+            model[intent] = value;
+        }
+    }
+    matches = matches && table.size() == model.size();
+    for (int i = 0; i < 200; ++i) {
+        std::string intent = "i" + std::to_string(i);
+        const int* value = table.find(intent, narrow(intent));
+        auto it = model.find(intent);
+        matches = matches && (it == model.end() ? value == nullptr : value && *value == it->second);
+    }
+    CHECK(matches);
+}
+
+TEST_MAIN()
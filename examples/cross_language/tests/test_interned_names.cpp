@@ -0,0 +1,211 @@
+// InternedNames: handle definitions, compacting and resolving envelopes,
+// requests for missing names, and what survives a session reset
+
+#include "../uap_client.hpp"
+#include "check.hpp"
+
+namespace {
+
+json envelope(const std::string& sender, const std::string& recipient, const std::string& intent) {
+    return json{{"type", "message"}, {"sender", sender}, {"recipient", recipient}, {"intent", intent},
+                {"payload", {{"value", 1}}}};
+}
+
+// What arrives from the registry: parsed from text, as on the wire, so
+// handles are unsigned numbers
+json received(const char* text) {
+    return json::parse(text);
+}
+
+json definitions() {
+    return received(R"({"entities":{"me":0,"peer":1},"intents":{"ping":0,"telemetry":7}})");
+}
+
+}  // namespace
+
+TEST(first_reset_asks_for_self) {
+    InternedNames names;
+    json request = names.reset("me");
+    CHECK(request == json({{"entities", {{"me", nullptr}}}, {"intents", json::object()}}));
+    CHECK(!names.active());
+}
+
+TEST(resolve_is_a_no_op_until_the_registry_answers) {
+    InternedNames names;
+    names.reset("me");
+    json message = received(R"({"sender":3,"intent":4})");
+    CHECK(!names.resolve(message));
+    CHECK(message["sender"] == 3);
+}
+
+TEST(compact_and_restore) {
+    InternedNames names;
+    names.reset("me");
+    names.define(definitions());
+    CHECK(names.active());
+
+    json message = envelope("me", "peer", "telemetry");
+    json original = message;
+    InternedNames::Saved saved;
+    json missing = json::object();
+    names.compact(message, saved, missing, 16);
+    CHECK(message["sender"] == 0);
+    CHECK(message["recipient"] == 1);
+    CHECK(message["intent"] == 7);
+    CHECK(message["payload"] == original["payload"]);
+    CHECK(missing.empty());
+
+    InternedNames::restore(saved);
+    CHECK(saved.empty());
+    CHECK(message == original);
+}
+
+TEST(resolve_swaps_handles_back_and_hashes_the_intent) {
+    InternedNames names;
+    names.reset("me");
+    names.define(definitions());
+
+    json message = received(R"({"sender":1,"recipient":0,"intent":7})");
+    std::optional<uint64_t> hash = names.resolve(message);
+    CHECK(message == json({{"sender", "peer"}, {"recipient", "me"}, {"intent", "telemetry"}}));
+    CHECK(hash == intent_hash("telemetry"));
+
+    // Names that were sent as strings stay strings, and give no hash
+    json plain = envelope("stranger", "me", "unknown");
+    CHECK(!names.resolve(plain));
+    CHECK(plain == envelope("stranger", "me", "unknown"));
+}
+
+TEST(batches_are_compacted_and_resolved_element_by_element) {
+    InternedNames names;
+    names.reset("me");
+    names.define(definitions());
+
+    json batch = {{"type", "batch"}, {"messages", {envelope("me", "peer", "ping"), envelope("me", "peer", "telemetry")}}};
+    json original = batch;
+    InternedNames::Saved saved;
+    json missing = json::object();
+    names.compact(batch, saved, missing, 16);
+    CHECK(batch["messages"][0]["intent"] == 0);
+    CHECK(batch["messages"][1]["intent"] == 7);
+
+    json incoming = json::parse(batch.dump());
+    names.resolve(incoming);
+    CHECK(incoming == original);
+
+    InternedNames::restore(saved);
+    CHECK(batch == original);
+}
+
+TEST(undefined_handles_throw) {
+    InternedNames names;
+    names.reset("me");
+    names.define(definitions());
+
+    json gap = received(R"({"intent":3})");
+    CHECK_THROWS(names.resolve(gap));
+    json beyond = received(R"({"sender":2})");
+    CHECK_THROWS(names.resolve(beyond));
+}
+
+TEST(missing_names_are_requested_once_up_to_capacity) {
+    InternedNames names;
+    names.reset("me");
+    names.define(definitions());
+
+    json message = envelope("me", "new-peer", "new-intent");
+    InternedNames::Saved saved;
+    json missing = json::object();
+    names.compact(message, saved, missing, 16);
+    CHECK(message["sender"] == 0);
+    CHECK(message["recipient"] == "new-peer");
+    CHECK(missing == json({{"entities", {{"new-peer", nullptr}}}, {"intents", {{"new-intent", nullptr}}}}));
+    InternedNames::restore(saved);
+
+    // Already asked for this session
+    json again = json::object();
+    names.compact(message, saved, again, 16);
+    CHECK(again.empty());
+    InternedNames::restore(saved);
+
+    // A request that could not be sent may be made again
+    names.forget_requests(missing);
+    json retry = json::object();
+    names.compact(message, saved, retry, 16);
+    CHECK(retry == missing);
+    InternedNames::restore(saved);
+
+    // "me" (by reset()) and "new-peer" count too, so one more entity fits
+    // under capacity 3
+    json capped = json::object();
+    json other = envelope("third", "fourth", "ping");
+    names.compact(other, saved, capped, 3);
+    CHECK(capped == json({{"entities", {{"third", nullptr}}}}));
+    InternedNames::restore(saved);
+}
+
+TEST(redefined_handle_forgets_its_old_name) {
+    InternedNames names;
+    names.reset("me");
+    names.define(definitions());
+    names.define(received(R"({"intents":{"pong":7}})"));
+
+    json message = envelope("me", "peer", "telemetry");
+    InternedNames::Saved saved;
+    json missing = json::object();
+    names.compact(message, saved, missing, 16);
+    CHECK(message["intent"] == "telemetry");
+
+    json incoming = received(R"({"intent":7})");
+    names.resolve(incoming);
+    CHECK(incoming["intent"] == "pong");
+}
+
+TEST(invalid_definitions_are_ignored) {
+    InternedNames names;
+    names.reset("me");
+    names.define(received(R"({"entities":{"huge":65536,"negative":-1,"fraction":1.5,"text":"1","":2},
+                                "intents":"not an object"})"));
+    json message = envelope("huge", "negative", "ping");
+    InternedNames::Saved saved;
+    json missing = json::object();
+    names.compact(message, saved, missing, 16);
+    CHECK(message["sender"] == "huge");
+    CHECK(message["recipient"] == "negative");
+    CHECK(saved.empty());
+}
+
+TEST(reset_proposes_last_sessions_handles) {
+    InternedNames names;
+    names.reset("me");
+    names.define(definitions());
+
+    json request = names.reset("me");
+    CHECK(request == definitions());
+    CHECK(!names.active());
+
+    // Handles are gone until the registry confirms them
+    json message = envelope("me", "peer", "ping");
+    InternedNames::Saved saved;
+    json missing = json::object();
+    names.compact(message, saved, missing, 16);
+    CHECK(message == envelope("me", "peer", "ping"));
+    // ...and already asked for, so compact() does not ask again
+    CHECK(missing.empty());
+
+    names.define(request);
+    names.compact(message, saved, missing, 16);
+    CHECK(message["intent"] == 0);
+    InternedNames::restore(saved);
+}
+
+TEST(reset_under_a_new_entity_id) {
+    InternedNames names;
+    names.reset("me");
+    names.define(definitions());
+    json request = names.reset("renamed");
+    CHECK(request["entities"]["me"] == 0);
+    CHECK(request["entities"]["renamed"] == nullptr);
+}
+
+TEST_MAIN()
@@ -0,0 +1,161 @@
+// LatencyHistogram: bucket edges across the whole 64-bit range, percentile
+// error bounds, and snapshot merging
+
+#include <random>
+
+#include "../uap_client.hpp"
+#include "check.hpp"
+
+namespace {
+
+// Inclusive upper edge; the top bucket's limit wraps to 0, so its edge is
+// the largest uint64_t
+uint64_t last_in_bucket(size_t index) {
+    return LatencyHistogram::bucket_limit(index) - 1;
+}
+
+std::vector<uint64_t> edge_values() {
+    std::vector<uint64_t> values;
+    for (uint64_t v = 0; v < 4096; ++v) {
+        values.push_back(v);
+    }
+    for (int shift = 4; shift < 64; ++shift) {
+        uint64_t power = uint64_t(1) << shift;
+        for (uint64_t step = 0; step < 8; ++step) {
+            uint64_t start = power + step * (power >> 3);
+            values.push_back(start - 1);
+            values.push_back(start);
+            values.push_back(start + 1);
+        }
+    }
+    values.push_back(UINT64_MAX - 1);
+    values.push_back(UINT64_MAX);
+    return values;
+}
+
+}  // namespace
+
+TEST(small_values_get_exact_buckets) {
+    for (uint64_t v = 0; v < 2 * LatencyHistogram::kSubBuckets; ++v) {
+        CHECK(LatencyHistogram::bucket_index(v) == v);
+        CHECK(LatencyHistogram::bucket_limit(v) == v + 1);
+    }
+}
+
+TEST(every_value_lies_inside_its_bucket) {
+    bool inside = true;
+    bool in_range = true;
+    for (uint64_t v : edge_values()) {
+        size_t index = LatencyHistogram::bucket_index(v);
+        in_range = in_range && index < LatencyHistogram::kBuckets;
+        inside = inside && v <= last_in_bucket(index);
+        inside = inside && (index == 0 || v > last_in_bucket(index - 1));
+    }
+    CHECK(in_range);
+    CHECK(inside);
+    CHECK(LatencyHistogram::bucket_index(UINT64_MAX) == LatencyHistogram::kBuckets - 1);
+}
+
+TEST(bucket_limits_are_contiguous) {
+    // Each bucket starts right where the previous one ends, and the first
+    // value of every bucket maps back to it
+    bool contiguous = true;
+    for (size_t i = 0; i + 1 < LatencyHistogram::kBuckets; ++i) {
+        uint64_t first = LatencyHistogram::bucket_limit(i);
+        contiguous = contiguous && LatencyHistogram::bucket_index(first) == i + 1;
+        contiguous = contiguous && LatencyHistogram::bucket_index(first - 1) == i;
+    }
+    CHECK(contiguous);
+}
+
+TEST(bucket_width_stays_within_one_eighth) {
+    bool bounded = true;
+    for (size_t i = 2 * LatencyHistogram::kSubBuckets; i + 1 < LatencyHistogram::kBuckets; ++i) {
+        uint64_t lower = LatencyHistogram::bucket_limit(i - 1);
+        uint64_t width = LatencyHistogram::bucket_limit(i) - lower;
+        bounded = bounded && width <= lower / LatencyHistogram::kSubBuckets;
+    }
+    CHECK(bounded);
+}
+
+TEST(empty_histogram) {
+    LatencyHistogram histogram;
+    HistogramSnapshot snap = histogram.snapshot();
+    CHECK(snap.count == 0);
+    CHECK(snap.percentile(0.5) == 0);
+    CHECK(snap.mean() == 0.0);
+    CHECK(snap.count_at_or_below(UINT64_MAX) == 0);
+}
+
+TEST(percentiles_bound_the_true_value) {
+    LatencyHistogram histogram;
+    for (uint64_t v = 1; v <= 100000; ++v) {
+        histogram.record(v);
+    }
+    HistogramSnapshot snap = histogram.snapshot();
+    CHECK(snap.count == 100000);
+    CHECK(snap.max == 100000);
+    CHECK(snap.sum == uint64_t(100000) * 100001 / 2);
+
+    for (double q : {0.0, 0.1, 0.5, 0.9, 0.99, 0.999}) {
+        uint64_t exact = static_cast<uint64_t>(q * 99999) + 1;
+        uint64_t reported = snap.percentile(q);
+        CHECK(reported >= exact);
+        CHECK(reported <= exact + exact / 8);
+    }
+    CHECK(snap.percentile(0.0) == 1);
+    // Capped by the largest sample instead of the bucket edge
+    CHECK(snap.percentile(1.0) == 100000);
+}
+
+TEST(single_sample_reports_itself) {
+    for (uint64_t v : {uint64_t(0), uint64_t(7), uint64_t(1000), uint64_t(123456789), UINT64_MAX}) {
+        LatencyHistogram histogram;
+        histogram.record(v);
+        HistogramSnapshot snap = histogram.snapshot();
+        CHECK(snap.percentile(0.0) == v);
+        CHECK(snap.percentile(0.99) == v);
+        CHECK(snap.max == v);
+    }
+}
+
+TEST(count_at_or_below_only_counts_whole_buckets) {
+    LatencyHistogram histogram;
+    for (uint64_t v : {uint64_t(5), uint64_t(15), uint64_t(16), uint64_t(17), uint64_t(1000)}) {
+        histogram.record(v);
+    }
+    HistogramSnapshot snap = histogram.snapshot();
+    CHECK(snap.count_at_or_below(4) == 0);
+    CHECK(snap.count_at_or_below(5) == 1);
+    CHECK(snap.count_at_or_below(15) == 2);
+    // 16 and 17 share a bucket, which only counts once wholly below the bound
+    CHECK(snap.count_at_or_below(16) == 2);
+    CHECK(snap.count_at_or_below(17) == 4);
+    CHECK(snap.count_at_or_below(UINT64_MAX) == 5);
+}
+
+TEST(merge_adds_samples) {
+    LatencyHistogram a;
+    LatencyHistogram b;
+    std::mt19937_64 rng(3);
+    LatencyHistogram both;
+    for (int i = 0; i < 5000; ++i) {
+        uint64_t v = rng() % 1000000;
+        (i % 2 ? a : b).record(v);
+        both.record(v);
+    }
+    HistogramSnapshot merged = a.snapshot();
+    merged.merge(b.snapshot());
+    HistogramSnapshot expected = both.snapshot();
+    CHECK(merged.count == expected.count);
+    CHECK(merged.sum == expected.sum);
+    CHECK(merged.max == expected.max);
+    CHECK(merged.buckets == expected.buckets);
+
+    // Merging into a default snapshot sizes its buckets
+    HistogramSnapshot empty;
+    empty.merge(expected);
+    CHECK(empty.percentile(0.5) == expected.percentile(0.5));
+}
+
+TEST_MAIN()
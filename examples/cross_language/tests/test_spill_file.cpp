@@ -0,0 +1,199 @@
+// SpillFile: ring wrap-around, dropping when full, and recovery of a file
+// left behind by a clean close or a crash
+
+#include "../uap_client.hpp"
+#include "check.hpp"
+
+#include <sys/wait.h>
+
+namespace {
+
+std::string temp_path(const char* name) {
+    return "/tmp/uap_test_" + std::string(name) + "_" + std::to_string(::getpid());
+}
+
+std::string envelope_for(uint64_t i) {
+    return std::string(i % 200 + 1, static_cast<char>('a' + i % 26)) + "#" + std::to_string(i);
+}
+
+std::string recipient_for(uint64_t i) {
+    return "peer-" + std::to_string(i);
+}
+
+// Pops every record, checking each is the next of a run of consecutive
+// indices; returns the number read, or -1 on a malformed record
+long drain_consecutive(SpillFile& spill) {
+    std::string recipient;
+    std::string envelope;
+    long read = 0;
+    uint64_t expected = 0;
+    while (spill.front(recipient, envelope)) {
+        if (!recipient.starts_with("peer-")) {
+            return -1;
+        }
+        uint64_t i = std::stoull(recipient.substr(5));
+        if ((read > 0 && i != expected) || envelope != envelope_for(i)) {
+            return -1;
+        }
+        expected = i + 1;
+        spill.pop();
+        ++read;
+    }
+    return read;
+}
+
+}  // namespace
+
+TEST(push_front_pop_in_order) {
+    std::string path = temp_path("order");
+    ::unlink(path.c_str());
+    SpillFile spill(path, 4096);
+    CHECK(spill.count() == 0);
+    for (uint64_t i = 0; i < 5; ++i) {
+        CHECK(spill.push(recipient_for(i), envelope_for(i)) == 0);
+    }
+    CHECK(spill.count() == 5);
+    CHECK(drain_consecutive(spill) == 5);
+    CHECK(spill.count() == 0);
+    std::string recipient;
+    std::string envelope;
+    CHECK(!spill.front(recipient, envelope));
+    ::unlink(path.c_str());
+}
+
+TEST(wraps_around_the_end_of_the_ring) {
+    std::string path = temp_path("wrap");
+    ::unlink(path.c_str());
+    // Records of 8 + 6..7 + 2..201 bytes in 1000 bytes wrap every few pushes,
+    // leaving wrap markers and short tails at varying offsets
+    SpillFile spill(path, 1000);
+    uint64_t next_push = 0;
+    uint64_t next_pop = 0;
+    for (int round = 0; round < 500; ++round) {
+        while (spill.count() < 3) {
+            CHECK(spill.push(recipient_for(next_push), envelope_for(next_push)) == 0);
+            ++next_push;
+        }
+        std::string recipient;
+        std::string envelope;
+        CHECK(spill.front(recipient, envelope));
+        CHECK(recipient == recipient_for(next_pop));
+        CHECK(envelope == envelope_for(next_pop));
+        spill.pop();
+        ++next_pop;
+    }
+    CHECK(spill.count() == next_push - next_pop);
+    ::unlink(path.c_str());
+}
+
+TEST(full_ring_drops_the_oldest) {
+    std::string path = temp_path("full");
+    ::unlink(path.c_str());
+    SpillFile spill(path, 512);
+    std::string payload(100, 'x');
+    size_t dropped = 0;
+    for (int i = 0; i < 20; ++i) {
+        dropped += spill.push("peer-" + std::to_string(i), payload);
+    }
+    // 8 + 6..7 + 100 bytes a record: four fit in 512
+    CHECK(spill.count() == 4);
+    CHECK(dropped == 16);
+    std::string recipient;
+    std::string envelope;
+    for (int i = 16; i < 20; ++i) {
+        CHECK(spill.front(recipient, envelope));
+        CHECK(recipient == "peer-" + std::to_string(i));
+        CHECK(envelope == payload);
+        spill.pop();
+    }
+    
+    // A record larger than the whole ring is dropped itself
+    CHECK(spill.push("peer", envelope_for(0)) == 0);
+    CHECK(spill.push("peer", std::string(600, 'y')) == 1);
+    CHECK(spill.count() == 1);
+    ::unlink(path.c_str());
+}
+
+TEST(reopen_keeps_records) {
+    std::string path = temp_path("reopen");
+    ::unlink(path.c_str());
+    {
+        SpillFile spill(path, 2048);
+        for (uint64_t i = 0; i < 40; ++i) {
+            spill.push(recipient_for(i), envelope_for(i));
+        }
+        spill.pop();
+    }
+    {
+        SpillFile spill(path, 2048);
+        CHECK(spill.count() > 0);
+        CHECK(drain_consecutive(spill) > 0);
+    }
+    // A different capacity starts over
+    {
+        SpillFile spill(path, 2048);
+        spill.push(recipient_for(0), envelope_for(0));
+    }
+    {
+        SpillFile spill(path, 4096);
+        CHECK(spill.count() == 0);
+    }
+    ::unlink(path.c_str());
+}
+
+TEST(torn_commit_falls_back_to_the_previous_state) {
+    std::string path = temp_path("torn");
+    ::unlink(path.c_str());
+    {
+        // Opening commits sequence 0 to the first copy; the two pushes then
+        // commit sequence 1 to the second copy and sequence 2 to the first
+        SpillFile spill(path, 1024);
+        spill.push(recipient_for(0), envelope_for(0));
+        spill.push(recipient_for(1), envelope_for(1));
+    }
+    {
+        // Scribble over the middle of the newest copy, as a crash partway
+        // through writing it would. Header: magic, capacity, then two
+        // 40-byte copies of {sequence, head, tail, count, check}.
+        int fd = ::open(path.c_str(), O_RDWR);
+        uint64_t garbage = 0x5A5A5A5A5A5A5A5AULL;
+        CHECK(::pwrite(fd, &garbage, sizeof(garbage), 16 + 8 * 2) == sizeof(garbage));
+        ::close(fd);
+    }
+    {
+        SpillFile spill(path, 1024);
+        CHECK(spill.count() == 1);
+        CHECK(drain_consecutive(spill) == 1);
+    }
+    ::unlink(path.c_str());
+}
+
+TEST(recovers_after_being_killed_mid_write) {
+    std::string path = temp_path("crash");
+    std::mt19937 random(12345);
+    for (int run = 0; run < 25; ++run) {
+        ::unlink(path.c_str());
+        pid_t child = ::fork();
+        if (child == 0) {
+            SpillFile spill(path, 8192);
+            for (uint64_t i = 0;; ++i) {
+                spill.push(recipient_for(i), envelope_for(i));
+                if (i % 3 == 0) {
+                    spill.pop();
+                }
+            }
+        }
+        ::usleep(200 + random() % 20000);
+        ::kill(child, SIGKILL);
+        ::waitpid(child, nullptr, 0);
+        
+        SpillFile spill(path, 8192);
+        size_t count = spill.count();
+        long read = drain_consecutive(spill);
+        CHECK(read >= 0);
+        CHECK(static_cast<size_t>(read) == count);
+    }
+    ::unlink(path.c_str());
+}
+
+TEST_MAIN()
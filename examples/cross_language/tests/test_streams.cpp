@@ -0,0 +1,248 @@
+// Streams between two clients on a LocalRouter: chunk reassembly (in order,
+// out of order and duplicated), the credit window, cancel and abort. The
+// registry URL points nowhere; local delivery needs no registry.
+
+#include <condition_variable>
+#include <future>
+
+#include "../uap_client.hpp"
+#include "check.hpp"
+
+namespace {
+
+const char* kNowhere = "ws://127.0.0.1:9";
+
+UAP_ClientOptions options(const std::shared_ptr<LocalRouter>& router) {
+    UAP_ClientOptions opts;
+    opts.local_router = router;
+    opts.stream_chunk_bytes = 1000;
+    opts.stream_window_bytes = 4000;
+    opts.stream_credit_timeout = std::chrono::milliseconds(300);
+    return opts;
+}
+
+// Keeps a client's I/O loop running with no registry connection to hold it
+// open. Declared after the client, so it goes first.
+using Running = boost::asio::executor_work_guard<boost::asio::io_service::executor_type>;
+
+Running keep_running(UAP_Client& client) {
+    return boost::asio::make_work_guard(client.executor());
+}
+
+// What a stream handler saw, for the test thread to wait on
+struct Received {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::string data;
+    std::vector<size_t> chunks;
+    json header;
+    bool ended = false;
+    bool aborted = false;
+    std::string abort_reason;
+
+    StreamHandler handler() {
+        return [this](InboundStream& stream, std::string_view chunk) {
+            std::lock_guard<std::mutex> lock(mutex);
+            header = stream.header();
+            data.append(chunk.data(), chunk.size());
+            chunks.push_back(chunk.size());
+            ended = stream.ended();
+            aborted = stream.aborted();
+            abort_reason = stream.abort_reason();
+            changed.notify_all();
+        };
+    }
+
+    bool wait_finished() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return changed.wait_for(lock, std::chrono::seconds(5), [this]() { return ended || aborted; });
+    }
+};
+
+std::string pattern(size_t size) {
+    std::string data(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = static_cast<char>((i * 131) >> 3);
+    }
+    return data;
+}
+
+json stream_frame(const std::string& recipient, uint64_t seq, std::string_view data) {
+    json frame = {{"type", "stream"}, {"id", "f" + std::to_string(seq)}, {"sender", "ghost"},
+                  {"recipient", recipient}, {"intent", "file"}, {"stream", "s1"}, {"seq", seq}};
+    if (!data.empty()) {
+        frame["data"] = json::binary(std::vector<std::uint8_t>(data.begin(), data.end()));
+    }
+    return frame;
+}
+
+}  // namespace
+
+TEST(chunks_arrive_in_order_with_credit) {
+    // Declared first: disconnecting aborts open streams into the handler
+    Received received;
+    auto router = std::make_shared<LocalRouter>();
+    UAP_Client sender("sender", kNowhere, options(router));
+    Running sender_running = keep_running(sender);
+    UAP_Client receiver("receiver", kNowhere, options(router));
+    Running receiver_running = keep_running(receiver);
+    receiver.register_stream_handler("file", received.handler());
+    CHECK(receiver.connect_async());
+    CHECK(sender.connect_async());
+
+    // Ten windows' worth, so the writer must wait for acknowledgements
+    std::string data = pattern(40500);
+    StreamWriter writer = sender.open_stream("receiver", "file", {{"name", "blob.bin"}});
+    CHECK(static_cast<bool>(writer));
+    CHECK(writer.write(std::string_view(data).substr(0, 12345)));
+    CHECK(writer.write(std::string_view(data).substr(12345)));
+    CHECK(writer.bytes_sent() == data.size());
+    CHECK(writer.close());
+    CHECK(!writer.is_open());
+    CHECK(!writer.write("late"));
+
+    CHECK(received.wait_finished());
+    std::lock_guard<std::mutex> lock(received.mutex);
+    CHECK(received.ended && !received.aborted);
+    CHECK(received.data == data);
+    CHECK(received.header == json({{"name", "blob.bin"}}));
+    // Opening call without data, then chunks of at most stream_chunk_bytes
+    CHECK(!received.chunks.empty() && received.chunks.front() == 0);
+    bool bounded = true;
+    for (size_t size : received.chunks) {
+        bounded = bounded && size <= 1000;
+    }
+    CHECK(bounded);
+}
+
+TEST(writer_stalls_at_the_window_until_acknowledged) {
+    // The handler holds the receiver's I/O thread on the first chunk, so no
+    // acknowledgement goes back until the gate opens
+    std::promise<void> gate;
+    std::shared_future<void> opened = gate.get_future().share();
+    Received received;
+    StreamHandler record = received.handler();
+    auto router = std::make_shared<LocalRouter>();
+    UAP_Client sender("sender", kNowhere, options(router));
+    Running sender_running = keep_running(sender);
+    UAP_Client receiver("receiver", kNowhere, options(router));
+    Running receiver_running = keep_running(receiver);
+    receiver.register_stream_handler("file", [&, opened](InboundStream& stream, std::string_view chunk) {
+        if (!chunk.empty()) {
+            opened.wait();
+        }
+        record(stream, chunk);
+    });
+    CHECK(receiver.connect_async());
+    CHECK(sender.connect_async());
+
+    std::string data = pattern(20000);
+    StreamWriter writer = sender.open_stream("receiver", "file");
+    CHECK(!writer.write(data));
+    // Exactly one window went out before the credit timeout
+    CHECK(writer.bytes_sent() == 4000);
+    CHECK(writer.is_open());
+
+    gate.set_value();
+    CHECK(writer.write(std::string_view(data).substr(4000)));
+    CHECK(writer.close());
+    CHECK(received.wait_finished());
+    std::lock_guard<std::mutex> lock(received.mutex);
+    CHECK(received.data == data);
+}
+
+TEST(early_and_duplicate_chunks_are_reordered) {
+    Received received;
+    auto router = std::make_shared<LocalRouter>();
+    UAP_Client receiver("receiver", kNowhere, options(router));
+    Running receiver_running = keep_running(receiver);
+    receiver.register_stream_handler("file", received.handler());
+    CHECK(receiver.connect_async());
+
+    auto mailbox = router->find("receiver");
+    CHECK(mailbox != nullptr);
+    auto push = [&](json frame) {
+        LocalRouter::Delivery delivery(new InboundMessage(std::move(frame)));
+        CHECK(mailbox->push(delivery, BackpressurePolicy::block));
+    };
+    json opening = stream_frame("receiver", 0, {});
+    opening["payload"] = {{"part", "header"}};
+    opening["window"] = 100000;
+    push(stream_frame("receiver", 3, "ccc"));
+    push(opening);
+    push(stream_frame("receiver", 2, "bb"));
+    push(stream_frame("receiver", 2, "bb"));
+    push(stream_frame("receiver", 1, "a"));
+    push(stream_frame("receiver", 1, "a"));
+    json last = stream_frame("receiver", 5, {});
+    last["end"] = true;
+    push(last);
+    push(stream_frame("receiver", 4, "dddd"));
+
+    CHECK(received.wait_finished());
+    std::lock_guard<std::mutex> lock(received.mutex);
+    CHECK(received.ended);
+    CHECK(received.data == "abbcccdddd");
+    CHECK(received.header == json({{"part", "header"}}));
+    CHECK(received.chunks == std::vector<size_t>({0, 1, 2, 3, 4, 0}));
+}
+
+TEST(receiver_cancel_stops_the_writer) {
+    auto router = std::make_shared<LocalRouter>();
+    UAP_Client sender("sender", kNowhere, options(router));
+    Running sender_running = keep_running(sender);
+    UAP_Client receiver("receiver", kNowhere, options(router));
+    Running receiver_running = keep_running(receiver);
+    receiver.register_stream_handler("file", [](InboundStream& stream, std::string_view chunk) {
+        if (!chunk.empty()) {
+            stream.cancel("Disk full");
+        }
+    });
+    CHECK(receiver.connect_async());
+    CHECK(sender.connect_async());
+
+    StreamWriter writer = sender.open_stream("receiver", "file");
+    std::string data = pattern(1000);
+    bool stopped = false;
+    for (int i = 0; i < 100 && !stopped; ++i) {
+        stopped = !writer.write(data);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK(stopped);
+    CHECK(!writer.is_open());
+    CHECK(writer.cancel_reason() == "Disk full");
+}
+
+TEST(abort_reaches_the_handler) {
+    // Declared first: disconnecting aborts open streams into the handler
+    Received received;
+    auto router = std::make_shared<LocalRouter>();
+    UAP_Client sender("sender", kNowhere, options(router));
+    Running sender_running = keep_running(sender);
+    UAP_Client receiver("receiver", kNowhere, options(router));
+    Running receiver_running = keep_running(receiver);
+    receiver.register_stream_handler("file", received.handler());
+    CHECK(receiver.connect_async());
+    CHECK(sender.connect_async());
+
+    {
+        StreamWriter writer = sender.open_stream("receiver", "file");
+        CHECK(writer.write(pattern(1500)));
+        // Destroying an open writer aborts its stream
+    }
+    CHECK(received.wait_finished());
+    std::lock_guard<std::mutex> lock(received.mutex);
+    CHECK(received.aborted && !received.ended);
+    CHECK(received.abort_reason == "Stream writer destroyed");
+    CHECK(received.data == pattern(1500));
+}
+
+TEST(broadcast_streams_are_refused) {
+    auto router = std::make_shared<LocalRouter>();
+    UAP_Client sender("sender", kNowhere, options(router));
+    Running sender_running = keep_running(sender);
+    CHECK(sender.connect_async());
+    CHECK(!sender.open_stream("*", "file"));
+}
+
+TEST_MAIN()
@@ -0,0 +1,180 @@
+// Envelopes in each wire encoding: encoding into a reused buffer, envelopes
+// extended in place with reopen_envelope() for stream frames and shared
+// multicast payloads, telling CBOR from MessagePack by the lead byte,
+// encoding names and batches
+
+#include "../uap_client.hpp"
+#include "check.hpp"
+
+namespace {
+
+const WireEncoding kEncodings[] = {WireEncoding::json, WireEncoding::cbor, WireEncoding::msgpack};
+
+json decode(const std::string& bytes, WireEncoding encoding) {
+    switch (encoding) {
+        case WireEncoding::cbor: return json::from_cbor(bytes);
+        case WireEncoding::msgpack: return json::from_msgpack(bytes);
+        default: return json::parse(bytes);
+    }
+}
+
+std::string encode(const json& value, WireEncoding encoding) {
+    OutboundFrame frame;
+    encode_envelope(value, encoding, frame);
+    return frame.data;
+}
+
+json head() {
+    return json{{"id", "m-1"}, {"sender", "alice"}, {"recipient", "bob"}, {"intent", "chunk"}};
+}
+
+std::string bytes_of(size_t size) {
+    std::string data(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = static_cast<char>(i * 31 + 7);
+    }
+    return data;
+}
+
+}  // namespace
+
+TEST(dump_to_matches_dump) {
+    json value = {{"text", "quote \" and \\ and \n"}, {"list", {1, 2.5, nullptr, true}}, {"nested", {{"a", {}}}}};
+    std::string out = "prefix:";
+    dump_to(value, out);
+    CHECK(out == "prefix:" + value.dump());
+}
+
+TEST(stream_frames_round_trip) {
+    // Sizes cross the one, two and four byte length headers of both binary
+    // encodings
+    for (WireEncoding encoding : kEncodings) {
+        for (size_t size : {size_t(0), size_t(1), size_t(23), size_t(24), size_t(255), size_t(256),
+                            size_t(65535), size_t(65536), size_t(100000)}) {
+            std::string data = bytes_of(size);
+            OutboundFrame frame;
+            encode_stream_frame(head(), data, encoding, frame);
+            json decoded = decode(frame.data, encoding);
+            CHECK(decoded["intent"] == "chunk");
+            CHECK(decoded["recipient"] == "bob");
+            std::string scratch;
+            CHECK(stream_frame_data(decoded, scratch) == data);
+            CHECK(decoded.size() == (size == 0 ? 4u : 5u));
+        }
+    }
+}
+
+TEST(shared_payload_tails_round_trip) {
+    json payload = {{"reading", 21.5}, {"tags", {"a", "b"}}, {"blob", std::string(300, 'x')}};
+    SharedPayload shared(payload);
+    for (WireEncoding encoding : kEncodings) {
+        std::string first = encode(head(), encoding);
+        reopen_envelope(first, encoding);
+        first += *shared.tail(encoding);
+
+        json other_head = head();
+        other_head["recipient"] = "carol";
+        std::string second = encode(other_head, encoding);
+        reopen_envelope(second, encoding);
+        second += *shared.tail(encoding);
+
+        json expected = head();
+        expected["payload"] = payload;
+        CHECK(decode(first, encoding) == expected);
+        expected["recipient"] = "carol";
+        CHECK(decode(second, encoding) == expected);
+    }
+    // The tail is built once per encoding and then shared
+    CHECK(shared.tail(WireEncoding::cbor) == shared.tail(WireEncoding::cbor));
+
+    json expected = head();
+    expected["payload"] = payload;
+    CHECK(json::parse(shared.json_envelope(head())) == expected);
+}
+
+TEST(reopen_stops_at_the_small_map_header) {
+    // CBOR map(n) fits the initial byte up to 23 members, MessagePack
+    // fixmap up to 15; one more member must not be squeezed in
+    for (auto [encoding, largest] : {std::pair{WireEncoding::cbor, 23}, std::pair{WireEncoding::msgpack, 15}}) {
+        json full = json::object();
+        for (int i = 0; i < largest - 1; ++i) {
+            full["k" + std::to_string(i)] = i;
+        }
+        std::string fits = encode(full, encoding);
+        reopen_envelope(fits, encoding);
+        fits += encoding == WireEncoding::cbor ? std::string("\x64" "last\x01", 6) : std::string("\xA4" "last\x01", 6);
+        json decoded = decode(fits, encoding);
+        CHECK(decoded.size() == static_cast<size_t>(largest));
+        CHECK(decoded["last"] == 1);
+
+        full["k" + std::to_string(largest - 1)] = 0;
+        std::string too_big = encode(full, encoding);
+        CHECK_THROWS(reopen_envelope(too_big, encoding));
+    }
+}
+
+TEST(envelopes_round_trip) {
+    json small = head();
+    small["payload"] = {{"reading", 21.5}, {"tags", {"a", "b"}}, {"none", nullptr}};
+    // More members than a CBOR map(n) byte or a MessagePack fixmap holds
+    json large = head();
+    for (int i = 0; i < 30; ++i) {
+        large["k" + std::to_string(i)] = i;
+    }
+    for (WireEncoding encoding : kEncodings) {
+        for (const json& envelope : {small, large}) {
+            OutboundFrame frame;
+            encode_envelope(envelope, encoding, frame);
+            bool text = encoding == WireEncoding::json;
+            CHECK((frame.opcode == websocketpp::frame::opcode::text) == text);
+            CHECK(decode(frame.data, encoding) == envelope);
+            if (!text) {
+                CHECK(decode_binary_envelope(frame.data) == envelope);
+            }
+        }
+    }
+}
+
+TEST(unknown_binary_frames_are_rejected) {
+    CHECK_THROWS(decode_binary_envelope(""));
+    // Envelopes are always maps: a bare integer and a MessagePack array are not
+    CHECK_THROWS(decode_binary_envelope(std::string("\x01", 1)));
+    CHECK_THROWS(decode_binary_envelope(encode(json::array({1, 2}), WireEncoding::msgpack)));
+}
+
+TEST(encoding_names_round_trip) {
+    for (WireEncoding encoding : kEncodings) {
+        CHECK(parse_encoding(encoding_name(encoding)) == encoding);
+    }
+    CHECK(!parse_encoding("xml"));
+    CHECK(!parse_encoding(""));
+}
+
+TEST(batches_round_trip) {
+    for (WireEncoding encoding : kEncodings) {
+        // 20 crosses MessagePack's fixarray limit
+        for (size_t count : {size_t(1), size_t(3), size_t(20)}) {
+            BatchBuilder batch;
+            batch.reset(encoding);
+            std::vector<json> envelopes;
+            for (size_t i = 0; i < count; ++i) {
+                json envelope = head();
+                envelope["id"] = "m-" + std::to_string(i);
+                envelopes.push_back(envelope);
+                batch.add(encode(envelope, encoding));
+            }
+            OutboundFrame frame;
+            batch.finish(frame);
+            CHECK(!frame.coalescible);
+            json decoded = decode(frame.data, encoding);
+            if (count == 1) {
+                CHECK(decoded == envelopes[0]);
+                continue;
+            }
+            CHECK(decoded["type"] == "batch");
+            CHECK(decoded["messages"] == json(envelopes));
+        }
+    }
+}
+
+TEST_MAIN()
@@ -0,0 +1,8293 @@
+// UAP client for the ReGenNexus registry
+//
+// Header-only client library shared by the cross-language demo
+// (cpp_client.cpp) and the benchmarks and load generator in bench/.
+//
+// Dependencies:
+// - nlohmann/json for JSON parsing (https://github.com/nlohmann/json)
+// - websocketpp for WebSocket communication (https://github.com/zaphoyd/websocketpp)
+// - Boost for asio
+// - OpenSSL (libssl, libcrypto) for TLS, AES-256-GCM and ECDH
+// - zstd (libzstd) for frame compression
+// - Linux for the shared-memory transport (link -lrt on glibc before 2.34)
+// - A C++20 compiler
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <optional>
+#include <stdexcept>
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <span>
+#include <array>
+#include <list>
+#include <set>
+#include <memory_resource>
+#include <shared_mutex>
+#include <unordered_map>
+#include <future>
+#include <deque>
+#include <type_traits>
+#include <any>
+#include <random>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <websocketpp/config/asio_client.hpp>
+#include <websocketpp/client.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <nlohmann/json.hpp>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <zstd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <unistd.h>
+
+using websocket_client = websocketpp::client<websocketpp::config::asio_client>;
+using websocket_tls_client = websocketpp::client<websocketpp::config::asio_tls_client>;
+using message_ptr = websocketpp::config::asio_client::message_type::ptr;
+using websocketpp::lib::placeholders::_1;
+using websocketpp::lib::placeholders::_2;
+
+// Per-frame scratch memory for the JSON trees built while one inbound frame
+// is handled. Allocations are bump-pointer carves from a buffer reused for
+// every frame; reset() hands everything back at once, spilling blocks
+// included, once no message from the frame is left.
+class MessageArena {
+public:
+    explicit MessageArena(size_t bytes)
+        : buffer_(new std::byte[bytes]), resource_(buffer_.get(), bytes, std::pmr::new_delete_resource()) {}
+    
+    std::pmr::memory_resource* resource() { return &resource_; }
+    void reset() { resource_.release(); }
+    
+    // Arena that JSON allocations on this thread currently go to; null for the heap
+    static MessageArena*& current() {
+        thread_local MessageArena* arena = nullptr;
+        return arena;
+    }
+    
+private:
+    std::unique_ptr<std::byte[]> buffer_;
+    std::pmr::monotonic_buffer_resource resource_;
+};
+
+// Points this thread's JSON allocations at an arena (or the heap, for null)
+// for the scope's lifetime
+class ArenaScope {
+public:
+    explicit ArenaScope(MessageArena* arena) : previous_(MessageArena::current()) {
+        MessageArena::current() = arena;
+    }
+    ~ArenaScope() { MessageArena::current() = previous_; }
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+    
+private:
+    MessageArena* previous_;
+};
+
+// Allocator of inbound_json. Each container remembers the arena that was
+// current when it was built; copies follow whatever is current where the
+// copy is made, so copying a value out of an arena-parsed tree outside an
+// ArenaScope lands on the heap. nlohmann/json allocates and frees the node
+// headers with fresh allocators, so an arena tree has to be destroyed under
+// the scope it was built in; only InboundMessage builds them, and it does.
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+    
+    ArenaAllocator() noexcept : arena_(MessageArena::current()) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena_(other.arena()) {}
+    
+    T* allocate(size_t n) {
+        if (arena_) {
+            return static_cast<T*>(arena_->resource()->allocate(n * sizeof(T), alignof(T)));
+        }
+        return std::allocator<T>().allocate(n);
+    }
+    
+    void deallocate(T* p, size_t n) {
+        if (arena_) {
+            arena_->resource()->deallocate(p, n * sizeof(T), alignof(T));
+        } else {
+            std::allocator<T>().deallocate(p, n);
+        }
+    }
+    
+    ArenaAllocator select_on_container_copy_construction() const { return ArenaAllocator(); }
+    
+    MessageArena* arena() const { return arena_; }
+    
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena_ == other.arena(); }
+    
+private:
+    MessageArena* arena_;
+};
+
+using json = nlohmann::json;
+
+// JSON parsed into a MessageArena by the inbound decode path, with objects
+// and arrays allocated through ArenaAllocator; strings keep std::string so
+// get<std::string>() and friends work unchanged. Handlers reach it through
+// InboundMessage::scratch_payload() and keep data by converting to json.
+using inbound_json = nlohmann::basic_json<std::map, std::vector, std::string, bool, std::int64_t,
+                                          std::uint64_t, double, ArenaAllocator>;
+
+// Bounded lock-free queue (Vyukov-style ring of sequenced cells).
+// Safe for any number of producers and consumers; UAP_Client uses it with
+// many producers and a single writer, plus producers popping the oldest
+// entry under the drop-oldest backpressure policy.
+// Values are swapped in and out of their cells rather than moved, so callers
+// get the cell's previous storage back and string buffers keep circulating
+// through the ring instead of being reallocated for every frame.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mask_ = size - 1;
+        cells_ = std::vector<Cell>(size);
+        for (size_t i = 0; i < size; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+    
+    // Returns false without blocking when the queue is full. On success value
+    // holds whatever the cell contained before.
+    bool try_push(T&& value) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells_[pos & mask_];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    using std::swap;
+                    swap(cell.data, value);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    // Returns false without blocking when the queue is empty. On success the
+    // cell keeps value's previous contents for reuse by a later push.
+    bool try_pop(T& value) {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells_[pos & mask_];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    using std::swap;
+                    swap(cell.data, value);
+                    cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    bool empty() const {
+        return size() == 0;
+    }
+    
+    // Approximate when producers or consumers are active
+    size_t size() const {
+        size_t head = dequeue_pos_.load(std::memory_order_acquire);
+        size_t tail = enqueue_pos_.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+    
+    size_t capacity() const {
+        return mask_ + 1;
+    }
+    
+private:
+    struct Cell {
+        std::atomic<size_t> sequence{0};
+        T data;
+        
+        Cell() = default;
+        Cell(Cell&& other) noexcept : data(std::move(other.data)) {
+            sequence.store(other.sequence.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        Cell& operator=(Cell&& other) noexcept {
+            sequence.store(other.sequence.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            data = std::move(other.data);
+            return *this;
+        }
+    };
+    
+    std::vector<Cell> cells_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> enqueue_pos_{0};
+    alignas(64) std::atomic<size_t> dequeue_pos_{0};
+};
+
+// Monotonic clock in nanoseconds, used for latency measurements
+inline uint64_t monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Wall-clock time as integer nanoseconds since the Unix epoch, converted
+// from system_clock's own period. On Linux this is a vDSO read, not a syscall.
+inline int64_t wall_clock_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Legacy floating-point 'timestamp' field (seconds) for a ts_ns reading
+inline double to_timestamp(int64_t ts_ns) {
+    return ts_ns / 1e9;
+}
+
+// An envelope's 'ttl' field is seconds, as UAP_Message.ttl on the Python
+// side; fractions are allowed
+inline double to_ttl_seconds(int64_t ttl_ns) {
+    return ttl_ns / 1e9;
+}
+
+// Clamped to [0, INT64_MAX] nanoseconds; NaN counts as no time at all
+inline int64_t from_ttl_seconds(double ttl) {
+    if (!(ttl > 0)) {
+        return 0;
+    }
+    double ns = ttl * 1e9;
+    if (ns >= 9223372036854775807.0) {
+        return std::numeric_limits<int64_t>::max();
+    }
+    return static_cast<int64_t>(std::llround(ns));
+}
+
+// ts_ns + ttl_ns, saturating instead of overflowing for far-off deadlines
+// and timestamps a peer made up
+inline int64_t expiry_ns(int64_t ts_ns, int64_t ttl_ns) {
+    if (ttl_ns > 0 && ts_ns > std::numeric_limits<int64_t>::max() - ttl_ns) {
+        return std::numeric_limits<int64_t>::max();
+    }
+    if (ttl_ns < 0 && ts_ns < std::numeric_limits<int64_t>::min() - ttl_ns) {
+        return std::numeric_limits<int64_t>::min();
+    }
+    return ts_ns + ttl_ns;
+}
+
+enum class LogLevel {
+    debug,
+    info,
+    warn,
+    error,
+    off
+};
+
+// Asynchronous levelled logger. Callers only stamp the time and push the
+// record onto a lock-free ring; a background thread formats and writes it.
+// When the ring is full records are dropped rather than stalling the caller.
+class Logger {
+public:
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+    
+    ~Logger() {
+        stopping_.store(true);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cv_.notify_one();
+        }
+        if (writer_.joinable()) {
+            writer_.join();
+        }
+    }
+    
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+    
+    void set_level(LogLevel level) {
+        level_.store(level, std::memory_order_relaxed);
+    }
+    
+    bool enabled(LogLevel level) const {
+        return level >= level_.load(std::memory_order_relaxed);
+    }
+    
+    void write(LogLevel level, std::string message) {
+        if (!enabled(level)) {
+            return;
+        }
+        Record record{level, std::chrono::system_clock::now(), std::move(message)};
+        if (!records_.try_push(std::move(record))) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (sleeping_.load()) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cv_.notify_one();
+        }
+    }
+    
+    // Records lost because the ring was full
+    size_t dropped_count() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+    
+private:
+    struct Record {
+        LogLevel level = LogLevel::info;
+        std::chrono::system_clock::time_point time;
+        std::string message;
+    };
+    
+    Logger() : records_(8192), writer_([this]() { run(); }) {}
+    
+    void run() {
+        Record record;
+        std::string out;
+        for (;;) {
+            while (records_.try_pop(record)) {
+                format(record, out);
+            }
+            if (!out.empty()) {
+                std::cout.write(out.data(), out.size());
+                std::cout.flush();
+                out.clear();
+            }
+            
+            if (stopping_.load() && records_.empty()) {
+                return;
+            }
+            
+            // Same handshake as DispatchPool: publish the flag, then re-check
+            std::unique_lock<std::mutex> lock(mutex_);
+            sleeping_.store(true);
+            if (records_.empty() && !stopping_.load()) {
+                cv_.wait_for(lock, std::chrono::milliseconds(100));
+            }
+            sleeping_.store(false);
+        }
+    }
+    
+    static void format(Record& record, std::string& out) {
+        std::time_t time = std::chrono::system_clock::to_time_t(record.time);
+        std::tm local{};
+        localtime_r(&time, &local);
+        char timestamp[32];
+        std::strftime(timestamp, sizeof(timestamp), "%a %b %e %H:%M:%S %Y", &local);
+        
+        out += '[';
+        out += timestamp;
+        out += "] ";
+        switch (record.level) {
+            case LogLevel::debug: out += "DEBUG "; break;
+            case LogLevel::warn: out += "WARN "; break;
+            case LogLevel::error: out += "ERROR "; break;
+            default: break;
+        }
+        out += record.message;
+        out += '\n';
+        record.message.clear();
+    }
+    
+    std::atomic<LogLevel> level_{LogLevel::info};
+    std::atomic<size_t> dropped_{0};
+    std::atomic<bool> stopping_{false};
+    std::atomic<bool> sleeping_{false};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    BoundedQueue<Record> records_;
+    std::thread writer_;
+};
+
+inline void set_log_level(LogLevel level) {
+    Logger::instance().set_level(level);
+}
+
+// Check before building an expensive message for a level that may be filtered out
+inline bool log_enabled(LogLevel level) {
+    return Logger::instance().enabled(level);
+}
+
+inline void log(LogLevel level, const std::string& message) {
+    Logger::instance().write(level, message);
+}
+
+// Logger function
+inline void log(const std::string& message) {
+    log(LogLevel::info, message);
+}
+
+// FNV-1a hash of an intent name; constexpr so intents known at build time
+// can be hashed by the compiler
+constexpr uint64_t intent_hash(std::string_view intent) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : intent) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Intent name with its hash precomputed at compile time, e.g.
+//   constexpr StaticIntent kPing{"ping"};
+struct StaticIntent {
+    constexpr explicit StaticIntent(std::string_view intent_name)
+        : name(intent_name), hash(intent_hash(intent_name)) {}
+    
+    std::string_view name;
+    uint64_t hash;
+};
+
+// Open-addressing intent -> value table with linear probing.
+// Intent names are interned (copied once) on insert; lookups take a
+// string_view and never allocate.
+template <typename Value>
+class IntentTable {
+public:
+    IntentTable() : slots_(16) {}
+    
+    Value* find(std::string_view intent) {
+        return find(intent, intent_hash(intent));
+    }
+    
+    Value* find(std::string_view intent, uint64_t hash) {
+        return const_cast<Value*>(std::as_const(*this).find(intent, hash));
+    }
+    
+    const Value* find(std::string_view intent) const {
+        return find(intent, intent_hash(intent));
+    }
+    
+    const Value* find(std::string_view intent, uint64_t hash) const {
+        for (size_t i = hash & mask(); slots_[i].used; i = (i + 1) & mask()) {
+            if (slots_[i].hash == hash && slots_[i].intent == intent) {
+                return &slots_[i].value;
+            }
+        }
+        return nullptr;
+    }
+    
+    void insert_or_assign(std::string_view intent, Value value) {
+        insert_or_assign(intent, intent_hash(intent), std::move(value));
+    }
+    
+    void insert_or_assign(std::string_view intent, uint64_t hash, Value value) {
+        if (Value* existing = find(intent, hash)) {
+            *existing = std::move(value);
+            return;
+        }
+        // Keep the load factor at or below one half so probe runs stay short
+        if ((size_ + 1) * 2 > slots_.size()) {
+            grow();
+        }
+        place(Slot{hash, std::string(intent), std::move(value), true});
+        ++size_;
+    }
+    
+    bool erase(std::string_view intent) {
+        return erase(intent, intent_hash(intent));
+    }
+    
+    // Backward-shift deletion: later entries of the probe run move up into
+    // the hole, so lookups never need tombstones
+    bool erase(std::string_view intent, uint64_t hash) {
+        size_t hole = hash & mask();
+        while (slots_[hole].used && !(slots_[hole].hash == hash && slots_[hole].intent == intent)) {
+            hole = (hole + 1) & mask();
+        }
+        if (!slots_[hole].used) {
+            return false;
+        }
+        for (size_t i = (hole + 1) & mask(); slots_[i].used; i = (i + 1) & mask()) {
+            size_t home = slots_[i].hash & mask();
+            bool reachable = hole <= i ? (home > hole && home <= i) : (home > hole || home <= i);
+            if (!reachable) {
+                slots_[hole] = std::move(slots_[i]);
+                hole = i;
+            }
+        }
+        slots_[hole] = Slot{};
+        --size_;
+        return true;
+    }
+    
+    size_t size() const {
+        return size_;
+    }
+    
+    // Calls f(intent, value) for every entry, in no particular order
+    template <typename F>
+    void for_each(F&& f) const {
+        for (const auto& slot : slots_) {
+            if (slot.used) {
+                f(std::string_view(slot.intent), slot.value);
+            }
+        }
+    }
+    
+private:
+    struct Slot {
+        uint64_t hash = 0;
+        std::string intent;
+        Value value{};
+        bool used = false;
+    };
+    
+    size_t mask() const {
+        return slots_.size() - 1;
+    }
+    
+    void place(Slot&& slot) {
+        size_t i = slot.hash & mask();
+        while (slots_[i].used) {
+            i = (i + 1) & mask();
+        }
+        slots_[i] = std::move(slot);
+    }
+    
+    void grow() {
+        std::vector<Slot> old(slots_.size() * 2);
+        old.swap(slots_);
+        for (auto& slot : old) {
+            if (slot.used) {
+                place(std::move(slot));
+            }
+        }
+    }
+    
+    std::vector<Slot> slots_;
+    size_t size_ = 0;
+};
+
+// A value published copy-on-write. Writers serialize on a mutex, edit a
+// copy of the current value and publish it with a version bump. Each reader
+// slot caches the snapshot it last saw and only reloads the shared pointer
+// (under a lock held just for the pointer copy) when the version has moved,
+// so the common read is one acquire load of a counter nobody writes to.
+// A slot must only be used by one thread at a time; the snapshot it returns
+// stays valid until that slot's next read.
+template <typename T>
+class SnapshotCell {
+public:
+    explicit SnapshotCell(size_t readers)
+        : current_(std::make_shared<const T>()), slots_(readers) {}
+    
+    // Applies edit to a copy of the value and publishes it; returns what edit returned
+    template <typename Edit>
+    auto update(Edit&& edit) {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        auto next = std::make_shared<T>(*current_);
+        auto result = edit(*next);
+        {
+            std::lock_guard<std::mutex> publish(publish_mutex_);
+            current_ = std::move(next);
+        }
+        version_.fetch_add(1, std::memory_order_release);
+        return result;
+    }
+    
+    // The current value, for threads without a reader slot
+    std::shared_ptr<const T> load() {
+        std::lock_guard<std::mutex> publish(publish_mutex_);
+        return current_;
+    }
+    
+    const T& read(size_t reader) {
+        Slot& slot = slots_[reader];
+        uint64_t version = version_.load(std::memory_order_acquire);
+        if (slot.version != version || !slot.value) {
+            std::lock_guard<std::mutex> publish(publish_mutex_);
+            slot.value = current_;
+            slot.version = version;
+        }
+        return *slot.value;
+    }
+    
+private:
+    // One cache line per slot, so readers on different threads never share one
+    struct alignas(64) Slot {
+        uint64_t version = 0;
+        std::shared_ptr<const T> value;
+    };
+    
+    std::mutex write_mutex_;
+    std::mutex publish_mutex_;
+    std::shared_ptr<const T> current_;
+    alignas(64) std::atomic<uint64_t> version_{0};
+    std::vector<Slot> slots_;
+};
+
+// Byte range inside a buffer; stays valid when the buffer is moved
+struct Span {
+    size_t offset = 0;
+    size_t length = 0;
+    bool present = false;
+};
+
+// Locates the routing fields of a UAP envelope without building a DOM.
+// Only the top-level object is tokenized; nested values (the payload in
+// particular) are skipped over and reported as raw spans. String fields with
+// escape sequences are decoded into a side buffer.
+class EnvelopeScanner {
+public:
+    struct Result {
+        Span intent, sender, recipient, id, type, reply_to, payload;
+        bool intent_decoded = false, sender_decoded = false;
+        bool recipient_decoded = false, id_decoded = false, type_decoded = false;
+        bool reply_to_decoded = false;
+        bool encrypted = false;
+        bool has_ts_ns = false;
+        int64_t ts_ns = 0;
+        bool has_ttl = false;
+        int64_t ttl_ns = 0;
+        
+        // ts_ns plus the ttl, if the envelope has both
+        std::optional<int64_t> expires_ns() const {
+            return has_ts_ns && has_ttl ? std::optional<int64_t>(expiry_ns(ts_ns, ttl_ns)) : std::nullopt;
+        }
+    };
+    
+    // Returns false if the frame is not a well-formed top-level JSON object.
+    // Nested values are only checked for balanced brackets, not fully validated.
+    static bool scan(std::string_view frame, Result& result, std::string& decoded) {
+        EnvelopeScanner s(frame, decoded);
+        return s.scan_object(result);
+    }
+    
+private:
+    EnvelopeScanner(std::string_view frame, std::string& decoded)
+        : in_(frame), decoded_(decoded) {}
+    
+    bool scan_object(Result& result) {
+        skip_ws();
+        if (!consume('{')) {
+            return false;
+        }
+        skip_ws();
+        if (consume('}')) {
+            return at_end();
+        }
+        for (;;) {
+            skip_ws();
+            Span key;
+            bool key_decoded = false;
+            if (!scan_string(key, key_decoded)) {
+                return false;
+            }
+            std::string_view name = view(key, key_decoded);
+            skip_ws();
+            if (!consume(':')) {
+                return false;
+            }
+            skip_ws();
+            
+            if (name == "intent" && peek() == '"') {
+                if (!scan_string(result.intent, result.intent_decoded)) return false;
+            } else if (name == "sender" && peek() == '"') {
+                if (!scan_string(result.sender, result.sender_decoded)) return false;
+            } else if (name == "recipient" && peek() == '"') {
+                if (!scan_string(result.recipient, result.recipient_decoded)) return false;
+            } else if (name == "id" && peek() == '"') {
+                if (!scan_string(result.id, result.id_decoded)) return false;
+            } else if (name == "type" && peek() == '"') {
+                if (!scan_string(result.type, result.type_decoded)) return false;
+            } else if (name == "reply_to" && peek() == '"') {
+                if (!scan_string(result.reply_to, result.reply_to_decoded)) return false;
+            } else if (name == "payload") {
+                size_t start = pos_;
+                if (!skip_value()) return false;
+                result.payload = Span{start, pos_ - start, true};
+            } else if (name == "encrypted" && in_.substr(pos_, 4) == "true") {
+                result.encrypted = true;
+                pos_ += 4;
+            } else if (name == "ts_ns" && scan_integer(result.ts_ns)) {
+                result.has_ts_ns = true;
+            } else if (name == "ttl" && scan_seconds(result.ttl_ns)) {
+                result.has_ttl = true;
+            } else if (!skip_value()) {
+                return false;
+            }
+            
+            skip_ws();
+            if (consume(',')) {
+                continue;
+            }
+            if (consume('}')) {
+                return at_end();
+            }
+            return false;
+        }
+    }
+    
+    // Reads a plain JSON integer; leaves the position alone (so the value is
+    // skipped as usual) for anything else, including floats
+    bool scan_integer(int64_t& value) {
+        const char* begin = in_.data() + pos_;
+        const char* end = in_.data() + in_.size();
+        auto result = std::from_chars(begin, end, value);
+        if (result.ec != std::errc() ||
+            (result.ptr != end && (*result.ptr == '.' || *result.ptr == 'e' || *result.ptr == 'E'))) {
+            return false;
+        }
+        pos_ += result.ptr - begin;
+        return true;
+    }
+    
+    // Reads a JSON number of seconds as nanoseconds; leaves the position
+    // alone for anything else, including negative and non-finite numbers
+    bool scan_seconds(int64_t& value) {
+        const char* begin = in_.data() + pos_;
+        double seconds = 0;
+        auto result = std::from_chars(begin, in_.data() + in_.size(), seconds);
+        if (result.ec != std::errc() || !std::isfinite(seconds) || seconds < 0) {
+            return false;
+        }
+        value = from_ttl_seconds(seconds);
+        pos_ += result.ptr - begin;
+        return true;
+    }
+    
+    // Records the contents of a string token (without quotes). Strings with
+    // escapes are decoded into decoded_ and the span refers to that buffer.
+    bool scan_string(Span& span, bool& is_decoded) {
+        if (!consume('"')) {
+            return false;
+        }
+        size_t start = pos_;
+        while (pos_ < in_.size() && in_[pos_] != '"' && in_[pos_] != '\\') {
+            ++pos_;
+        }
+        if (pos_ < in_.size() && in_[pos_] == '"') {
+            span = Span{start, pos_ - start, true};
+            is_decoded = false;
+            ++pos_;
+            return true;
+        }
+        
+        // Slow path: unescape into the side buffer
+        size_t out_start = decoded_.size();
+        decoded_.append(in_.data() + start, pos_ - start);
+        while (pos_ < in_.size()) {
+            char c = in_[pos_++];
+            if (c == '"') {
+                span = Span{out_start, decoded_.size() - out_start, true};
+                is_decoded = true;
+                return true;
+            }
+            if (c != '\\') {
+                decoded_.push_back(c);
+                continue;
+            }
+            if (pos_ >= in_.size()) {
+                return false;
+            }
+            char e = in_[pos_++];
+            switch (e) {
+                case '"': decoded_.push_back('"'); break;
+                case '\\': decoded_.push_back('\\'); break;
+                case '/': decoded_.push_back('/'); break;
+                case 'b': decoded_.push_back('\b'); break;
+                case 'f': decoded_.push_back('\f'); break;
+                case 'n': decoded_.push_back('\n'); break;
+                case 'r': decoded_.push_back('\r'); break;
+                case 't': decoded_.push_back('\t'); break;
+                case 'u': {
+                    uint32_t cp = 0;
+                    if (!read_hex4(cp)) return false;
+                    if (cp >= 0xD800 && cp <= 0xDBFF) {
+                        uint32_t low = 0;
+                        if (in_.substr(pos_, 2) != "\\u") return false;
+                        pos_ += 2;
+                        if (!read_hex4(low) || low < 0xDC00 || low > 0xDFFF) return false;
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    append_utf8(cp);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return false;
+    }
+    
+    bool skip_value() {
+        if (pos_ >= in_.size()) {
+            return false;
+        }
+        char c = in_[pos_];
+        if (c == '"') {
+            return skip_string();
+        }
+        if (c == '{' || c == '[') {
+            // Balanced skip; strings are skipped whole so brackets inside them don't count
+            size_t depth = 0;
+            while (pos_ < in_.size()) {
+                c = in_[pos_];
+                if (c == '"') {
+                    if (!skip_string()) return false;
+                    continue;
+                }
+                if (c == '{' || c == '[') {
+                    ++depth;
+                } else if (c == '}' || c == ']') {
+                    if (--depth == 0) {
+                        ++pos_;
+                        return true;
+                    }
+                }
+                ++pos_;
+            }
+            return false;
+        }
+        // Number, true, false or null
+        size_t start = pos_;
+        while (pos_ < in_.size() && in_[pos_] != ',' && in_[pos_] != '}' && in_[pos_] != ']' &&
+               !is_ws(in_[pos_])) {
+            ++pos_;
+        }
+        return pos_ > start;
+    }
+    
+    bool skip_string() {
+        ++pos_;
+        while (pos_ < in_.size()) {
+            char c = in_[pos_++];
+            if (c == '\\') {
+                ++pos_;
+            } else if (c == '"') {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    bool read_hex4(uint32_t& value) {
+        if (pos_ + 4 > in_.size()) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = in_[pos_++];
+            value <<= 4;
+            if (c >= '0' && c <= '9') value |= c - '0';
+            else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+            else return false;
+        }
+        return true;
+    }
+    
+    void append_utf8(uint32_t cp) {
+        if (cp < 0x80) {
+            decoded_.push_back(static_cast<char>(cp));
+        } else if (cp < 0x800) {
+            decoded_.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            decoded_.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            decoded_.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            decoded_.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            decoded_.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else {
+            decoded_.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            decoded_.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            decoded_.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            decoded_.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+    
+    std::string_view view(const Span& span, bool is_decoded) const {
+        const std::string_view source = is_decoded ? std::string_view(decoded_) : in_;
+        return source.substr(span.offset, span.length);
+    }
+    
+    static bool is_ws(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+    
+    void skip_ws() {
+        while (pos_ < in_.size() && is_ws(in_[pos_])) {
+            ++pos_;
+        }
+    }
+    
+    char peek() const {
+        return pos_ < in_.size() ? in_[pos_] : '\0';
+    }
+    
+    bool consume(char c) {
+        if (peek() != c) {
+            return false;
+        }
+        ++pos_;
+        return true;
+    }
+    
+    bool at_end() {
+        skip_ws();
+        return pos_ == in_.size();
+    }
+    
+    std::string_view in_;
+    std::string& decoded_;
+    size_t pos_ = 0;
+};
+
+// Inbound message with lazily parsed contents.
+// Routing fields are available immediately as views into the owned frame;
+// the payload and the full document are only parsed when first requested.
+// payload() and document() parse onto the heap. Given an arena,
+// scratch_payload() and scratch_document() parse into it instead; those
+// trees are released with the message and are only good while it is being
+// dispatched. detach() moves whatever lives in the arena to the heap, for
+// messages that outlive the frame they arrived in.
+class InboundMessage {
+public:
+    // Takes ownership of the raw frame; throws std::runtime_error if the frame
+    // is not a JSON object
+    explicit InboundMessage(std::string frame, MessageArena* arena = nullptr)
+        : frame_(std::move(frame)), arena_(arena) {
+        if (!EnvelopeScanner::scan(frame_, fields_, decoded_)) {
+            throw std::runtime_error("Malformed message envelope");
+        }
+    }
+    
+    // Wraps an already decoded document (binary frames); routing fields are
+    // copied out of it so the accessors behave the same as for text frames
+    explicit InboundMessage(json document) {
+        copy_fields(document);
+        auto payload = document.find("payload");
+        if (payload != document.end()) {
+            payload_ = *payload;
+        }
+        document_ = std::move(document);
+    }
+    
+    // Wraps a document built under ArenaScope(arena), such as an element of
+    // a batch frame
+    InboundMessage(inbound_json document, MessageArena* arena) : arena_(arena) {
+        ArenaScope scope(arena_);
+        copy_fields(document);
+        auto payload = document.find("payload");
+        if (payload != document.end()) {
+            scratch_payload_ = *payload;
+        }
+        scratch_document_ = std::move(document);
+    }
+    
+    // Copies envelope (an element of a batch frame) into arena and wraps it
+    static InboundMessage copy_of(const inbound_json& envelope, MessageArena* arena) {
+        ArenaScope scope(arena);
+        return InboundMessage(inbound_json(envelope), arena);
+    }
+    
+    // Copies are detached: whatever the original holds in its arena is
+    // copied onto the heap
+    InboundMessage(const InboundMessage& other)
+        : frame_(other.frame_), decoded_(other.decoded_), fields_(other.fields_),
+          payload_(other.payload_), document_(other.document_), payload_text_(other.payload_text_),
+          received_ns_(other.received_ns_), intent_hash_(other.intent_hash_) {
+        if (frame_.empty()) {
+            if (!payload_ && other.scratch_payload_) {
+                payload_ = json(*other.scratch_payload_);
+            }
+            if (!document_ && other.scratch_document_) {
+                document_ = json(*other.scratch_document_);
+            }
+        }
+    }
+    
+    InboundMessage(InboundMessage&& other) noexcept = default;
+    
+    InboundMessage& operator=(const InboundMessage& other) {
+        return *this = InboundMessage(other);
+    }
+    
+    InboundMessage& operator=(InboundMessage&& other) noexcept {
+        if (this != &other) {
+            release_scratch();
+            frame_ = std::move(other.frame_);
+            decoded_ = std::move(other.decoded_);
+            fields_ = other.fields_;
+            payload_ = std::move(other.payload_);
+            document_ = std::move(other.document_);
+            scratch_payload_ = std::move(other.scratch_payload_);
+            scratch_document_ = std::move(other.scratch_document_);
+            payload_text_ = std::move(other.payload_text_);
+            received_ns_ = other.received_ns_;
+            intent_hash_ = other.intent_hash_;
+            arena_ = other.arena_;
+        }
+        return *this;
+    }
+    
+    ~InboundMessage() {
+        release_scratch();
+    }
+    
+    // Moves whatever was parsed into the arena onto the heap. Text frames
+    // simply drop their scratch trees and reparse on demand; others copy them.
+    void detach() {
+        if (!arena_) {
+            return;
+        }
+        if (frame_.empty()) {
+            if (!payload_ && scratch_payload_) {
+                payload_ = json(*scratch_payload_);
+            }
+            if (!document_ && scratch_document_) {
+                document_ = json(*scratch_document_);
+            }
+        }
+        release_scratch();
+        arena_ = nullptr;
+    }
+    
+    MessageArena* arena() const { return arena_; }
+    
+    std::string_view intent() const { return field(fields_.intent, fields_.intent_decoded); }
+    std::string_view sender() const { return field(fields_.sender, fields_.sender_decoded); }
+    std::string_view recipient() const { return field(fields_.recipient, fields_.recipient_decoded); }
+    std::string_view id() const { return field(fields_.id, fields_.id_decoded); }
+    std::string_view type() const { return field(fields_.type, fields_.type_decoded); }
+    // Sender's wall clock at send time, in ns since the epoch, when it set one
+    std::optional<int64_t> ts_ns() const {
+        return fields_.has_ts_ns ? std::optional<int64_t>(fields_.ts_ns) : std::nullopt;
+    }
+    // When the sender's ttl runs out, on the same clock as ts_ns
+    std::optional<int64_t> expires_ns() const { return fields_.expires_ns(); }
+    // Id of the request this message answers, if any
+    std::string_view reply_to() const { return field(fields_.reply_to, fields_.reply_to_decoded); }
+    bool encrypted() const { return fields_.encrypted; }
+    bool has_intent() const { return fields_.intent.present; }
+    // intent_hash(intent()), known without hashing when the intent arrived
+    // as an interned handle
+    uint64_t intent_hash() const { return intent_hash_ ? *intent_hash_ : ::intent_hash(intent()); }
+    void set_intent_hash(uint64_t hash) { intent_hash_ = hash; }
+    
+    // Raw JSON text of the payload, suitable for forwarding without reparsing.
+    // Messages that arrived as a decoded document serialize their payload on first call.
+    std::string_view payload_raw() const {
+        if (frame_.empty()) {
+            if (payload_text_.empty()) {
+                if (payload_) {
+                    payload_text_ = payload_->dump();
+                } else if (scratch_payload_) {
+                    payload_text_ = scratch_payload_->dump();
+                } else {
+                    payload_text_ = "{}";
+                }
+            }
+            return payload_text_;
+        }
+        if (!fields_.payload.present) {
+            return "{}";
+        }
+        return std::string_view(frame_).substr(fields_.payload.offset, fields_.payload.length);
+    }
+    
+    // Parsed payload; parsed on first call
+    const json& payload() const {
+        if (!payload_) {
+            if (frame_.empty() && scratch_payload_) {
+                payload_ = json(*scratch_payload_);
+            } else {
+                payload_ = json::parse(payload_raw());
+            }
+        }
+        return *payload_;
+    }
+    
+    // Whole message as a DOM, for handlers written against json; parsed on first call
+    const json& document() const {
+        if (!document_) {
+            if (frame_.empty() && scratch_document_) {
+                document_ = json(*scratch_document_);
+            } else {
+                document_ = json::parse(frame_);
+            }
+        }
+        return *document_;
+    }
+    
+    // payload() parsed into the arena the message arrived with (the heap when
+    // there is none); only valid until the handler returns
+    const inbound_json& scratch_payload() const {
+        if (!scratch_payload_) {
+            ArenaScope scope(arena_);
+            if (frame_.empty() && payload_) {
+                scratch_payload_ = inbound_json(*payload_);
+            } else {
+                scratch_payload_ = inbound_json::parse(payload_raw());
+            }
+        }
+        return *scratch_payload_;
+    }
+    
+    // document() parsed into the arena, on the same terms as scratch_payload()
+    const inbound_json& scratch_document() const {
+        if (!scratch_document_) {
+            ArenaScope scope(arena_);
+            if (frame_.empty() && document_) {
+                scratch_document_ = inbound_json(*document_);
+            } else {
+                scratch_document_ = inbound_json::parse(frame_);
+            }
+        }
+        return *scratch_document_;
+    }
+    
+    // Raw JSON text of the frame; empty for messages that arrived binary-encoded
+    const std::string& frame() const {
+        return frame_;
+    }
+    
+    // monotonic_ns() when the frame carrying this message was read; 0 if unknown
+    uint64_t received_ns() const { return received_ns_; }
+    void set_received_ns(uint64_t received_ns) { received_ns_ = received_ns; }
+    
+private:
+    // Frees the scratch trees under the scope they were built in
+    void release_scratch() {
+        if (!scratch_payload_ && !scratch_document_) {
+            return;
+        }
+        ArenaScope scope(arena_);
+        scratch_payload_.reset();
+        scratch_document_.reset();
+    }
+    
+    template <typename Json>
+    void copy_fields(const Json& document) {
+        if (!document.is_object()) {
+            throw std::runtime_error("Malformed message envelope");
+        }
+        copy_field(document, "intent", fields_.intent, fields_.intent_decoded);
+        copy_field(document, "sender", fields_.sender, fields_.sender_decoded);
+        copy_field(document, "recipient", fields_.recipient, fields_.recipient_decoded);
+        copy_field(document, "id", fields_.id, fields_.id_decoded);
+        copy_field(document, "type", fields_.type, fields_.type_decoded);
+        copy_field(document, "reply_to", fields_.reply_to, fields_.reply_to_decoded);
+        auto encrypted = document.find("encrypted");
+        fields_.encrypted = encrypted != document.end() && encrypted->is_boolean() && encrypted->template get<bool>();
+        auto ts_ns = document.find("ts_ns");
+        if (ts_ns != document.end() && ts_ns->is_number_integer()) {
+            fields_.ts_ns = ts_ns->template get<int64_t>();
+            fields_.has_ts_ns = true;
+        }
+        auto ttl = document.find("ttl");
+        if (ttl != document.end() && ttl->is_number()) {
+            double seconds = ttl->template get<double>();
+            if (std::isfinite(seconds) && seconds >= 0) {
+                fields_.ttl_ns = from_ttl_seconds(seconds);
+                fields_.has_ttl = true;
+            }
+        }
+    }
+    
+    template <typename Json>
+    void copy_field(const Json& document, const char* name, Span& span, bool& is_decoded) {
+        auto it = document.find(name);
+        if (it == document.end() || !it->is_string()) {
+            return;
+        }
+        const std::string& value = it->template get_ref<const std::string&>();
+        span = Span{decoded_.size(), value.size(), true};
+        is_decoded = true;
+        decoded_ += value;
+    }
+    
+    std::string_view field(const Span& span, bool is_decoded) const {
+        const std::string& source = is_decoded ? decoded_ : frame_;
+        return std::string_view(source).substr(span.offset, span.length);
+    }
+    
+    std::string frame_;
+    std::string decoded_;
+    EnvelopeScanner::Result fields_;
+    mutable std::optional<json> payload_;
+    mutable std::optional<json> document_;
+    mutable std::optional<inbound_json> scratch_payload_;
+    mutable std::optional<inbound_json> scratch_document_;
+    mutable std::string payload_text_;
+    uint64_t received_ns_ = 0;
+    std::optional<uint64_t> intent_hash_;
+    MessageArena* arena_ = nullptr;
+};
+
+// Encodings a UAP envelope can travel in. Binary encodings keep the same
+// field layout as UAP_Message.to_dict on the Python side.
+enum class WireEncoding {
+    json,
+    cbor,
+    msgpack
+};
+
+inline const char* encoding_name(WireEncoding encoding) {
+    switch (encoding) {
+        case WireEncoding::cbor: return "cbor";
+        case WireEncoding::msgpack: return "msgpack";
+        default: return "json";
+    }
+}
+
+inline std::optional<WireEncoding> parse_encoding(std::string_view name) {
+    if (name == "json") return WireEncoding::json;
+    if (name == "cbor") return WireEncoding::cbor;
+    if (name == "msgpack") return WireEncoding::msgpack;
+    return std::nullopt;
+}
+
+struct ConflationSlot;
+
+// A serialized frame waiting for the writer
+struct OutboundFrame {
+    std::string data;
+    // Immutable bytes that follow data on the wire, shared with other frames
+    // (a multicast payload, see SharedPayload); joined to data only when the
+    // frame is written
+    std::shared_ptr<const std::string> tail;
+    websocketpp::frame::opcode::value opcode = websocketpp::frame::opcode::text;
+    WireEncoding encoding = WireEncoding::json;
+    // Single envelopes may be merged into a batch frame by the writer
+    bool coalescible = true;
+    // monotonic_ns() when the frame was queued, for enqueue-to-wire latency
+    uint64_t enqueued_ns = 0;
+    // wall_clock_ns() after which the writer drops the frame instead of
+    // sending it; 0 never expires
+    int64_t expires_ns = 0;
+    // Only set on the stand-in a conflated send queues; the writer takes the
+    // slot's newest frame in its place (see RegistryConnection::enqueue_latest)
+    std::shared_ptr<ConflationSlot> conflated;
+};
+
+// Newest frame to one recipient with one of UAP_ClientOptions::conflate_intents
+struct ConflationSlot {
+    std::mutex mutex;
+    OutboundFrame frame;
+    // A stand-in for this slot waits in a send lane
+    bool queued = false;
+};
+
+// Appends a frame's shared tail to its own buffer, for whatever needs the
+// frame in one piece
+inline void join_tail(OutboundFrame& frame) {
+    if (frame.tail) {
+        frame.data += *frame.tail;
+        frame.tail.reset();
+    }
+}
+
+// Buffers above this size are released after use rather than recycled, so a
+// single large frame doesn't pin its allocation in a queue cell forever
+const size_t kMaxRetainedFrameBytes = 64 * 1024;
+
+inline void release_if_oversized(std::string& buffer) {
+    if (buffer.capacity() > kMaxRetainedFrameBytes) {
+        std::string().swap(buffer);
+    }
+}
+
+// Appends data to out as base64
+inline void append_base64(std::string& out, std::string_view data) {
+    size_t start = out.size();
+    out.resize(start + 4 * ((data.size() + 2) / 3));
+    int n = EVP_EncodeBlock(reinterpret_cast<unsigned char*>(&out[start]),
+                            reinterpret_cast<const unsigned char*>(data.data()), static_cast<int>(data.size()));
+    out.resize(start + n);
+}
+
+inline std::string base64_encode(std::string_view data) {
+    std::string out;
+    append_base64(out, data);
+    return out;
+}
+
+inline std::string base64_decode(std::string_view text) {
+    if (text.size() % 4 != 0) {
+        throw std::runtime_error("Invalid base64");
+    }
+    std::string out(3 * (text.size() / 4), '\0');
+    int n = EVP_DecodeBlock(reinterpret_cast<unsigned char*>(&out[0]),
+                            reinterpret_cast<const unsigned char*>(text.data()), static_cast<int>(text.size()));
+    if (n < 0) {
+        throw std::runtime_error("Invalid base64");
+    }
+    // EVP_DecodeBlock counts padding as output bytes
+    size_t padding = 0;
+    if (!text.empty() && text[text.size() - 1] == '=') ++padding;
+    if (text.size() > 1 && text[text.size() - 2] == '=') ++padding;
+    out.resize(n - padding);
+    return out;
+}
+
+inline void append_big_endian(std::string& out, char lead, size_t n, int bytes) {
+    out.push_back(lead);
+    for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8) {
+        out.push_back(static_cast<char>((n >> shift) & 0xFF));
+    }
+}
+
+// CBOR header: small values live in the initial byte, larger ones follow it
+inline void append_cbor_length(std::string& out, uint8_t base, uint8_t one_byte, size_t n) {
+    if (n < 24) {
+        out.push_back(static_cast<char>(base | n));
+    } else if (n < 256) {
+        append_big_endian(out, static_cast<char>(one_byte), n, 1);
+    } else if (n < 65536) {
+        append_big_endian(out, static_cast<char>(one_byte + 1), n, 2);
+    } else {
+        append_big_endian(out, static_cast<char>(one_byte + 2), n, 4);
+    }
+}
+
+// Appends value as compact JSON text to out; the same text as value.dump(),
+// without a string of its own
+inline void dump_to(const json& value, std::string& out) {
+    nlohmann::detail::serializer<json> serializer(nlohmann::detail::output_adapter<char, std::string>(out), ' ');
+    serializer.dump(value, false, false, 0);
+}
+
+// Serializes an envelope in the given encoding into frame, reusing its buffer
+inline void encode_envelope(const json& message, WireEncoding encoding, OutboundFrame& frame) {
+    frame.data.clear();
+    frame.encoding = encoding;
+    frame.coalescible = true;
+    frame.expires_ns = 0;
+    if (encoding == WireEncoding::json) {
+        dump_to(message, frame.data);
+        frame.opcode = websocketpp::frame::opcode::text;
+        return;
+    }
+    if (encoding == WireEncoding::cbor) {
+        json::to_cbor(message, frame.data);
+    } else {
+        json::to_msgpack(message, frame.data);
+    }
+    frame.opcode = websocketpp::frame::opcode::binary;
+}
+
+// Makes room for one more member at the end of an encoded envelope: drops
+// the closing brace of JSON text, or counts one more member in the map
+// header of CBOR (map(n), n < 23) and MessagePack (fixmap(n), n < 15)
+inline void reopen_envelope(std::string& out, WireEncoding encoding) {
+    switch (encoding) {
+        case WireEncoding::json:
+            out.pop_back();
+            return;
+        case WireEncoding::cbor:
+            if (static_cast<uint8_t>(out[0]) >= 0xB7) {
+                throw std::runtime_error("Envelope has too many members to extend");
+            }
+            break;
+        case WireEncoding::msgpack:
+            if (static_cast<uint8_t>(out[0]) >= 0x8F) {
+                throw std::runtime_error("Envelope has too many members to extend");
+            }
+            break;
+    }
+    ++out[0];
+}
+
+// Assembles {"type": "batch", "messages": [...]} from envelopes that are
+// already encoded. Items are concatenated into the array as they are, so a
+// batch costs a copy per envelope but no re-encoding.
+class BatchBuilder {
+public:
+    void reset(WireEncoding encoding) {
+        encoding_ = encoding;
+        body_.clear();
+        count_ = 0;
+    }
+    
+    void add(const std::string& encoded_envelope) {
+        if (encoding_ == WireEncoding::json && count_ > 0) {
+            body_.push_back(',');
+        }
+        body_ += encoded_envelope;
+        ++count_;
+    }
+    
+    size_t count() const {
+        return count_;
+    }
+    
+    WireEncoding encoding() const {
+        return encoding_;
+    }
+    
+    // A batch of one is written as the plain envelope
+    void finish(OutboundFrame& frame) const {
+        std::string& out = frame.data;
+        out.clear();
+        frame.encoding = encoding_;
+        frame.coalescible = false;
+        frame.opcode = encoding_ == WireEncoding::json ? websocketpp::frame::opcode::text
+                                                       : websocketpp::frame::opcode::binary;
+        if (count_ == 1) {
+            out = body_;
+            return;
+        }
+        out.reserve(body_.size() + 40);
+        switch (encoding_) {
+            case WireEncoding::json:
+                out += "{\"type\":\"batch\",\"messages\":[";
+                out += body_;
+                out += "]}";
+                return;
+            case WireEncoding::cbor:
+                // map(2), "type", "batch", "messages", array(count)
+                out += "\xA2" "\x64" "type" "\x65" "batch" "\x68" "messages";
+                append_cbor_length(out, 0x80, 0x98, count_);
+                break;
+            case WireEncoding::msgpack:
+                // fixmap(2), "type", "batch", "messages", array(count)
+                out += "\x82" "\xA4" "type" "\xA5" "batch" "\xA8" "messages";
+                if (count_ < 16) {
+                    out.push_back(static_cast<char>(0x90 | count_));
+                } else {
+                    append_big_endian(out, count_ < 65536 ? '\xDC' : '\xDD', count_, count_ < 65536 ? 2 : 4);
+                }
+                break;
+        }
+        out += body_;
+    }
+    
+private:
+    WireEncoding encoding_ = WireEncoding::json;
+    std::string body_;
+    size_t count_ = 0;
+};
+
+// Serializes a stream frame: the envelope plus a "data" member holding the
+// chunk, a byte string in CBOR and MessagePack and base64 text in JSON. The
+// chunk is appended to the encoded envelope rather than copied into a json.
+inline void encode_stream_frame(const json& envelope, std::string_view data, WireEncoding encoding,
+                                OutboundFrame& frame) {
+    encode_envelope(envelope, encoding, frame);
+    frame.coalescible = false;
+    if (data.empty()) {
+        return;
+    }
+    std::string& out = frame.data;
+    out.reserve(out.size() + data.size() + data.size() / 3 + 16);
+    reopen_envelope(out, encoding);
+    switch (encoding) {
+        case WireEncoding::json:
+            out += ",\"data\":\"";
+            append_base64(out, data);
+            out += "\"}";
+            return;
+        case WireEncoding::cbor:
+            out += "\x64" "data";
+            append_cbor_length(out, 0x40, 0x58, data.size());
+            break;
+        case WireEncoding::msgpack:
+            out += "\xA4" "data";
+            if (data.size() < 256) {
+                append_big_endian(out, '\xC4', data.size(), 1);
+            } else {
+                append_big_endian(out, data.size() < 65536 ? '\xC5' : '\xC6', data.size(), data.size() < 65536 ? 2 : 4);
+            }
+            break;
+    }
+    out.append(data.data(), data.size());
+}
+
+// Payload of a multicast, serialized at most once per encoding into an
+// immutable buffer that every recipient's frame shares as its tail. Each
+// frame only encodes its own head (id, sender, recipient, intent and
+// timestamps), reopened with reopen_envelope(); the tail holds the
+// "payload" member and, in JSON, the closing brace.
+class SharedPayload {
+public:
+    // payload must outlive this object
+    explicit SharedPayload(const json& payload) : payload_(payload) {}
+    
+    const std::shared_ptr<const std::string>& tail(WireEncoding encoding) {
+        std::shared_ptr<const std::string>& tail = tails_[static_cast<size_t>(encoding)];
+        if (!tail) {
+            std::string bytes;
+            switch (encoding) {
+                case WireEncoding::json:
+                    bytes = ",\"payload\":";
+                    dump_to(payload_, bytes);
+                    bytes.push_back('}');
+                    break;
+                case WireEncoding::cbor:
+                    bytes = "\x67" "payload";
+                    json::to_cbor(payload_, bytes);
+                    break;
+                case WireEncoding::msgpack:
+                    bytes = "\xA7" "payload";
+                    json::to_msgpack(payload_, bytes);
+                    break;
+            }
+            tail = std::make_shared<const std::string>(std::move(bytes));
+        }
+        return tail;
+    }
+    
+    // A whole JSON envelope from a head json, e.g. for rings and the offline
+    // buffer, which take text
+    std::string json_envelope(const json& head) {
+        std::string envelope = head.dump();
+        reopen_envelope(envelope, WireEncoding::json);
+        envelope += *tail(WireEncoding::json);
+        return envelope;
+    }
+    
+private:
+    const json& payload_;
+    std::array<std::shared_ptr<const std::string>, 3> tails_;
+};
+
+// The chunk carried by a stream frame: a view of its binary "data" member, or
+// of scratch holding a decoded base64 one
+inline std::string_view stream_frame_data(const json& frame, std::string& scratch) {
+    auto data = frame.find("data");
+    if (data == frame.end()) {
+        return {};
+    }
+    if (data->is_binary()) {
+        const auto& bytes = data->get_binary();
+        return std::string_view(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    }
+    if (data->is_string()) {
+        scratch = base64_decode(data->get_ref<const std::string&>());
+        return scratch;
+    }
+    throw std::runtime_error("Malformed stream data");
+}
+
+// Appends text as a JSON string literal
+inline void append_json_string(std::string& out, std::string_view text) {
+    static const char hex[] = "0123456789abcdef";
+    out.push_back('"');
+    size_t run = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        out.append(text.data() + run, i - run);
+        run = i + 1;
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                out += "\\u00";
+                out.push_back(hex[c >> 4]);
+                out.push_back(hex[c & 0xF]);
+        }
+    }
+    out.append(text.data() + run, text.size() - run);
+    out.push_back('"');
+}
+
+// Writes a UAP envelope around a payload that is already serialized JSON.
+// The payload text is spliced in verbatim and is not validated.
+inline void write_raw_envelope(std::string& out, std::string_view id, std::string_view sender,
+                               std::string_view recipient, std::string_view intent,
+                               std::string_view payload_json, int64_t ts_ns, int64_t ttl_ns = 0) {
+    out.clear();
+    out.reserve(payload_json.size() + id.size() + sender.size() + recipient.size() + intent.size() + 88);
+    out += "{\"id\":";
+    append_json_string(out, id);
+    out += ",\"sender\":";
+    append_json_string(out, sender);
+    out += ",\"recipient\":";
+    append_json_string(out, recipient);
+    out += ",\"intent\":";
+    append_json_string(out, intent);
+    out += ",\"payload\":";
+    out.append(payload_json.data(), payload_json.size());
+    out += ",\"timestamp\":";
+    char number[32];
+    auto result = std::to_chars(number, number + sizeof(number), to_timestamp(ts_ns));
+    out.append(number, result.ptr);
+    out += ",\"ts_ns\":";
+    result = std::to_chars(number, number + sizeof(number), ts_ns);
+    out.append(number, result.ptr);
+    if (ttl_ns != 0) {
+        out += ",\"ttl\":";
+        result = std::to_chars(number, number + sizeof(number), to_ttl_seconds(ttl_ns));
+        out.append(number, result.ptr);
+    }
+    out.push_back('}');
+}
+
+// Returns object serialized with one extra member whose value is raw JSON text,
+// e.g. to embed a received payload in a reply without parsing it
+inline std::string with_raw_field(const json& object, std::string_view key, std::string_view raw_value) {
+    std::string out = object.dump();
+    out.pop_back();
+    if (!object.empty()) {
+        out.push_back(',');
+    }
+    append_json_string(out, key);
+    out.push_back(':');
+    out.append(raw_value.data(), raw_value.size());
+    out.push_back('}');
+    return out;
+}
+
+// Decodes a binary frame; the first byte tells CBOR maps (major type 5)
+// from MessagePack maps (fixmap, map16, map32)
+inline json decode_binary_envelope(const std::string& data) {
+    if (data.empty()) {
+        throw std::runtime_error("Empty binary frame");
+    }
+    uint8_t lead = static_cast<uint8_t>(data[0]);
+    if (lead >= 0xA0 && lead <= 0xBF) {
+        return json::from_cbor(data);
+    }
+    if ((lead >= 0x80 && lead <= 0x8F) || lead == 0xDE || lead == 0xDF) {
+        return json::from_msgpack(data);
+    }
+    throw std::runtime_error("Unknown binary frame encoding");
+}
+
+// A zstd dictionary for frame compression, trained on captured traffic with
+// `python -m protocol.compression train` or `zstd --train`. Immutable once
+// loaded, so one instance can be shared by every connection and client.
+class CompressionDictionary {
+public:
+    // Throws std::runtime_error unless data is a zstd dictionary with an id;
+    // level is the compression level frames are compressed at
+    explicit CompressionDictionary(std::string_view data, int level = 3)
+        : id_(ZSTD_getDictID_fromDict(data.data(), data.size())),
+          compress_(ZSTD_createCDict(data.data(), data.size(), level), ZSTD_freeCDict),
+          decompress_(ZSTD_createDDict(data.data(), data.size()), ZSTD_freeDDict) {
+        if (id_ == 0) {
+            throw std::runtime_error("Not a zstd dictionary, or one without an id");
+        }
+        if (!compress_ || !decompress_) {
+            throw std::runtime_error("Could not load zstd dictionary");
+        }
+    }
+    
+    // Reads a dictionary file; throws std::runtime_error if it cannot
+    static std::shared_ptr<const CompressionDictionary> load(const std::string& path, int level = 3) {
+        std::unique_ptr<FILE, decltype(&std::fclose)> file(std::fopen(path.c_str(), "rb"), std::fclose);
+        if (!file) {
+            throw std::runtime_error("Could not open " + path + ": " + std::strerror(errno));
+        }
+        std::string data;
+        char buffer[4096];
+        size_t n = 0;
+        while ((n = std::fread(buffer, 1, sizeof(buffer), file.get())) > 0) {
+            data.append(buffer, n);
+        }
+        return std::make_shared<const CompressionDictionary>(data, level);
+    }
+    
+    uint32_t id() const {
+        return id_;
+    }
+    
+    const ZSTD_CDict* compress_dict() const {
+        return compress_.get();
+    }
+    
+    const ZSTD_DDict* decompress_dict() const {
+        return decompress_.get();
+    }
+    
+private:
+    uint32_t id_;
+    std::unique_ptr<ZSTD_CDict, decltype(&ZSTD_freeCDict)> compress_;
+    std::unique_ptr<ZSTD_DDict, decltype(&ZSTD_freeDDict)> decompress_;
+};
+
+// Largest frame decompression may produce, so a peer cannot make us
+// allocate without bound (websocketpp's default message size limit)
+const size_t kMaxDecompressedFrameBytes = 32000000;
+
+// True for a binary frame holding a zstd frame; no JSON, CBOR or MessagePack
+// envelope starts with the zstd magic number
+inline bool is_compressed_frame(std::string_view data) {
+    return data.size() >= 4 && static_cast<uint8_t>(data[0]) == 0x28 && static_cast<uint8_t>(data[1]) == 0xB5 &&
+           static_cast<uint8_t>(data[2]) == 0x2F && static_cast<uint8_t>(data[3]) == 0xFD;
+}
+
+// Compresses and decompresses one connection's frames. The zstd contexts
+// are reused from frame to frame and are not thread-safe; both directions
+// run on the connection's I/O thread.
+class FrameCompressor {
+public:
+    FrameCompressor() : cctx_(ZSTD_createCCtx(), ZSTD_freeCCtx), dctx_(ZSTD_createDCtx(), ZSTD_freeDCtx) {}
+    
+    // Dictionary outgoing frames are compressed with; nullptr sends them as they are
+    void use(std::shared_ptr<const CompressionDictionary> dictionary) {
+        dictionary_ = std::move(dictionary);
+    }
+    
+    const std::shared_ptr<const CompressionDictionary>& dictionary() const {
+        return dictionary_;
+    }
+    
+    // Replaces frame's data with a zstd frame holding it, sent as a binary
+    // frame, if the data is at least threshold bytes and compresses smaller.
+    // Returns the bytes saved, 0 if the frame was left alone.
+    size_t compress(OutboundFrame& frame, size_t threshold) {
+        if (!dictionary_ || frame.data.size() < threshold) {
+            return 0;
+        }
+        scratch_.resize(ZSTD_compressBound(frame.data.size()));
+        size_t size = ZSTD_compress_usingCDict(cctx_.get(), &scratch_[0], scratch_.size(), frame.data.data(),
+                                               frame.data.size(), dictionary_->compress_dict());
+        if (ZSTD_isError(size) || size >= frame.data.size()) {
+            return 0;
+        }
+        size_t saved = frame.data.size() - size;
+        scratch_.resize(size);
+        frame.data.swap(scratch_);
+        frame.opcode = websocketpp::frame::opcode::binary;
+        release_if_oversized(scratch_);
+        return saved;
+    }
+    
+    // Decompresses a zstd frame with whichever of dictionaries its header
+    // names (none if it names none); throws std::runtime_error on failure
+    std::string decompress(std::string_view data,
+                           const std::vector<std::shared_ptr<const CompressionDictionary>>& dictionaries) {
+        unsigned long long content_size = ZSTD_getFrameContentSize(data.data(), data.size());
+        if (content_size == ZSTD_CONTENTSIZE_ERROR || content_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+            content_size > kMaxDecompressedFrameBytes) {
+            throw std::runtime_error("Compressed frame without a usable content size");
+        }
+        std::string out(static_cast<size_t>(content_size), '\0');
+        uint32_t dict_id = ZSTD_getDictID_fromFrame(data.data(), data.size());
+        size_t size = 0;
+        if (dict_id == 0) {
+            size = ZSTD_decompressDCtx(dctx_.get(), &out[0], out.size(), data.data(), data.size());
+        } else {
+            auto it = std::find_if(dictionaries.begin(), dictionaries.end(),
+                                   [&](const auto& dictionary) { return dictionary->id() == dict_id; });
+            if (it == dictionaries.end()) {
+                throw std::runtime_error("Compressed frame uses unknown dictionary " + std::to_string(dict_id));
+            }
+            size = ZSTD_decompress_usingDDict(dctx_.get(), &out[0], out.size(), data.data(), data.size(),
+                                              (*it)->decompress_dict());
+        }
+        if (ZSTD_isError(size) || size != out.size()) {
+            throw std::runtime_error("Corrupt compressed frame");
+        }
+        return out;
+    }
+    
+private:
+    std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx_;
+    std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx_;
+    std::shared_ptr<const CompressionDictionary> dictionary_;
+    std::string scratch_;
+};
+
+// What an interned handle stands for
+enum class InternKind {
+    entity,
+    intent
+};
+
+const size_t kInternKinds = 2;
+
+// Handles above this are ignored, so a registry cannot make us allocate
+// an arbitrarily large name table
+const uint64_t kMaxInternHandle = 65535;
+
+// Integer handles the registry assigned to entity ids and intents for one
+// session of a connection (see UAP_ClientOptions::intern_names). Handles
+// are defined and resolved on the connection's I/O thread; any thread may
+// look them up for the frames it encodes.
+class InternedNames {
+public:
+    // Envelope members swapped for handles, with the names they held
+    using Saved = std::vector<std::pair<json*, json>>;
+    
+    // I/O thread: forgets every handle at the start of a session. Returns
+    // the registration's request, mapping self and every name that had a
+    // handle last session to that handle (null for none): frames queued
+    // before the reconnect may carry them, so the registry keeps them.
+    json reset(const std::string& self) {
+        json request = {{"entities", json::object()}, {"intents", json::object()}};
+        // Same order as compact(): the table, then the requests
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        std::lock_guard<std::mutex> requests(request_mutex_);
+        active_.store(false, std::memory_order_release);
+        for (size_t kind = 0; kind < kInternKinds; ++kind) {
+            json& names = request[key(kind)];
+            for (size_t handle = 0; handle < names_[kind].size(); ++handle) {
+                if (!names_[kind][handle].text.empty()) {
+                    names[names_[kind][handle].text] = handle;
+                }
+            }
+            if (kind == static_cast<size_t>(InternKind::entity) && !names.contains(self)) {
+                names[self] = nullptr;
+            }
+            handles_[kind] = IntentTable<uint32_t>();
+            names_[kind].clear();
+            requested_[kind].clear();
+            for (const auto& [name, handle] : names.items()) {
+                requested_[kind].insert(name);
+            }
+            requested_count_[kind].store(requested_[kind].size(), std::memory_order_relaxed);
+        }
+        return request;
+    }
+    
+    // I/O thread: records {"entities": {name: handle}, "intents": {...}}
+    // from a registration_ack or an intern frame, which also tells us the
+    // registry takes handles
+    void define(const json& definitions) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        for (size_t kind = 0; kind < kInternKinds; ++kind) {
+            auto field = definitions.find(key(kind));
+            if (field == definitions.end() || !field->is_object()) {
+                continue;
+            }
+            for (const auto& [name, handle] : field->items()) {
+                if (name.empty() || !handle.is_number_unsigned() || handle.get<uint64_t>() > kMaxInternHandle) {
+                    continue;
+                }
+                uint32_t value = handle.get<uint32_t>();
+                std::vector<Name>& names = names_[kind];
+                if (names.size() <= value) {
+                    names.resize(value + 1);
+                }
+                // A handle given a new name no longer stands for the old one
+                if (!names[value].text.empty() && names[value].text != name) {
+                    handles_[kind].erase(names[value].text);
+                }
+                names[value] = Name{name, intent_hash(name)};
+                handles_[kind].insert_or_assign(name, value);
+            }
+        }
+        active_.store(true, std::memory_order_release);
+    }
+    
+    // True once the registry has answered with handles this session
+    bool active() const {
+        return active_.load(std::memory_order_acquire);
+    }
+    
+    // Swaps the sender, recipient and intent of envelope, and of each
+    // envelope in a batch, for their handles, keeping the names in saved
+    // for restore(). Names without a handle that were not asked for yet
+    // are added to missing as {"entities": {name: null}, "intents": {...}},
+    // up to capacity of each per session.
+    void compact(json& envelope, Saved& saved, json& missing, size_t capacity) {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        compact_one(envelope, saved, missing, capacity);
+        auto messages = envelope.find("messages");
+        if (messages != envelope.end() && messages->is_array()) {
+            for (json& element : *messages) {
+                if (element.is_object()) {
+                    compact_one(element, saved, missing, capacity);
+                }
+            }
+        }
+    }
+    
+    // Puts back what compact() took out; swapping moves no strings
+    static void restore(Saved& saved) {
+        for (auto& [field, name] : saved) {
+            std::swap(*field, name);
+        }
+        saved.clear();
+    }
+    
+    // Lets missing names whose request could not be sent be asked for again
+    void forget_requests(const json& missing) {
+        std::lock_guard<std::mutex> lock(request_mutex_);
+        for (size_t kind = 0; kind < kInternKinds; ++kind) {
+            auto field = missing.find(key(kind));
+            if (field == missing.end()) {
+                continue;
+            }
+            for (const auto& [name, handle] : field->items()) {
+                requested_[kind].erase(name);
+            }
+            requested_count_[kind].store(requested_[kind].size(), std::memory_order_relaxed);
+        }
+    }
+    
+    // I/O thread: swaps handles in envelope, and in each envelope of a
+    // batch, back for their names. Returns the intent's hash when the
+    // intent was a handle. Throws std::runtime_error for an undefined handle.
+    std::optional<uint64_t> resolve(json& envelope) const {
+        if (!active()) {
+            return std::nullopt;
+        }
+        std::optional<uint64_t> hash = resolve_one(envelope);
+        auto messages = envelope.find("messages");
+        if (messages != envelope.end() && messages->is_array()) {
+            for (json& element : *messages) {
+                if (element.is_object()) {
+                    resolve_one(element);
+                }
+            }
+        }
+        return hash;
+    }
+    
+private:
+    struct Name {
+        std::string text;
+        uint64_t hash = 0;
+    };
+    
+    static constexpr std::pair<const char*, InternKind> kMembers[] = {
+        {"sender", InternKind::entity},
+        {"recipient", InternKind::entity},
+        {"intent", InternKind::intent}
+    };
+    
+    static const char* key(size_t kind) {
+        return kind == static_cast<size_t>(InternKind::entity) ? "entities" : "intents";
+    }
+    
+    void compact_one(json& envelope, Saved& saved, json& missing, size_t capacity) {
+        for (const auto& [member, kind_value] : kMembers) {
+            size_t kind = static_cast<size_t>(kind_value);
+            auto field = envelope.find(member);
+            if (field == envelope.end() || !field->is_string()) {
+                continue;
+            }
+            const std::string& name = field->get_ref<const std::string&>();
+            if (const uint32_t* handle = handles_[kind].find(name)) {
+                json value = *handle;
+                std::swap(*field, value);
+                saved.emplace_back(&*field, std::move(value));
+            } else if (first_request(kind, name, capacity)) {
+                missing[key(kind)][name] = nullptr;
+            }
+        }
+    }
+    
+    bool first_request(size_t kind, const std::string& name, size_t capacity) {
+        if (requested_count_[kind].load(std::memory_order_relaxed) >= capacity) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(request_mutex_);
+        if (requested_[kind].size() >= capacity || !requested_[kind].insert(name).second) {
+            return false;
+        }
+        requested_count_[kind].store(requested_[kind].size(), std::memory_order_relaxed);
+        return true;
+    }
+    
+    std::optional<uint64_t> resolve_one(json& envelope) const {
+        std::optional<uint64_t> hash;
+        for (const auto& [member, kind_value] : kMembers) {
+            size_t kind = static_cast<size_t>(kind_value);
+            auto field = envelope.find(member);
+            if (field == envelope.end() || !field->is_number_unsigned()) {
+                continue;
+            }
+            uint64_t handle = field->get<uint64_t>();
+            const std::vector<Name>& names = names_[kind];
+            if (handle >= names.size() || names[handle].text.empty()) {
+                const char* what = kind_value == InternKind::entity ? "entity" : "intent";
+                throw std::runtime_error(std::string("Undefined ") + what + " handle " + std::to_string(handle));
+            }
+            *field = names[handle].text;
+            if (kind_value == InternKind::intent) {
+                hash = names[handle].hash;
+            }
+        }
+        return hash;
+    }
+    
+    mutable std::shared_mutex mutex_;
+    std::array<IntentTable<uint32_t>, kInternKinds> handles_;
+    // By handle; only the I/O thread reads or writes these
+    std::array<std::vector<Name>, kInternKinds> names_;
+    std::atomic<bool> active_{false};
+    
+    // Names asked for this session
+    std::mutex request_mutex_;
+    std::array<std::set<std::string, std::less<>>, kInternKinds> requested_;
+    std::array<std::atomic<size_t>, kInternKinds> requested_count_{};
+};
+
+// What send_message does when the outbound queue is full
+enum class BackpressurePolicy {
+    block,          // Wait for the writer to make room
+    drop_oldest,    // Discard the oldest queued frame to make room
+    drop_newest     // Discard the frame being sent
+};
+
+// Send lanes, most urgent first. Each registry connection queues frames per
+// lane: control frames go out ahead of anything queued, and normal and bulk
+// frames share the writer by weight (see UAP_ClientOptions::intent_priorities).
+enum class MessagePriority {
+    control,    // Heartbeats, e-stops, subscription updates, stream credit
+    normal,
+    bulk        // Telemetry backlogs, stream data
+};
+
+constexpr size_t kPriorityCount = 3;
+
+inline const char* priority_name(MessagePriority priority) {
+    switch (priority) {
+        case MessagePriority::control: return "control";
+        case MessagePriority::bulk: return "bulk";
+        default: return "normal";
+    }
+}
+
+// Worker pool that runs message handlers off the I/O thread.
+// Each task carries a shard key (the sender), and tasks with the same key always
+// run on the same worker in submission order. There is no ordering across workers.
+class DispatchPool {
+public:
+    using Task = std::function<void()>;
+    
+    DispatchPool(size_t workers, size_t queue_depth) {
+        for (size_t i = 0; i < workers; ++i) {
+            shards_.emplace_back(new Shard(queue_depth));
+        }
+        for (auto& shard : shards_) {
+            Shard* s = shard.get();
+            s->worker = std::thread([this, s]() { run_worker(*s); });
+        }
+    }
+    
+    ~DispatchPool() {
+        stop();
+    }
+    
+    DispatchPool(const DispatchPool&) = delete;
+    DispatchPool& operator=(const DispatchPool&) = delete;
+    
+    // Queue a task on the shard owning key; waits while that shard is full.
+    // Returns false once the pool is stopping.
+    bool submit(size_t key, Task task) {
+        Shard& shard = *shards_[key % shards_.size()];
+        while (!shard.tasks.try_push(std::move(task))) {
+            if (stopping_.load(std::memory_order_acquire)) {
+                return false;
+            }
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            ++shard.blocked_submitters;
+            shard.space_cv.wait_for(lock, std::chrono::milliseconds(1));
+            --shard.blocked_submitters;
+        }
+        if (shard.sleeping.load()) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.work_cv.notify_one();
+        }
+        return true;
+    }
+    
+    // Finish queued tasks, then join all workers
+    void stop() {
+        if (stopping_.exchange(true)) {
+            return;
+        }
+        for (auto& shard : shards_) {
+            {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                shard->work_cv.notify_all();
+            }
+            if (shard->worker.joinable()) {
+                shard->worker.join();
+            }
+        }
+    }
+    
+    size_t queued_count() const {
+        size_t total = 0;
+        for (const auto& shard : shards_) {
+            total += shard->tasks.size();
+        }
+        return total;
+    }
+    
+private:
+    struct Shard {
+        explicit Shard(size_t depth) : tasks(depth) {}
+        
+        BoundedQueue<Task> tasks;
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable work_cv;
+        std::condition_variable space_cv;
+        std::atomic<bool> sleeping{false};
+        std::atomic<int> blocked_submitters{0};
+    };
+    
+    void run_worker(Shard& shard) {
+        Task task;
+        for (;;) {
+            while (shard.tasks.try_pop(task)) {
+                if (shard.blocked_submitters.load() > 0) {
+                    std::lock_guard<std::mutex> lock(shard.mutex);
+                    shard.space_cv.notify_one();
+                }
+                try {
+                    task();
+                } catch (const std::exception& e) {
+                    log(LogLevel::error, "Error in message handler: " + std::string(e.what()));
+                }
+                task = nullptr;
+            }
+            
+            if (stopping_.load(std::memory_order_acquire)) {
+                return;
+            }
+            
+            // Publish that we are going to sleep, then re-check so a concurrent
+            // submit either sees the flag or we see its task.
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            shard.sleeping.store(true);
+            if (shard.tasks.empty() && !stopping_.load()) {
+                shard.work_cv.wait_for(lock, std::chrono::milliseconds(100));
+            }
+            shard.sleeping.store(false);
+        }
+    }
+    
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::atomic<bool> stopping_{false};
+};
+
+// Move-only counterpart of std::function, for callbacks that own a promise
+// or an asio completion handler
+template <typename Signature>
+class UniqueFunction;
+
+template <typename R, typename... Args>
+class UniqueFunction<R(Args...)> {
+public:
+    UniqueFunction() = default;
+    
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, UniqueFunction>>>
+    UniqueFunction(F f) : impl_(new Impl<F>(std::move(f))) {}
+    
+    explicit operator bool() const {
+        return impl_ != nullptr;
+    }
+    
+    R operator()(Args... args) {
+        return impl_->call(std::forward<Args>(args)...);
+    }
+    
+private:
+    struct Base {
+        virtual ~Base() = default;
+        virtual R call(Args... args) = 0;
+    };
+    
+    template <typename F>
+    struct Impl : Base {
+        explicit Impl(F f) : f(std::move(f)) {}
+        R call(Args... args) override { return f(std::forward<Args>(args)...); }
+        F f;
+    };
+    
+    std::unique_ptr<Base> impl_;
+};
+
+// Adapts an asio completion handler into a callback that can be invoked from
+// any thread: the handler itself always runs on its associated executor
+// (fallback if it has none), which keeps outstanding work until then.
+template <typename... Args, typename Handler, typename Executor>
+UniqueFunction<void(Args...)> bind_completion(Handler handler, const Executor& fallback) {
+    auto executor = boost::asio::prefer(boost::asio::get_associated_executor(handler, fallback),
+                                        boost::asio::execution::outstanding_work.tracked);
+    return [handler = std::move(handler), executor](Args... args) mutable {
+        boost::asio::post(executor, [handler = std::move(handler), ... args = std::move(args)]() mutable {
+            handler(std::move(args)...);
+        });
+    };
+}
+
+// Thrown from a request() future when no response arrived in time
+class RequestTimeout : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Outstanding requests keyed by message id. Sharded so concurrent requests
+// and responses on different connections rarely contend for a lock.
+class CorrelationTable {
+public:
+    // Receives either an error or the reply envelope
+    using Completion = UniqueFunction<void(std::exception_ptr, json)>;
+    
+    // Returns false if id is already pending
+    bool add(const std::string& id, Completion completion) {
+        Shard& shard = shard_for(id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (!shard.entries.emplace(id, std::move(completion)).second) {
+            return false;
+        }
+        pending_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    
+    // Removes and returns the request pending under id
+    Completion take(std::string_view id) {
+        Shard& shard = shard_for(id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(std::string(id));
+        if (it == shard.entries.end()) {
+            return Completion();
+        }
+        Completion completion = std::move(it->second);
+        shard.entries.erase(it);
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        return completion;
+    }
+    
+    // Completes every pending request with error
+    void fail_all(std::exception_ptr error) {
+        for (Shard& shard : shards_) {
+            std::unordered_map<std::string, Completion> entries;
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                entries.swap(shard.entries);
+            }
+            pending_.fetch_sub(entries.size(), std::memory_order_relaxed);
+            for (auto& entry : entries) {
+                entry.second(error, json());
+            }
+        }
+    }
+    
+    // Lets the receive path skip the lookup entirely while nothing is pending
+    size_t size() const {
+        return pending_.load(std::memory_order_relaxed);
+    }
+    
+private:
+    static constexpr size_t kShards = 16;
+    
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, Completion> entries;
+    };
+    
+    Shard& shard_for(std::string_view id) {
+        return shards_[std::hash<std::string_view>()(id) % kShards];
+    }
+    
+    std::array<Shard, kShards> shards_;
+    std::atomic<size_t> pending_{0};
+};
+
+// Hashed timer wheel for request timeouts. Scheduling is an O(1) append to a
+// slot; one thread ticks through the slots and hands expired keys to
+// on_expire. Entries are never cancelled: a request that was answered is
+// simply gone from the CorrelationTable when its key expires.
+// The thread only ticks while entries are pending.
+class TimerWheel {
+public:
+    using Expire = std::function<void(const std::string&)>;
+    
+    TimerWheel(Expire on_expire, std::chrono::milliseconds tick = std::chrono::milliseconds(10), size_t slots = 512)
+        : on_expire_(std::move(on_expire)), tick_(tick), slots_(slots) {
+        thread_ = std::thread([this]() { run(); });
+    }
+    
+    ~TimerWheel() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+    
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+    
+    // Rounded up to a whole tick
+    void schedule(std::chrono::milliseconds delay, std::string key) {
+        size_t ticks = std::max<size_t>(1, (delay.count() + tick_.count() - 1) / tick_.count());
+        bool was_idle;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slots_[(cursor_ + ticks) % slots_.size()].push_back(Entry{(ticks - 1) / slots_.size(), std::move(key)});
+            was_idle = pending_++ == 0;
+        }
+        if (was_idle) {
+            cv_.notify_one();
+        }
+    }
+    
+private:
+    struct Entry {
+        size_t rounds;
+        std::string key;
+    };
+    
+    void run() {
+        std::vector<std::string> expired;
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto next_tick = std::chrono::steady_clock::now() + tick_;
+        for (;;) {
+            if (pending_ == 0) {
+                cv_.wait(lock, [this]() { return stopping_ || pending_ > 0; });
+                next_tick = std::chrono::steady_clock::now() + tick_;
+            }
+            if (stopping_) {
+                return;
+            }
+            if (cv_.wait_until(lock, next_tick, [this]() { return stopping_; })) {
+                return;
+            }
+            next_tick += tick_;
+            
+            cursor_ = (cursor_ + 1) % slots_.size();
+            std::vector<Entry>& slot = slots_[cursor_];
+            size_t kept = 0;
+            for (Entry& entry : slot) {
+                if (entry.rounds == 0) {
+                    expired.push_back(std::move(entry.key));
+                } else {
+                    --entry.rounds;
+                    slot[kept++] = std::move(entry);
+                }
+            }
+            slot.resize(kept);
+            pending_ -= expired.size();
+            
+            if (!expired.empty()) {
+                lock.unlock();
+                for (const std::string& key : expired) {
+                    on_expire_(key);
+                }
+                expired.clear();
+                lock.lock();
+            }
+        }
+    }
+    
+    Expire on_expire_;
+    std::chrono::milliseconds tick_;
+    std::vector<std::vector<Entry>> slots_;
+    size_t cursor_ = 0;
+    size_t pending_ = 0;
+    bool stopping_ = false;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread thread_;
+};
+
+// AES-256-GCM message encryption compatible with CryptoManager in
+// src/security/crypto.py: ECDH on P-384, HKDF-SHA384 with info
+// "ReGenNexus-ECDH-Key", and an envelope carrying base64 'ciphertext' and
+// 'nonce' fields. The cipher goes through OpenSSL's EVP interface, which
+// picks AES-NI / ARMv8 crypto extensions when the CPU has them.
+//
+// Derived keys are cached per peer in a bounded LRU, so ECDH runs once per
+// peer session rather than once per message. After rekey_after_messages
+// encryptions or rekey_after of wall time the sender moves to the next key
+// epoch; epochs above 0 salt HKDF with the epoch number and travel in the
+// envelope as 'key_epoch'.
+class MessageCrypto {
+public:
+    struct Options {
+        size_t max_sessions = 256;
+        uint64_t rekey_after_messages = uint64_t(1) << 32;
+        std::chrono::seconds rekey_after{24 * 3600};
+    };
+    
+    MessageCrypto() : MessageCrypto(Options()) {}
+    
+    explicit MessageCrypto(const Options& options) : options_(options) {}
+    
+    MessageCrypto(const MessageCrypto&) = delete;
+    MessageCrypto& operator=(const MessageCrypto&) = delete;
+    
+    // Our P-384 private key in PEM (PKCS8) form
+    void set_private_key(const std::string& pem) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        private_key_ = read_pem(pem, true);
+        sessions_.clear();
+        lru_.clear();
+    }
+    
+    // A peer's public key in PEM (SubjectPublicKeyInfo) form
+    void add_peer_key(const std::string& peer_id, const std::string& pem) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        peer_keys_[peer_id] = read_pem(pem, false);
+        drop_session(peer_id);
+    }
+    
+    bool has_peer(const std::string& peer_id) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return private_key_ && peer_keys_.count(peer_id) > 0;
+    }
+    
+    // Wraps the serialized envelope message_json (sent by sender to recipient)
+    // in an encrypted envelope
+    json encrypt_envelope(std::string_view message_json, const std::string& sender,
+                          const std::string& recipient, const json& id, double timestamp) {
+        uint64_t epoch = 0;
+        Key key = sending_key(recipient, epoch);
+        
+        unsigned char nonce[kNonceBytes];
+        if (RAND_bytes(nonce, sizeof(nonce)) != 1) {
+            throw std::runtime_error("RAND_bytes failed");
+        }
+        std::string sealed = seal(key, nonce, message_json);
+        
+        json envelope = {
+            {"sender", sender},
+            {"recipient", recipient},
+            {"encrypted", true},
+            {"ciphertext", base64_encode(sealed)},
+            {"nonce", base64_encode(std::string_view(reinterpret_cast<const char*>(nonce), sizeof(nonce)))},
+            {"id", id},
+            {"timestamp", timestamp}
+        };
+        if (epoch > 0) {
+            envelope["key_epoch"] = epoch;
+        }
+        return envelope;
+    }
+    
+    // Returns the plaintext envelope JSON; throws if the message cannot be decrypted
+    std::string decrypt_envelope(const json& envelope) {
+        std::string sender = envelope.value("sender", std::string());
+        if (sender.empty()) {
+            throw std::runtime_error("Encrypted message has no sender");
+        }
+        uint64_t epoch = envelope.value("key_epoch", uint64_t(0));
+        Key key = receiving_key(sender, epoch);
+        
+        std::string nonce = base64_decode(envelope.value("nonce", std::string()));
+        if (nonce.size() != kNonceBytes) {
+            throw std::runtime_error("Invalid nonce");
+        }
+        return open(key, reinterpret_cast<const unsigned char*>(nonce.data()),
+                    base64_decode(envelope.value("ciphertext", std::string())));
+    }
+    
+private:
+    static const size_t kKeyBytes = 32;
+    static const size_t kNonceBytes = 12;
+    static const size_t kTagBytes = 16;
+    
+    using Key = std::array<unsigned char, kKeyBytes>;
+    using PKey = std::shared_ptr<EVP_PKEY>;
+    
+    struct Session {
+        Key key;
+        uint64_t epoch = 0;
+        uint64_t messages = 0;
+        std::chrono::steady_clock::time_point created;
+        std::list<std::string>::iterator lru;
+        // Keys for epochs we received but are not sending on
+        std::map<uint64_t, Key> received;
+    };
+    
+    Key sending_key(const std::string& peer_id, uint64_t& epoch) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Session& session = get_session(peer_id);
+        auto age = std::chrono::steady_clock::now() - session.created;
+        if (session.messages >= options_.rekey_after_messages || age >= options_.rekey_after) {
+            ++session.epoch;
+            session.key = derive(peer_id, session.epoch);
+            session.messages = 0;
+            session.created = std::chrono::steady_clock::now();
+        }
+        ++session.messages;
+        epoch = session.epoch;
+        return session.key;
+    }
+    
+    Key receiving_key(const std::string& peer_id, uint64_t epoch) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Session& session = get_session(peer_id);
+        if (epoch == session.epoch) {
+            return session.key;
+        }
+        auto it = session.received.find(epoch);
+        if (it == session.received.end()) {
+            // Only the most recent few peer epochs are worth keeping
+            if (session.received.size() >= 4) {
+                session.received.erase(session.received.begin());
+            }
+            it = session.received.emplace(epoch, derive(peer_id, epoch)).first;
+        }
+        return it->second;
+    }
+    
+    // mutex_ held
+    Session& get_session(const std::string& peer_id) {
+        auto it = sessions_.find(peer_id);
+        if (it != sessions_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            return it->second;
+        }
+        while (sessions_.size() >= options_.max_sessions && !lru_.empty()) {
+            sessions_.erase(lru_.back());
+            lru_.pop_back();
+        }
+        Session session;
+        session.key = derive(peer_id, 0);
+        session.created = std::chrono::steady_clock::now();
+        lru_.push_front(peer_id);
+        session.lru = lru_.begin();
+        return sessions_.emplace(peer_id, std::move(session)).first->second;
+    }
+    
+    // mutex_ held
+    void drop_session(const std::string& peer_id) {
+        auto it = sessions_.find(peer_id);
+        if (it != sessions_.end()) {
+            lru_.erase(it->second.lru);
+            sessions_.erase(it);
+        }
+    }
+    
+    // ECDH followed by HKDF-SHA384; mutex_ held
+    Key derive(const std::string& peer_id, uint64_t epoch) {
+        auto peer = peer_keys_.find(peer_id);
+        if (!private_key_ || peer == peer_keys_.end()) {
+            throw std::runtime_error("No key material for " + peer_id);
+        }
+        
+        std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> ctx(
+            EVP_PKEY_CTX_new(private_key_.get(), nullptr), EVP_PKEY_CTX_free);
+        size_t secret_len = 0;
+        if (!ctx || EVP_PKEY_derive_init(ctx.get()) != 1 ||
+            EVP_PKEY_derive_set_peer(ctx.get(), peer->second.get()) != 1 ||
+            EVP_PKEY_derive(ctx.get(), nullptr, &secret_len) != 1) {
+            throw std::runtime_error("ECDH setup failed");
+        }
+        std::vector<unsigned char> secret(secret_len);
+        if (EVP_PKEY_derive(ctx.get(), secret.data(), &secret_len) != 1) {
+            throw std::runtime_error("ECDH failed");
+        }
+        
+        static const char info[] = "ReGenNexus-ECDH-Key";
+        unsigned char salt[8];
+        for (int i = 0; i < 8; ++i) {
+            salt[i] = static_cast<unsigned char>(epoch >> (56 - 8 * i));
+        }
+        std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> kdf(
+            EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr), EVP_PKEY_CTX_free);
+        Key key;
+        size_t key_len = key.size();
+        if (!kdf || EVP_PKEY_derive_init(kdf.get()) != 1 ||
+            EVP_PKEY_CTX_set_hkdf_md(kdf.get(), EVP_sha384()) != 1 ||
+            (epoch > 0 && EVP_PKEY_CTX_set1_hkdf_salt(kdf.get(), salt, sizeof(salt)) != 1) ||
+            EVP_PKEY_CTX_set1_hkdf_key(kdf.get(), secret.data(), static_cast<int>(secret_len)) != 1 ||
+            EVP_PKEY_CTX_add1_hkdf_info(kdf.get(), reinterpret_cast<const unsigned char*>(info), sizeof(info) - 1) != 1 ||
+            EVP_PKEY_derive(kdf.get(), key.data(), &key_len) != 1) {
+            OPENSSL_cleanse(secret.data(), secret.size());
+            throw std::runtime_error("HKDF failed");
+        }
+        OPENSSL_cleanse(secret.data(), secret.size());
+        return key;
+    }
+    
+    // One cipher context per thread, reinitialized per message
+    static EVP_CIPHER_CTX* cipher_context() {
+        thread_local std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> ctx(
+            EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+        return ctx.get();
+    }
+    
+    // Returns ciphertext || tag, the layout AESGCM.encrypt produces in Python
+    static std::string seal(const Key& key, const unsigned char* nonce, std::string_view plaintext) {
+        EVP_CIPHER_CTX* ctx = cipher_context();
+        std::string out(plaintext.size() + kTagBytes, '\0');
+        unsigned char* dst = reinterpret_cast<unsigned char*>(&out[0]);
+        int len = 0;
+        int final_len = 0;
+        if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key.data(), nonce) != 1 ||
+            EVP_EncryptUpdate(ctx, dst, &len, reinterpret_cast<const unsigned char*>(plaintext.data()),
+                              static_cast<int>(plaintext.size())) != 1 ||
+            EVP_EncryptFinal_ex(ctx, dst + len, &final_len) != 1 ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, kTagBytes, dst + plaintext.size()) != 1) {
+            throw std::runtime_error("AES-GCM encryption failed");
+        }
+        return out;
+    }
+    
+    static std::string open(const Key& key, const unsigned char* nonce, const std::string& sealed) {
+        if (sealed.size() < kTagBytes) {
+            throw std::runtime_error("Ciphertext too short");
+        }
+        EVP_CIPHER_CTX* ctx = cipher_context();
+        size_t body = sealed.size() - kTagBytes;
+        std::string out(body, '\0');
+        unsigned char* dst = reinterpret_cast<unsigned char*>(&out[0]);
+        const unsigned char* src = reinterpret_cast<const unsigned char*>(sealed.data());
+        int len = 0;
+        int final_len = 0;
+        if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key.data(), nonce) != 1 ||
+            EVP_DecryptUpdate(ctx, dst, &len, src, static_cast<int>(body)) != 1 ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, kTagBytes, const_cast<unsigned char*>(src + body)) != 1 ||
+            EVP_DecryptFinal_ex(ctx, dst + len, &final_len) != 1) {
+            throw std::runtime_error("AES-GCM authentication failed");
+        }
+        return out;
+    }
+    
+    static PKey read_pem(const std::string& pem, bool is_private) {
+        std::unique_ptr<BIO, decltype(&BIO_free)> bio(
+            BIO_new_mem_buf(pem.data(), static_cast<int>(pem.size())), BIO_free);
+        EVP_PKEY* key = nullptr;
+        if (bio) {
+            key = is_private ? PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr)
+                             : PEM_read_bio_PUBKEY(bio.get(), nullptr, nullptr, nullptr);
+        }
+        if (!key) {
+            throw std::runtime_error("Could not read PEM key");
+        }
+        return PKey(key, EVP_PKEY_free);
+    }
+    
+    Options options_;
+    mutable std::mutex mutex_;
+    PKey private_key_;
+    std::map<std::string, PKey> peer_keys_;
+    std::map<std::string, Session> sessions_;
+    std::list<std::string> lru_;
+};
+
+// Counter split across cache-line sized slots so concurrent threads rarely
+// touch the same line; reads sum the slots
+class ShardedCounter {
+public:
+    void add(uint64_t n = 1) {
+        slots_[thread_slot()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    
+    uint64_t load() const {
+        uint64_t total = 0;
+        for (const Slot& slot : slots_) {
+            total += slot.value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+    
+private:
+    static constexpr size_t kSlots = 16;
+    
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> value{0};
+    };
+    
+    static size_t thread_slot() {
+        static std::atomic<size_t> next{0};
+        thread_local size_t slot = next.fetch_add(1, std::memory_order_relaxed) % kSlots;
+        return slot;
+    }
+    
+    std::array<Slot, kSlots> slots_;
+};
+
+// Point-in-time copy of a LatencyHistogram. Values are nanoseconds.
+struct HistogramSnapshot {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    std::vector<uint64_t> buckets;
+    
+    double mean() const {
+        return count == 0 ? 0.0 : static_cast<double>(sum) / count;
+    }
+    
+    // Adds other's samples, e.g. to combine the stats of several clients
+    void merge(const HistogramSnapshot& other) {
+        if (buckets.size() < other.buckets.size()) {
+            buckets.resize(other.buckets.size());
+        }
+        for (size_t i = 0; i < other.buckets.size(); ++i) {
+            buckets[i] += other.buckets[i];
+        }
+        count += other.count;
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+    
+    // Upper bound of the bucket holding quantile q (0..1); within 12.5% of the true value
+    uint64_t percentile(double q) const;
+    
+    // Number of samples known to be <= bound
+    uint64_t count_at_or_below(uint64_t bound) const;
+};
+
+// Log-linear (HDR-style) histogram: each power of two is split into eight
+// linear sub-buckets, so any value is recorded with at most 12.5% error and
+// the whole uint64_t range fits in 496 counters. Recording is a few relaxed
+// atomic adds and never takes a lock.
+class LatencyHistogram {
+public:
+    static constexpr size_t kSubBucketBits = 3;
+    static constexpr size_t kSubBuckets = size_t(1) << kSubBucketBits;
+    static constexpr size_t kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+    
+    void record(uint64_t value) {
+        buckets_[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        uint64_t seen = max_.load(std::memory_order_relaxed);
+        while (value > seen && !max_.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+        }
+    }
+    
+    HistogramSnapshot snapshot() const {
+        HistogramSnapshot snap;
+        snap.buckets.resize(kBuckets);
+        for (size_t i = 0; i < kBuckets; ++i) {
+            snap.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+            snap.count += snap.buckets[i];
+        }
+        snap.sum = sum_.load(std::memory_order_relaxed);
+        snap.max = max_.load(std::memory_order_relaxed);
+        return snap;
+    }
+    
+    static size_t bucket_index(uint64_t value) {
+        if (value < 2 * kSubBuckets) {
+            return static_cast<size_t>(value);
+        }
+        size_t exponent = 63 - __builtin_clzll(value);
+        size_t sub = (value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+        return (exponent - kSubBucketBits + 1) * kSubBuckets + sub;
+    }
+    
+    // Smallest value that lands in the bucket after index
+    static uint64_t bucket_limit(size_t index) {
+        if (index < 2 * kSubBuckets) {
+            return index + 1;
+        }
+        size_t exponent = index / kSubBuckets + kSubBucketBits - 1;
+        uint64_t width = uint64_t(1) << (exponent - kSubBucketBits);
+        uint64_t lower = (kSubBuckets + index % kSubBuckets) * width;
+        return lower + width;
+    }
+    
+private:
+    std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+inline uint64_t HistogramSnapshot::percentile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * (count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return std::min(LatencyHistogram::bucket_limit(i) - 1, max);
+        }
+    }
+    return max;
+}
+
+inline uint64_t HistogramSnapshot::count_at_or_below(uint64_t bound) const {
+    uint64_t total = 0;
+    for (size_t i = 0; i < buckets.size() && LatencyHistogram::bucket_limit(i) - 1 <= bound; ++i) {
+        total += buckets[i];
+    }
+    return total;
+}
+
+// Snapshot returned by UAP_Client::stats(). Latencies are nanoseconds:
+// enqueue_to_wire from a send call to the socket write, wire_to_handler
+// from frame arrival to handler start, handler_duration per intent, and
+// one_way from the sender's ts_ns to our receipt (only meaningful between
+// hosts with synchronized clocks; see registry_clock_offset_ns).
+struct ClientStats {
+    uint64_t frames_sent = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t frames_received = 0;
+    uint64_t bytes_received = 0;
+    uint64_t messages_dispatched = 0;
+    uint64_t local_sent = 0;
+    size_t local_dropped = 0;
+    uint64_t shm_sent = 0;
+    uint64_t shm_received = 0;
+    uint64_t shm_dropped = 0;
+    size_t shm_peers = 0;
+    uint64_t stream_bytes_sent = 0;
+    uint64_t stream_bytes_received = 0;
+    uint64_t frames_compressed = 0;
+    uint64_t compression_bytes_saved = 0;
+    uint64_t multicasts = 0;
+    uint64_t multicast_envelopes = 0;
+    uint64_t expired_outbound = 0;
+    uint64_t expired_inbound = 0;
+    uint64_t conflated = 0;
+    size_t queued = 0;
+    size_t dropped = 0;
+    // queued, dropped and enqueue_to_wire per MessagePriority lane
+    std::array<size_t, kPriorityCount> lane_queued{};
+    std::array<size_t, kPriorityCount> lane_dropped{};
+    std::array<HistogramSnapshot, kPriorityCount> lane_enqueue_to_wire;
+    size_t log_dropped = 0;
+    uint64_t reconnects = 0;
+    uint64_t tls_resumptions = 0;
+    size_t offline_buffered = 0;
+    size_t offline_dropped = 0;
+    uint64_t captured_frames = 0;
+    uint64_t capture_dropped = 0;
+    HistogramSnapshot enqueue_to_wire;
+    HistogramSnapshot wire_to_handler;
+    HistogramSnapshot one_way;
+    std::map<std::string, HistogramSnapshot> handler_duration;
+    // Registry clock minus ours, and the round trip it was measured over
+    std::optional<int64_t> registry_clock_offset_ns;
+    int64_t registry_clock_rtt_ns = 0;
+};
+
+// Live instrumentation shared by a client and its connections
+class ClientMetrics {
+public:
+    ShardedCounter frames_sent;
+    ShardedCounter bytes_sent;
+    ShardedCounter frames_received;
+    ShardedCounter bytes_received;
+    ShardedCounter messages_dispatched;
+    ShardedCounter local_sent;
+    ShardedCounter shm_sent;
+    ShardedCounter shm_received;
+    ShardedCounter shm_dropped;
+    ShardedCounter stream_bytes_sent;
+    ShardedCounter stream_bytes_received;
+    ShardedCounter frames_compressed;
+    ShardedCounter compression_bytes_saved;
+    ShardedCounter multicasts;
+    ShardedCounter multicast_envelopes;
+    ShardedCounter expired_outbound;
+    ShardedCounter expired_inbound;
+    ShardedCounter conflated;
+    LatencyHistogram enqueue_to_wire;
+    std::array<LatencyHistogram, kPriorityCount> lane_enqueue_to_wire;
+    LatencyHistogram wire_to_handler;
+    LatencyHistogram one_way;
+    
+    // Handler duration histogram for an intent, created on first use.
+    // Called at handler registration, never on the message path.
+    std::shared_ptr<LatencyHistogram> handler_histogram(std::string_view intent) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& histogram = handler_durations_[std::string(intent)];
+        if (!histogram) {
+            histogram = std::make_shared<LatencyHistogram>();
+        }
+        return histogram;
+    }
+    
+    void fill(ClientStats& stats) const {
+        stats.frames_sent = frames_sent.load();
+        stats.bytes_sent = bytes_sent.load();
+        stats.frames_received = frames_received.load();
+        stats.bytes_received = bytes_received.load();
+        stats.messages_dispatched = messages_dispatched.load();
+        stats.local_sent = local_sent.load();
+        stats.shm_sent = shm_sent.load();
+        stats.shm_received = shm_received.load();
+        stats.shm_dropped = shm_dropped.load();
+        stats.stream_bytes_sent = stream_bytes_sent.load();
+        stats.stream_bytes_received = stream_bytes_received.load();
+        stats.frames_compressed = frames_compressed.load();
+        stats.compression_bytes_saved = compression_bytes_saved.load();
+        stats.multicasts = multicasts.load();
+        stats.multicast_envelopes = multicast_envelopes.load();
+        stats.expired_outbound = expired_outbound.load();
+        stats.expired_inbound = expired_inbound.load();
+        stats.conflated = conflated.load();
+        stats.enqueue_to_wire = enqueue_to_wire.snapshot();
+        for (size_t lane = 0; lane < kPriorityCount; ++lane) {
+            stats.lane_enqueue_to_wire[lane] = lane_enqueue_to_wire[lane].snapshot();
+        }
+        stats.wire_to_handler = wire_to_handler.snapshot();
+        stats.one_way = one_way.snapshot();
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& [intent, histogram] : handler_durations_) {
+            stats.handler_duration[intent] = histogram->snapshot();
+        }
+    }
+    
+private:
+    mutable std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<LatencyHistogram>> handler_durations_;
+};
+
+// Renders stats in the Prometheus text exposition format
+inline std::string prometheus_text(const ClientStats& stats, const std::string& entity_id) {
+    // 1-2-5 series from 1us to 10s, in seconds as Prometheus expects
+    static const double kBounds[] = {
+        1e-6, 2e-6, 5e-6, 1e-5, 2e-5, 5e-5, 1e-4, 2e-4, 5e-4,
+        1e-3, 2e-3, 5e-3, 1e-2, 2e-2, 5e-2, 1e-1, 2e-1, 5e-1, 1.0, 2.0, 5.0, 10.0
+    };
+    
+    auto escape = [](std::string_view value) {
+        std::string out;
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                out += '\\';
+                out += c;
+            } else if (c == '\n') {
+                out += "\\n";
+            } else {
+                out += c;
+            }
+        }
+        return out;
+    };
+    
+    std::string labels = "entity=\"" + escape(entity_id) + "\"";
+    std::string out;
+    auto metric = [&](const char* name, const char* type, const char* help, uint64_t value) {
+        out += std::string("# HELP ") + name + " " + help + "\n";
+        out += std::string("# TYPE ") + name + " " + type + "\n";
+        out += std::string(name) + "{" + labels + "} " + std::to_string(value) + "\n";
+    };
+    auto histogram = [&](const std::string& extra_labels, const char* name, const HistogramSnapshot& snap) {
+        std::string series = labels + extra_labels;
+        for (double bound : kBounds) {
+            char le[32];
+            std::snprintf(le, sizeof(le), "%g", bound);
+            uint64_t within = snap.count_at_or_below(static_cast<uint64_t>(bound * 1e9));
+            out += std::string(name) + "_bucket{" + series + ",le=\"" + le + "\"} " + std::to_string(within) + "\n";
+        }
+        out += std::string(name) + "_bucket{" + series + ",le=\"+Inf\"} " + std::to_string(snap.count) + "\n";
+        char sum[32];
+        std::snprintf(sum, sizeof(sum), "%.9f", snap.sum / 1e9);
+        out += std::string(name) + "_sum{" + series + "} " + sum + "\n";
+        out += std::string(name) + "_count{" + series + "} " + std::to_string(snap.count) + "\n";
+    };
+    auto lane_metric = [&](const char* name, const char* type, const char* help,
+                           const std::array<size_t, kPriorityCount>& values) {
+        out += std::string("# HELP ") + name + " " + help + "\n";
+        out += std::string("# TYPE ") + name + " " + type + "\n";
+        for (size_t lane = 0; lane < kPriorityCount; ++lane) {
+            out += std::string(name) + "{" + labels + ",priority=\"" + priority_name(MessagePriority(lane)) + "\"} " +
+                   std::to_string(values[lane]) + "\n";
+        }
+    };
+    auto histogram_header = [&](const char* name, const char* help) {
+        out += std::string("# HELP ") + name + " " + help + "\n";
+        out += std::string("# TYPE ") + name + " histogram\n";
+    };
+    
+    metric("uap_frames_sent_total", "counter", "Frames written to the registry.", stats.frames_sent);
+    metric("uap_bytes_sent_total", "counter", "Bytes written to the registry.", stats.bytes_sent);
+    metric("uap_frames_received_total", "counter", "Frames read from the registry.", stats.frames_received);
+    metric("uap_bytes_received_total", "counter", "Bytes read from the registry.", stats.bytes_received);
+    metric("uap_messages_dispatched_total", "counter", "Messages handed to a handler.", stats.messages_dispatched);
+    metric("uap_frames_dropped_total", "counter", "Frames discarded by backpressure.", stats.dropped);
+    metric("uap_local_messages_sent_total", "counter", "Messages handed to clients in the same process.", stats.local_sent);
+    metric("uap_local_messages_dropped_total", "counter", "Messages from clients in the same process discarded by backpressure.", stats.local_dropped);
+    metric("uap_shm_messages_sent_total", "counter", "Messages written to shared memory rings of same-host peers.", stats.shm_sent);
+    metric("uap_shm_messages_received_total", "counter", "Messages read from shared memory rings of same-host peers.", stats.shm_received);
+    metric("uap_shm_messages_dropped_total", "counter", "Messages to same-host peers discarded because a ring was full.", stats.shm_dropped);
+    metric("uap_shm_peers", "gauge", "Same-host peers with a shared memory channel.", stats.shm_peers);
+    metric("uap_stream_bytes_sent_total", "counter", "Stream data bytes sent.", stats.stream_bytes_sent);
+    metric("uap_stream_bytes_received_total", "counter", "Stream data bytes handed to stream handlers.", stats.stream_bytes_received);
+    metric("uap_frames_compressed_total", "counter", "Frames written to the registry compressed.", stats.frames_compressed);
+    metric("uap_compression_saved_bytes_total", "counter", "Bytes compression took off frames written to the registry.", stats.compression_bytes_saved);
+    metric("uap_multicasts_total", "counter", "Multicasts and broadcasts sent.", stats.multicasts);
+    metric("uap_multicast_envelopes_total", "counter", "Envelopes the client addressed to multicast recipients one by one, without registry fan-out.", stats.multicast_envelopes);
+    metric("uap_expired_outbound_total", "counter", "Messages dropped unsent because their ttl ran out while queued.", stats.expired_outbound);
+    metric("uap_expired_inbound_total", "counter", "Received messages dropped before dispatch because their ttl had run out.", stats.expired_inbound);
+    metric("uap_conflated_total", "counter", "Queued messages replaced by a newer one to the same recipient with the same intent.", stats.conflated);
+    metric("uap_log_records_dropped_total", "counter", "Log records discarded because the log ring was full.", stats.log_dropped);
+    metric("uap_send_queue_frames", "gauge", "Frames waiting for the writer.", stats.queued);
+    lane_metric("uap_send_lane_frames", "gauge", "Frames waiting for the writer, per priority lane.", stats.lane_queued);
+    lane_metric("uap_send_lane_dropped_total", "counter", "Frames discarded by backpressure, per priority lane.",
+                stats.lane_dropped);
+    metric("uap_reconnects_total", "counter", "Times a registry connection came back after dropping.", stats.reconnects);
+    metric("uap_tls_resumptions_total", "counter", "TLS handshakes that resumed an earlier session.", stats.tls_resumptions);
+    metric("uap_offline_messages", "gauge", "Messages held until a connection is back.", stats.offline_buffered);
+    metric("uap_offline_dropped_total", "counter", "Held messages discarded because the offline buffer was full.", stats.offline_dropped);
+    metric("uap_captured_frames_total", "counter", "Frames written to the frame capture file.", stats.captured_frames);
+    metric("uap_capture_dropped_total", "counter", "Frames left out of the frame capture because the file was full.", stats.capture_dropped);
+    
+    histogram_header("uap_enqueue_to_wire_seconds", "Time from a send call to the socket write.");
+    histogram("", "uap_enqueue_to_wire_seconds", stats.enqueue_to_wire);
+    histogram_header("uap_lane_enqueue_to_wire_seconds", "Time from a send call to the socket write, per priority lane.");
+    for (size_t lane = 0; lane < kPriorityCount; ++lane) {
+        histogram(std::string(",priority=\"") + priority_name(MessagePriority(lane)) + "\"",
+                  "uap_lane_enqueue_to_wire_seconds", stats.lane_enqueue_to_wire[lane]);
+    }
+    histogram_header("uap_wire_to_handler_seconds", "Time from frame arrival to handler start.");
+    histogram("", "uap_wire_to_handler_seconds", stats.wire_to_handler);
+    histogram_header("uap_one_way_latency_seconds", "Time from the sender's ts_ns to receipt.");
+    histogram("", "uap_one_way_latency_seconds", stats.one_way);
+    histogram_header("uap_handler_duration_seconds", "Handler run time per intent.");
+    for (const auto& [intent, snap] : stats.handler_duration) {
+        histogram(",intent=\"" + escape(intent) + "\"", "uap_handler_duration_seconds", snap);
+    }
+    return out;
+}
+
+// Minimal HTTP endpoint serving one text document (the Prometheus scrape
+// target). Runs on its own io_service thread so scrapes never touch the
+// connections' I/O threads.
+class MetricsEndpoint {
+public:
+    using Render = std::function<std::string()>;
+    
+    // Throws boost::system::system_error if the address cannot be bound
+    MetricsEndpoint(const std::string& address, unsigned short port, Render render)
+        : acceptor_(io_service_, boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address(address), port)),
+          render_(std::move(render)) {
+        accept();
+        thread_ = std::thread([this]() {
+            try {
+                io_service_.run();
+            } catch (const std::exception& e) {
+                log(LogLevel::error, "Metrics endpoint error: " + std::string(e.what()));
+            }
+        });
+    }
+    
+    ~MetricsEndpoint() {
+        io_service_.stop();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+    
+    MetricsEndpoint(const MetricsEndpoint&) = delete;
+    MetricsEndpoint& operator=(const MetricsEndpoint&) = delete;
+    
+    unsigned short port() const {
+        return acceptor_.local_endpoint().port();
+    }
+    
+private:
+    struct Session {
+        explicit Session(boost::asio::io_service& io_service) : socket(io_service) {}
+        
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::streambuf request;
+        std::string response;
+    };
+    
+    void accept() {
+        auto session = std::make_shared<Session>(io_service_);
+        acceptor_.async_accept(session->socket, [this, session](const boost::system::error_code& ec) {
+            if (ec) {
+                return;
+            }
+            serve(session);
+            accept();
+        });
+    }
+    
+    void serve(std::shared_ptr<Session> session) {
+        // Whatever the request line says, the answer is the metrics document
+        boost::asio::async_read_until(session->socket, session->request, "\r\n\r\n",
+            [this, session](const boost::system::error_code& ec, size_t) {
+                if (ec) {
+                    return;
+                }
+                std::string body = render_();
+                session->response = "HTTP/1.0 200 OK\r\n"
+                                    "Content-Type: text/plain; version=0.0.4\r\n"
+                                    "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                                    "Connection: close\r\n\r\n" + body;
+                boost::asio::async_write(session->socket, boost::asio::buffer(session->response),
+                    [session](const boost::system::error_code&, size_t) {
+                        boost::system::error_code ignored;
+                        session->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                    });
+            });
+    }
+    
+    boost::asio::io_service io_service_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    Render render_;
+    std::thread thread_;
+};
+
+// Text form of a message id, kept inline so ids cost no allocation
+struct MessageId {
+    std::array<char, 36> text;
+    
+    std::string_view view() const { return std::string_view(text.data(), text.size()); }
+    std::string str() const { return std::string(text.data(), text.size()); }
+};
+
+// UUIDv7 (RFC 9562) message ids: a 48-bit Unix millisecond timestamp, then
+// 74 random bits. Each thread has its own xoshiro256** generator seeded once
+// from std::random_device, so generating an id makes no syscall. Ids from one
+// thread are strictly increasing: within a millisecond the 12-bit rand_a
+// field counts up from a random start, borrowing the next millisecond if it
+// runs out. The 62 random bits in rand_b keep threads from colliding.
+class MessageIdGenerator {
+public:
+    static MessageIdGenerator& local() {
+        thread_local MessageIdGenerator generator;
+        return generator;
+    }
+    
+    MessageId next() {
+        uint64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        if (now_ms > last_ms_) {
+            last_ms_ = now_ms;
+            // Leave headroom so the counter rarely has to borrow
+            counter_ = random() & 0x7FF;
+        } else if (++counter_ > 0xFFF) {
+            ++last_ms_;
+            counter_ = 0;
+        }
+        
+        uint64_t high = (last_ms_ << 16) | 0x7000 | counter_;
+        uint64_t low = (random() >> 2) | 0x8000000000000000ULL;
+        
+        MessageId id;
+        static const char kHex[] = "0123456789abcdef";
+        char* out = id.text.data();
+        int nibble = 0;
+        for (int shift = 60; shift >= 0; shift -= 4, ++nibble) {
+            if (nibble == 8 || nibble == 12) {
+                *out++ = '-';
+            }
+            *out++ = kHex[(high >> shift) & 0xF];
+        }
+        for (int shift = 60; shift >= 0; shift -= 4, ++nibble) {
+            if (nibble == 16 || nibble == 20) {
+                *out++ = '-';
+            }
+            *out++ = kHex[(low >> shift) & 0xF];
+        }
+        return id;
+    }
+    
+private:
+    MessageIdGenerator() {
+        std::random_device device;
+        for (uint64_t& word : state_) {
+            word = (uint64_t(device()) << 32) | device();
+        }
+    }
+    
+    // xoshiro256**
+    uint64_t random() {
+        auto rotl = [](uint64_t x, int k) { return (x << k) | (x >> (64 - k)); };
+        uint64_t result = rotl(state_[1] * 5, 7) * 9;
+        uint64_t t = state_[1] << 17;
+        state_[2] ^= state_[0];
+        state_[3] ^= state_[1];
+        state_[1] ^= state_[2];
+        state_[0] ^= state_[3];
+        state_[2] ^= t;
+        state_[3] = rotl(state_[3], 45);
+        return result;
+    }
+    
+    std::array<uint64_t, 4> state_;
+    uint64_t last_ms_ = 0;
+    uint64_t counter_ = 0;
+};
+
+inline MessageId next_message_id() {
+    return MessageIdGenerator::local().next();
+}
+
+// Generate a UUID
+inline std::string generate_uuid() {
+    return next_message_id().str();
+}
+
+// Fixed-size ring of records in a memory-mapped file, so messages held back
+// while offline survive both memory pressure and a process restart. Records
+// are never split across the end of the ring: a writer that runs out of room
+// leaves a wrap marker (or fewer than 8 bytes) and continues at offset 0.
+// When full, the oldest records are dropped. Not thread-safe; OfflineBuffer
+// serializes access.
+//
+// head, tail and count are committed together: the header holds two
+// checksummed copies of them, each commit overwrites the older copy, and
+// a reopened file resumes from the newest copy that checks out. Record
+// bytes are written before the commit that covers them, and records about
+// to be overwritten are dropped by a commit of their own first, so a crash
+// at any point leaves the state of the last commit readable.
+class SpillFile {
+public:
+    SpillFile(const std::string& path, size_t capacity) {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd_ < 0) {
+            throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+        }
+        
+        struct stat info;
+        bool reuse = ::fstat(fd_, &info) == 0 && static_cast<size_t>(info.st_size) == sizeof(Header) + capacity;
+        if (!reuse && ::ftruncate(fd_, sizeof(Header) + capacity) != 0) {
+            ::close(fd_);
+            throw std::runtime_error("cannot size " + path + ": " + std::strerror(errno));
+        }
+        
+        void* mapping = ::mmap(nullptr, sizeof(Header) + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (mapping == MAP_FAILED) {
+            ::close(fd_);
+            throw std::runtime_error("cannot map " + path + ": " + std::strerror(errno));
+        }
+        header_ = static_cast<Header*>(mapping);
+        data_ = static_cast<char*>(mapping) + sizeof(Header);
+        
+        // Records left by a previous run are kept if the layout matches
+        if (header_->magic != kMagic || header_->capacity != capacity || !recover()) {
+            header_->magic = kMagic;
+            header_->capacity = capacity;
+            state_ = State{};
+            header_->states[0] = sealed(state_);
+            header_->states[1] = State{};
+        }
+    }
+    
+    ~SpillFile() {
+        ::munmap(header_, sizeof(Header) + header_->capacity);
+        ::close(fd_);
+    }
+    
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+    
+    size_t count() const {
+        return state_.count;
+    }
+    
+    // Appends a record, dropping the oldest until it fits; returns how many
+    // were dropped. A record larger than the whole file is dropped itself.
+    size_t push(std::string_view recipient, std::string_view envelope) {
+        uint64_t size = kRecordHeader + recipient.size() + envelope.size();
+        uint64_t capacity = header_->capacity;
+        if (size > capacity) {
+            return 1;
+        }
+        
+        size_t dropped = 0;
+        for (;;) {
+            if (state_.count == 0) {
+                state_.head = state_.tail = 0;
+            }
+            uint64_t head = state_.head;
+            uint64_t tail = state_.tail;
+            bool full = state_.count > 0 && head == tail;
+            
+            if (!full && tail >= head) {
+                if (capacity - tail >= size) {
+                    break;
+                }
+                // Wrap to the start, if the oldest record leaves room there
+                if (head >= size) {
+                    mark_wrap(tail);
+                    state_.tail = 0;
+                    continue;
+                }
+            } else if (!full && head - tail >= size) {
+                break;
+            }
+            advance_head();
+            ++dropped;
+        }
+        // The space the record goes into has to be free in the committed
+        // state before it is written
+        if (dropped > 0) {
+            commit();
+        }
+        
+        char* at = data_ + state_.tail;
+        uint32_t lengths[2] = {static_cast<uint32_t>(recipient.size()), static_cast<uint32_t>(envelope.size())};
+        std::memcpy(at, lengths, sizeof(lengths));
+        std::memcpy(at + kRecordHeader, recipient.data(), recipient.size());
+        std::memcpy(at + kRecordHeader + recipient.size(), envelope.data(), envelope.size());
+        state_.tail = (state_.tail + size) % capacity;
+        ++state_.count;
+        commit();
+        return dropped;
+    }
+    
+    // Copies out the oldest record; false when empty
+    bool front(std::string& recipient, std::string& envelope) {
+        if (state_.count == 0) {
+            return false;
+        }
+        const char* at = data_ + record_offset(state_.head);
+        uint32_t lengths[2];
+        std::memcpy(lengths, at, sizeof(lengths));
+        recipient.assign(at + kRecordHeader, lengths[0]);
+        envelope.assign(at + kRecordHeader + lengths[0], lengths[1]);
+        return true;
+    }
+    
+    void pop() {
+        if (state_.count == 0) {
+            return;
+        }
+        advance_head();
+        commit();
+    }
+    
+private:
+    struct State {
+        uint64_t sequence = 0;
+        uint64_t head = 0;
+        uint64_t tail = 0;
+        uint64_t count = 0;
+        uint64_t check = 0;
+    };
+    
+    struct Header {
+        uint64_t magic;
+        uint64_t capacity;
+        State states[2];
+    };
+    
+    static constexpr uint64_t kMagic = 0x3230505350414155ULL;  // "UAAPSP02"
+    static constexpr size_t kRecordHeader = 2 * sizeof(uint32_t);
+    static constexpr uint32_t kWrap = 0xFFFFFFFFu;
+    
+    static uint64_t checksum(const State& state) {
+        // splitmix64 over the fields, so a copy torn mid-write fails the check
+        uint64_t hash = kMagic;
+        for (uint64_t word : {state.sequence, state.head, state.tail, state.count}) {
+            hash += word + 0x9E3779B97F4A7C15ULL;
+            hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+            hash ^= hash >> 31;
+        }
+        return hash;
+    }
+    
+    static State sealed(State state) {
+        state.check = checksum(state);
+        return state;
+    }
+    
+    bool valid(const State& state) const {
+        uint64_t capacity = header_->capacity;
+        return state.check == checksum(state) && state.head < capacity && state.tail < capacity &&
+               state.count <= capacity / kRecordHeader;
+    }
+    
+    // Picks up the newest intact copy of the state; false if neither is
+    bool recover() {
+        const State& first = header_->states[0];
+        const State& second = header_->states[1];
+        bool first_valid = valid(first);
+        bool second_valid = valid(second);
+        if (!first_valid && !second_valid) {
+            return false;
+        }
+        state_ = !second_valid || (first_valid && first.sequence > second.sequence) ? first : second;
+        return true;
+    }
+    
+    // Publishes state_ over the older copy; everything written to the ring
+    // before this is ordered ahead of it
+    void commit() {
+        ++state_.sequence;
+        std::atomic_thread_fence(std::memory_order_release);
+        header_->states[state_.sequence % 2] = sealed(state_);
+    }
+    
+    // Offset of the record at head, past a wrap marker or a tail too short
+    // for a record header
+    uint64_t record_offset(uint64_t head) const {
+        uint32_t marker = 0;
+        if (header_->capacity - head >= kRecordHeader) {
+            std::memcpy(&marker, data_ + head, sizeof(marker));
+        }
+        if (header_->capacity - head < kRecordHeader || marker == kWrap) {
+            return 0;
+        }
+        return head;
+    }
+    
+    void advance_head() {
+        uint64_t head = record_offset(state_.head);
+        uint32_t lengths[2];
+        std::memcpy(lengths, data_ + head, sizeof(lengths));
+        state_.head = (head + kRecordHeader + lengths[0] + lengths[1]) % header_->capacity;
+        --state_.count;
+    }
+    
+    void mark_wrap(uint64_t offset) {
+        if (header_->capacity - offset >= kRecordHeader) {
+            std::memcpy(data_ + offset, &kWrap, sizeof(kWrap));
+        }
+    }
+    
+    int fd_ = -1;
+    Header* header_ = nullptr;
+    char* data_ = nullptr;
+    State state_;
+};
+
+enum class CaptureDirection : uint8_t {
+    inbound = 1,
+    outbound = 2,
+};
+
+// Append-only record of the frames a client exchanged with the registry,
+// for replaying real traffic through dispatch (UAP_Client::replay). The
+// file is mapped at a fixed size up front, sparse until written, and cut
+// down to what was used when the capture closes; records that no longer
+// fit are counted and dropped.
+//
+// Layout: a 32-byte header, then records of a 16-byte header (u32 length,
+// u8 direction, u8 websocket opcode, u16 connection, u64 ns since the
+// capture started) followed by the frame bytes as they crossed the socket,
+// padded to 8 bytes. A record is published by storing its first word last,
+// so a file left by a crash ends at the first zero word. Thread-safe.
+class FrameCapture {
+public:
+    FrameCapture(const std::string& path, size_t capacity) : capacity_(capacity & ~size_t(7)) {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd_ < 0) {
+            throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+        }
+        if (::ftruncate(fd_, sizeof(Header) + capacity_) != 0) {
+            ::close(fd_);
+            throw std::runtime_error("cannot size " + path + ": " + std::strerror(errno));
+        }
+        
+        void* mapping = ::mmap(nullptr, sizeof(Header) + capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (mapping == MAP_FAILED) {
+            ::close(fd_);
+            throw std::runtime_error("cannot map " + path + ": " + std::strerror(errno));
+        }
+        ::madvise(mapping, sizeof(Header) + capacity_, MADV_SEQUENTIAL);
+        header_ = static_cast<Header*>(mapping);
+        data_ = static_cast<char*>(mapping) + sizeof(Header);
+        started_ns_ = monotonic_ns();
+        *header_ = Header{kMagic, static_cast<uint64_t>(wall_clock_ns()), capacity_, 0};
+    }
+    
+    ~FrameCapture() {
+        uint64_t used = tail_.load();
+        header_->used = used;
+        ::munmap(header_, sizeof(Header) + capacity_);
+        if (::ftruncate(fd_, sizeof(Header) + used) != 0) {
+            log(LogLevel::warn, "Could not trim frame capture: " + std::string(std::strerror(errno)));
+        }
+        ::close(fd_);
+    }
+    
+    FrameCapture(const FrameCapture&) = delete;
+    FrameCapture& operator=(const FrameCapture&) = delete;
+    
+    // now_ns is monotonic_ns() when the frame was read or written
+    void record(CaptureDirection direction, websocketpp::frame::opcode::value opcode, size_t connection,
+                std::string_view data, uint64_t now_ns = monotonic_ns()) {
+        uint64_t size = kRecordHeader + ((data.size() + 7) & ~uint64_t(7));
+        uint64_t offset = tail_.load(std::memory_order_relaxed);
+        do {
+            if (data.size() > UINT32_MAX || capacity_ - offset < size) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        } while (!tail_.compare_exchange_weak(offset, offset + size, std::memory_order_relaxed));
+        
+        char* at = data_ + offset;
+        uint64_t at_ns = now_ns > started_ns_ ? now_ns - started_ns_ : 0;
+        std::memcpy(at + sizeof(uint64_t), &at_ns, sizeof(at_ns));
+        std::memcpy(at + kRecordHeader, data.data(), data.size());
+        uint64_t word = static_cast<uint64_t>(data.size()) | uint64_t(direction) << 32 |
+                        uint64_t(opcode & 0xFF) << 40 | uint64_t(connection & 0xFFFF) << 48;
+        std::atomic_ref<uint64_t>(*reinterpret_cast<uint64_t*>(at)).store(word, std::memory_order_release);
+        records_.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    uint64_t records() const {
+        return records_.load(std::memory_order_relaxed);
+    }
+    
+    uint64_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+    
+private:
+    friend class CaptureReader;
+    
+    struct Header {
+        uint64_t magic;
+        uint64_t started_wall_ns;
+        uint64_t capacity;
+        uint64_t used;  // written when the capture closes
+    };
+    
+    static constexpr uint64_t kMagic = 0x3130504143504155ULL;  // "UAPCAP01"
+    static constexpr size_t kRecordHeader = 2 * sizeof(uint64_t);
+    
+    int fd_ = -1;
+    size_t capacity_;
+    Header* header_ = nullptr;
+    char* data_ = nullptr;
+    uint64_t started_ns_ = 0;
+    std::atomic<uint64_t> tail_{0};
+    std::atomic<uint64_t> records_{0};
+    std::atomic<uint64_t> dropped_{0};
+};
+
+// Reads a FrameCapture file front to back
+class CaptureReader {
+public:
+    struct Frame {
+        CaptureDirection direction;
+        websocketpp::frame::opcode::value opcode;
+        size_t connection = 0;
+        uint64_t at_ns = 0;  // since the capture started
+        std::string_view data;  // into the mapping
+    };
+    
+    explicit CaptureReader(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(FrameCapture::Header)) {
+            ::close(fd);
+            throw std::runtime_error(path + " is not a frame capture");
+        }
+        size_ = static_cast<size_t>(info.st_size);
+        mapping_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping_ == MAP_FAILED) {
+            throw std::runtime_error("cannot map " + path + ": " + std::strerror(errno));
+        }
+        ::madvise(mapping_, size_, MADV_SEQUENTIAL);
+        
+        const auto* header = static_cast<const FrameCapture::Header*>(mapping_);
+        if (header->magic != FrameCapture::kMagic) {
+            ::munmap(mapping_, size_);
+            throw std::runtime_error(path + " is not a frame capture");
+        }
+        started_wall_ns_ = header->started_wall_ns;
+        // A capture that never closed has no length; its records end at a zero word
+        end_ = size_ - sizeof(FrameCapture::Header);
+        if (header->used != 0 && header->used < end_) {
+            end_ = header->used;
+        }
+    }
+    
+    ~CaptureReader() {
+        ::munmap(mapping_, size_);
+    }
+    
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader& operator=(const CaptureReader&) = delete;
+    
+    // Wall clock time the capture started at
+    uint64_t started_wall_ns() const {
+        return started_wall_ns_;
+    }
+    
+    // The next record; false at the end
+    bool next(Frame& frame) {
+        const char* data = static_cast<const char*>(mapping_) + sizeof(FrameCapture::Header);
+        if (end_ - offset_ < FrameCapture::kRecordHeader) {
+            return false;
+        }
+        uint64_t word;
+        std::memcpy(&word, data + offset_, sizeof(word));
+        uint64_t length = word & 0xFFFFFFFFu;
+        uint64_t size = FrameCapture::kRecordHeader + ((length + 7) & ~uint64_t(7));
+        if (word == 0 || end_ - offset_ < size) {
+            return false;
+        }
+        frame.direction = static_cast<CaptureDirection>((word >> 32) & 0xFF);
+        frame.opcode = static_cast<websocketpp::frame::opcode::value>((word >> 40) & 0xFF);
+        frame.connection = static_cast<size_t>(word >> 48);
+        std::memcpy(&frame.at_ns, data + offset_ + sizeof(uint64_t), sizeof(frame.at_ns));
+        frame.data = std::string_view(data + offset_ + FrameCapture::kRecordHeader, length);
+        offset_ += size;
+        return true;
+    }
+    
+    void rewind() {
+        offset_ = 0;
+    }
+    
+private:
+    void* mapping_ = nullptr;
+    size_t size_ = 0;
+    uint64_t end_ = 0;
+    uint64_t offset_ = 0;
+    uint64_t started_wall_ns_ = 0;
+};
+
+// Messages accepted while no registry connection is up, replayed in order
+// once one is. The newest `capacity` envelopes are kept in memory; with a
+// spill file, older ones move there instead of being dropped, so replay
+// reads the file before memory. Not thread-safe; UAP_Client holds a lock.
+class OfflineBuffer {
+public:
+    struct Record {
+        std::string recipient;
+        std::string envelope;  // JSON text, already sealed if encrypted
+    };
+    
+    OfflineBuffer(size_t capacity, const std::string& spill_path, size_t spill_bytes)
+        : capacity_(capacity) {
+        if (!spill_path.empty() && spill_bytes > 0) {
+            try {
+                spill_.reset(new SpillFile(spill_path, spill_bytes));
+                if (spill_->count() > 0) {
+                    log("Recovered " + std::to_string(spill_->count()) + " offline messages from " + spill_path);
+                }
+            } catch (const std::exception& e) {
+                log(LogLevel::error, "Offline spill disabled: " + std::string(e.what()));
+            }
+        }
+    }
+    
+    size_t size() const {
+        return memory_.size() + (spill_ ? spill_->count() : 0);
+    }
+    
+    bool empty() const {
+        return size() == 0;
+    }
+    
+    // Number of messages discarded because both tiers were full
+    size_t dropped_count() const {
+        return dropped_;
+    }
+    
+    void push(Record&& record) {
+        if (memory_.size() >= capacity_) {
+            Record& oldest = memory_.front();
+            if (spill_) {
+                dropped_ += spill_->push(oldest.recipient, oldest.envelope);
+            } else {
+                ++dropped_;
+            }
+            memory_.pop_front();
+        }
+        memory_.push_back(std::move(record));
+    }
+    
+    // The oldest message; false when empty
+    bool front(Record& record) {
+        if (spill_ && spill_->front(record.recipient, record.envelope)) {
+            return true;
+        }
+        if (memory_.empty()) {
+            return false;
+        }
+        record = memory_.front();
+        return true;
+    }
+    
+    void pop() {
+        if (spill_ && spill_->count() > 0) {
+            spill_->pop();
+        } else if (!memory_.empty()) {
+            memory_.pop_front();
+        }
+    }
+    
+private:
+    size_t capacity_;
+    std::deque<Record> memory_;
+    std::unique_ptr<SpillFile> spill_;
+    size_t dropped_ = 0;
+};
+
+// Set on every RegistryConnection I/O thread, where waiting for another
+// client's progress could deadlock (that client may be waiting on this thread)
+inline bool& on_io_thread() {
+    thread_local bool flag = false;
+    return flag;
+}
+
+// In-process delivery between UAP_Clients that share a process, the native
+// counterpart of registry_url "local" on the Python side. A client whose
+// options name a router attaches to it while connected; messages other
+// attached clients address to it then skip the registry entirely. The sender
+// builds the InboundMessage and hands the pointer through the recipient's
+// ring, and the recipient's I/O thread dispatches it. Nothing is serialized
+// or encrypted, since nothing leaves the process. Recipients that are not
+// attached are reached over the network as usual.
+class LocalRouter {
+public:
+    using Delivery = std::unique_ptr<InboundMessage>;
+    
+    // One attached client's inbound ring. Any number of senders push; the
+    // owning client's I/O thread is the only consumer.
+    class Mailbox {
+    public:
+        // wake is called when a push finds no drain pending; the consumer
+        // then pops until finish_drain() returns false
+        Mailbox(size_t capacity, std::function<void()> wake)
+            : queue_(capacity), wake_(std::move(wake)) {}
+        
+        // Applies policy while the ring is full, like RegistryConnection's
+        // send queue; false if the message was dropped or the recipient left
+        bool push(Delivery& message, BackpressurePolicy policy) {
+            if (!open_.load(std::memory_order_acquire)) {
+                return false;
+            }
+            if (policy == BackpressurePolicy::block && on_io_thread()) {
+                policy = BackpressurePolicy::drop_newest;
+            }
+            
+            while (!queue_.try_push(std::move(message))) {
+                switch (policy) {
+                    case BackpressurePolicy::drop_newest:
+                        dropped_.fetch_add(1, std::memory_order_relaxed);
+                        return false;
+                    
+                    case BackpressurePolicy::drop_oldest: {
+                        Delivery oldest;
+                        if (queue_.try_pop(oldest)) {
+                            dropped_.fetch_add(1, std::memory_order_relaxed);
+                        }
+                        break;
+                    }
+                    
+                    case BackpressurePolicy::block: {
+                        schedule_drain();
+                        std::unique_lock<std::mutex> lock(space_mutex_);
+                        ++blocked_producers_;
+                        space_cv_.wait_for(lock, std::chrono::milliseconds(10));
+                        --blocked_producers_;
+                        if (!open_.load(std::memory_order_acquire)) {
+                            return false;
+                        }
+                        break;
+                    }
+                }
+            }
+            
+            schedule_drain();
+            return true;
+        }
+        
+        // Consumer only
+        bool try_pop(Delivery& message) {
+            if (!queue_.try_pop(message)) {
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(space_mutex_);
+            if (blocked_producers_ > 0) {
+                space_cv_.notify_all();
+            }
+            return true;
+        }
+        
+        // Ends a drain pass; true if a push raced with it and the consumer
+        // should keep going
+        bool finish_drain() {
+            drain_scheduled_.store(false, std::memory_order_release);
+            return !queue_.empty() && !drain_scheduled_.exchange(true, std::memory_order_acq_rel);
+        }
+        
+        // Called by the owner on attach and detach. Once closed, wake is never
+        // called again, so the owner may go away. Opening forgets any drain
+        // that was pending when the owner's I/O loop last stopped.
+        void set_open(bool open) {
+            {
+                std::lock_guard<std::mutex> lock(wake_mutex_);
+                open_.store(open, std::memory_order_release);
+            }
+            if (open) {
+                drain_scheduled_.store(false, std::memory_order_release);
+                if (!queue_.empty()) {
+                    schedule_drain();
+                }
+            }
+        }
+        
+        // Messages the ring had no room for
+        size_t dropped_count() const {
+            return dropped_.load(std::memory_order_relaxed);
+        }
+        
+    private:
+        void schedule_drain() {
+            if (!drain_scheduled_.exchange(true, std::memory_order_acq_rel)) {
+                std::lock_guard<std::mutex> lock(wake_mutex_);
+                if (open_.load(std::memory_order_relaxed)) {
+                    wake_();
+                }
+            }
+        }
+        
+        BoundedQueue<Delivery> queue_;
+        std::function<void()> wake_;
+        std::mutex wake_mutex_;
+        std::atomic<bool> drain_scheduled_{false};
+        std::atomic<bool> open_{false};
+        std::atomic<size_t> dropped_{0};
+        std::mutex space_mutex_;
+        std::condition_variable space_cv_;
+        int blocked_producers_ = 0;
+    };
+    
+    // False if another client is already attached under entity_id
+    bool attach(const std::string& entity_id, std::shared_ptr<Mailbox> mailbox) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        return mailboxes_.emplace(entity_id, std::move(mailbox)).second;
+    }
+    
+    // Removes entity_id if mailbox is still the one attached under it
+    void detach(const std::string& entity_id, const Mailbox* mailbox) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        auto it = mailboxes_.find(entity_id);
+        if (it != mailboxes_.end() && it->second.get() == mailbox) {
+            mailboxes_.erase(it);
+        }
+    }
+    
+    // The attached recipient's mailbox, or null if it is not in this process
+    std::shared_ptr<Mailbox> find(std::string_view entity_id) const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        auto it = mailboxes_.find(entity_id);
+        return it == mailboxes_.end() ? nullptr : it->second;
+    }
+    
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return mailboxes_.size();
+    }
+    
+private:
+    mutable std::shared_mutex mutex_;
+    std::map<std::string, std::shared_ptr<Mailbox>, std::less<>> mailboxes_;
+};
+
+// Shared memory layout of a ShmChannel segment, also read by
+// src/protocol/shm_transport.py: a header, then two rings, each a control
+// block followed by ring_bytes of data. Side 0 (the registry's initiator)
+// writes ring 0 and reads ring 1; side 1 the reverse.
+struct ShmSegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ring_bytes;
+    std::atomic<uint32_t> state[2];
+    int32_t pid[2];
+    char reserved[32];
+};
+
+struct ShmRingControl {
+    // Bytes written and consumed so far; the ring offset is the count modulo ring_bytes
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    // Futex the reader waits on while sleeping is set
+    alignas(64) std::atomic<uint32_t> doorbell;
+    std::atomic<uint32_t> sleeping;
+};
+
+static_assert(sizeof(ShmSegmentHeader) == 64, "layout shared with shm_transport.py");
+static_assert(sizeof(ShmRingControl) == 192, "layout shared with shm_transport.py");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring counters must be address-free");
+
+// How a ShmChannel::write went
+enum class ShmWrite {
+    written,
+    full,           // The ring had no room under the backpressure policy
+    unavailable     // The peer is gone or the frame is too large; use the registry
+};
+
+// Channel to one peer process over a POSIX shared memory segment holding a
+// single-producer single-consumer ring in each direction. The initiator
+// creates the segment and unlinks its name once the peer has mapped it; the
+// other side opens it. Records are [u32 length][u32 kind][envelope], padded
+// to 8 bytes and never split across the end of a ring (a wrap marker sends
+// the reader back to the start). Writers on any thread serialize on a mutex;
+// one reader thread per channel sleeps on a futex when its ring is empty
+// and hands every envelope to on_frame.
+class ShmChannel {
+public:
+    using FrameCallback = std::function<void(std::string&& frame, bool binary)>;
+    
+    ShmChannel(std::string name, bool initiator, size_t ring_bytes, FrameCallback on_frame)
+        : name_(std::move(name)), side_(initiator ? 0 : 1), requested_ring_bytes_(ring_bytes),
+          on_frame_(std::move(on_frame)) {}
+    
+    ~ShmChannel() {
+        close();
+    }
+    
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator=(const ShmChannel&) = delete;
+    
+    // Starts the reader thread, which creates or opens the segment first
+    void start() {
+        thread_ = std::thread([this]() {
+            on_io_thread() = true;
+            try {
+                if (!(side_ == 0 ? create() : open_existing())) {
+                    return;
+                }
+                read_loop();
+            } catch (const std::exception& e) {
+                log(LogLevel::error, "Shared memory channel " + name_ + " failed: " + std::string(e.what()));
+            }
+            ready_ = false;
+            finished_ = true;
+        });
+    }
+    
+    // Marks our side closed so the peer stops writing, stops the reader and
+    // unmaps the segment
+    void close() {
+        stopping_ = true;
+        if (ShmRingControl* rx = rx_.load(std::memory_order_acquire)) {
+            rx->doorbell.fetch_add(1, std::memory_order_release);
+            futex(&rx->doorbell, FUTEX_WAKE, INT32_MAX);
+        }
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        if (mapping_) {
+            header_->state[side_].store(kClosed, std::memory_order_release);
+            if (side_ == 0 && !unlinked_) {
+                ::shm_unlink(name_.c_str());
+            }
+            ::munmap(mapping_, mapping_size_);
+            mapping_ = nullptr;
+            rx_.store(nullptr, std::memory_order_release);
+        }
+        ready_ = false;
+    }
+    
+    // True once both sides have the segment mapped and neither has closed it
+    bool ready() const {
+        return ready_.load(std::memory_order_acquire);
+    }
+    
+    const std::string& name() const {
+        return name_;
+    }
+    
+    // The reader has stopped: the segment never came up or the peer closed it
+    bool finished() const {
+        return finished_.load(std::memory_order_acquire);
+    }
+    
+    ShmWrite write(std::string_view frame, bool binary, BackpressurePolicy policy) {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        if (!mapping_ || header_->state[1 - side_].load(std::memory_order_acquire) != kAttached) {
+            ready_ = false;
+            return ShmWrite::unavailable;
+        }
+        uint64_t size = ring_bytes_;
+        uint64_t need = record_size(frame.size());
+        if (need > size / 2) {
+            return ShmWrite::unavailable;
+        }
+        // The reader may be this very thread's peer waiting on us; and the
+        // reader's tail cannot be moved from here to drop the oldest record
+        if (policy == BackpressurePolicy::block && on_io_thread()) {
+            policy = BackpressurePolicy::drop_newest;
+        }
+        
+        ShmRingControl& ring = *tx_;
+        uint64_t head = ring.head.load(std::memory_order_relaxed);
+        uint64_t offset = head % size;
+        uint64_t skip = size - offset < need ? size - offset : 0;
+        while (size - (head - ring.tail.load(std::memory_order_acquire)) < skip + need) {
+            if (policy != BackpressurePolicy::block) {
+                return ShmWrite::full;
+            }
+            if (stopping_ || peer_gone()) {
+                ready_ = false;
+                return ShmWrite::unavailable;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        
+        if (skip > 0) {
+            uint32_t marker[2] = {kWrapMarker, 0};
+            std::memcpy(tx_data_ + offset, marker, sizeof(marker));
+            head += skip;
+            offset = 0;
+        }
+        uint32_t record[2] = {static_cast<uint32_t>(frame.size()), binary ? kBinary : kText};
+        std::memcpy(tx_data_ + offset, record, sizeof(record));
+        std::memcpy(tx_data_ + offset + kRecordHeader, frame.data(), frame.size());
+        ring.head.store(head + need, std::memory_order_release);
+        
+        // Pairs with the reader setting sleeping before its last look at head
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ring.sleeping.load(std::memory_order_relaxed)) {
+            ring.doorbell.fetch_add(1, std::memory_order_release);
+            futex(&ring.doorbell, FUTEX_WAKE, 1);
+        }
+        return ShmWrite::written;
+    }
+    
+private:
+    static constexpr uint32_t kMagic = 0x4D504155;  // "UAPM"
+    static constexpr uint32_t kVersion = 1;
+    static constexpr uint32_t kAttached = 1;
+    static constexpr uint32_t kClosed = 2;
+    static constexpr uint32_t kText = 1;
+    static constexpr uint32_t kBinary = 2;
+    static constexpr uint32_t kWrapMarker = 0xFFFFFFFF;
+    static constexpr uint64_t kRecordHeader = 8;
+    
+    static uint64_t record_size(size_t length) {
+        return (kRecordHeader + length + 7) & ~uint64_t(7);
+    }
+    
+    static size_t segment_size(uint64_t ring_bytes) {
+        return sizeof(ShmSegmentHeader) + 2 * (sizeof(ShmRingControl) + ring_bytes);
+    }
+    
+    static long futex(std::atomic<uint32_t>* word, int op, uint32_t value, const timespec* timeout = nullptr) {
+        return ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, value, timeout, nullptr, 0);
+    }
+    
+    bool create() {
+        uint64_t ring_bytes = std::max<uint64_t>(4096, (requested_ring_bytes_ + 7) & ~uint64_t(7));
+        // A segment left by a crashed run under the same name is replaced
+        ::shm_unlink(name_.c_str());
+        int fd = ::shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            throw std::runtime_error("cannot create: " + std::string(std::strerror(errno)));
+        }
+        bool sized = ::ftruncate(fd, segment_size(ring_bytes)) == 0;
+        int error = errno;
+        if (!sized) {
+            ::close(fd);
+            ::shm_unlink(name_.c_str());
+            throw std::runtime_error("cannot size: " + std::string(std::strerror(error)));
+        }
+        map(fd, ring_bytes);
+        header_->version = kVersion;
+        header_->ring_bytes = ring_bytes;
+        // The peer waits for the magic before reading anything else
+        std::atomic_ref<uint32_t>(header_->magic).store(kMagic, std::memory_order_release);
+        attach();
+        return true;
+    }
+    
+    // The initiator may not have created the segment yet; keep trying briefly
+    bool open_existing() {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (!stopping_) {
+            int fd = ::shm_open(name_.c_str(), O_RDWR, 0600);
+            struct stat info;
+            if (fd >= 0 && ::fstat(fd, &info) == 0 &&
+                static_cast<size_t>(info.st_size) >= segment_size(0)) {
+                void* peek = ::mmap(nullptr, sizeof(ShmSegmentHeader), PROT_READ, MAP_SHARED, fd, 0);
+                if (peek != MAP_FAILED) {
+                    const ShmSegmentHeader* header = static_cast<const ShmSegmentHeader*>(peek);
+                    bool initialized = std::atomic_ref<const uint32_t>(header->magic).load(std::memory_order_acquire) == kMagic;
+                    uint32_t version = header->version;
+                    uint64_t ring_bytes = header->ring_bytes;
+                    ::munmap(peek, sizeof(ShmSegmentHeader));
+                    if (initialized) {
+                        if (version != kVersion || static_cast<size_t>(info.st_size) != segment_size(ring_bytes)) {
+                            ::close(fd);
+                            throw std::runtime_error("unsupported segment layout");
+                        }
+                        map(fd, ring_bytes);
+                        attach();
+                        return true;
+                    }
+                }
+            }
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            if (std::chrono::steady_clock::now() > deadline) {
+                log(LogLevel::warn, "Shared memory segment " + name_ + " never appeared; using the registry");
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    }
+    
+    // Takes ownership of fd
+    void map(int fd, uint64_t ring_bytes) {
+        size_t size = segment_size(ring_bytes);
+        void* mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int error = errno;
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("cannot map: " + std::string(std::strerror(error)));
+        }
+        
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        char* base = static_cast<char*>(mapping);
+        char* rings[2] = {base + sizeof(ShmSegmentHeader),
+                          base + sizeof(ShmSegmentHeader) + sizeof(ShmRingControl) + ring_bytes};
+        mapping_ = mapping;
+        mapping_size_ = size;
+        ring_bytes_ = ring_bytes;
+        header_ = reinterpret_cast<ShmSegmentHeader*>(base);
+        tx_ = reinterpret_cast<ShmRingControl*>(rings[side_]);
+        tx_data_ = rings[side_] + sizeof(ShmRingControl);
+        rx_data_ = rings[1 - side_] + sizeof(ShmRingControl);
+        rx_.store(reinterpret_cast<ShmRingControl*>(rings[1 - side_]), std::memory_order_release);
+    }
+    
+    void attach() {
+        header_->pid[side_] = static_cast<int32_t>(::getpid());
+        header_->state[side_].store(kAttached, std::memory_order_release);
+        log("Shared memory channel " + name_ + " mapped (" + std::to_string(ring_bytes_) + " bytes per ring)");
+    }
+    
+    bool peer_gone() const {
+        if (header_->state[1 - side_].load(std::memory_order_acquire) != kAttached) {
+            return true;
+        }
+        return ::kill(header_->pid[1 - side_], 0) != 0 && errno == ESRCH;
+    }
+    
+    // Tracks the peer's state; the initiator drops the segment's name as soon
+    // as the peer holds a mapping, so nothing is left behind in /dev/shm.
+    // False once the peer has closed its side.
+    bool refresh_peer() {
+        uint32_t state = header_->state[1 - side_].load(std::memory_order_acquire);
+        if (state == kAttached && side_ == 0 && !unlinked_) {
+            ::shm_unlink(name_.c_str());
+            unlinked_ = true;
+        }
+        ready_.store(state == kAttached && !stopping_, std::memory_order_release);
+        return state != kClosed;
+    }
+    
+    void read_loop() {
+        ShmRingControl& ring = *rx_.load(std::memory_order_acquire);
+        uint64_t size = ring_bytes_;
+        uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        refresh_peer();
+        while (!stopping_) {
+            uint64_t head = ring.head.load(std::memory_order_acquire);
+            if (head == tail) {
+                uint32_t bell = ring.doorbell.load(std::memory_order_acquire);
+                ring.sleeping.store(1, std::memory_order_seq_cst);
+                if (ring.head.load(std::memory_order_seq_cst) == tail && !stopping_) {
+                    // Wake up now and then to notice the peer attaching or leaving
+                    timespec timeout{0, ready_ ? 200000000 : 5000000};
+                    futex(&ring.doorbell, FUTEX_WAIT, bell, &timeout);
+                }
+                ring.sleeping.store(0, std::memory_order_relaxed);
+                // What the peer wrote before closing has been read by now
+                if (!refresh_peer()) {
+                    log("Shared memory channel " + name_ + " closed by peer");
+                    return;
+                }
+                continue;
+            }
+            
+            uint64_t offset = tail % size;
+            uint32_t record[2];
+            std::memcpy(record, rx_data_ + offset, sizeof(record));
+            if (record[0] == kWrapMarker) {
+                tail += size - offset;
+                ring.tail.store(tail, std::memory_order_release);
+                continue;
+            }
+            // The peer's counters and lengths are not trusted: a record must
+            // lie within the ring and within what has been written
+            if (kRecordHeader + record[0] > size - offset || record_size(record[0]) > head - tail) {
+                log(LogLevel::error, "Shared memory channel " + name_ + " has a corrupt record; closing it");
+                header_->state[side_].store(kClosed, std::memory_order_release);
+                return;
+            }
+            std::string frame(rx_data_ + offset + kRecordHeader, record[0]);
+            tail += record_size(record[0]);
+            ring.tail.store(tail, std::memory_order_release);
+            on_frame_(std::move(frame), record[1] == kBinary);
+        }
+    }
+    
+    std::string name_;
+    int side_;
+    size_t requested_ring_bytes_;
+    FrameCallback on_frame_;
+    std::thread thread_;
+    std::atomic<bool> stopping_{false};
+    std::atomic<bool> ready_{false};
+    std::atomic<bool> finished_{false};
+    bool unlinked_ = false;
+    
+    // Set up once by the reader thread; unmapped by close() under write_mutex_
+    std::mutex write_mutex_;
+    void* mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    uint64_t ring_bytes_ = 0;
+    ShmSegmentHeader* header_ = nullptr;
+    ShmRingControl* tx_ = nullptr;
+    char* tx_data_ = nullptr;
+    char* rx_data_ = nullptr;
+    std::atomic<ShmRingControl*> rx_{nullptr};
+};
+
+// Identifies the machine (more precisely, the running kernel) for the
+// registry's same-host check: peers must also share /dev/shm to use it
+inline std::string local_host_id() {
+    static const std::string host_id = []() {
+        std::string id;
+        if (FILE* file = std::fopen("/proc/sys/kernel/random/boot_id", "r")) {
+            char buffer[64] = {};
+            if (std::fgets(buffer, sizeof(buffer), file)) {
+                id = buffer;
+            }
+            std::fclose(file);
+        }
+        while (!id.empty() && (id.back() == '\n' || id.back() == ' ')) {
+            id.pop_back();
+        }
+        return id;
+    }();
+    return host_id;
+}
+
+// TLS settings for wss:// registry URLs
+struct TlsOptions {
+    // PEM trust anchors; empty uses the system's default paths
+    std::string ca_file;
+    
+    // Client certificate chain and key, for registries that require mutual TLS
+    std::string cert_file;
+    std::string key_file;
+    
+    // Check the registry's certificate chain and that it names the URL's host
+    bool verify_peer = true;
+    
+    // Keep the session ticket from each handshake and offer it on reconnect,
+    // letting the registry skip the full handshake
+    bool session_resumption = true;
+};
+
+// Tuning knobs for UAP_Client
+struct UAP_ClientOptions {
+    size_t send_queue_capacity = 1024;
+    BackpressurePolicy backpressure = BackpressurePolicy::block;
+    
+    // Priority lanes (see MessagePriority). A message takes the priority its
+    // intent has here, normal if it is not listed, unless the send names
+    // one. Control frames wait in a lane of control_queue_capacity and go
+    // out first; normal and bulk lanes hold send_queue_capacity each, and
+    // while both have frames the writer sends normal_weight normal frames
+    // per bulk one. Normal and bulk frames are held back while more than
+    // send_buffer_limit bytes wait in the socket's buffer (0 never holds
+    // them), so a control frame never queues behind a whole upload. Lanes
+    // apply to registry connections; local and shared memory rings are FIFO.
+    std::map<std::string, MessagePriority, std::less<>> intent_priorities;
+    size_t control_queue_capacity = 64;
+    size_t normal_weight = 4;
+    size_t send_buffer_limit = 256 * 1024;
+    
+    // Message deadlines. Envelopes with an intent listed in intent_ttls, or
+    // with any other intent while default_ttl is non-zero, carry that ttl
+    // (seconds after ts_ns, as UAP_Message.ttl). The writer drops such a
+    // message instead of sending it once the deadline has passed, and any
+    // received message past its sender's deadline is dropped before
+    // dispatch. Both count in stats(). Deadlines are wall-clock times, so
+    // across hosts they are only as good as the clock sync.
+    std::map<std::string, std::chrono::milliseconds, std::less<>> intent_ttls;
+    std::chrono::milliseconds default_ttl{0};
+    
+    // Latest value wins for these intents: while a message to a recipient
+    // waits in its send lane, sending that recipient another one with the
+    // same intent replaces it rather than queueing behind it, so a sensor
+    // stream under backpressure sends its newest sample instead of working
+    // through a backlog. Applies to send_message(), try_send() and
+    // send_raw() toward the registry; requests, batches, multicasts and
+    // messages held offline always keep every message.
+    std::set<std::string, std::less<>> conflate_intents;
+    
+    // Handler workers; 0 runs every handler inline on the I/O thread
+    size_t dispatch_workers = 0;
+    size_t dispatch_queue_depth = 256;
+    
+    // Connections to the registry, each with its own I/O thread, send queue and
+    // send_queue_capacity. Outbound messages are sharded by recipient hash, so
+    // each recipient's messages stay in order on one connection; inbound
+    // messages from all of them reach the same handlers. With more than one
+    // connection and no dispatch workers, inline handlers may run concurrently.
+    size_t pool_size = 1;
+
+    // Encodings advertised at registration, most preferred first. The client
+    // sends JSON text frames until the registry accepts one of the others.
+    std::vector<WireEncoding> encodings = {WireEncoding::cbor, WireEncoding::msgpack, WireEncoding::json};
+    
+    // zstd dictionaries offered at registration (see CompressionDictionary).
+    // Once the registry accepts one, frames of at least compression_threshold
+    // bytes go out compressed with it, when that makes them smaller.
+    // Compressed frames from the registry may use any of these. Compression
+    // runs on the I/O thread, after coalescing.
+    std::vector<std::shared_ptr<const CompressionDictionary>> compression_dictionaries;
+    size_t compression_threshold = 128;
+    
+    // Ask the registry for integer handles for our entity id and the
+    // recipients and intents we send to (see InternedNames). On binary
+    // encodings, envelopes then carry a handle instead of each name the
+    // registry has assigned one to, and the registry may do the same for
+    // us. At most intern_capacity entities and intents are asked for per
+    // connection; later names always go out as strings.
+    bool intern_names = true;
+    size_t intern_capacity = 1024;
+    
+    // Frame coalescing: the writer packs up to coalesce_max_messages queued
+    // envelopes into one batch frame, waiting at most coalesce_window for more
+    // to arrive. 0 messages disables coalescing; a zero window only merges
+    // what is already queued.
+    size_t coalesce_max_messages = 0;
+    std::chrono::microseconds coalesce_window{0};
+    
+    // Encrypt messages to every peer whose public key is known to
+    // UAP_Client::crypto(); broadcasts are never encrypted
+    bool encrypt_messages = false;
+    MessageCrypto::Options crypto;
+    
+    // Messages kept per async_next_message inbox while no coroutine is waiting;
+    // the oldest is dropped beyond this
+    size_t inbox_capacity = 1024;
+    
+    // Serve stats() in the Prometheus text format over HTTP; 0 disables it
+    unsigned short metrics_port = 0;
+    std::string metrics_address = "127.0.0.1";
+    
+    // Reconnect after a connection drops or fails to open, re-sending the
+    // registration. Attempt n waits a random time between half and all of
+    // reconnect_initial_delay * 2^n, capped at reconnect_max_delay;
+    // 0 attempts retries forever.
+    bool auto_reconnect = true;
+    std::chrono::milliseconds reconnect_initial_delay{250};
+    std::chrono::milliseconds reconnect_max_delay{30000};
+    size_t reconnect_max_attempts = 0;
+    
+    // Messages sent between connect() and disconnect() while no connection
+    // is up are held, up to offline_buffer_capacity in memory, and replayed
+    // in order on reconnect; 0 fails such sends instead. With a spill path,
+    // overflow goes to a memory-mapped ring file of offline_spill_bytes that
+    // also survives a restart; otherwise the oldest messages are dropped.
+    size_t offline_buffer_capacity = 4096;
+    std::string offline_spill_path;
+    size_t offline_spill_bytes = 64 * 1024 * 1024;
+    
+    // Record every frame exchanged with the registry, as sent and received
+    // on the socket, to a FrameCapture file of up to capture_bytes at this
+    // path (truncated on start); UAP_Client::replay() feeds one back through
+    // dispatch. Local router and shared memory traffic is not recorded.
+    std::string capture_path;
+    size_t capture_bytes = 256 * 1024 * 1024;
+    
+    // Ask the registry to deliver only intents that have a handler or an
+    // async_next_message inbox (replies to request() always get through);
+    // turn off to receive every message addressed to this entity
+    bool filter_intents = true;
+    
+    // Scratch arena per connection for the JSON parsed while one inbound frame
+    // is handled (batch frames and InboundMessage::scratch_payload()), reset
+    // after dispatch; 0 parses onto the heap. Messages handed to dispatch
+    // workers or inboxes are moved to the heap first.
+    size_t inbound_arena_bytes = 0;
+    
+    // Deliver messages to other clients attached to this router in-process,
+    // bypassing the registry (see LocalRouter). Each client's local ring holds
+    // local_queue_capacity messages, under the same backpressure policy as
+    // the send queue.
+    std::shared_ptr<LocalRouter> local_router;
+    size_t local_queue_capacity = 4096;
+    
+    // Ask the registry for a shared-memory channel (see ShmChannel) to each
+    // peer that registers the same host id. Envelopes to such a peer skip
+    // the WebSocket; what a ring cannot take goes through the registry.
+    // shm_host_id replaces the kernel boot id as the host id, e.g. for
+    // containers that share one /dev/shm.
+    bool shm_transport = true;
+    size_t shm_ring_bytes = 8 * 1024 * 1024;
+    std::string shm_host_id;
+    
+    // Streams (see open_stream): writes are cut into chunks of
+    // stream_chunk_bytes, and at most stream_window_bytes may be sent before
+    // the receiver acknowledges them. A write waits up to
+    // stream_credit_timeout for acknowledgements; a receiving stream that
+    // sees nothing for stream_idle_timeout is aborted.
+    size_t stream_chunk_bytes = 64 * 1024;
+    size_t stream_window_bytes = 1024 * 1024;
+    std::chrono::milliseconds stream_credit_timeout{10000};
+    std::chrono::milliseconds stream_idle_timeout{30000};
+    
+    // This client's entry in the registry's directory, sent with every
+    // registration (see register_capabilities()). With discovery on, the
+    // registry also keeps a copy of the whole directory up to date here,
+    // pushing each change as it happens, so directory() and find_entities()
+    // are local lookups rather than queries.
+    std::string entity_type = "client";
+    std::vector<std::string> capabilities;
+    bool discovery = false;
+    
+    // How long connect() and async_connect() wait for every pooled connection
+    std::chrono::milliseconds connect_timeout{5000};
+    
+    TlsOptions tls;
+};
+
+// One message of a send_batch call
+struct OutgoingMessage {
+    std::string recipient;
+    std::string intent;
+    json payload;
+};
+
+// Intents the registry should deliver to this client. Every registration
+// carries the whole set; changes in between go out as subscribe and
+// unsubscribe frames.
+class IntentSubscriptions {
+public:
+    // True if the intent was not yet subscribed
+    bool add(std::string_view intent) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return intents_.emplace(intent).second;
+    }
+    
+    // True if the intent was subscribed
+    bool remove(std::string_view intent) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = intents_.find(intent);
+        if (it == intents_.end()) {
+            return false;
+        }
+        intents_.erase(it);
+        return true;
+    }
+    
+    json to_json() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return json(intents_);
+    }
+    
+private:
+    mutable std::mutex mutex_;
+    std::set<std::string, std::less<>> intents_;
+};
+
+// What this client advertises in the registry's directory. Every
+// registration carries it; changes in between go out as capabilities frames.
+class EntityProfile {
+public:
+    EntityProfile(std::string type, std::vector<std::string> capabilities)
+        : type_(std::move(type)), capabilities_(std::move(capabilities)) {}
+    
+    void set(std::vector<std::string> capabilities, json metadata) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capabilities_ = std::move(capabilities);
+        metadata_ = std::move(metadata);
+    }
+    
+    // Adds entity_type, capabilities and metadata to a registration or
+    // capabilities frame
+    void add_to(json& frame) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        frame["entity_type"] = type_;
+        frame["capabilities"] = capabilities_;
+        if (metadata_.is_object() && !metadata_.empty()) {
+            frame["metadata"] = metadata_;
+        }
+    }
+    
+private:
+    mutable std::mutex mutex_;
+    std::string type_;
+    std::vector<std::string> capabilities_;
+    json metadata_ = json::object();
+};
+
+// One entity in the registry's directory
+struct EntityInfo {
+    std::string id;
+    std::string type;
+    std::vector<std::string> capabilities;  // sorted
+    json metadata;
+};
+
+// The registry's directory as of one version, indexed by capability.
+// CapabilityIndex publishes it copy-on-write and never changes it afterwards,
+// so a snapshot may be queried from any thread, without locks, for as long
+// as it is held. with_capability() and find() are one hash lookup each.
+class EntityDirectory {
+public:
+    using Entities = std::vector<std::string>;
+    
+    // False until the registry's first snapshot has arrived
+    bool synced() const { return synced_; }
+    uint64_t version() const { return version_; }
+    size_t size() const { return entities_.size(); }
+    
+    // Ids of the entities with a capability, sorted
+    const Entities& with_capability(std::string_view capability) const {
+        static const Entities none;
+        const auto* entities = by_capability_.find(capability);
+        return entities ? **entities : none;
+    }
+    
+    const EntityInfo* find(std::string_view entity_id) const {
+        const auto* info = entities_.find(entity_id);
+        return info ? info->get() : nullptr;
+    }
+    
+    // Ids of the entities that have every one of capabilities and, unless
+    // entity_type is empty, are of that type; sorted
+    Entities find_entities(std::span<const std::string> capabilities, std::string_view entity_type = {}) const {
+        auto matches = [&](const EntityInfo& info) {
+            if (!entity_type.empty() && info.type != entity_type) {
+                return false;
+            }
+            return std::all_of(capabilities.begin(), capabilities.end(), [&](const std::string& capability) {
+                return std::binary_search(info.capabilities.begin(), info.capabilities.end(), capability);
+            });
+        };
+        
+        Entities found;
+        if (capabilities.empty()) {
+            entities_.for_each([&](std::string_view, const std::shared_ptr<const EntityInfo>& info) {
+                if (matches(*info)) {
+                    found.push_back(info->id);
+                }
+            });
+            std::sort(found.begin(), found.end());
+            return found;
+        }
+        
+        // Filter the smallest of the capability sets
+        const Entities* candidates = &with_capability(capabilities.front());
+        for (const std::string& capability : capabilities.subspan(1)) {
+            const Entities& entities = with_capability(capability);
+            if (entities.size() < candidates->size()) {
+                candidates = &entities;
+            }
+        }
+        for (const std::string& id : *candidates) {
+            if (matches(*find(id))) {
+                found.push_back(id);
+            }
+        }
+        return found;
+    }
+    
+private:
+    friend class CapabilityIndex;
+    
+    // Adds or replaces an entity, or removes it for a null entry
+    void put(const std::string& id, const json& entry) {
+        if (const EntityInfo* previous = find(id)) {
+            for (const std::string& capability : previous->capabilities) {
+                edit_set(capability, id, false);
+            }
+            entities_.erase(id);
+        }
+        if (!entry.is_object()) {
+            return;
+        }
+        
+        auto info = std::make_shared<EntityInfo>();
+        info->id = id;
+        info->type = entry.value("entity_type", std::string("client"));
+        auto capabilities = entry.find("capabilities");
+        if (capabilities != entry.end() && capabilities->is_array()) {
+            for (const json& capability : *capabilities) {
+                if (capability.is_string()) {
+                    info->capabilities.push_back(capability.get<std::string>());
+                }
+            }
+        }
+        std::sort(info->capabilities.begin(), info->capabilities.end());
+        info->capabilities.erase(std::unique(info->capabilities.begin(), info->capabilities.end()),
+                                 info->capabilities.end());
+        auto metadata = entry.find("metadata");
+        info->metadata = metadata != entry.end() && metadata->is_object() ? json(*metadata) : json::object();
+        
+        for (const std::string& capability : info->capabilities) {
+            edit_set(capability, id, true);
+        }
+        entities_.insert_or_assign(id, std::move(info));
+    }
+    
+    // Sets are shared with earlier snapshots, so an edit replaces the set
+    // with a changed copy
+    void edit_set(const std::string& capability, const std::string& id, bool add) {
+        const auto* current = by_capability_.find(capability);
+        auto next = std::make_shared<Entities>(current ? **current : Entities());
+        auto it = std::lower_bound(next->begin(), next->end(), id);
+        bool present = it != next->end() && *it == id;
+        if (add && !present) {
+            next->insert(it, id);
+        } else if (!add && present) {
+            next->erase(it);
+        }
+        if (next->empty()) {
+            by_capability_.erase(capability);
+        } else {
+            by_capability_.insert_or_assign(capability, std::shared_ptr<const Entities>(std::move(next)));
+        }
+    }
+    
+    bool synced_ = false;
+    uint64_t version_ = 0;
+    IntentTable<std::shared_ptr<const EntityInfo>> entities_;
+    IntentTable<std::shared_ptr<const Entities>> by_capability_;
+};
+
+// This client's copy of the registry's directory (UAP_ClientOptions::discovery).
+// The registry sends a snapshot after each registration and then a delta
+// per change, numbered consecutively. Every pooled connection gets each
+// frame, so deltas at or below the current version are skipped, as are
+// snapshots below it; a delta that skips ahead means one was lost, and
+// apply() asks for a directory_sync. Once every connection is down the
+// registry may have restarted its numbering, so desync() makes the next
+// snapshot count whatever its version.
+class CapabilityIndex {
+public:
+    CapabilityIndex() : directory_(0) {}
+    
+    std::shared_ptr<const EntityDirectory> load() const {
+        return directory_.load();
+    }
+    
+    // Applies a directory frame; true if the caller should send a
+    // directory_sync frame (and call sync_not_sent() if that fails)
+    bool apply(const json& frame) {
+        auto version = frame.find("version");
+        auto entities = frame.find("entities");
+        if (version == frame.end() || !version->is_number_unsigned() || entities == frame.end() ||
+            !entities->is_object()) {
+            log(LogLevel::warn, "Ignoring malformed directory frame");
+            return false;
+        }
+        uint64_t number = version->get<uint64_t>();
+        bool snapshot = frame.value("snapshot", false);
+        
+        auto current = directory_.load();
+        if (snapshot) {
+            // A late or reordered snapshot would roll the directory back
+            if (current->synced() && !stale_.load() && number < current->version()) {
+                return false;
+            }
+        } else {
+            // Deltas before the first snapshot are covered by it
+            if (!current->synced() || number <= current->version()) {
+                return false;
+            }
+            if (number > current->version() + 1) {
+                return !sync_requested_.exchange(true);
+            }
+        }
+        
+        directory_.update([&](EntityDirectory& directory) {
+            if (snapshot) {
+                if (directory.synced_ && !stale_.load() && number < directory.version_) {
+                    return false;
+                }
+                stale_.store(false);
+                directory = EntityDirectory();
+                directory.synced_ = true;
+                sync_requested_.store(false);
+            } else if (number != directory.version_ + 1) {
+                // Another connection applied it first
+                return false;
+            }
+            directory.version_ = number;
+            for (const auto& [id, entry] : entities->items()) {
+                directory.put(id, entry);
+            }
+            return true;
+        });
+        return false;
+    }
+    
+    void sync_not_sent() {
+        sync_requested_.store(false);
+    }
+    
+    // Keeps the entities for lookups while offline, but lets the next
+    // snapshot replace them regardless of its version
+    void desync() {
+        stale_.store(true);
+        sync_requested_.store(false);
+    }
+    
+private:
+    mutable SnapshotCell<EntityDirectory> directory_;
+    std::atomic<bool> stale_{false};
+    std::atomic<bool> sync_requested_{false};
+};
+
+// One WebSocket connection to the registry. Each connection has its own I/O
+// thread, send queue and writer strand; UAP_Client owns one per pool slot.
+class RegistryConnection {
+public:
+    using InboundCallback = std::function<void(InboundMessage&&)>;
+    using StateCallback = std::function<void()>;
+    
+    RegistryConnection(const UAP_ClientOptions& options, const std::string& entity_id,
+                       const std::string& registry_url, size_t index, size_t pool_size,
+                       ClientMetrics& metrics, const IntentSubscriptions* subscriptions,
+                       const EntityProfile& profile, FrameCapture* capture, InboundCallback on_inbound,
+                       StateCallback on_state_change)
+        : options_(options), metrics_(metrics), subscriptions_(subscriptions), profile_(profile), capture_(capture),
+          entity_id_(entity_id),
+          registry_url_(registry_url), index_(index), pool_size_(pool_size),
+          on_inbound_(std::move(on_inbound)), on_state_change_(std::move(on_state_change)) {
+        for (size_t i = 0; i < kPriorityCount; ++i) {
+            size_t capacity = MessagePriority(i) == MessagePriority::control ? options_.control_queue_capacity
+                                                                             : options_.send_queue_capacity;
+            lanes_[i].reset(new BoundedQueue<OutboundFrame>(capacity));
+        }
+        
+        if (options_.inbound_arena_bytes > 0) {
+            arena_.reset(new MessageArena(options_.inbound_arena_bytes));
+        }
+        
+        if (pool_size_ > 1) {
+            label_ = " (connection " + std::to_string(index_ + 1) + "/" + std::to_string(pool_size_) + ")";
+        }
+        
+        // wss:// URLs go through a TLS endpoint sharing the same I/O loop
+        if (registry_url_.rfind("wss://", 0) == 0) {
+            tls_client_.reset(new websocket_tls_client());
+            try {
+                tls_context_ = make_tls_context();
+            } catch (const std::exception& e) {
+                log(LogLevel::error, "TLS setup error" + label_ + ": " + std::string(e.what()));
+            }
+            tls_client_->set_tls_init_handler([this](websocketpp::connection_hdl) { return tls_context_; });
+            tls_client_->set_socket_init_handler([this](websocketpp::connection_hdl, auto& socket) {
+                offer_tls_session(socket.native_handle());
+            });
+        }
+        
+        // Set up WebSocket client
+        with_endpoint([this](auto& endpoint) {
+            endpoint.clear_access_channels(websocketpp::log::alevel::all);
+            endpoint.set_error_channels(websocketpp::log::elevel::all);
+            
+            endpoint.init_asio(&io_service_);
+            
+            // Set up callbacks
+            endpoint.set_open_handler(std::bind(&RegistryConnection::on_open, this, _1));
+            endpoint.set_message_handler(std::bind(&RegistryConnection::on_message, this, _1, _2));
+            endpoint.set_close_handler(std::bind(&RegistryConnection::on_close, this, _1));
+            endpoint.set_fail_handler(std::bind(&RegistryConnection::on_fail, this, _1));
+        });
+        
+        // All socket writes are serialized on this strand
+        write_strand_.reset(new boost::asio::io_service::strand(io_service_));
+        batch_timer_.reset(new boost::asio::steady_timer(io_service_));
+        pace_timer_.reset(new boost::asio::steady_timer(io_service_));
+        reconnect_timer_.reset(new boost::asio::steady_timer(io_service_));
+    }
+    
+    ~RegistryConnection() {
+        if (tls_session_) {
+            SSL_SESSION_free(tls_session_);
+        }
+    }
+    
+    // A captured inbound frame, handled as if it had just been read. Only
+    // while the connection is not running: the frame borrows its I/O state.
+    void replay_frame(websocketpp::frame::opcode::value opcode, std::string payload) {
+        receive(opcode, payload, monotonic_ns());
+    }
+    
+    // A captured registration: what follows is a new session, which starts
+    // uncompressed, in JSON and without interned names, as in on_open()
+    void replay_registration() {
+        encoding_.store(WireEncoding::json);
+        compressor_.use(nullptr);
+        fanout_.store(false);
+        names_.reset(entity_id_);
+    }
+    
+    // Start connecting and spawn the I/O thread; on_state_change fires once the
+    // registration message is out
+    bool start() {
+        stopping_ = false;
+        if (tls_client_ && !tls_context_) {
+            return false;
+        }
+        if (!open_connection()) {
+            return false;
+        }
+        
+        // Start the client thread
+        client_thread_ = std::thread([this]() {
+            io_thread_id_ = std::this_thread::get_id();
+            on_io_thread() = true;
+            try {
+                io_service_.run();
+            } catch (const std::exception& e) {
+                log(LogLevel::error, "Client thread error" + label_ + ": " + std::string(e.what()));
+            }
+        });
+        return true;
+    }
+    
+    void close() {
+        // No reconnect after this, including from a retry already scheduled
+        stopping_ = true;
+        if (connected_) {
+            try {
+                websocketpp::lib::error_code ec;
+                with_endpoint([&](auto& endpoint) {
+                    endpoint.close(connection_hdl_, websocketpp::close::status::normal, "Disconnecting", ec);
+                });
+                if (ec) {
+                    log(LogLevel::error, "Error closing connection" + label_ + ": " + ec.message());
+                }
+                
+                connected_ = false;
+            } catch (const std::exception& e) {
+                log(LogLevel::error, "Exception in disconnect: " + std::string(e.what()));
+            }
+        }
+    }
+    
+    // Stop the I/O thread and wait for it to exit
+    void stop() {
+        stopping_ = true;
+        if (client_thread_.joinable()) {
+            io_service_.stop();
+            client_thread_.join();
+        }
+    }
+    
+    // Wait for the I/O thread to exit on its own
+    void join() {
+        if (client_thread_.joinable()) {
+            client_thread_.join();
+        }
+    }
+    
+    bool connected() const {
+        return connected_.load();
+    }
+    
+    // Encoding accepted by the registry for this connection
+    WireEncoding encoding() const {
+        return encoding_.load();
+    }
+    
+    // Serializes message in this connection's encoding. On binary encodings
+    // names the registry has a handle for go out as the handle, and the
+    // first sight of any other name asks the registry for one. message is
+    // left as it was.
+    void encode(json& message, OutboundFrame& frame) {
+        WireEncoding encoding = encoding_.load();
+        if (encoding == WireEncoding::json || !names_.active()) {
+            encode_envelope(message, encoding, frame);
+            return;
+        }
+        thread_local InternedNames::Saved saved;
+        json missing;
+        names_.compact(message, saved, missing, options_.intern_capacity);
+        try {
+            encode_envelope(message, encoding, frame);
+        } catch (...) {
+            InternedNames::restore(saved);
+            throw;
+        }
+        InternedNames::restore(saved);
+        if (!missing.is_null()) {
+            request_handles(std::move(missing), encoding);
+        }
+    }
+    
+    size_t index() const {
+        return index_;
+    }
+    
+    // Registry clock minus ours, measured at registration; nullopt if the
+    // registry's ack carried no ts_ns
+    std::optional<int64_t> clock_offset_ns() const {
+        return has_clock_offset_.load() ? std::optional<int64_t>(clock_offset_ns_.load()) : std::nullopt;
+    }
+    
+    // Round trip of the registration exchange, bounding the offset's error
+    int64_t clock_rtt_ns() const {
+        return clock_rtt_ns_.load();
+    }
+    
+    // The loop this connection's I/O thread runs
+    boost::asio::io_service& io_service() {
+        return io_service_;
+    }
+    
+    // Number of frames waiting for the writer
+    size_t queued_count() const {
+        size_t total = 0;
+        for (size_t i = 0; i < kPriorityCount; ++i) {
+            total += lanes_[i]->size();
+        }
+        return total;
+    }
+    
+    size_t queued_count(MessagePriority priority) const {
+        return lanes_[static_cast<size_t>(priority)]->size();
+    }
+    
+    // Number of frames discarded by backpressure or lost to a failed write
+    size_t dropped_count() const {
+        size_t total = 0;
+        for (size_t i = 0; i < kPriorityCount; ++i) {
+            total += dropped_[i].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+    
+    size_t dropped_count(MessagePriority priority) const {
+        return dropped_[static_cast<size_t>(priority)].load(std::memory_order_relaxed);
+    }
+    
+    // Number of times this connection came back after dropping
+    uint64_t reconnect_count() const {
+        return reconnects_.load(std::memory_order_relaxed);
+    }
+    
+    // True once the registry has said it delivers envelopes addressed to
+    // "*" itself (see UAP_Client::multicast())
+    bool fanout() const {
+        return fanout_.load();
+    }
+    
+    // Number of TLS handshakes that resumed an earlier session
+    uint64_t tls_resumption_count() const {
+        return tls_resumptions_.load(std::memory_order_relaxed);
+    }
+    
+    // Queues frame only if there is room right now; never blocks or drops
+    bool try_enqueue_frame(OutboundFrame& frame, MessagePriority priority = MessagePriority::normal) {
+        frame.enqueued_ns = monotonic_ns();
+        if (!lane(priority).try_push(std::move(frame))) {
+            return false;
+        }
+        schedule_write();
+        return true;
+    }
+    
+    // On success frame is left holding a recycled buffer from the queue
+    // policy applies within the frame's lane: drop_oldest discards the
+    // oldest frame of the same priority
+    bool enqueue_frame(OutboundFrame& frame, BackpressurePolicy policy,
+                       MessagePriority priority = MessagePriority::normal) {
+        frame.enqueued_ns = monotonic_ns();
+        BoundedQueue<OutboundFrame>& queue = lane(priority);
+        std::atomic<size_t>& dropped = dropped_[static_cast<size_t>(priority)];
+        
+        // Blocking on the I/O thread would stall the writer we are waiting for
+        if (policy == BackpressurePolicy::block && std::this_thread::get_id() == io_thread_id_) {
+            policy = BackpressurePolicy::drop_newest;
+        }
+        
+        while (!queue.try_push(std::move(frame))) {
+            switch (policy) {
+                case BackpressurePolicy::drop_newest:
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                    
+                case BackpressurePolicy::drop_oldest: {
+                    OutboundFrame oldest;
+                    if (queue.try_pop(oldest)) {
+                        dropped.fetch_add(1, std::memory_order_relaxed);
+                        if (oldest.conflated) {
+                            release_slot(*oldest.conflated);
+                        }
+                    }
+                    break;
+                }
+                    
+                case BackpressurePolicy::block: {
+                    schedule_write();
+                    std::unique_lock<std::mutex> lock(space_mutex_);
+                    ++blocked_producers_;
+                    space_cv_.wait_for(lock, std::chrono::milliseconds(10));
+                    --blocked_producers_;
+                    if (!connected_) {
+                        return false;
+                    }
+                    break;
+                }
+            }
+        }
+        
+        schedule_write();
+        return true;
+    }
+    
+    // enqueue_frame() for the latest value of key, a recipient and intent
+    // (see UAP_ClientOptions::conflate_intents). If an earlier frame for key
+    // still waits, frame replaces it in place and nothing more is queued;
+    // otherwise a stand-in goes into the lane, and the writer sends whatever
+    // frame is newest for key when it gets there. Like enqueue_frame(), frame
+    // is left holding a recycled buffer.
+    bool enqueue_latest(OutboundFrame& frame, std::string_view key, BackpressurePolicy policy,
+                        MessagePriority priority = MessagePriority::normal) {
+        std::shared_ptr<ConflationSlot> slot = conflation_slot(key);
+        {
+            std::lock_guard<std::mutex> lock(slot->mutex);
+            frame.enqueued_ns = monotonic_ns();
+            std::swap(frame, slot->frame);
+            if (slot->queued) {
+                metrics_.conflated.add();
+                return true;
+            }
+            slot->queued = true;
+        }
+        frame.conflated = slot;
+        if (enqueue_frame(frame, policy, priority)) {
+            return true;
+        }
+        // The slot's frame is lost with this send, as it would be unconflated
+        frame.conflated.reset();
+        release_slot(*slot);
+        return false;
+    }
+    
+    // Never blocks: queues frame, or parks it until the writer frees space.
+    // done(true) once the frame is queued, done(false) if the connection goes
+    // down first. Parked frames are admitted in order, ahead of later parks
+    // of the same priority.
+    void enqueue_or_park(OutboundFrame frame, UniqueFunction<void(bool)> done,
+                         MessagePriority priority = MessagePriority::normal) {
+        if (!connected_) {
+            done(false);
+            return;
+        }
+        frame.enqueued_ns = monotonic_ns();
+        {
+            std::lock_guard<std::mutex> lock(parked_mutex_);
+            std::deque<ParkedSend>& parked = parked_[static_cast<size_t>(priority)];
+            if (!parked.empty() || !lane(priority).try_push(std::move(frame))) {
+                parked.push_back(ParkedSend{std::move(frame), std::move(done)});
+                parked_count_.fetch_add(1, std::memory_order_release);
+            }
+        }
+        if (done) {
+            done(true);
+        }
+        // Either way the writer needs a pass: to send the frame or to admit it
+        schedule_write();
+    }
+    
+private:
+    // Calls f with the plain or TLS endpoint, whichever the URL selected
+    template <typename F>
+    void with_endpoint(F&& f) {
+        if (tls_client_) {
+            f(*tls_client_);
+        } else {
+            f(client_);
+        }
+    }
+    
+    // Starts an asynchronous resolve, connect and handshake
+    bool open_connection() {
+        websocketpp::lib::error_code ec;
+        with_endpoint([&](auto& endpoint) {
+            auto connection = endpoint.get_connection(registry_url_, ec);
+            if (!ec) {
+                connection_hdl_ = connection->get_handle();
+                endpoint.connect(connection);
+            }
+        });
+        if (ec) {
+            log(LogLevel::error, "Connection error" + label_ + ": " + ec.message());
+            return false;
+        }
+        return true;
+    }
+    
+    std::shared_ptr<boost::asio::ssl::context> make_tls_context() {
+        namespace ssl = boost::asio::ssl;
+        const TlsOptions& tls = options_.tls;
+        auto context = std::make_shared<ssl::context>(ssl::context::tls_client);
+        context->set_options(ssl::context::default_workarounds | ssl::context::no_sslv2 | ssl::context::no_sslv3 |
+                             ssl::context::no_tlsv1 | ssl::context::no_tlsv1_1);
+        
+        if (tls.verify_peer) {
+            context->set_verify_mode(ssl::verify_peer);
+            if (tls.ca_file.empty()) {
+                context->set_default_verify_paths();
+            } else {
+                context->load_verify_file(tls.ca_file);
+            }
+            context->set_verify_callback(ssl::host_name_verification(websocketpp::uri(registry_url_).get_host()));
+        } else {
+            context->set_verify_mode(ssl::verify_none);
+        }
+        
+        if (!tls.cert_file.empty()) {
+            context->use_certificate_chain_file(tls.cert_file);
+            context->use_private_key_file(tls.key_file.empty() ? tls.cert_file : tls.key_file, ssl::context::pem);
+        }
+        
+        // TLS 1.3 tickets can arrive after the handshake, so they are caught
+        // by callback rather than read off the connection in on_open
+        if (tls.session_resumption) {
+            SSL_CTX* native = context->native_handle();
+            SSL_CTX_set_ex_data(native, tls_ex_index(), this);
+            SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_sess_set_new_cb(native, &RegistryConnection::on_new_tls_session);
+        }
+        return context;
+    }
+    
+    // asio keeps its verify callback in the context's app data, so we need
+    // a slot of our own
+    static int tls_ex_index() {
+        static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+    
+    // I/O thread; keeps the newest session, taking over OpenSSL's reference
+    static int on_new_tls_session(SSL* ssl, SSL_SESSION* session) {
+        auto* self = static_cast<RegistryConnection*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_ex_index()));
+        if (self->tls_session_) {
+            SSL_SESSION_free(self->tls_session_);
+        }
+        self->tls_session_ = session;
+        return 1;
+    }
+    
+    // I/O thread, before each handshake
+    void offer_tls_session(SSL* ssl) {
+        if (tls_session_ && SSL_set_session(ssl, tls_session_) != 1) {
+            log(LogLevel::warn, "Could not offer TLS session for resumption" + label_);
+        }
+    }
+    
+    struct ParkedSend {
+        OutboundFrame frame;
+        UniqueFunction<void(bool)> done;
+    };
+    
+    BoundedQueue<OutboundFrame>& lane(MessagePriority priority) {
+        return *lanes_[static_cast<size_t>(priority)];
+    }
+    
+    // Writer strand: moves parked frames into their lanes while they have room
+    void admit_parked() {
+        std::lock_guard<std::mutex> lock(parked_mutex_);
+        size_t remaining = 0;
+        for (size_t i = 0; i < kPriorityCount; ++i) {
+            std::deque<ParkedSend>& parked = parked_[i];
+            while (!parked.empty() && lanes_[i]->try_push(std::move(parked.front().frame))) {
+                parked.front().done(true);
+                parked.pop_front();
+            }
+            remaining += parked.size();
+        }
+        parked_count_.store(remaining, std::memory_order_release);
+    }
+    
+    void fail_parked() {
+        std::lock_guard<std::mutex> lock(parked_mutex_);
+        for (std::deque<ParkedSend>& parked : parked_) {
+            for (ParkedSend& send : parked) {
+                send.done(false);
+            }
+            parked.clear();
+        }
+        parked_count_.store(0, std::memory_order_release);
+    }
+    
+    // Make sure exactly one drain pass is pending on the writer strand
+    void schedule_write() {
+        if (!write_scheduled_.exchange(true, std::memory_order_acq_rel)) {
+            write_strand_->post([this]() { drain_send_queue(); });
+        }
+    }
+    
+    // Runs on the writer strand only
+    void drain_send_queue() {
+        // Frames wait in the queue across a reconnect; on_open reschedules us
+        if (!connected_) {
+            write_scheduled_.store(false, std::memory_order_release);
+            return;
+        }
+        
+        OutboundFrame frame;
+        MessagePriority priority;
+        for (;;) {
+            while (next_frame(frame, priority)) {
+                notify_blocked_producers();
+                if (parked_count_.load(std::memory_order_acquire) > 0) {
+                    admit_parked();
+                }
+                if (frame.conflated) {
+                    take_latest(frame);
+                }
+                if (frame.expires_ns != 0) {
+                    // Cleared so the recycled buffer carries no deadline back to a producer
+                    bool expired = wall_clock_ns() > frame.expires_ns;
+                    frame.expires_ns = 0;
+                    if (expired) {
+                        metrics_.expired_outbound.add();
+                        frame.tail.reset();
+                        continue;
+                    }
+                }
+                // Control frames never wait for a batch, nor keep its order
+                if (priority == MessagePriority::control) {
+                    if (!write_frame(frame, priority)) {
+                        count_dropped(priority);
+                    }
+                    continue;
+                }
+                if (options_.coalesce_max_messages > 0 && frame.coalescible) {
+                    add_to_batch(frame, priority);
+                    continue;
+                }
+                // Keep ordering: anything already batched goes out first
+                flush_batch();
+                if (!write_frame(frame, priority)) {
+                    count_dropped(priority);
+                }
+            }
+            
+            if (batch_.count() > 0) {
+                if (options_.coalesce_window.count() > 0) {
+                    arm_batch_timer();
+                } else {
+                    flush_batch();
+                }
+            }
+            
+            if (parked_count_.load(std::memory_order_acquire) > 0) {
+                admit_parked();
+            }
+            
+            write_scheduled_.store(false, std::memory_order_release);
+            
+            // A producer may have pushed after our last pop but before the flag
+            // cleared. Held-back lanes wait for the pace timer instead.
+            bool writable = !lane(MessagePriority::control).empty() ||
+                            (!pace_timer_armed_ && (!lane(MessagePriority::normal).empty() ||
+                                                    !lane(MessagePriority::bulk).empty()));
+            if (!writable || write_scheduled_.exchange(true, std::memory_order_acq_rel)) {
+                return;
+            }
+        }
+    }
+    
+    // Strand only: swaps a conflation stand-in for the newest frame of its
+    // slot, leaving the stand-in's buffer there for the next send to reuse
+    void take_latest(OutboundFrame& frame) {
+        std::shared_ptr<ConflationSlot> slot = std::move(frame.conflated);
+        std::lock_guard<std::mutex> lock(slot->mutex);
+        std::swap(frame, slot->frame);
+        slot->queued = false;
+    }
+    
+    void release_slot(ConflationSlot& slot) {
+        std::lock_guard<std::mutex> lock(slot.mutex);
+        slot.queued = false;
+    }
+    
+    // Slot for a conflation key, created on first use and kept for the
+    // connection's lifetime
+    std::shared_ptr<ConflationSlot> conflation_slot(std::string_view key) {
+        std::lock_guard<std::mutex> lock(conflation_mutex_);
+        auto it = conflation_slots_.find(key);
+        if (it == conflation_slots_.end()) {
+            it = conflation_slots_.emplace(std::string(key), std::make_shared<ConflationSlot>()).first;
+        }
+        return it->second;
+    }
+    
+    // Strand only: pops the next frame to write. Control frames come first;
+    // normal and bulk frames take turns by normal_weight, unless the socket
+    // buffer is over send_buffer_limit.
+    bool next_frame(OutboundFrame& frame, MessagePriority& priority) {
+        if (lane(MessagePriority::control).try_pop(frame)) {
+            priority = MessagePriority::control;
+            return true;
+        }
+        if (pace_timer_armed_ || send_buffer_full()) {
+            return false;
+        }
+        MessagePriority order[2] = {MessagePriority::normal, MessagePriority::bulk};
+        if (normal_run_ >= std::max<size_t>(options_.normal_weight, 1)) {
+            std::swap(order[0], order[1]);
+        }
+        for (MessagePriority candidate : order) {
+            if (lane(candidate).try_pop(frame)) {
+                normal_run_ = candidate == MessagePriority::normal ? normal_run_ + 1 : 0;
+                priority = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Strand only. websocketpp reports no write completions, so while the
+    // buffer is over the limit a timer polls it. Between polls
+    // buffered_estimate_ only grows by what we write, an upper bound that
+    // saves asking the connection for every frame.
+    bool send_buffer_full() {
+        if (options_.send_buffer_limit == 0 || buffered_estimate_ <= options_.send_buffer_limit) {
+            return false;
+        }
+        buffered_estimate_ = 0;
+        with_endpoint([&](auto& endpoint) {
+            websocketpp::lib::error_code ec;
+            auto connection = endpoint.get_con_from_hdl(connection_hdl_, ec);
+            if (!ec && connection) {
+                buffered_estimate_ = connection->get_buffered_amount();
+            }
+        });
+        if (buffered_estimate_ <= options_.send_buffer_limit) {
+            return false;
+        }
+        
+        pace_timer_armed_ = true;
+        pace_timer_->expires_after(std::chrono::milliseconds(1));
+        pace_timer_->async_wait(write_strand_->wrap([this](const boost::system::error_code& ec) {
+            pace_timer_armed_ = false;
+            if (ec != boost::asio::error::operation_aborted) {
+                schedule_write();
+            }
+        }));
+        return true;
+    }
+    
+    // Returns false if the frame could not be handed to the socket
+    bool write_frame(OutboundFrame& frame, MessagePriority priority = MessagePriority::normal) {
+        join_tail(frame);
+        size_t saved = compressor_.compress(frame, options_.compression_threshold);
+        websocketpp::lib::error_code ec;
+        with_endpoint([&](auto& endpoint) {
+            endpoint.send(connection_hdl_, frame.data, frame.opcode, ec);
+        });
+        if (ec) {
+            log(LogLevel::error, "Error sending message" + label_ + ": " + ec.message());
+        } else {
+            metrics_.frames_sent.add();
+            metrics_.bytes_sent.add(frame.data.size());
+            if (capture_) {
+                capture_->record(CaptureDirection::outbound, frame.opcode, index_, frame.data);
+            }
+            if (saved > 0) {
+                metrics_.frames_compressed.add();
+                metrics_.compression_bytes_saved.add(saved);
+            }
+            buffered_estimate_ += frame.data.size();
+            if (frame.enqueued_ns != 0) {
+                uint64_t waited = monotonic_ns() - frame.enqueued_ns;
+                metrics_.enqueue_to_wire.record(waited);
+                metrics_.lane_enqueue_to_wire[static_cast<size_t>(priority)].record(waited);
+            }
+        }
+        release_if_oversized(frame.data);
+        return !ec;
+    }
+    
+    void count_dropped(MessagePriority priority) {
+        dropped_[static_cast<size_t>(priority)].fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    // Strand only
+    void add_to_batch(OutboundFrame& frame, MessagePriority priority) {
+        join_tail(frame);
+        if (batch_.count() > 0 && batch_.encoding() != frame.encoding) {
+            flush_batch();
+        }
+        if (batch_.count() == 0) {
+            batch_.reset(frame.encoding);
+        }
+        batch_.add(frame.data);
+        batch_enqueued_.emplace_back(frame.enqueued_ns, priority);
+        if (batch_.count() >= options_.coalesce_max_messages) {
+            flush_batch();
+        }
+    }
+    
+    // Strand only. Without a connection the batch is kept, like the frames
+    // still queued, and goes out first once on_open reschedules the writer.
+    void flush_batch() {
+        if (batch_.count() == 0) {
+            return;
+        }
+        if (batch_timer_armed_) {
+            batch_timer_->cancel();
+            batch_timer_armed_ = false;
+        }
+        if (!connected_) {
+            return;
+        }
+        batch_.finish(batch_frame_);
+        batch_.reset(batch_.encoding());
+        batch_frame_.enqueued_ns = 0;
+        bool written = write_frame(batch_frame_);
+        
+        // Each coalesced message waited from its own enqueue until this write,
+        // or was lost with it
+        uint64_t now = monotonic_ns();
+        for (auto [enqueued_ns, priority] : batch_enqueued_) {
+            if (!written) {
+                count_dropped(priority);
+                continue;
+            }
+            metrics_.enqueue_to_wire.record(now - enqueued_ns);
+            metrics_.lane_enqueue_to_wire[static_cast<size_t>(priority)].record(now - enqueued_ns);
+        }
+        batch_enqueued_.clear();
+    }
+    
+    // Strand only; flushes the pending batch once the coalescing window ends
+    void arm_batch_timer() {
+        if (batch_timer_armed_) {
+            return;
+        }
+        batch_timer_armed_ = true;
+        batch_timer_->expires_after(options_.coalesce_window);
+        batch_timer_->async_wait(write_strand_->wrap([this](const boost::system::error_code& ec) {
+            if (ec == boost::asio::error::operation_aborted) {
+                return;
+            }
+            batch_timer_armed_ = false;
+            flush_batch();
+        }));
+    }
+    
+    // Handles are only used once the registry has defined them, so the
+    // request may go out in any order relative to the frames that prompted it
+    void request_handles(json missing, WireEncoding encoding) {
+        json request = missing;
+        request["type"] = "intern";
+        OutboundFrame frame;
+        encode_envelope(request, encoding, frame);
+        frame.coalescible = false;
+        if (!try_enqueue_frame(frame, MessagePriority::control)) {
+            names_.forget_requests(missing);
+        }
+    }
+    
+    void notify_blocked_producers() {
+        std::lock_guard<std::mutex> lock(space_mutex_);
+        if (blocked_producers_ > 0) {
+            space_cv_.notify_all();
+        }
+    }
+    
+    // WebSocket callbacks
+    void on_open(websocketpp::connection_hdl hdl) {
+        log("Connected to registry" + label_);
+        
+        if (tls_client_ && SSL_session_reused(tls_client_->get_con_from_hdl(hdl)->get_socket().native_handle())) {
+            tls_resumptions_.fetch_add(1, std::memory_order_relaxed);
+            if (log_enabled(LogLevel::debug)) {
+                log(LogLevel::debug, "Resumed TLS session" + label_);
+            }
+        }
+        
+        // Every connection starts in JSON, uncompressed, until the registry
+        // accepts an encoding and a dictionary
+        encoding_.store(WireEncoding::json);
+        compressor_.use(nullptr);
+        fanout_.store(false);
+        json intern_request = names_.reset(entity_id_);
+        
+        // Register with the registry
+        json encodings = json::array();
+        for (WireEncoding encoding : options_.encodings) {
+            encodings.push_back(encoding_name(encoding));
+        }
+        // ts_ns lets the registry's ack carry its clock reading back to us
+        registration_sent_ns_ = wall_clock_ns();
+        json registration_message = {
+            {"type", "registration"},
+            {"entity_id", entity_id_},
+            {"encodings", encodings},
+            {"ts_ns", registration_sent_ns_}
+        };
+        // A re-registration resynchronizes the filter after a reconnect
+        if (subscriptions_) {
+            registration_message["intents"] = subscriptions_->to_json();
+        }
+        // Our directory entry; with discovery the registry answers with a
+        // snapshot of the whole directory
+        profile_.add_to(registration_message);
+        if (options_.discovery) {
+            registration_message["discovery"] = true;
+        }
+        // Pooled connections tell the registry they belong to one entity
+        if (pool_size_ > 1) {
+            registration_message["connection_index"] = index_;
+            registration_message["pool_size"] = pool_size_;
+        }
+        // Lets the registry pair us with peers on the same host
+        if (options_.shm_transport) {
+            std::string host_id = options_.shm_host_id.empty() ? local_host_id() : options_.shm_host_id;
+            if (!host_id.empty()) {
+                registration_message["host_id"] = host_id;
+                registration_message["transports"] = json::array({"shm"});
+            }
+        }
+        // The registry picks one of our dictionaries, if it has any of them
+        if (!options_.compression_dictionaries.empty()) {
+            json ids = json::array();
+            for (const auto& dictionary : options_.compression_dictionaries) {
+                ids.push_back(dictionary->id());
+            }
+            registration_message["compression"] = {{"algorithm", "zstd"}, {"dictionaries", ids}};
+        }
+        // Handles only pay off on binary encodings
+        bool binary = std::any_of(options_.encodings.begin(), options_.encodings.end(),
+                                  [](WireEncoding encoding) { return encoding != WireEncoding::json; });
+        if (options_.intern_names && binary) {
+            registration_message["interning"] = std::move(intern_request);
+        }
+        
+        std::string registration = registration_message.dump();
+        websocketpp::lib::error_code ec;
+        with_endpoint([&](auto& endpoint) {
+            endpoint.send(hdl, registration, websocketpp::frame::opcode::text, ec);
+        });
+        
+        if (ec) {
+            log(LogLevel::error, "Error sending registration message: " + ec.message());
+            return;
+        }
+        if (capture_) {
+            capture_->record(CaptureDirection::outbound, websocketpp::frame::opcode::text, index_, registration);
+        }
+        
+        log("Sent registration message for " + entity_id_ + label_);
+        
+        if (ever_connected_) {
+            reconnects_.fetch_add(1, std::memory_order_relaxed);
+        }
+        ever_connected_ = true;
+        reconnect_attempt_ = 0;
+        
+        // Update connection status
+        buffered_estimate_ = 0;
+        connected_ = true;
+        on_state_change_();
+        
+        // Flush whatever was queued before the connection dropped
+        schedule_write();
+    }
+    
+    void on_message(websocketpp::connection_hdl hdl, message_ptr msg) {
+        uint64_t received_ns = monotonic_ns();
+        if (capture_) {
+            capture_->record(CaptureDirection::inbound, msg->get_opcode(), index_, msg->get_payload(), received_ns);
+        }
+        receive(msg->get_opcode(), msg->get_raw_payload(), received_ns);
+    }
+    
+    void receive(websocketpp::frame::opcode::value opcode, std::string& payload, uint64_t received_ns) {
+        metrics_.frames_received.add();
+        metrics_.bytes_received.add(payload.size());
+        try {
+            handle_frame(opcode, payload, received_ns);
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Error handling message: " + std::string(e.what()));
+        }
+        // Every message from the frame is gone or detached by now
+        if (arena_) {
+            arena_->reset();
+        }
+    }
+    
+    void handle_frame(websocketpp::frame::opcode::value opcode, std::string& payload, uint64_t received_ns) {
+        // Binary frames are decoded whole; text frames only have their
+        // routing fields located and the payload stays unparsed
+        std::optional<InboundMessage> message;
+        if (opcode == websocketpp::frame::opcode::binary && is_compressed_frame(payload)) {
+            // Inside is the frame as it would have been sent uncompressed
+            std::string frame = compressor_.decompress(payload, options_.compression_dictionaries);
+            if (!frame.empty() && frame[0] == '{') {
+                message.emplace(std::move(frame), arena_.get());
+            } else {
+                emplace_binary(frame, message);
+            }
+        } else if (opcode == websocketpp::frame::opcode::binary) {
+            emplace_binary(payload, message);
+        } else {
+            message.emplace(std::move(payload), arena_.get());
+        }
+        message->set_received_ns(received_ns);
+        
+        if (message->type() == "registration_ack") {
+            on_registration_ack(message->document());
+            return;
+        }
+        if (message->type() == "intern") {
+            names_.define(message->document());
+            return;
+        }
+        
+        on_inbound_(std::move(*message));
+    }
+    
+    // Decodes a binary envelope, putting back the names of interned handles
+    void emplace_binary(const std::string& data, std::optional<InboundMessage>& message) {
+        json document = decode_binary_envelope(data);
+        std::optional<uint64_t> intent_hash = names_.resolve(document);
+        message.emplace(std::move(document));
+        if (intent_hash) {
+            message->set_intent_hash(*intent_hash);
+        }
+    }
+    
+    // The registry answers registration with the encoding it picked from our
+    // list, optionally the dictionary it picked, and its own clock reading
+    void on_registration_ack(const json& ack) {
+        auto registry_ns = ack.find("ts_ns");
+        if (registry_ns != ack.end() && registry_ns->is_number_integer()) {
+            // NTP-style estimate, assuming the ack took half the round trip
+            int64_t received_ns = wall_clock_ns();
+            int64_t midpoint = registration_sent_ns_ + (received_ns - registration_sent_ns_) / 2;
+            clock_offset_ns_.store(registry_ns->get<int64_t>() - midpoint);
+            clock_rtt_ns_.store(received_ns - registration_sent_ns_);
+            has_clock_offset_.store(true);
+        }
+        
+        auto compression = ack.find("compression");
+        if (compression != ack.end() && compression->is_object()) {
+            accept_compression(*compression);
+        }
+        
+        auto interning = ack.find("interning");
+        if (interning != ack.end() && interning->is_object()) {
+            names_.define(*interning);
+        }
+        
+        fanout_.store(ack.value("fanout", false));
+        
+        auto field = ack.find("encoding");
+        if (field == ack.end() || !field->is_string()) {
+            return;
+        }
+        auto encoding = parse_encoding(field->get<std::string>());
+        if (!encoding || std::find(options_.encodings.begin(), options_.encodings.end(), *encoding) == options_.encodings.end()) {
+            log(LogLevel::warn, "Registry selected unsupported encoding " + field->get<std::string>() + ", staying on json");
+            return;
+        }
+        encoding_.store(*encoding);
+        log(std::string("Registry accepted encoding: ") + encoding_name(*encoding) + label_);
+    }
+    
+    void accept_compression(const json& choice) {
+        auto id = choice.find("dictionary");
+        auto algorithm = choice.find("algorithm");
+        if (algorithm == choice.end() || *algorithm != "zstd" || id == choice.end() || !id->is_number_unsigned()) {
+            log(LogLevel::warn, "Registry selected unsupported compression " + choice.dump() + ", sending uncompressed" + label_);
+            return;
+        }
+        for (const auto& dictionary : options_.compression_dictionaries) {
+            if (dictionary->id() == id->get<uint64_t>()) {
+                compressor_.use(dictionary);
+                log("Registry accepted compression: zstd dictionary " + std::to_string(dictionary->id()) + label_);
+                return;
+            }
+        }
+        log(LogLevel::warn, "Registry selected unknown dictionary " + id->dump() + ", sending uncompressed" + label_);
+    }
+    
+    void on_close(websocketpp::connection_hdl hdl) {
+        log("Connection to registry closed" + label_);
+        
+        connected_ = false;
+        on_state_change_();
+        notify_blocked_producers();
+        fail_parked();
+        schedule_reconnect();
+    }
+    
+    void on_fail(websocketpp::connection_hdl hdl) {
+        log(LogLevel::warn, "Connection to registry failed" + label_);
+        
+        connected_ = false;
+        on_state_change_();
+        notify_blocked_producers();
+        fail_parked();
+        schedule_reconnect();
+    }
+    
+    // I/O thread. The pending timer keeps the I/O loop alive while we wait.
+    void schedule_reconnect() {
+        if (stopping_ || !options_.auto_reconnect) {
+            return;
+        }
+        if (options_.reconnect_max_attempts > 0 && reconnect_attempt_ >= options_.reconnect_max_attempts) {
+            log(LogLevel::error, "Giving up on registry" + label_ + " after " +
+                std::to_string(reconnect_attempt_) + " reconnect attempts");
+            return;
+        }
+        
+        std::chrono::milliseconds delay = reconnect_delay(reconnect_attempt_++);
+        log(LogLevel::warn, "Reconnecting to registry" + label_ + " in " + std::to_string(delay.count()) + " ms");
+        reconnect_timer_->expires_after(delay);
+        reconnect_timer_->async_wait([this](const boost::system::error_code& ec) {
+            if (ec == boost::asio::error::operation_aborted || stopping_) {
+                return;
+            }
+            if (!open_connection()) {
+                schedule_reconnect();
+            }
+        });
+    }
+    
+    // Jitter keeps clients dropped by the same outage from retrying in lockstep
+    std::chrono::milliseconds reconnect_delay(size_t attempt) {
+        double cap = static_cast<double>(options_.reconnect_initial_delay.count());
+        double max_delay = static_cast<double>(options_.reconnect_max_delay.count());
+        for (size_t i = 0; i < attempt && cap < max_delay; ++i) {
+            cap *= 2;
+        }
+        cap = std::min(cap, max_delay);
+        std::uniform_real_distribution<double> jitter(cap / 2, cap);
+        return std::chrono::milliseconds(static_cast<int64_t>(jitter(reconnect_rng_)));
+    }
+    
+private:
+    const UAP_ClientOptions& options_;
+    ClientMetrics& metrics_;
+    const IntentSubscriptions* subscriptions_;
+    const EntityProfile& profile_;
+    FrameCapture* capture_;
+    std::string entity_id_;
+    std::string registry_url_;
+    size_t index_;
+    size_t pool_size_;
+    std::string label_;
+    std::atomic<bool> connected_{false};
+    
+    // Both endpoints run on io_service_; tls_client_ only exists for wss://
+    boost::asio::io_service io_service_;
+    websocket_client client_;
+    std::unique_ptr<websocket_tls_client> tls_client_;
+    std::shared_ptr<boost::asio::ssl::context> tls_context_;
+    SSL_SESSION* tls_session_ = nullptr;
+    std::atomic<uint64_t> tls_resumptions_{0};
+    websocketpp::connection_hdl connection_hdl_;
+    std::unique_ptr<MessageArena> arena_;
+    FrameCompressor compressor_;
+    InternedNames names_;
+    std::atomic<bool> fanout_{false};
+    std::thread client_thread_;
+    std::atomic<std::thread::id> io_thread_id_;
+    std::atomic<WireEncoding> encoding_{WireEncoding::json};
+    
+    // Reconnect state; the counters are touched only on the I/O thread
+    std::atomic<bool> stopping_{false};
+    bool ever_connected_ = false;
+    size_t reconnect_attempt_ = 0;
+    std::atomic<uint64_t> reconnects_{0};
+    std::unique_ptr<boost::asio::steady_timer> reconnect_timer_;
+    std::mt19937 reconnect_rng_{std::random_device{}()};
+    
+    // Clock offset against the registry; written on the I/O thread
+    int64_t registration_sent_ns_ = 0;
+    std::atomic<int64_t> clock_offset_ns_{0};
+    std::atomic<int64_t> clock_rtt_ns_{0};
+    std::atomic<bool> has_clock_offset_{false};
+    
+    // Outbound path: producers push frames into the lane of their
+    // MessagePriority, the strand drains them to the socket
+    std::array<std::unique_ptr<BoundedQueue<OutboundFrame>>, kPriorityCount> lanes_;
+    std::unique_ptr<boost::asio::io_service::strand> write_strand_;
+    
+    // Coalescing and pacing state, touched only on the writer strand
+    BatchBuilder batch_;
+    OutboundFrame batch_frame_;
+    std::vector<std::pair<uint64_t, MessagePriority>> batch_enqueued_;
+    std::unique_ptr<boost::asio::steady_timer> batch_timer_;
+    bool batch_timer_armed_ = false;
+    size_t normal_run_ = 0;
+    size_t buffered_estimate_ = 0;
+    std::unique_ptr<boost::asio::steady_timer> pace_timer_;
+    bool pace_timer_armed_ = false;
+    std::atomic<bool> write_scheduled_{false};
+    std::array<std::atomic<size_t>, kPriorityCount> dropped_{};
+    std::mutex space_mutex_;
+    std::condition_variable space_cv_;
+    int blocked_producers_ = 0;
+    
+    // Frames from enqueue_or_park waiting for queue space, per lane
+    std::mutex parked_mutex_;
+    std::array<std::deque<ParkedSend>, kPriorityCount> parked_;
+    std::atomic<size_t> parked_count_{0};
+    
+    // Latest frame per conflated recipient and intent (see enqueue_latest)
+    std::mutex conflation_mutex_;
+    std::map<std::string, std::shared_ptr<ConflationSlot>, std::less<>> conflation_slots_;
+    
+    InboundCallback on_inbound_;
+    StateCallback on_state_change_;
+};
+
+// One stream being received, handed to the handler from
+// UAP_Client::register_stream_handler() with every chunk. The first call
+// carries the sender's header and no data; the last has ended() or
+// aborted() set. Calls for one stream never overlap.
+class InboundStream {
+public:
+    const std::string& id() const { return id_; }
+    const std::string& sender() const { return sender_; }
+    const std::string& intent() const { return intent_; }
+    // Payload the sender passed to open_stream()
+    const json& header() const { return header_; }
+    uint64_t bytes_received() const { return bytes_received_; }
+    bool ended() const { return ended_; }
+    bool aborted() const { return aborted_; }
+    const std::string& abort_reason() const { return abort_reason_; }
+    
+    // Tells the sender to stop; the handler is not called again
+    void cancel(std::string reason = "Cancelled by receiver") {
+        cancel_reason_ = std::move(reason);
+    }
+    
+    // For the handler's own per-stream state
+    std::any& context() { return context_; }
+    
+private:
+    friend class UAP_Client;
+    
+    std::string id_;
+    std::string sender_;
+    std::string intent_;
+    json header_ = json::object();
+    uint64_t bytes_received_ = 0;
+    bool ended_ = false;
+    bool aborted_ = false;
+    std::string abort_reason_;
+    std::string cancel_reason_;
+    std::any context_;
+};
+
+using StreamHandler = std::function<void(InboundStream& stream, std::string_view data)>;
+
+// Sending side of a stream, shared by its StreamWriter and the client,
+// which applies the receiver's acknowledgements
+struct OutboundStream {
+    std::string id;
+    std::string recipient;
+    std::string intent;
+    std::mutex mutex;
+    std::condition_variable credit;
+    uint64_t next_seq = 0;
+    uint64_t sent = 0;
+    uint64_t acknowledged = 0;
+    bool finished = false;
+    std::string cancel_reason;
+};
+
+class UAP_Client;
+
+// Writer returned by UAP_Client::open_stream(). Each write is cut into
+// chunks that travel as separate frames, so other messages on the same
+// connection go out between them. Writes wait while the receiver has not
+// acknowledged stream_window_bytes (except on I/O threads, where they fail
+// instead). Destroying an open writer aborts the stream. A writer is used
+// by one thread at a time, and the client must outlive it.
+class StreamWriter {
+public:
+    StreamWriter() = default;
+    StreamWriter(StreamWriter&& other) noexcept = default;
+    
+    StreamWriter& operator=(StreamWriter&& other) noexcept {
+        if (this != &other) {
+            abort("Stream writer replaced");
+            client_ = other.client_;
+            state_ = std::move(other.state_);
+        }
+        return *this;
+    }
+    
+    ~StreamWriter() {
+        abort("Stream writer destroyed");
+    }
+    
+    // False for a writer whose stream could not be opened
+    explicit operator bool() const { return state_ != nullptr; }
+    
+    const std::string& id() const { return state_->id; }
+    
+    // Sends data, waiting for acknowledgements as needed. False if the stream
+    // is finished, the receiver cancelled it, it could not be queued, or no
+    // credit came within stream_credit_timeout; chunks sent before that stay sent.
+    bool write(std::string_view data);
+    
+    // Ends the stream after everything written so far
+    bool close();
+    
+    // Ends the stream; the receiver sees aborted() with reason
+    void abort(std::string_view reason = "Aborted by sender");
+    
+    bool is_open() const {
+        if (!state_) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return !state_->finished;
+    }
+    
+    uint64_t bytes_sent() const {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->sent;
+    }
+    
+    // Why the receiver cancelled the stream; empty if it has not
+    std::string cancel_reason() const {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->cancel_reason;
+    }
+    
+private:
+    friend class UAP_Client;
+    
+    StreamWriter(UAP_Client* client, std::shared_ptr<OutboundStream> state)
+        : client_(client), state_(std::move(state)) {}
+    
+    UAP_Client* client_ = nullptr;
+    std::shared_ptr<OutboundStream> state_;
+};
+
+// UAP Client class
+class UAP_Client {
+public:
+    using Options = UAP_ClientOptions;
+    
+    UAP_Client(const std::string& entity_id, const std::string& registry_url,
+               const Options& options = Options())
+        : entity_id_(entity_id), registry_url_(registry_url),
+          options_(options), crypto_(options.crypto),
+          message_handlers_(std::max<size_t>(options.pool_size, 1) + kMaxShmChannels),
+          profile_(options.entity_type, options.capabilities) {
+        
+        if (options_.dispatch_workers > 0) {
+            dispatch_pool_.reset(new DispatchPool(options_.dispatch_workers, options_.dispatch_queue_depth));
+        }
+        
+        if (!options_.capture_path.empty() && options_.capture_bytes > 0) {
+            try {
+                capture_.reset(new FrameCapture(options_.capture_path, options_.capture_bytes));
+                log("Capturing registry frames to " + options_.capture_path);
+            } catch (const std::exception& e) {
+                log(LogLevel::error, "Frame capture disabled: " + std::string(e.what()));
+            }
+        }
+        
+        size_t pool_size = std::max<size_t>(options_.pool_size, 1);
+        for (size_t i = 0; i < pool_size; ++i) {
+            connections_.emplace_back(new RegistryConnection(
+                options_, entity_id_, registry_url_, i, pool_size, metrics_,
+                options_.filter_intents ? &subscriptions_ : nullptr, profile_, capture_.get(),
+                [this, i](InboundMessage&& message) { on_inbound(std::move(message), i); },
+                [this]() { on_connection_state_change(); }));
+        }
+        
+        if (options_.local_router) {
+            local_mailbox_ = std::make_shared<LocalRouter::Mailbox>(options_.local_queue_capacity, [this]() {
+                boost::asio::post(executor(), [this]() { drain_local(); });
+            });
+        }
+        
+        if (options_.offline_buffer_capacity > 0) {
+            offline_.reset(new OfflineBuffer(options_.offline_buffer_capacity, options_.offline_spill_path,
+                                             options_.offline_spill_bytes));
+            offline_pending_.store(offline_->size());
+        }
+        
+        request_timeouts_.reset(new TimerWheel([this](const std::string& id) {
+            if (auto completion = pending_requests_.take(id)) {
+                completion(std::make_exception_ptr(RequestTimeout("Request " + id + " timed out")), json());
+            }
+        }));
+        
+        if (options_.metrics_port != 0) {
+            try {
+                metrics_endpoint_.reset(new MetricsEndpoint(options_.metrics_address, options_.metrics_port,
+                                                            [this]() { return prometheus_text(); }));
+                log("Serving metrics on " + options_.metrics_address + ":" + std::to_string(metrics_endpoint_->port()));
+            } catch (const std::exception& e) {
+                log(LogLevel::error, "Could not start metrics endpoint: " + std::string(e.what()));
+            }
+        }
+    }
+    
+    ~UAP_Client() {
+        disconnect();
+        metrics_endpoint_.reset();
+    }
+    
+    // Start connecting and return at once; resolution, TCP and TLS setup for
+    // every pooled connection run concurrently on their I/O threads. Messages
+    // sent before the registry answers are held in the offline buffer and go
+    // out in order as soon as a connection registers (with
+    // offline_buffer_capacity 0 they fail instead). Returns false only if a
+    // connection could not be started at all.
+    bool connect_async() {
+        try {
+            log("Connecting to registry at " + registry_url_ + "...");
+            reopen_inboxes();
+            started_ = true;
+            
+            for (auto& connection : connections_) {
+                if (!connection->start()) {
+                    return false;
+                }
+            }
+            attach_local();
+            return true;
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Exception in connect: " + std::string(e.what()));
+            return false;
+        }
+    }
+    
+    // Connect to the registry, waiting up to connect_timeout. A pooled client
+    // succeeds as long as one of its connections comes up; traffic for the
+    // others is routed around them.
+    bool connect() {
+        try {
+            if (!connect_async()) {
+                return false;
+            }
+            
+            // Wait for connection to be established
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait_for(lock, options_.connect_timeout, [this]() {
+                return connected_count() == connections_.size();
+            });
+            
+            size_t established = connected_count();
+            if (established > 0 && established < connections_.size()) {
+                log(LogLevel::warn, "Only " + std::to_string(established) + " of " +
+                    std::to_string(connections_.size()) + " pooled connections established");
+            }
+            return established > 0;
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Exception in connect: " + std::string(e.what()));
+            return false;
+        }
+    }
+    
+    // Disconnect from the registry
+    void disconnect() {
+        // Sends from here on fail; anything still held is kept for the next connect()
+        started_ = false;
+        detach_local();
+        close_shm_channels();
+        for (auto& connection : connections_) {
+            connection->close();
+        }
+        for (auto& connection : connections_) {
+            connection->stop();
+        }
+        
+        // Let handlers already handed to the pool run to completion
+        if (dispatch_pool_) {
+            dispatch_pool_->stop();
+        }
+        
+        // No reply can arrive any more
+        if (pending_requests_.size() > 0) {
+            pending_requests_.fail_all(std::make_exception_ptr(std::runtime_error("Disconnected from registry")));
+        }
+        close_inboxes();
+        close_streams();
+        
+        log("Disconnected from registry");
+    }
+    
+    // Feed the inbound frames of a FrameCapture file through dispatch, on
+    // the calling thread, as if each had just arrived on the connection it
+    // was recorded on (modulo this client's pool size). speed 1 keeps the
+    // recorded spacing, 2 halves it and 0 sends frames as fast as dispatch
+    // takes them. Handlers see the recorded messages, registration_ack and
+    // intern frames included; replies and acks they send fail, since the
+    // client must not be connected, and messages that carried a ttl are past
+    // it and dropped. Returns false if the capture could not be read.
+    bool replay(const std::string& path, double speed = 1.0) {
+        if (started_) {
+            log(LogLevel::error, "Cannot replay " + path + " while connected");
+            return false;
+        }
+        try {
+            CaptureReader reader(path);
+            CaptureReader::Frame frame;
+            reopen_inboxes();
+            
+            size_t replayed = 0;
+            uint64_t first_ns = 0;
+            auto start = std::chrono::steady_clock::now();
+            while (reader.next(frame)) {
+                auto& connection = connections_[frame.connection % connections_.size()];
+                if (frame.direction != CaptureDirection::inbound) {
+                    if (frame.opcode == websocketpp::frame::opcode::text &&
+                        frame.data.find("\"registration\"") != std::string_view::npos &&
+                        InboundMessage(std::string(frame.data)).type() == "registration") {
+                        connection->replay_registration();
+                    }
+                    continue;
+                }
+                if (replayed++ == 0) {
+                    first_ns = frame.at_ns;
+                } else if (speed > 0) {
+                    auto offset = std::chrono::nanoseconds(
+                        static_cast<int64_t>(static_cast<double>(frame.at_ns - std::min(frame.at_ns, first_ns)) / speed));
+                    std::this_thread::sleep_until(start + offset);
+                }
+                connection->replay_frame(frame.opcode, std::string(frame.data));
+            }
+            log("Replayed " + std::to_string(replayed) + " frames from " + path);
+            return true;
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Cannot replay " + path + ": " + std::string(e.what()));
+            return false;
+        }
+    }
+    
+    // Send a message to another entity.
+    // The message is queued for the writer strand; the configured backpressure
+    // policy decides what happens when the queue is full.
+    bool send_message(const std::string& recipient, const std::string& intent, const json& payload) {
+        return enqueue_message(recipient, intent, payload, options_.backpressure);
+    }
+    
+    // send_message() in the given lane, whatever intent_priorities says
+    bool send_message(const std::string& recipient, const std::string& intent, const json& payload,
+                      MessagePriority priority) {
+        return enqueue_message(recipient, intent, payload, options_.backpressure, std::string(), priority);
+    }
+    
+    // Send a request and return a future for its reply. The reply is the first
+    // message whose reply_to names the request's id (or whose id is
+    // "response-<id>", as create_response() in src/protocol/message.py sets it);
+    // it completes the future with the whole reply envelope instead of going to
+    // an intent handler. The future throws RequestTimeout once timeout passes.
+    std::future<json> request(const std::string& recipient, const std::string& intent, const json& payload,
+                              std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+        std::promise<json> promise;
+        std::future<json> reply = promise.get_future();
+        start_request(recipient, intent, payload, timeout,
+                      [promise = std::move(promise)](std::exception_ptr error, json envelope) mutable {
+                          if (error) {
+                              promise.set_exception(error);
+                          } else {
+                              promise.set_value(std::move(envelope));
+                          }
+                      });
+        return reply;
+    }
+    
+    // Coroutine API. Each operation takes an asio completion token and defaults
+    // to boost::asio::use_awaitable, so inside a coroutine:
+    //
+    //     bool up = co_await client.async_connect();
+    //     co_await client.async_send("python_client", "reading", payload);
+    //     json reply = co_await client.async_request("python_client", "query", payload);
+    //     auto message = co_await client.async_next_message("command");
+    //
+    // Completions run on the awaiting coroutine's executor, and none of the
+    // operations ever block a thread, so any number of coroutines can share
+    // one io_context, including executor() below.
+    
+    // The first connection's I/O loop, for co_spawn'ing agents next to the
+    // client; it runs while the client is connected
+    boost::asio::io_service::executor_type executor() {
+        return connections_.front()->io_service().get_executor();
+    }
+    
+    // Like connect(), without blocking: completes with true once every pooled
+    // connection has registered, or after connect_timeout with whether any did
+    template <typename CompletionToken = boost::asio::use_awaitable_t<>>
+    auto async_connect(CompletionToken&& token = CompletionToken()) {
+        return boost::asio::async_initiate<CompletionToken, void(bool)>([this](auto handler) {
+            UniqueFunction<void(bool)> done = bind_completion<bool>(std::move(handler), executor());
+            if (!connect_async()) {
+                done(false);
+                return;
+            }
+            
+            uint64_t waiter;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (connected_count() == connections_.size()) {
+                    done(true);
+                    return;
+                }
+                waiter = next_connect_waiter_++;
+                connect_waiters_.emplace(waiter, std::move(done));
+            }
+            
+            auto timer = std::make_shared<boost::asio::steady_timer>(executor(), options_.connect_timeout);
+            timer->async_wait([this, timer, waiter](const boost::system::error_code&) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = connect_waiters_.find(waiter);
+                if (it != connect_waiters_.end()) {
+                    it->second(connected_count() > 0);
+                    connect_waiters_.erase(it);
+                }
+            });
+        }, token);
+    }
+    
+    // Like send_message(), but a full send queue suspends the caller instead
+    // of blocking or dropping. Completes with false if the message could not
+    // be queued (not connected, or the connection dropped while waiting).
+    template <typename CompletionToken = boost::asio::use_awaitable_t<>>
+    auto async_send(std::string recipient, std::string intent, json payload,
+                    CompletionToken&& token = CompletionToken()) {
+        return boost::asio::async_initiate<CompletionToken, void(bool)>(
+            [this](auto handler, std::string recipient, std::string intent, json payload) {
+                UniqueFunction<void(bool)> done = bind_completion<bool>(std::move(handler), executor());
+                // A full local ring fails the send rather than suspending it
+                if (auto mailbox = local_mailbox(recipient)) {
+                    done(deliver_local(*mailbox, InboundMessage(make_envelope(recipient, intent, payload)),
+                                       BackpressurePolicy::drop_newest));
+                    return;
+                }
+                
+                std::shared_ptr<ShmChannel> channel = shm_channel(recipient);
+                RegistryConnection* connection = route(recipient);
+                bool hold = hold_offline(connection);
+                if (!connection && !hold && !channel) {
+                    log(LogLevel::warn, "Not connected to registry");
+                    done(false);
+                    return;
+                }
+                
+                OutboundFrame frame;
+                try {
+                    int64_t ts_ns = wall_clock_ns();
+                    json message = seal_if_needed(make_envelope(recipient, intent, payload, std::string(), ts_ns));
+                    if (hold || channel) {
+                        encode_envelope(message, WireEncoding::json, frame);
+                    } else {
+                        connection->encode(message, frame);
+                    }
+                    frame.expires_ns = deadline_of(intent, ts_ns);
+                } catch (const std::exception& e) {
+                    log(LogLevel::error, "Exception in async_send: " + std::string(e.what()));
+                    done(false);
+                    return;
+                }
+                // Like a local ring, a full shared memory ring fails the send
+                if (channel) {
+                    if (auto sent = send_shm(*channel, frame.data, BackpressurePolicy::drop_newest, recipient, intent)) {
+                        done(*sent);
+                        return;
+                    }
+                    if (!connection && !hold) {
+                        log(LogLevel::warn, "Not connected to registry");
+                        done(false);
+                        return;
+                    }
+                }
+                if (hold) {
+                    buffer_offline(recipient, std::move(frame.data));
+                    done(true);
+                    return;
+                }
+                connection->enqueue_or_park(std::move(frame), std::move(done), priority_of(intent));
+            },
+            token, std::move(recipient), std::move(intent), std::move(payload));
+    }
+    
+    // request() for coroutines: completes with the reply envelope, or with
+    // RequestTimeout (thrown from co_await) once timeout passes
+    template <typename CompletionToken = boost::asio::use_awaitable_t<>>
+    auto async_request(std::string recipient, std::string intent, json payload,
+                       std::chrono::milliseconds timeout = std::chrono::seconds(5),
+                       CompletionToken&& token = CompletionToken()) {
+        return boost::asio::async_initiate<CompletionToken, void(std::exception_ptr, json)>(
+            [this](auto handler, std::string recipient, std::string intent, json payload,
+                   std::chrono::milliseconds timeout) {
+                start_request(recipient, intent, payload, timeout,
+                              bind_completion<std::exception_ptr, json>(std::move(handler), executor()));
+            },
+            token, std::move(recipient), std::move(intent), std::move(payload), timeout);
+    }
+    
+    // Waits for the next message with the given intent. From the first call
+    // on, messages with that intent go to this inbox rather than to a
+    // registered handler; up to inbox_capacity of them are kept while no one
+    // is waiting. Completes with nullopt after timeout (zero waits forever)
+    // or when the client disconnects.
+    template <typename CompletionToken = boost::asio::use_awaitable_t<>>
+    auto async_next_message(std::string intent, std::chrono::milliseconds timeout = std::chrono::milliseconds::zero(),
+                            CompletionToken&& token = CompletionToken()) {
+        return boost::asio::async_initiate<CompletionToken, void(std::optional<InboundMessage>)>(
+            [this](auto handler, std::string intent, std::chrono::milliseconds timeout) {
+                auto waiter = std::make_shared<MessageWaiter>();
+                waiter->done = bind_completion<std::optional<InboundMessage>>(std::move(handler), executor());
+                
+                std::lock_guard<std::mutex> lock(inbox_mutex_);
+                auto inserted = inboxes_.try_emplace(intent);
+                if (inserted.second) {
+                    inbox_count_.fetch_add(1, std::memory_order_release);
+                    subscribe(intent);
+                }
+                Inbox& inbox = inserted.first->second;
+                if (!inbox.messages.empty()) {
+                    waiter->done(std::move(inbox.messages.front()));
+                    inbox.messages.pop_front();
+                    return;
+                }
+                if (inbox_closed_) {
+                    waiter->done(std::nullopt);
+                    return;
+                }
+                inbox.waiters.push_back(waiter);
+                
+                if (timeout.count() > 0) {
+                    waiter->timer.reset(new boost::asio::steady_timer(executor(), timeout));
+                    waiter->timer->async_wait([this, waiter, intent](const boost::system::error_code& ec) {
+                        if (ec == boost::asio::error::operation_aborted) {
+                            return;
+                        }
+                        std::lock_guard<std::mutex> lock(inbox_mutex_);
+                        if (!waiter->done) {
+                            return;
+                        }
+                        auto& waiters = inboxes_[intent].waiters;
+                        waiters.erase(std::remove(waiters.begin(), waiters.end(), waiter), waiters.end());
+                        waiter->done(std::nullopt);
+                        waiter->done = {};
+                    });
+                }
+            },
+            token, std::move(intent), timeout);
+    }
+    
+    // Send a message whose payload is already serialized JSON, such as a
+    // received InboundMessage::payload_raw(). On the JSON encoding the payload
+    // is spliced into the envelope without being parsed, using a per-thread buffer.
+    bool send_raw(std::string_view recipient, std::string_view intent, std::string_view payload_json) {
+        int64_t ttl_ns = ttl_of(intent);
+        if (auto mailbox = local_mailbox(recipient)) {
+            // The envelope is scanned like a received frame; the payload stays unparsed
+            std::string envelope;
+            write_raw_envelope(envelope, next_message_id().view(), entity_id_, recipient, intent,
+                               payload_json, wall_clock_ns(), ttl_ns);
+            return deliver_local(*mailbox, InboundMessage(std::move(envelope)), options_.backpressure);
+        }
+        
+        std::shared_ptr<ShmChannel> channel = shm_channel(recipient);
+        RegistryConnection* connection = route(recipient);
+        bool hold = hold_offline(connection);
+        if (!connection && !hold && !channel) {
+            log(LogLevel::warn, "Not connected to registry");
+            return false;
+        }
+        
+        try {
+            thread_local OutboundFrame scratch;
+            // Held messages and shared memory rings take JSON text whatever the wire encoding
+            WireEncoding encoding = hold || channel ? WireEncoding::json : connection->encoding();
+            MessageId id = next_message_id();
+            int64_t ts_ns = wall_clock_ns();
+            if (should_encrypt(recipient)) {
+                // The plaintext is the envelope text itself, so the payload is still never parsed
+                write_raw_envelope(scratch.data, id.view(), entity_id_, recipient, intent, payload_json, ts_ns, ttl_ns);
+                json sealed = crypto_.encrypt_envelope(scratch.data, entity_id_, std::string(recipient), id.str(),
+                                                       to_timestamp(ts_ns));
+                encode_envelope(sealed, encoding, scratch);
+            } else if (encoding == WireEncoding::json) {
+                write_raw_envelope(scratch.data, id.view(), entity_id_, recipient, intent, payload_json, ts_ns, ttl_ns);
+                scratch.opcode = websocketpp::frame::opcode::text;
+                scratch.encoding = WireEncoding::json;
+                scratch.coalescible = true;
+            } else {
+                // Binary encodings need the payload as a value
+                json message = {
+                    {"id", id.str()},
+                    {"sender", entity_id_},
+                    {"recipient", recipient},
+                    {"intent", intent},
+                    {"payload", json::parse(payload_json)},
+                    {"timestamp", to_timestamp(ts_ns)},
+                    {"ts_ns", ts_ns}
+                };
+                set_ttl(message, ttl_ns);
+                connection->encode(message, scratch);
+            }
+            scratch.expires_ns = ttl_ns != 0 ? expiry_ns(ts_ns, ttl_ns) : 0;
+            
+            if (channel) {
+                if (auto sent = send_shm(*channel, scratch.data, options_.backpressure, recipient, intent)) {
+                    release_if_oversized(scratch.data);
+                    return *sent;
+                }
+                if (!connection && !hold) {
+                    log(LogLevel::warn, "Not connected to registry");
+                    return false;
+                }
+            }
+            
+            if (hold) {
+                buffer_offline(recipient, scratch.data);
+                return true;
+            }
+            
+            bool queued = enqueue_message_frame(*connection, scratch, recipient, intent, options_.backpressure,
+                                                priority_of(intent));
+            release_if_oversized(scratch.data);
+            if (!queued) {
+                log(LogLevel::warn, "Send queue full, dropped message to " + std::string(recipient) + " with intent " + std::string(intent));
+                return false;
+            }
+            
+            if (log_enabled(LogLevel::debug)) {
+                log(LogLevel::debug, "Queued message to " + std::string(recipient) + " with intent " + std::string(intent));
+            }
+            return true;
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Exception in send_raw: " + std::string(e.what()));
+            return false;
+        }
+    }
+    
+    // Send one message to many recipients, serializing the payload once. A
+    // registry that fans out (its registration_ack says "fanout": true)
+    // gets a single envelope listing them all. Otherwise each recipient's
+    // envelope goes on its usual connection, all of them sharing one
+    // encoded copy of the payload (see SharedPayload). Local and same-host
+    // peers are reached directly either way, and recipients whose
+    // messages would be encrypted get an envelope sealed for them. True if
+    // every recipient's message was queued.
+    bool multicast(std::span<const std::string> recipients, const std::string& intent, const json& payload) {
+        if (recipients.empty()) {
+            return true;
+        }
+        try {
+            return send_shared(recipients, false, intent, payload);
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Exception in multicast: " + std::string(e.what()));
+            return false;
+        }
+    }
+    
+    // Send a message to every other entity of the registry (recipient "*").
+    // Without registry fan-out the recipients come from the local directory
+    // (UAP_ClientOptions::discovery), so until it has arrived this fails.
+    bool broadcast(const std::string& intent, const json& payload) {
+        try {
+            return send_shared({}, true, intent, payload);
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Exception in broadcast: " + std::string(e.what()));
+            return false;
+        }
+    }
+    
+    // Key material for encrypted messages (see UAP_ClientOptions::encrypt_messages)
+    MessageCrypto& crypto() {
+        return crypto_;
+    }
+    
+    // Send several messages as a single batch frame. A pooled client sends one
+    // batch per connection so every recipient keeps to its usual connection.
+    bool send_batch(std::span<const OutgoingMessage> messages) {
+        if (messages.empty()) {
+            return true;
+        }
+        
+        try {
+            std::vector<json> envelopes(connections_.size(), json::array());
+            // Each batch goes in the lane of its most urgent message
+            std::vector<MessagePriority> priorities(connections_.size(), MessagePriority::bulk);
+            // A batch frame expires with its last message to expire; never, if one has no ttl
+            std::vector<std::optional<int64_t>> ttls(connections_.size());
+            int64_t ts_ns = wall_clock_ns();
+            bool all_queued = true;
+            for (const OutgoingMessage& message : messages) {
+                // Local recipients get their messages one by one, in order
+                if (auto mailbox = local_mailbox(message.recipient)) {
+                    if (!deliver_local(*mailbox, InboundMessage(make_envelope(message.recipient, message.intent,
+                                                                              message.payload)),
+                                       options_.backpressure)) {
+                        all_queued = false;
+                    }
+                    continue;
+                }
+                
+                std::shared_ptr<ShmChannel> channel = shm_channel(message.recipient);
+                RegistryConnection* connection = route(message.recipient);
+                bool hold = hold_offline(connection);
+                if (!connection && !hold && !channel) {
+                    log(LogLevel::warn, "Not connected to registry");
+                    return false;
+                }
+                int64_t ttl_ns = ttl_of(message.intent);
+                json envelope = {
+                    {"id", next_message_id().str()},
+                    {"sender", entity_id_},
+                    {"recipient", message.recipient},
+                    {"intent", message.intent},
+                    {"payload", message.payload},
+                    {"timestamp", to_timestamp(ts_ns)},
+                    {"ts_ns", ts_ns}
+                };
+                set_ttl(envelope, ttl_ns);
+                envelope = seal_if_needed(std::move(envelope));
+                // Same-host peers get their messages one by one on the ring
+                if (channel) {
+                    if (auto sent = send_shm(*channel, envelope.dump(), options_.backpressure,
+                                             message.recipient, message.intent)) {
+                        all_queued = all_queued && *sent;
+                        continue;
+                    }
+                    if (!connection && !hold) {
+                        log(LogLevel::warn, "Not connected to registry");
+                        return false;
+                    }
+                }
+                // Held messages are replayed one by one rather than as a batch
+                if (hold) {
+                    buffer_offline(message.recipient, envelope.dump());
+                } else {
+                    size_t index = connection->index();
+                    envelopes[index].push_back(std::move(envelope));
+                    priorities[index] = std::min(priorities[index], priority_of(message.intent));
+                    if (!ttls[index]) {
+                        ttls[index] = ttl_ns;
+                    } else if (*ttls[index] != 0) {
+                        ttls[index] = ttl_ns == 0 ? 0 : std::max(*ttls[index], ttl_ns);
+                    }
+                }
+            }
+            
+            for (size_t i = 0; i < connections_.size(); ++i) {
+                size_t count = envelopes[i].size();
+                if (count == 0) {
+                    continue;
+                }
+                json batch = {
+                    {"type", "batch"},
+                    {"messages", std::move(envelopes[i])}
+                };
+                
+                thread_local OutboundFrame scratch;
+                connections_[i]->encode(batch, scratch);
+                scratch.coalescible = false;
+                scratch.expires_ns = *ttls[i] != 0 ? expiry_ns(ts_ns, *ttls[i]) : 0;
+                bool queued = connections_[i]->enqueue_frame(scratch, options_.backpressure, priorities[i]);
+                release_if_oversized(scratch.data);
+                if (!queued) {
+                    log(LogLevel::warn, "Send queue full, dropped batch of " + std::to_string(count) + " messages");
+                    all_queued = false;
+                    continue;
+                }
+                
+                if (log_enabled(LogLevel::debug)) {
+                    log(LogLevel::debug, "Queued batch of " + std::to_string(count) + " messages");
+                }
+            }
+            return all_queued;
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Exception in send_batch: " + std::string(e.what()));
+            return false;
+        }
+    }
+    
+    // Send a message without ever blocking; returns false if the queue is full
+    bool try_send(const std::string& recipient, const std::string& intent, const json& payload) {
+        return enqueue_message(recipient, intent, payload, BackpressurePolicy::drop_newest);
+    }
+    
+    // Number of frames waiting for the writers
+    size_t queued_count() const {
+        size_t total = 0;
+        for (const auto& connection : connections_) {
+            total += connection->queued_count();
+        }
+        return total;
+    }
+    
+    // Number of frames discarded by backpressure or lost to a failed write
+    size_t dropped_count() const {
+        size_t total = 0;
+        for (const auto& connection : connections_) {
+            total += connection->dropped_count();
+        }
+        return total;
+    }
+    
+    // Snapshot of counters and latency histograms; cheap enough to poll
+    ClientStats stats() const {
+        ClientStats stats;
+        metrics_.fill(stats);
+        stats.queued = queued_count();
+        stats.dropped = dropped_count();
+        for (const auto& connection : connections_) {
+            for (size_t lane = 0; lane < kPriorityCount; ++lane) {
+                stats.lane_queued[lane] += connection->queued_count(MessagePriority(lane));
+                stats.lane_dropped[lane] += connection->dropped_count(MessagePriority(lane));
+            }
+        }
+        stats.log_dropped = Logger::instance().dropped_count();
+        if (local_mailbox_) {
+            stats.local_dropped = local_mailbox_->dropped_count();
+        }
+        stats.shm_peers = shm_peer_count_.load(std::memory_order_relaxed);
+        for (const auto& connection : connections_) {
+            stats.reconnects += connection->reconnect_count();
+            stats.tls_resumptions += connection->tls_resumption_count();
+        }
+        if (offline_) {
+            std::lock_guard<std::mutex> lock(offline_mutex_);
+            stats.offline_buffered = offline_->size();
+            stats.offline_dropped = offline_->dropped_count();
+        }
+        if (capture_) {
+            stats.captured_frames = capture_->records();
+            stats.capture_dropped = capture_->dropped();
+        }
+        // The connection with the tightest round trip gives the best estimate
+        for (const auto& connection : connections_) {
+            auto offset = connection->clock_offset_ns();
+            if (offset && (!stats.registry_clock_offset_ns || connection->clock_rtt_ns() < stats.registry_clock_rtt_ns)) {
+                stats.registry_clock_offset_ns = offset;
+                stats.registry_clock_rtt_ns = connection->clock_rtt_ns();
+            }
+        }
+        return stats;
+    }
+    
+    // stats() in the Prometheus text exposition format
+    std::string prometheus_text() const {
+        return ::prometheus_text(stats(), entity_id_);
+    }
+    
+    // Register a message handler for a specific intent.
+    // With a dispatch pool configured, handlers run on the pool unless run_inline
+    // marks them as cheap enough to run directly on the I/O thread.
+    void register_message_handler(const std::string& intent, 
+                                 std::function<void(const json&)> handler,
+                                 bool run_inline = false) {
+        add_handler(intent, intent_hash(intent), wrap_json_handler(std::move(handler)), run_inline);
+    }
+    
+    // Same as above for an intent whose hash was computed at compile time
+    void register_message_handler(const StaticIntent& intent,
+                                 std::function<void(const json&)> handler,
+                                 bool run_inline = false) {
+        add_handler(intent.name, intent.hash, wrap_json_handler(std::move(handler)), run_inline);
+    }
+    
+    // Register a handler that receives the lazily parsed message; the payload is
+    // only parsed if the handler calls payload() or document()
+    void register_message_handler(const std::string& intent,
+                                 std::function<void(const InboundMessage&)> handler,
+                                 bool run_inline = false) {
+        add_handler(intent, intent_hash(intent), std::move(handler), run_inline);
+    }
+    
+    void register_message_handler(const StaticIntent& intent,
+                                 std::function<void(const InboundMessage&)> handler,
+                                 bool run_inline = false) {
+        add_handler(intent.name, intent.hash, std::move(handler), run_inline);
+    }
+    
+    // Remove the handler for an intent, and unsubscribe from it unless an
+    // async_next_message inbox still wants it. Safe at any time; a handler
+    // already running, or already handed to the dispatch pool, still finishes.
+    bool unregister_message_handler(const std::string& intent) {
+        if (!message_handlers_.update([&](HandlerTable& table) { return table.erase(intent); })) {
+            return false;
+        }
+        log("Unregistered handler for intent: " + intent);
+        
+        bool has_inbox;
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex_);
+            has_inbox = inboxes_.count(intent) > 0;
+        }
+        if (!has_inbox && !has_stream_handler(intent)) {
+            unsubscribe(intent);
+        }
+        return true;
+    }
+    
+    // Replace the capabilities (and metadata) this client advertises in the
+    // registry's directory. Goes out on every connection and with every
+    // later registration; false if a connection could not queue it.
+    bool register_capabilities(std::vector<std::string> capabilities, json metadata = json::object()) {
+        profile_.set(std::move(capabilities), std::move(metadata));
+        if (!started_) {
+            return true;
+        }
+        json update = {{"type", "capabilities"}};
+        profile_.add_to(update);
+        bool queued = true;
+        for (auto& connection : connections_) {
+            OutboundFrame frame;
+            encode_envelope(update, connection->encoding(), frame);
+            frame.coalescible = false;
+            if (!connection->enqueue_frame(frame, BackpressurePolicy::block, MessagePriority::control)) {
+                log(LogLevel::warn, "Could not send capabilities update");
+                queued = false;
+            }
+        }
+        return queued;
+    }
+    
+    // The registry's directory as last pushed to this client, with discovery
+    // on (empty and not synced() otherwise). Lookups on a snapshot never
+    // leave the process; a planner can hold one across a whole pass and
+    // call directory() again for later changes.
+    std::shared_ptr<const EntityDirectory> directory() const {
+        return directory_.load();
+    }
+    
+    // Ids of the entities with all of capabilities and, if entity_type is
+    // given, of that type, from the local directory
+    std::vector<std::string> find_entities(const std::vector<std::string>& capabilities,
+                                           std::string_view entity_type = {}) const {
+        return directory()->find_entities(capabilities, entity_type);
+    }
+    
+    // Opens a stream of raw bytes to recipient, for payloads too large to
+    // send as one message (camera frames, model files). header is handed to
+    // the receiver's stream handler for intent before any data. The writer is
+    // empty (false) if the stream could not be opened: not connected, or the
+    // recipient's messages would be encrypted, which streams do not support.
+    StreamWriter open_stream(const std::string& recipient, const std::string& intent,
+                             const json& header = json::object()) {
+        if (recipient == "*") {
+            log(LogLevel::error, "Streams cannot be broadcast");
+            return StreamWriter();
+        }
+        if (should_encrypt(recipient)) {
+            log(LogLevel::error, "Streams are not encrypted; not opening one to " + recipient);
+            return StreamWriter();
+        }
+        
+        auto state = std::make_shared<OutboundStream>();
+        state->id = next_message_id().str();
+        state->recipient = recipient;
+        state->intent = intent;
+        {
+            std::lock_guard<std::mutex> lock(streams_mutex_);
+            outbound_streams_[state->id] = state;
+        }
+        
+        // The opening frame carries the header and the window
+        json frame = stream_envelope(*state);
+        frame["payload"] = header;
+        frame["window"] = stream_window();
+        if (!send_stream_frame(recipient, frame, {}, BackpressurePolicy::block)) {
+            forget_outbound_stream(state->id);
+            log(LogLevel::warn, "Could not open stream to " + recipient + " with intent " + intent);
+            return StreamWriter();
+        }
+        state->next_seq = 1;
+        log("Opened stream " + state->id + " to " + recipient + " with intent " + intent);
+        return StreamWriter(this, std::move(state));
+    }
+    
+    // Register the handler for streams with an intent; it runs on the thread
+    // that read each chunk, so slow consumers should hand data off. Replaces
+    // any earlier stream handler for the intent.
+    void register_stream_handler(const std::string& intent, StreamHandler handler) {
+        {
+            std::unique_lock<std::shared_mutex> lock(stream_handlers_mutex_);
+            stream_handlers_[intent] = std::move(handler);
+        }
+        log("Registered stream handler for intent: " + intent);
+        subscribe(intent);
+    }
+    
+    bool unregister_stream_handler(const std::string& intent) {
+        {
+            std::unique_lock<std::shared_mutex> lock(stream_handlers_mutex_);
+            auto it = stream_handlers_.find(intent);
+            if (it == stream_handlers_.end()) {
+                return false;
+            }
+            stream_handlers_.erase(it);
+        }
+        log("Unregistered stream handler for intent: " + intent);
+        
+        bool has_inbox;
+        {
+            std::lock_guard<std::mutex> lock(inbox_mutex_);
+            has_inbox = inboxes_.count(intent) > 0;
+        }
+        if (!has_inbox && !message_handlers_.load()->find(intent)) {
+            unsubscribe(intent);
+        }
+        return true;
+    }
+    
+    // Run the client (blocking)
+    void run() {
+        // This is a no-op since we already started the client threads in connect()
+        // Just wait for the client to be stopped
+        for (auto& connection : connections_) {
+            connection->join();
+        }
+    }
+    
+private:
+    using Handler = std::function<void(const InboundMessage&)>;
+    
+    static Handler wrap_json_handler(std::function<void(const json&)> handler) {
+        return [handler = std::move(handler)](const InboundMessage& message) {
+            handler(message.document());
+        };
+    }
+    
+    void add_handler(std::string_view intent, uint64_t hash, Handler handler, bool run_inline) {
+        HandlerEntry entry{std::move(handler), run_inline, metrics_.handler_histogram(intent)};
+        message_handlers_.update([&](HandlerTable& table) {
+            table.insert_or_assign(intent, hash, std::move(entry));
+            return true;
+        });
+        log("Registered handler for intent: " + std::string(intent));
+        subscribe(intent);
+    }
+    
+    void subscribe(std::string_view intent) {
+        if (options_.filter_intents && subscriptions_.add(intent)) {
+            send_subscription_update("subscribe", intent);
+        }
+    }
+    
+    void unsubscribe(std::string_view intent) {
+        if (options_.filter_intents && subscriptions_.remove(intent)) {
+            send_subscription_update("unsubscribe", intent);
+        }
+    }
+    
+    // Queued on every connection, connected or not: one that is still
+    // opening sends it right after its registration, and one that comes
+    // back later re-registers with the full set anyway. Before connect()
+    // there is nothing to update; the first registration carries the set.
+    void send_subscription_update(const char* type, std::string_view intent) {
+        if (!started_) {
+            return;
+        }
+        json update = {
+            {"type", type},
+            {"intents", json::array({intent})}
+        };
+        for (auto& connection : connections_) {
+            OutboundFrame frame;
+            encode_envelope(update, connection->encoding(), frame);
+            frame.coalescible = false;
+            if (!connection->enqueue_frame(frame, BackpressurePolicy::block, MessagePriority::control)) {
+                log(LogLevel::warn, std::string("Could not send ") + type + " for intent " + std::string(intent));
+            }
+        }
+    }
+    
+    size_t connected_count() const {
+        size_t count = 0;
+        for (const auto& connection : connections_) {
+            count += connection->connected() ? 1 : 0;
+        }
+        return count;
+    }
+    
+    // Picks the connection for a recipient: its hash shard while that is up,
+    // otherwise the next live connection. nullptr when none are connected.
+    RegistryConnection* route(std::string_view recipient) {
+        size_t count = connections_.size();
+        size_t shard = count == 1 ? 0 : std::hash<std::string_view>()(recipient) % count;
+        for (size_t i = 0; i < count; ++i) {
+            RegistryConnection* connection = connections_[(shard + i) % count].get();
+            if (connection->connected()) {
+                return connection;
+            }
+        }
+        return nullptr;
+    }
+    
+    // Every envelope gets an id, freshly generated unless the caller has one
+    json make_envelope(const std::string& recipient, const std::string& intent,
+                       const json& payload, const std::string& id = std::string(),
+                       int64_t ts_ns = wall_clock_ns()) const {
+        json envelope = {
+            {"id", id.empty() ? next_message_id().str() : id},
+            {"sender", entity_id_},
+            {"recipient", recipient},
+            {"intent", intent},
+            {"payload", payload},
+            {"timestamp", to_timestamp(ts_ns)},
+            {"ts_ns", ts_ns}
+        };
+        set_ttl(envelope, ttl_of(intent));
+        return envelope;
+    }
+    
+    // TTL in ns for a message with this intent, 0 for none (see
+    // UAP_ClientOptions::intent_ttls)
+    int64_t ttl_of(std::string_view intent) const {
+        std::chrono::milliseconds ttl = options_.default_ttl;
+        if (!options_.intent_ttls.empty()) {
+            auto it = options_.intent_ttls.find(intent);
+            if (it != options_.intent_ttls.end()) {
+                ttl = it->second;
+            }
+        }
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(ttl).count();
+    }
+    
+    // OutboundFrame::expires_ns for a message sent at ts_ns
+    int64_t deadline_of(std::string_view intent, int64_t ts_ns) const {
+        int64_t ttl_ns = ttl_of(intent);
+        return ttl_ns != 0 ? expiry_ns(ts_ns, ttl_ns) : 0;
+    }
+    
+    static void set_ttl(json& envelope, int64_t ttl_ns) {
+        if (ttl_ns != 0) {
+            envelope["ttl"] = to_ttl_seconds(ttl_ns);
+        }
+    }
+    
+    // Queues a message's frame, as the latest value for its recipient if
+    // its intent is conflated (see UAP_ClientOptions::conflate_intents)
+    bool enqueue_message_frame(RegistryConnection& connection, OutboundFrame& frame, std::string_view recipient,
+                               std::string_view intent, BackpressurePolicy policy, MessagePriority priority) {
+        if (options_.conflate_intents.empty() || !options_.conflate_intents.contains(intent)) {
+            return connection.enqueue_frame(frame, policy, priority);
+        }
+        thread_local std::string key;
+        key.assign(recipient);
+        key.push_back('\0');
+        key.append(intent);
+        return connection.enqueue_latest(frame, key, policy, priority);
+    }
+    
+    // Lane for a message with this intent (see UAP_ClientOptions::intent_priorities)
+    MessagePriority priority_of(std::string_view intent) const {
+        if (options_.intent_priorities.empty()) {
+            return MessagePriority::normal;
+        }
+        auto it = options_.intent_priorities.find(intent);
+        return it == options_.intent_priorities.end() ? MessagePriority::normal : it->second;
+    }
+    
+    bool enqueue_message(const std::string& recipient, const std::string& intent,
+                         const json& payload, BackpressurePolicy policy,
+                         const std::string& id = std::string(),
+                         std::optional<MessagePriority> priority = std::nullopt) {
+        if (auto mailbox = local_mailbox(recipient)) {
+            return deliver_local(*mailbox, InboundMessage(make_envelope(recipient, intent, payload, id)), policy);
+        }
+        
+        std::shared_ptr<ShmChannel> channel = shm_channel(recipient);
+        RegistryConnection* connection = route(recipient);
+        bool hold = hold_offline(connection);
+        if (!connection && !hold && !channel) {
+            log(LogLevel::warn, "Not connected to registry");
+            return false;
+        }
+        
+        try {
+            // Create message
+            int64_t ts_ns = wall_clock_ns();
+            json message = seal_if_needed(make_envelope(recipient, intent, payload, id, ts_ns));
+            if (channel) {
+                if (auto sent = send_shm(*channel, message.dump(), policy, recipient, intent)) {
+                    return *sent;
+                }
+                if (!connection && !hold) {
+                    log(LogLevel::warn, "Not connected to registry");
+                    return false;
+                }
+            }
+            if (hold) {
+                buffer_offline(recipient, message.dump());
+                return true;
+            }
+            
+            thread_local OutboundFrame scratch;
+            connection->encode(message, scratch);
+            scratch.expires_ns = deadline_of(intent, ts_ns);
+            // Requests are never conflated away, or their replies would never come
+            bool queued = id.empty()
+                ? enqueue_message_frame(*connection, scratch, recipient, intent, policy,
+                                        priority.value_or(priority_of(intent)))
+                : connection->enqueue_frame(scratch, policy, priority.value_or(priority_of(intent)));
+            release_if_oversized(scratch.data);
+            if (!queued) {
+                log(LogLevel::warn, "Send queue full, dropped message to " + recipient + " with intent " + intent);
+                return false;
+            }
+            
+            if (log_enabled(LogLevel::debug)) {
+                log(LogLevel::debug, "Queued message to " + recipient + " with intent " + intent);
+            }
+            return true;
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Exception in send_message: " + std::string(e.what()));
+            return false;
+        }
+    }
+    
+    // Envelope members other than the payload, which SharedPayload supplies
+    json envelope_head(std::string_view recipient, const std::string& intent, int64_t ts_ns) const {
+        json head = {
+            {"id", next_message_id().str()},
+            {"sender", entity_id_},
+            {"recipient", recipient},
+            {"intent", intent},
+            {"timestamp", to_timestamp(ts_ns)},
+            {"ts_ns", ts_ns}
+        };
+        set_ttl(head, ttl_of(intent));
+        return head;
+    }
+    
+    // multicast() and broadcast(). The registry's fan-out envelope goes on
+    // the connection "*" routes to, so it may overtake messages to some of
+    // the recipients still queued on their own connections.
+    bool send_shared(std::span<const std::string> recipients, bool everyone, const std::string& intent,
+                     const json& payload) {
+        SharedPayload shared(payload);
+        MessagePriority priority = priority_of(intent);
+        int64_t ts_ns = wall_clock_ns();
+        int64_t expires_ns = deadline_of(intent, ts_ns);
+        RegistryConnection* fanout = route("*");
+        if (fanout && !fanout->fanout()) {
+            fanout = nullptr;
+        }
+        metrics_.multicasts.add();
+        
+        if (everyone && fanout) {
+            return enqueue_shared(*fanout, envelope_head("*", intent, ts_ns), shared, priority, expires_ns);
+        }
+        std::vector<std::string> directory_entities;
+        if (everyone) {
+            auto directory = directory_.load();
+            if (!directory->synced()) {
+                log(LogLevel::error, "Cannot broadcast: the registry does not fan out and no directory has arrived");
+                return false;
+            }
+            directory_entities = directory->find_entities({});
+            std::erase(directory_entities, entity_id_);
+            recipients = directory_entities;
+        }
+        
+        bool all_queued = true;
+        std::vector<std::string_view> remote;
+        for (const std::string& recipient : recipients) {
+            if (auto mailbox = local_mailbox(recipient)) {
+                all_queued &= deliver_local(*mailbox, InboundMessage(shared.json_envelope(envelope_head(recipient, intent, ts_ns))),
+                                            options_.backpressure);
+            } else if (should_encrypt(recipient)) {
+                all_queued &= enqueue_message(recipient, intent, payload, options_.backpressure);
+            } else if (std::shared_ptr<ShmChannel> channel = shm_channel(recipient)) {
+                std::string envelope = shared.json_envelope(envelope_head(recipient, intent, ts_ns));
+                if (auto sent = send_shm(*channel, envelope, options_.backpressure, recipient, intent)) {
+                    all_queued &= *sent;
+                } else {
+                    remote.push_back(recipient);
+                }
+            } else {
+                remote.push_back(recipient);
+            }
+        }
+        if (remote.empty()) {
+            return all_queued;
+        }
+        
+        if (fanout) {
+            json head = envelope_head("*", intent, ts_ns);
+            head["recipients"] = remote;
+            return enqueue_shared(*fanout, std::move(head), shared, priority, expires_ns) && all_queued;
+        }
+        
+        metrics_.multicast_envelopes.add(remote.size());
+        for (std::string_view recipient : remote) {
+            RegistryConnection* connection = route(recipient);
+            if (hold_offline(connection)) {
+                buffer_offline(recipient, shared.json_envelope(envelope_head(recipient, intent, ts_ns)));
+            } else if (!connection) {
+                log(LogLevel::warn, "Not connected to registry");
+                return false;
+            } else {
+                all_queued &= enqueue_shared(*connection, envelope_head(recipient, intent, ts_ns), shared, priority,
+                                             expires_ns);
+            }
+        }
+        return all_queued;
+    }
+    
+    // Queues an envelope head with the shared payload as its tail
+    bool enqueue_shared(RegistryConnection& connection, json head, SharedPayload& shared, MessagePriority priority,
+                        int64_t expires_ns) {
+        thread_local OutboundFrame scratch;
+        connection.encode(head, scratch);
+        reopen_envelope(scratch.data, scratch.encoding);
+        scratch.tail = shared.tail(scratch.encoding);
+        scratch.expires_ns = expires_ns;
+        bool queued = connection.enqueue_frame(scratch, options_.backpressure, priority);
+        scratch.tail.reset();
+        release_if_oversized(scratch.data);
+        if (!queued) {
+            log(LogLevel::warn, "Send queue full, dropped multicast to " + head.value("recipient", std::string()) +
+                " with intent " + head.value("intent", std::string()));
+        }
+        return queued;
+    }
+    
+    // Mailbox of recipient if it is attached to our LocalRouter; null otherwise,
+    // including while we are not connected ourselves
+    std::shared_ptr<LocalRouter::Mailbox> local_mailbox(std::string_view recipient) const {
+        if (!local_mailbox_ || !started_.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return options_.local_router->find(recipient);
+    }
+    
+    bool deliver_local(LocalRouter::Mailbox& mailbox, InboundMessage&& message, BackpressurePolicy policy) {
+        try {
+            message.set_received_ns(monotonic_ns());
+            LocalRouter::Delivery delivery(new InboundMessage(std::move(message)));
+            if (!mailbox.push(delivery, policy)) {
+                log(LogLevel::warn, "Local queue full, dropped message to " + std::string(delivery->recipient()) +
+                    " with intent " + std::string(delivery->intent()));
+                return false;
+            }
+            metrics_.local_sent.add();
+            return true;
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Exception in local send: " + std::string(e.what()));
+            return false;
+        }
+    }
+    
+    void attach_local() {
+        if (!local_mailbox_) {
+            return;
+        }
+        if (!options_.local_router->attach(entity_id_, local_mailbox_)) {
+            log(LogLevel::warn, "Another client is attached to the local router as " + entity_id_ +
+                "; its messages go through the registry");
+            return;
+        }
+        local_mailbox_->set_open(true);
+    }
+    
+    // After this no sender can reach us locally and our mailbox never wakes us
+    void detach_local() {
+        if (!local_mailbox_) {
+            return;
+        }
+        options_.local_router->detach(entity_id_, local_mailbox_.get());
+        local_mailbox_->set_open(false);
+    }
+    
+    // Runs on executor(), the first connection's I/O thread, so local
+    // messages read handler slot 0 just like that connection's frames
+    void drain_local() {
+        LocalRouter::Delivery message;
+        size_t handled = 0;
+        do {
+            while (local_mailbox_->try_pop(message)) {
+                try {
+                    dispatch(std::move(*message), 0);
+                } catch (const std::exception& e) {
+                    log(LogLevel::error, "Error handling local message: " + std::string(e.what()));
+                }
+                message.reset();
+                // Let the connection's own I/O run between long bursts
+                if (++handled == kLocalDrainBurst) {
+                    boost::asio::post(executor(), [this]() { drain_local(); });
+                    return;
+                }
+            }
+        } while (local_mailbox_->finish_drain());
+    }
+    
+    // Channel to recipient if it is a same-host peer whose channel is up
+    std::shared_ptr<ShmChannel> shm_channel(std::string_view recipient) const {
+        if (shm_peer_count_.load(std::memory_order_acquire) == 0 || !started_.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        std::shared_lock<std::shared_mutex> lock(shm_mutex_);
+        auto it = shm_peers_.find(recipient);
+        if (it == shm_peers_.end() || !it->second.channel->ready()) {
+            return nullptr;
+        }
+        return it->second.channel;
+    }
+    
+    // Writes an envelope to a same-host peer's ring. nullopt if the ring
+    // cannot carry it and the registry should; otherwise whether it was sent.
+    std::optional<bool> send_shm(ShmChannel& channel, std::string_view envelope, BackpressurePolicy policy,
+                                 std::string_view recipient, std::string_view intent) {
+        switch (channel.write(envelope, false, policy)) {
+            case ShmWrite::written:
+                metrics_.shm_sent.add();
+                if (log_enabled(LogLevel::debug)) {
+                    log(LogLevel::debug, "Wrote message to " + std::string(recipient) + " with intent " +
+                        std::string(intent) + " to shared memory");
+                }
+                return true;
+            case ShmWrite::full:
+                metrics_.shm_dropped.add();
+                log(LogLevel::warn, "Shared memory ring full, dropped message to " + std::string(recipient) +
+                    " with intent " + std::string(intent));
+                return false;
+            default:
+                return std::nullopt;
+        }
+    }
+    
+    // A snapshot or delta of the registry's directory. A lost delta is
+    // answered on the connection that noticed, which the registry replies to
+    // with a fresh snapshot.
+    void on_directory_frame(const json& frame, size_t reader) {
+        if (!options_.discovery || !directory_.apply(frame) || reader >= connections_.size()) {
+            return;
+        }
+        RegistryConnection& connection = *connections_[reader];
+        OutboundFrame request;
+        encode_envelope(json{{"type", "directory_sync"}}, connection.encoding(), request);
+        request.coalescible = false;
+        if (!connection.try_enqueue_frame(request, MessagePriority::control)) {
+            directory_.sync_not_sent();
+        }
+    }
+    
+    // transport_offer and transport_close frames from the registry, which
+    // pairs us with every peer that registered our host id
+    void on_transport_frame(const json& frame) {
+        if (!options_.shm_transport || frame.value("transport", std::string()) != "shm") {
+            return;
+        }
+        std::string peer = frame.value("peer", std::string());
+        if (frame.value("type", std::string()) == "transport_close") {
+            close_shm_channel(peer);
+            return;
+        }
+        
+        // A POSIX shared memory name: one leading slash and no other
+        std::string segment = frame.value("segment", std::string());
+        if (peer.empty() || segment.size() < 2 || segment.size() > 255 || segment[0] != '/' ||
+            segment.find('/', 1) != std::string::npos) {
+            log(LogLevel::warn, "Ignoring malformed shared memory offer for " + peer);
+            return;
+        }
+        open_shm_channel(peer, segment, frame.value("initiator", false));
+    }
+    
+    void open_shm_channel(const std::string& peer, const std::string& segment, bool initiator) {
+        std::shared_ptr<ShmChannel> replaced;
+        std::shared_ptr<ShmChannel> channel;
+        {
+            std::unique_lock<std::shared_mutex> lock(shm_mutex_);
+            size_t slot = 0;
+            auto it = shm_peers_.find(peer);
+            if (it != shm_peers_.end()) {
+                // Every pooled connection gets the offer; the first one wins
+                if (it->second.channel->name() == segment && !it->second.channel->finished()) {
+                    return;
+                }
+                replaced = std::move(it->second.channel);
+                slot = it->second.slot;
+            } else {
+                std::array<bool, kMaxShmChannels> used{};
+                for (const auto& [name, entry] : shm_peers_) {
+                    used[entry.slot] = true;
+                }
+                auto free = std::find(used.begin(), used.end(), false);
+                if (free == used.end()) {
+                    log(LogLevel::warn, "Too many shared memory peers; messages to " + peer +
+                        " go through the registry");
+                    return;
+                }
+                slot = free - used.begin();
+            }
+            size_t reader = std::max<size_t>(options_.pool_size, 1) + slot;
+            channel = std::make_shared<ShmChannel>(segment, initiator, options_.shm_ring_bytes, shm_receiver(reader));
+            shm_peers_[peer] = ShmPeer{channel, slot};
+            shm_peer_count_.store(shm_peers_.size(), std::memory_order_release);
+        }
+        // The old reader uses the same handler slot, so it stops first
+        if (replaced) {
+            replaced->close();
+        }
+        channel->start();
+        log("Opening shared memory channel to " + peer);
+    }
+    
+    void close_shm_channel(const std::string& peer) {
+        std::shared_ptr<ShmChannel> channel;
+        {
+            std::unique_lock<std::shared_mutex> lock(shm_mutex_);
+            auto it = shm_peers_.find(peer);
+            if (it == shm_peers_.end()) {
+                return;
+            }
+            channel = std::move(it->second.channel);
+            shm_peers_.erase(it);
+            shm_peer_count_.store(shm_peers_.size(), std::memory_order_release);
+        }
+        channel->close();
+        log("Closed shared memory channel to " + peer);
+    }
+    
+    void close_shm_channels() {
+        std::map<std::string, ShmPeer, std::less<>> peers;
+        {
+            std::unique_lock<std::shared_mutex> lock(shm_mutex_);
+            peers.swap(shm_peers_);
+            shm_peer_count_.store(0, std::memory_order_release);
+        }
+        for (auto& [peer, entry] : peers) {
+            entry.channel->close();
+        }
+    }
+    
+    // Runs on a channel's reader thread, which has its own handler table
+    // slot and, like a connection, its own arena
+    ShmChannel::FrameCallback shm_receiver(size_t reader) {
+        std::shared_ptr<MessageArena> arena;
+        if (options_.inbound_arena_bytes > 0) {
+            arena = std::make_shared<MessageArena>(options_.inbound_arena_bytes);
+        }
+        return [this, reader, arena](std::string&& frame, bool binary) {
+            metrics_.shm_received.add();
+            try {
+                std::optional<InboundMessage> message;
+                if (binary) {
+                    message.emplace(decode_binary_envelope(frame));
+                } else {
+                    message.emplace(std::move(frame), arena.get());
+                }
+                message->set_received_ns(monotonic_ns());
+                on_inbound(std::move(*message), reader);
+            } catch (const std::exception& e) {
+                log(LogLevel::error, "Error handling shared memory message: " + std::string(e.what()));
+            }
+            if (arena) {
+                arena->reset();
+            }
+        };
+    }
+    
+    bool should_encrypt(std::string_view recipient) const {
+        return options_.encrypt_messages && recipient != "*" && crypto_.has_peer(std::string(recipient));
+    }
+    
+    // Replaces message with its encrypted envelope when the recipient's key is known
+    json seal_if_needed(json message) {
+        const std::string& recipient = message["recipient"].get_ref<const std::string&>();
+        if (!should_encrypt(recipient)) {
+            return message;
+        }
+        return crypto_.encrypt_envelope(message.dump(), entity_id_, recipient,
+                                        message.value("id", json("")), message.value("timestamp", 0.0));
+    }
+    
+    // Called from every connection's I/O thread
+    void on_connection_state_change() {
+        // Taking the lock orders the connection's state change before a waiter's check
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!connect_waiters_.empty() && connected_count() == connections_.size()) {
+                for (auto& waiter : connect_waiters_) {
+                    waiter.second(true);
+                }
+                connect_waiters_.clear();
+            }
+        }
+        cv_.notify_all();
+        
+        if (options_.discovery && connected_count() == 0) {
+            directory_.desync();
+        }
+        if (offline_pending_.load(std::memory_order_acquire) > 0 && connected_count() > 0) {
+            schedule_replay();
+        }
+    }
+    
+    // A message waits in the offline buffer when no connection is up, or
+    // when earlier messages are still waiting there, to keep them in order
+    bool hold_offline(RegistryConnection* connection) const {
+        return offline_ && started_.load(std::memory_order_acquire) &&
+               (!connection || offline_pending_.load(std::memory_order_acquire) > 0);
+    }
+    
+    void buffer_offline(std::string_view recipient, std::string envelope) {
+        {
+            std::lock_guard<std::mutex> lock(offline_mutex_);
+            offline_->push(OfflineBuffer::Record{std::string(recipient), std::move(envelope)});
+            offline_pending_.store(offline_->size(), std::memory_order_release);
+        }
+        if (log_enabled(LogLevel::debug)) {
+            log(LogLevel::debug, "Held message to " + std::string(recipient) + " until reconnected");
+        }
+        // A connection may have come up since the caller looked
+        if (connected_count() > 0) {
+            schedule_replay();
+        }
+    }
+    
+    // Makes sure one replay pass is pending on a live connection's I/O thread
+    void schedule_replay() {
+        if (replay_scheduled_.exchange(true, std::memory_order_acq_rel)) {
+            return;
+        }
+        for (auto& connection : connections_) {
+            if (connection->connected()) {
+                boost::asio::post(connection->io_service(), [this]() { replay_offline(); });
+                return;
+            }
+        }
+        replay_scheduled_.store(false, std::memory_order_release);
+    }
+    
+    // Sends held messages oldest first, stopping when every connection is
+    // down again and backing off briefly when a send queue is full. The
+    // flag is cleared under the lock, so a message held after the last
+    // check always finds it clear and schedules the next pass.
+    void replay_offline() {
+        std::lock_guard<std::mutex> lock(offline_mutex_);
+        OfflineBuffer::Record record;
+        OutboundFrame frame;
+        size_t replayed = 0;
+        size_t expired = 0;
+        bool deadlines = options_.default_ttl.count() != 0 || !options_.intent_ttls.empty();
+        EnvelopeScanner::Result fields;
+        std::string decoded;
+        while (offline_->front(record)) {
+            RegistryConnection* connection = route(record.recipient);
+            if (!connection) {
+                break;
+            }
+            // Only our own ttl can be on a held envelope, so without one there is nothing to scan for
+            int64_t expires_ns = 0;
+            if (deadlines) {
+                fields = EnvelopeScanner::Result();
+                decoded.clear();
+                if (EnvelopeScanner::scan(record.envelope, fields, decoded)) {
+                    expires_ns = fields.expires_ns().value_or(0);
+                }
+                if (expires_ns != 0 && wall_clock_ns() > expires_ns) {
+                    metrics_.expired_outbound.add();
+                    offline_->pop();
+                    ++expired;
+                    continue;
+                }
+            }
+            try {
+                if (connection->encoding() == WireEncoding::json) {
+                    frame.data = std::move(record.envelope);
+                    frame.opcode = websocketpp::frame::opcode::text;
+                    frame.encoding = WireEncoding::json;
+                    frame.coalescible = true;
+                } else {
+                    json envelope = json::parse(record.envelope);
+                    connection->encode(envelope, frame);
+                }
+                frame.expires_ns = expires_ns;
+            } catch (const std::exception& e) {
+                log(LogLevel::error, "Dropping unreadable offline message: " + std::string(e.what()));
+                offline_->pop();
+                continue;
+            }
+            
+            if (!connection->try_enqueue_frame(frame)) {
+                offline_pending_.store(offline_->size(), std::memory_order_release);
+                auto timer = std::make_shared<boost::asio::steady_timer>(connection->io_service(),
+                                                                         std::chrono::milliseconds(5));
+                timer->async_wait([this, timer](const boost::system::error_code& ec) {
+                    if (ec != boost::asio::error::operation_aborted) {
+                        replay_offline();
+                    }
+                });
+                return;
+            }
+            offline_->pop();
+            ++replayed;
+        }
+        offline_pending_.store(offline_->size(), std::memory_order_release);
+        replay_scheduled_.store(false, std::memory_order_release);
+        
+        if (replayed > 0) {
+            log("Replayed " + std::to_string(replayed) + " messages held while offline");
+        }
+        if (expired > 0) {
+            log(LogLevel::warn, "Dropped " + std::to_string(expired) + " held messages whose ttl ran out while offline");
+        }
+    }
+    
+    // Declared with the other stream members below
+    struct InboundStreamState;
+    
+    uint64_t stream_window() const {
+        return std::max(options_.stream_window_bytes, stream_chunk_bytes());
+    }
+    
+    size_t stream_chunk_bytes() const {
+        return std::max<size_t>(options_.stream_chunk_bytes, 1);
+    }
+    
+    json stream_envelope(const OutboundStream& state) {
+        int64_t ts_ns = wall_clock_ns();
+        return {
+            {"type", "stream"},
+            {"id", next_message_id().str()},
+            {"sender", entity_id_},
+            {"recipient", state.recipient},
+            {"intent", state.intent},
+            {"stream", state.id},
+            {"seq", state.next_seq},
+            {"ts_ns", ts_ns}
+        };
+    }
+    
+    // Sends a stream or stream_credit frame the way any envelope would go:
+    // in-process, over shared memory, or through the registry. Stream frames
+    // are never held offline; a stream spanning a reconnect is lost anyway.
+    // All frames of a stream share the bulk lane so they stay in order.
+    bool send_stream_frame(const std::string& recipient, const json& envelope, std::string_view data,
+                           BackpressurePolicy policy, MessagePriority priority = MessagePriority::bulk) {
+        try {
+            if (auto mailbox = local_mailbox(recipient)) {
+                json document = envelope;
+                if (!data.empty()) {
+                    document["data"] = json::binary(std::vector<std::uint8_t>(data.begin(), data.end()));
+                }
+                return deliver_local(*mailbox, InboundMessage(std::move(document)), policy);
+            }
+            
+            thread_local OutboundFrame scratch;
+            if (auto channel = shm_channel(recipient)) {
+                encode_stream_frame(envelope, data, WireEncoding::cbor, scratch);
+                ShmWrite result = channel->write(scratch.data, true, policy);
+                if (result != ShmWrite::unavailable) {
+                    release_if_oversized(scratch.data);
+                    if (result == ShmWrite::full) {
+                        metrics_.shm_dropped.add();
+                        return false;
+                    }
+                    metrics_.shm_sent.add();
+                    return true;
+                }
+            }
+            
+            RegistryConnection* connection = route(recipient);
+            if (!connection) {
+                log(LogLevel::warn, "Not connected to registry");
+                return false;
+            }
+            encode_stream_frame(envelope, data, connection->encoding(), scratch);
+            bool queued = connection->enqueue_frame(scratch, policy, priority);
+            release_if_oversized(scratch.data);
+            return queued;
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Exception sending stream frame: " + std::string(e.what()));
+            return false;
+        }
+    }
+    
+    // StreamWriter::write: one chunk at a time, each waiting for room in the window
+    bool write_stream(OutboundStream& state, std::string_view data) {
+        size_t chunk_bytes = stream_chunk_bytes();
+        uint64_t window = stream_window();
+        while (!data.empty()) {
+            std::string_view chunk = data.substr(0, chunk_bytes);
+            std::unique_lock<std::mutex> lock(state.mutex);
+            auto has_room = [&]() { return state.finished || state.sent + chunk.size() <= state.acknowledged + window; };
+            if (!has_room()) {
+                // Acknowledgements arrive on the I/O threads, so those cannot wait for them
+                if (on_io_thread() ||
+                    !state.credit.wait_for(lock, options_.stream_credit_timeout, has_room)) {
+                    log(LogLevel::warn, "No acknowledgement from " + state.recipient + " for stream " + state.id);
+                    return false;
+                }
+            }
+            if (state.finished) {
+                return false;
+            }
+            json frame = stream_envelope(state);
+            
+            // Not held while sending: a full send queue would otherwise keep
+            // the I/O thread from applying acknowledgements
+            lock.unlock();
+            if (!send_stream_frame(state.recipient, frame, chunk, BackpressurePolicy::block)) {
+                log(LogLevel::warn, "Send queue full, stream " + state.id + " to " + state.recipient + " stalled");
+                return false;
+            }
+            lock.lock();
+            ++state.next_seq;
+            state.sent += chunk.size();
+            metrics_.stream_bytes_sent.add(chunk.size());
+            data.remove_prefix(chunk.size());
+        }
+        return true;
+    }
+    
+    // Sends the final frame of a stream: an end marker, or an abort with its reason
+    bool finish_stream(OutboundStream& state, std::optional<std::string_view> abort_reason) {
+        json frame;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.finished) {
+                return false;
+            }
+            state.finished = true;
+            frame = stream_envelope(state);
+            ++state.next_seq;
+        }
+        state.credit.notify_all();
+        forget_outbound_stream(state.id);
+        
+        if (abort_reason) {
+            frame["abort"] = std::string(*abort_reason);
+        } else {
+            frame["end"] = true;
+        }
+        return send_stream_frame(state.recipient, frame, {}, BackpressurePolicy::block);
+    }
+    
+    void forget_outbound_stream(const std::string& id) {
+        std::lock_guard<std::mutex> lock(streams_mutex_);
+        outbound_streams_.erase(id);
+    }
+    
+    // A receiver acknowledging data, or cancelling the stream
+    void on_stream_credit(const json& frame, std::string_view sender) {
+        std::string id = frame.value("stream", std::string());
+        std::shared_ptr<OutboundStream> state;
+        {
+            std::lock_guard<std::mutex> lock(streams_mutex_);
+            auto it = outbound_streams_.find(id);
+            if (it == outbound_streams_.end() || it->second->recipient != sender) {
+                return;
+            }
+            state = it->second;
+        }
+        std::string cancel = frame.value("cancel", std::string());
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->acknowledged = std::max(state->acknowledged, frame.value("received", uint64_t(0)));
+            if (!cancel.empty()) {
+                state->finished = true;
+                state->cancel_reason = cancel;
+            }
+        }
+        state->credit.notify_all();
+        if (!cancel.empty()) {
+            forget_outbound_stream(id);
+            log(LogLevel::warn, "Stream " + id + " to " + std::string(sender) + " cancelled: " + cancel);
+        }
+    }
+    
+    static std::string stream_key(std::string_view sender, std::string_view id) {
+        std::string key(sender);
+        key.push_back('\0');
+        key += id;
+        return key;
+    }
+    
+    // A chunk of a stream we are receiving. Chunks reach the handler in
+    // sequence order; any that arrive early wait in the stream's state.
+    void on_stream_frame(InboundMessage& message) {
+        const json& frame = message.document();
+        std::string id = frame.value("stream", std::string());
+        if (id.empty() || !frame.contains("seq")) {
+            throw std::runtime_error("Malformed stream frame");
+        }
+        uint64_t seq = frame.value("seq", uint64_t(0));
+        
+        std::shared_ptr<InboundStreamState> state;
+        std::vector<std::shared_ptr<InboundStreamState>> expired;
+        {
+            std::lock_guard<std::mutex> lock(inbound_streams_mutex_);
+            std::string key = stream_key(message.sender(), id);
+            auto it = inbound_streams_.find(key);
+            if (it == inbound_streams_.end()) {
+                expired = take_idle_streams();
+                auto created = std::make_shared<InboundStreamState>();
+                created->stream.id_ = id;
+                created->stream.sender_ = std::string(message.sender());
+                created->stream.intent_ = std::string(message.intent());
+                {
+                    std::shared_lock<std::shared_mutex> handlers(stream_handlers_mutex_);
+                    auto handler = stream_handlers_.find(message.intent());
+                    if (handler != stream_handlers_.end()) {
+                        created->handler = handler->second;
+                    }
+                }
+                it = inbound_streams_.emplace(std::move(key), std::move(created)).first;
+            }
+            state = it->second;
+        }
+        for (auto& idle : expired) {
+            std::lock_guard<std::mutex> lock(idle->mutex);
+            end_stream(*idle, "Timed out");
+        }
+        
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->last_activity = std::chrono::steady_clock::now();
+        if (state->finished || seq < state->next_seq) {
+            return;
+        }
+        if (!state->handler) {
+            cancel_stream(*state, "No stream handler for intent " + state->stream.intent_);
+            return;
+        }
+        if (seq > state->next_seq) {
+            if (state->early.size() >= kMaxEarlyChunks) {
+                cancel_stream(*state, "Too many chunks out of order");
+                return;
+            }
+            message.detach();
+            state->early.emplace(seq, std::move(message));
+            return;
+        }
+        
+        deliver_stream_chunk(*state, frame);
+        while (!state->finished && !state->early.empty() && state->early.begin()->first == state->next_seq) {
+            // Taken out first: the chunk may finish the stream, which clears early
+            auto next = state->early.extract(state->early.begin());
+            deliver_stream_chunk(*state, next.mapped().document());
+        }
+    }
+    
+    // Under state.mutex
+    void deliver_stream_chunk(InboundStreamState& state, const json& frame) {
+        InboundStream& stream = state.stream;
+        if (state.next_seq++ == 0) {
+            auto header = frame.find("payload");
+            if (header != frame.end()) {
+                stream.header_ = json(*header);
+            }
+            state.window = frame.value("window", uint64_t(0));
+        }
+        std::string scratch;
+        std::string_view data = stream_frame_data(frame, scratch);
+        stream.bytes_received_ += data.size();
+        metrics_.stream_bytes_received.add(data.size());
+        
+        std::string abort = frame.value("abort", std::string());
+        if (!abort.empty()) {
+            stream.aborted_ = true;
+            stream.abort_reason_ = abort;
+        }
+        stream.ended_ = frame.value("end", false);
+        
+        try {
+            state.handler(stream, data);
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Error in stream handler for " + stream.intent_ + ": " + std::string(e.what()));
+            stream.cancel("Stream handler failed");
+        }
+        
+        if (stream.ended_ || stream.aborted_) {
+            finish_inbound_stream(state);
+        } else if (!stream.cancel_reason_.empty()) {
+            cancel_stream(state, stream.cancel_reason_);
+        } else if (stream.bytes_received_ - state.acknowledged >= std::max<uint64_t>(state.window / 4, 1) &&
+                   state.window > 0) {
+            // Acknowledge a quarter window at a time so the sender never runs dry
+            state.acknowledged = stream.bytes_received_;
+            send_stream_credit(state, {});
+        }
+    }
+    
+    // Under state.mutex: tells the sender to stop, and ignores what it
+    // still sends until the stream goes idle
+    void cancel_stream(InboundStreamState& state, const std::string& reason) {
+        state.finished = true;
+        state.early.clear();
+        send_stream_credit(state, reason);
+        log(LogLevel::warn, "Cancelled stream " + state.stream.id_ + " from " + state.stream.sender_ + ": " + reason);
+    }
+    
+    void send_stream_credit(const InboundStreamState& state, const std::string& cancel) {
+        json frame = {
+            {"type", "stream_credit"},
+            {"id", next_message_id().str()},
+            {"sender", entity_id_},
+            {"recipient", state.stream.sender_},
+            // Replies get past the sender's intent subscriptions
+            {"reply_to", state.stream.id_},
+            {"stream", state.stream.id_},
+            {"received", state.stream.bytes_received_},
+            {"ts_ns", wall_clock_ns()}
+        };
+        if (!cancel.empty()) {
+            frame["cancel"] = cancel;
+        }
+        send_stream_frame(state.stream.sender_, frame, {}, BackpressurePolicy::drop_newest, MessagePriority::control);
+    }
+    
+    // Under state.mutex
+    void finish_inbound_stream(InboundStreamState& state) {
+        state.finished = true;
+        state.early.clear();
+        std::lock_guard<std::mutex> lock(inbound_streams_mutex_);
+        inbound_streams_.erase(stream_key(state.stream.sender_, state.stream.id_));
+    }
+    
+    // Under state.mutex: a stream that will never be finished by its
+    // sender is aborted towards the handler
+    void end_stream(InboundStreamState& state, const std::string& reason) {
+        if (state.finished || !state.handler) {
+            return;
+        }
+        state.finished = true;
+        state.stream.aborted_ = true;
+        state.stream.abort_reason_ = reason;
+        try {
+            state.handler(state.stream, std::string_view());
+        } catch (const std::exception& e) {
+            log(LogLevel::error, "Error in stream handler for " + state.stream.intent_ + ": " + std::string(e.what()));
+        }
+    }
+    
+    // Under inbound_streams_mutex_; checked whenever a new stream opens
+    std::vector<std::shared_ptr<InboundStreamState>> take_idle_streams() {
+        std::vector<std::shared_ptr<InboundStreamState>> idle;
+        auto cutoff = std::chrono::steady_clock::now() - options_.stream_idle_timeout;
+        for (auto it = inbound_streams_.begin(); it != inbound_streams_.end();) {
+            std::unique_lock<std::mutex> lock(it->second->mutex, std::try_to_lock);
+            if (lock.owns_lock() && it->second->last_activity < cutoff) {
+                idle.push_back(std::move(it->second));
+                it = inbound_streams_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return idle;
+    }
+    
+    // On disconnect: writers stop waiting, handlers see their streams aborted
+    void close_streams() {
+        std::map<std::string, std::shared_ptr<OutboundStream>, std::less<>> outbound;
+        std::map<std::string, std::shared_ptr<InboundStreamState>, std::less<>> inbound;
+        {
+            std::lock_guard<std::mutex> lock(streams_mutex_);
+            outbound.swap(outbound_streams_);
+        }
+        {
+            std::lock_guard<std::mutex> lock(inbound_streams_mutex_);
+            inbound.swap(inbound_streams_);
+        }
+        for (auto& [id, state] : outbound) {
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->finished = true;
+            }
+            state->credit.notify_all();
+        }
+        for (auto& [key, state] : inbound) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            end_stream(*state, "Disconnected");
+        }
+    }
+    
+    bool has_stream_handler(std::string_view intent) const {
+        std::shared_lock<std::shared_mutex> lock(stream_handlers_mutex_);
+        return stream_handlers_.find(intent) != stream_handlers_.end();
+    }
+    
+    // Inbound messages from every pooled connection end up here
+    // reader is the connection's index, naming its handler table slot
+    void on_inbound(InboundMessage&& message, size_t reader) {
+        if (message.type() == "transport_offer" || message.type() == "transport_close") {
+            on_transport_frame(message.document());
+            return;
+        }
+        if (message.type() == "directory") {
+            on_directory_frame(message.document(), reader);
+            return;
+        }
+        
+        // Batches are unpacked and each envelope dispatched in order
+        if (message.type() == "batch") {
+            const inbound_json& batch = message.scratch_document();
+            auto messages = batch.find("messages");
+            if (messages != batch.end() && messages->is_array()) {
+                for (const inbound_json& envelope : *messages) {
+                    if (!envelope.is_object()) {
+                        continue;
+                    }
+                    // One bad envelope doesn't cost the rest of the batch
+                    try {
+                        InboundMessage element = InboundMessage::copy_of(envelope, message.arena());
+                        element.set_received_ns(message.received_ns());
+                        dispatch(std::move(element), reader);
+                    } catch (const std::exception& e) {
+                        log(LogLevel::error, "Error handling batched message: " + std::string(e.what()));
+                    }
+                }
+            }
+            return;
+        }
+        
+        dispatch(std::move(message), reader);
+    }
+    
+    void dispatch(InboundMessage&& message, size_t reader) {
+        if (message.encrypted()) {
+            // The plaintext is a complete JSON envelope, scanned like any text frame
+            InboundMessage plain(crypto_.decrypt_envelope(message.document()));
+            if (plain.encrypted()) {
+                throw std::runtime_error("Nested encrypted envelope");
+            }
+            // The key only vouches for the outer sender; a peer must not
+            // speak for another entity inside the ciphertext
+            if (plain.sender() != message.sender()) {
+                throw std::runtime_error("Encrypted message from " + std::string(message.sender()) +
+                                         " claims to be from " + std::string(plain.sender()));
+            }
+            plain.set_received_ns(message.received_ns());
+            message = std::move(plain);
+        }
+        
+        // Streams bypass the handler table and the dispatch pool
+        if (message.type() == "stream") {
+            on_stream_frame(message);
+            return;
+        }
+        if (message.type() == "stream_credit") {
+            on_stream_credit(message.document(), message.sender());
+            return;
+        }
+        
+        if (auto sent_ns = message.ts_ns()) {
+            int64_t elapsed = wall_clock_ns() - *sent_ns;
+            if (elapsed >= 0) {
+                metrics_.one_way.record(static_cast<uint64_t>(elapsed));
+            }
+        }
+        if (drop_if_expired(message)) {
+            return;
+        }
+        
+        if (pending_requests_.size() > 0 && complete_request(message)) {
+            return;
+        }
+        
+        // Handle the message
+        if (!message.has_intent()) {
+            return;
+        }
+        
+        if (inbox_count_.load(std::memory_order_acquire) > 0 && deliver_to_inbox(message)) {
+            return;
+        }
+        
+        std::string_view intent = message.intent();
+        if (log_enabled(LogLevel::debug)) {
+            log(LogLevel::debug, "Received message with intent " + std::string(intent) +
+                " from " + std::string(message.sender()));
+        }
+        
+        if (const HandlerEntry* entry = message_handlers_.read(reader).find(intent, message.intent_hash())) {
+            if (!dispatch_pool_ || entry->run_inline) {
+                // Call the appropriate handler
+                run_handler(entry->handler, *entry->duration, message);
+            } else {
+                // Shard by sender so each sender's messages stay in order
+                size_t key = std::hash<std::string_view>()(message.sender());
+                message.detach();
+                dispatch_pool_->submit(key, [this, handler = entry->handler, duration = entry->duration,
+                                             message = std::move(message)]() {
+                    // It may have run out while queued for the worker
+                    if (!drop_if_expired(message)) {
+                        run_handler(handler, *duration, message);
+                    }
+                });
+            }
+        } else if (log_enabled(LogLevel::debug)) {
+            log(LogLevel::debug, "No handler registered for intent: " + std::string(intent));
+        }
+    }
+    
+    // Sends a request and arranges for exactly one call of done: with the
+    // reply, a send failure, a timeout or a disconnect
+    void start_request(const std::string& recipient, const std::string& intent, const json& payload,
+                       std::chrono::milliseconds timeout, CorrelationTable::Completion done) {
+        std::string id = generate_uuid();
+        pending_requests_.add(id, std::move(done));
+        
+        if (!enqueue_message(recipient, intent, payload, options_.backpressure, id)) {
+            if (auto failed = pending_requests_.take(id)) {
+                failed(std::make_exception_ptr(std::runtime_error("Failed to send request " + id)), json());
+            }
+            return;
+        }
+        
+        request_timeouts_->schedule(timeout, std::move(id));
+    }
+    
+    // Completes the request message answers, if it is a reply to one of ours
+    bool complete_request(const InboundMessage& message) {
+        std::string_view id = message.reply_to();
+        if (id.empty()) {
+            std::string_view own = message.id();
+            if (!own.starts_with("response-")) {
+                return false;
+            }
+            id = own.substr(std::string_view("response-").size());
+        }
+        auto completion = pending_requests_.take(id);
+        if (!completion) {
+            return false;
+        }
+        completion(nullptr, message.document());
+        return true;
+    }
+    
+    // Hands message to its intent's inbox, if async_next_message opened one
+    bool deliver_to_inbox(InboundMessage& message) {
+        std::lock_guard<std::mutex> lock(inbox_mutex_);
+        auto it = inboxes_.find(std::string(message.intent()));
+        if (it == inboxes_.end()) {
+            return false;
+        }
+        metrics_.messages_dispatched.add();
+        message.detach();
+        Inbox& inbox = it->second;
+        if (!inbox.waiters.empty()) {
+            std::shared_ptr<MessageWaiter> waiter = std::move(inbox.waiters.front());
+            inbox.waiters.pop_front();
+            waiter->done(std::move(message));
+            waiter->done = {};
+            if (waiter->timer) {
+                // Timers may only be touched from their own executor
+                boost::asio::post(executor(), [waiter]() { waiter->timer->cancel(); });
+            }
+            return true;
+        }
+        if (inbox.messages.size() >= options_.inbox_capacity) {
+            inbox.messages.pop_front();
+        }
+        inbox.messages.push_back(std::move(message));
+        return true;
+    }
+    
+    void reopen_inboxes() {
+        std::lock_guard<std::mutex> lock(inbox_mutex_);
+        inbox_closed_ = false;
+    }
+    
+    // Wakes every waiting async_next_message with nullopt
+    void close_inboxes() {
+        std::lock_guard<std::mutex> lock(inbox_mutex_);
+        inbox_closed_ = true;
+        for (auto& [intent, inbox] : inboxes_) {
+            for (auto& waiter : inbox.waiters) {
+                waiter->done(std::nullopt);
+                waiter->done = {};
+            }
+            inbox.waiters.clear();
+        }
+    }
+    
+    // True, and counted, if the sender's deadline for message has passed
+    bool drop_if_expired(const InboundMessage& message) {
+        std::optional<int64_t> expires_ns = message.expires_ns();
+        if (!expires_ns || wall_clock_ns() <= *expires_ns) {
+            return false;
+        }
+        metrics_.expired_inbound.add();
+        if (log_enabled(LogLevel::debug)) {
+            log(LogLevel::debug, "Dropped expired message with intent " + std::string(message.intent()) +
+                " from " + std::string(message.sender()));
+        }
+        return true;
+    }
+    
+    void run_handler(const Handler& handler, LatencyHistogram& duration, const InboundMessage& message) {
+        uint64_t start_ns = monotonic_ns();
+        if (message.received_ns() != 0) {
+            metrics_.wire_to_handler.record(start_ns - message.received_ns());
+        }
+        metrics_.messages_dispatched.add();
+        handler(message);
+        duration.record(monotonic_ns() - start_ns);
+    }
+    
+private:
+    std::string entity_id_;
+    std::string registry_url_;
+    Options options_;
+    
+    MessageCrypto crypto_;
+    ClientMetrics metrics_;
+    
+    // Outlives connections_, which write to it
+    std::unique_ptr<FrameCapture> capture_;
+    
+    struct HandlerEntry {
+        Handler handler;
+        bool run_inline = false;
+        std::shared_ptr<LatencyHistogram> duration;
+    };
+    
+    // Registration copies the table; dispatch reads it lock-free, through
+    // one reader slot per pooled connection
+    using HandlerTable = IntentTable<HandlerEntry>;
+    SnapshotCell<HandlerTable> message_handlers_;
+    IntentSubscriptions subscriptions_;
+    EntityProfile profile_;
+    CapabilityIndex directory_;
+    std::unique_ptr<DispatchPool> dispatch_pool_;
+    
+    // Outstanding request() calls; the wheel refers to the table, so it goes second
+    CorrelationTable pending_requests_;
+    std::unique_ptr<TimerWheel> request_timeouts_;
+    
+    // async_next_message state, keyed by intent
+    struct MessageWaiter {
+        UniqueFunction<void(std::optional<InboundMessage>)> done;
+        std::unique_ptr<boost::asio::steady_timer> timer;
+    };
+    struct Inbox {
+        std::deque<InboundMessage> messages;
+        std::deque<std::shared_ptr<MessageWaiter>> waiters;
+    };
+    std::mutex inbox_mutex_;
+    std::unordered_map<std::string, Inbox> inboxes_;
+    std::atomic<size_t> inbox_count_{0};
+    bool inbox_closed_ = false;
+    
+    // Declared after options_, which every connection refers to
+    std::vector<std::unique_ptr<RegistryConnection>> connections_;
+    std::unique_ptr<MetricsEndpoint> metrics_endpoint_;
+    
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    
+    // Pending async_connect calls by id, so each timeout only ends its own call
+    std::map<uint64_t, UniqueFunction<void(bool)>> connect_waiters_;
+    uint64_t next_connect_waiter_ = 0;
+    
+    // Between connect() and disconnect(); only then are sends held offline
+    std::atomic<bool> started_{false};
+    
+    // Our ring on options_.local_router, if one is set
+    static constexpr size_t kLocalDrainBurst = 256;
+    std::shared_ptr<LocalRouter::Mailbox> local_mailbox_;
+    
+    // Shared memory channels to same-host peers, by peer id. Reader threads
+    // dispatch through handler slots after the connections' (slot is the
+    // offset past them); shm_peer_count_ keeps the send path off the lock
+    // while there are none.
+    static constexpr size_t kMaxShmChannels = 8;
+    struct ShmPeer {
+        std::shared_ptr<ShmChannel> channel;
+        size_t slot;
+    };
+    mutable std::shared_mutex shm_mutex_;
+    std::map<std::string, ShmPeer, std::less<>> shm_peers_;
+    std::atomic<size_t> shm_peer_count_{0};
+    
+    friend class StreamWriter;
+    // Streams we are sending, by stream id
+    std::mutex streams_mutex_;
+    std::map<std::string, std::shared_ptr<OutboundStream>, std::less<>> outbound_streams_;
+    
+    // Streams being received, by sender and stream id (see stream_key)
+    struct InboundStreamState {
+        std::mutex mutex;
+        InboundStream stream;
+        StreamHandler handler;
+        uint64_t next_seq = 0;
+        uint64_t window = 0;
+        uint64_t acknowledged = 0;
+        bool finished = false;
+        // Chunks that overtook an earlier one, e.g. across pooled connections
+        std::map<uint64_t, InboundMessage> early;
+        std::chrono::steady_clock::time_point last_activity;
+    };
+    static constexpr size_t kMaxEarlyChunks = 64;
+    std::mutex inbound_streams_mutex_;
+    std::map<std::string, std::shared_ptr<InboundStreamState>, std::less<>> inbound_streams_;
+    
+    mutable std::shared_mutex stream_handlers_mutex_;
+    std::map<std::string, StreamHandler, std::less<>> stream_handlers_;
+    
+    // Messages held while offline. offline_pending_ mirrors the buffer's size
+    // so the send path only takes the lock while something is held.
+    mutable std::mutex offline_mutex_;
+    std::unique_ptr<OfflineBuffer> offline_;
+    std::atomic<size_t> offline_pending_{0};
+    std::atomic<bool> replay_scheduled_{false};
+};
+
+inline bool StreamWriter::write(std::string_view data) {
+    return state_ && client_->write_stream(*state_, data);
+}
+
+inline bool StreamWriter::close() {
+    return state_ && client_->finish_stream(*state_, std::nullopt);
+}
+
+inline void StreamWriter::abort(std::string_view reason) {
+    if (state_) {
+        client_->finish_stream(*state_, reason);
+    }
+}
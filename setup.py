@@ -53,6 +53,13 @@ setup(
         "azure": [
             "azure-iot-device>=2.12.0"
         ],
+        "binary": [
+            "cbor2>=5.4.0",
+            "msgpack>=1.0.0"
+        ],
+        "compression": [
+            "zstandard>=0.19.0"
+        ],
         "dev": [
             "pytest>=7.0.0",
             "pytest-asyncio>=0.18.0",
@@ -0,0 +1,197 @@
+"""
+ReGenNexus Core - Frame Compression
+
+This module implements the Python side of per-frame zstd compression (see
+docs/core_protocol.md). Small telemetry envelopes repeat the same keys,
+entity ids and intents in every message, which a general-purpose compressor
+only learns within one frame; a dictionary trained on captured traffic
+carries that knowledge into every frame instead. train_dictionary() builds
+one, negotiate_compression() answers a registration's offer, and
+FrameCompressor compresses and decompresses frames on a connection.
+
+Needs the zstandard package (the "compression" extra). Run the module to
+train a dictionary from captured frames, one per line:
+
+    python -m protocol.compression train capture.jsonl -o telemetry.dict
+"""
+
+import argparse
+import logging
+from typing import Any, Dict, Iterable, List, Optional, Sequence, Union
+
+logger = logging.getLogger(__name__)
+
+# Every zstd frame starts with this; no JSON, CBOR or MessagePack envelope does
+ZSTD_MAGIC = b"\x28\xb5\x2f\xfd"
+
+# Frames shorter than this are sent as they are
+DEFAULT_THRESHOLD = 128
+
+DEFAULT_LEVEL = 3
+DEFAULT_DICTIONARY_BYTES = 4096
+
+# Largest frame decompress() will produce, to bound what a peer can make us
+# allocate
+MAX_DECOMPRESSED_BYTES = 32 * 1024 * 1024
+
+
+def _zstd():
+    import zstandard
+    return zstandard
+
+
+def is_compressed(frame: Union[bytes, str]) -> bool:
+    """Check whether a received frame is a zstd frame."""
+    return isinstance(frame, (bytes, bytearray, memoryview)) and bytes(frame[:4]) == ZSTD_MAGIC
+
+
+def train_dictionary(samples: Iterable[bytes], size: int = DEFAULT_DICTIONARY_BYTES,
+                     dict_id: int = 0) -> bytes:
+    """
+    Train a zstd dictionary on sample frames.
+
+    Args:
+        samples: Frames as they go over the wire, e.g. captured envelopes
+        size: Dictionary size in bytes
+        dict_id: Id to give the dictionary; 0 lets zstd pick a random one
+
+    Returns:
+        The dictionary, in the format zstd --train writes
+    """
+    samples = [bytes(sample) for sample in samples if sample]
+    if not samples:
+        raise ValueError("No samples to train on")
+    dictionary = _zstd().train_dictionary(size, samples, dict_id=dict_id)
+    return dictionary.as_bytes()
+
+
+def dictionary_id(dictionary: bytes) -> int:
+    """Return the id a trained dictionary carries in its header."""
+    return _zstd().ZstdCompressionDict(dictionary).dict_id()
+
+
+def negotiate_compression(offer: Optional[Dict[str, Any]],
+                          dictionaries: Dict[int, bytes]) -> Optional[Dict[str, Any]]:
+    """
+    Pick the dictionary to use with a peer.
+
+    Args:
+        offer: The "compression" field of its registration
+        dictionaries: Dictionaries this side has, by id
+
+    Returns:
+        The "compression" field for the registration_ack, or None to leave
+        the connection uncompressed
+    """
+    if not offer or offer.get("algorithm") != "zstd":
+        return None
+    for offered_id in offer.get("dictionaries", []):
+        if offered_id in dictionaries:
+            return {"algorithm": "zstd", "dictionary": offered_id}
+    return None
+
+
+class FrameCompressor:
+    """Compresses outgoing and decompresses incoming frames on one connection."""
+
+    def __init__(self, dictionaries: Sequence[bytes], dictionary: Optional[int] = None,
+                 threshold: int = DEFAULT_THRESHOLD, level: int = DEFAULT_LEVEL):
+        """
+        Initialize the compressor.
+
+        Args:
+            dictionaries: Dictionaries incoming frames may use
+            dictionary: Id of the dictionary to compress with (the one
+                negotiated); None only decompresses
+            threshold: Smallest frame to compress, in bytes
+            level: zstd compression level
+        """
+        zstd = _zstd()
+        self.dictionaries = {}
+        for data in dictionaries:
+            loaded = zstd.ZstdCompressionDict(data)
+            self.dictionaries[loaded.dict_id()] = loaded
+        self.threshold = threshold
+        self._compressor = None
+        if dictionary is not None:
+            if dictionary not in self.dictionaries:
+                raise ValueError(f"Unknown dictionary: {dictionary}")
+            self._compressor = zstd.ZstdCompressor(level=level, dict_data=self.dictionaries[dictionary],
+                                                   write_content_size=True)
+        self._decompressors = {}
+
+    def compress(self, frame: Union[bytes, str]) -> Union[bytes, str]:
+        """
+        Compress a frame about to be sent.
+
+        The result goes out as a binary WebSocket frame, whatever the frame
+        was; frames under the threshold, and every frame if no dictionary was
+        negotiated, come back unchanged.
+        """
+        if self._compressor is None or len(frame) < self.threshold:
+            return frame
+        data = frame.encode("utf-8") if isinstance(frame, str) else bytes(frame)
+        compressed = self._compressor.compress(data)
+        return compressed if len(compressed) < len(data) else frame
+
+    def decompress(self, frame: Union[bytes, str]) -> Union[bytes, str]:
+        """
+        Undo compress() on a received frame.
+
+        Returns JSON text as str and binary encodings as bytes, as if the
+        frame had arrived uncompressed; frames that are not zstd frames come
+        back unchanged. Raises ValueError for a frame that does not declare
+        its size, declares more than MAX_DECOMPRESSED_BYTES or needs a
+        dictionary we do not have.
+        """
+        if not is_compressed(frame):
+            return frame
+        zstd = _zstd()
+        parameters = zstd.get_frame_parameters(frame)
+        # The output buffer is sized from the declared content size, so an
+        # undeclared or oversized one is refused before anything is allocated
+        if parameters.content_size in (zstd.CONTENTSIZE_UNKNOWN, zstd.CONTENTSIZE_ERROR) or \
+                parameters.content_size > MAX_DECOMPRESSED_BYTES:
+            raise ValueError("Compressed frame without a usable content size")
+        dict_id = parameters.dict_id
+        decompressor = self._decompressors.get(dict_id)
+        if decompressor is None:
+            if dict_id and dict_id not in self.dictionaries:
+                raise ValueError(f"Frame uses unknown dictionary {dict_id}")
+            decompressor = zstd.ZstdDecompressor(dict_data=self.dictionaries.get(dict_id))
+            self._decompressors[dict_id] = decompressor
+        data = decompressor.decompress(frame)
+        if data[:1] == b"{":
+            return data.decode("utf-8")
+        return data
+
+
+def _read_samples(paths: Sequence[str]) -> List[bytes]:
+    samples = []
+    for path in paths:
+        with open(path, "rb") as f:
+            samples.extend(line.rstrip(b"\r\n") for line in f if line.strip())
+    return samples
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Train zstd dictionaries for UAP frame compression")
+    commands = parser.add_subparsers(dest="command", required=True)
+    train = commands.add_parser("train", help="train a dictionary from captured frames, one per line")
+    train.add_argument("samples", nargs="+")
+    train.add_argument("-o", "--output", required=True)
+    train.add_argument("--size", type=int, default=DEFAULT_DICTIONARY_BYTES, help="dictionary size in bytes")
+    train.add_argument("--id", type=int, default=0, help="dictionary id (0 picks one at random)")
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.INFO)
+    samples = _read_samples(args.samples)
+    dictionary = train_dictionary(samples, args.size, args.id)
+    with open(args.output, "wb") as f:
+        f.write(dictionary)
+    logger.info("Trained dictionary %d (%d bytes) on %d frames", dictionary_id(dictionary),
+                len(dictionary), len(samples))
+
+
+if __name__ == "__main__":
+    main()
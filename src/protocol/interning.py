@@ -0,0 +1,132 @@
+"""
+ReGenNexus Core - Interned Names
+
+This module implements the registry side of interned names (see
+docs/core_protocol.md): for the length of one connection session, entity ids
+and intents get small integer handles, which binary-encoded envelopes carry
+in place of the strings. SessionNames assigns the handles a registration or
+intern frame asks for, resolves them in received envelopes, and compacts
+envelopes about to be sent, producing the intern frame that has to go out
+before a handle's first use.
+"""
+
+from typing import Any, Dict, Optional, Tuple
+
+# Envelope members each kind of name appears in
+MEMBERS = {
+    "entities": ("sender", "recipient"),
+    "intents": ("intent",),
+}
+
+# Clients ignore handles above this
+MAX_HANDLE = 65535
+
+
+class SessionNames:
+    """Handles for entity ids and intents on one connection."""
+
+    def __init__(self):
+        # kind -> name -> handle, and kind -> handle -> name
+        self.handles: Dict[str, Dict[str, int]] = {kind: {} for kind in MEMBERS}
+        self.names: Dict[str, Dict[int, str]] = {kind: {} for kind in MEMBERS}
+
+    def _assign(self, kind: str, name: str, proposed: Optional[int] = None) -> Optional[int]:
+        handles = self.handles[kind]
+        if name in handles:
+            return handles[name]
+        names = self.names[kind]
+        if proposed is None or proposed in names or not 0 <= proposed <= MAX_HANDLE:
+            proposed = len(names)
+            while proposed in names:
+                proposed += 1
+            if proposed > MAX_HANDLE:
+                return None
+        handles[name] = proposed
+        names[proposed] = name
+        return proposed
+
+    def accept(self, request: Dict[str, Any]) -> Dict[str, Dict[str, int]]:
+        """
+        Assign the handles a registration's "interning" field or an intern
+        frame asks for.
+
+        A name mapped to a handle keeps it: after a reconnect, frames the
+        client queued in its previous session may already use it. A name
+        mapped to None gets a new handle.
+
+        Args:
+            request: {"entities": {name: handle or None}, "intents": {...}}
+
+        Returns:
+            The definitions to send back, in the same shape: the
+            registration_ack's "interning" field, or an intern frame once
+            "type" is added
+        """
+        definitions: Dict[str, Dict[str, int]] = {kind: {} for kind in MEMBERS}
+        for kind in MEMBERS:
+            entries = request.get(kind) or {}
+            # Proposed handles first, so fresh ones don't take them
+            for name, proposed in sorted(entries.items(), key=lambda item: item[1] is None):
+                if not isinstance(name, str) or not name:
+                    continue
+                handle = self._assign(kind, name, proposed if isinstance(proposed, int) else None)
+                if handle is not None:
+                    definitions[kind][name] = handle
+        return definitions
+
+    def resolve(self, envelope: Dict[str, Any]) -> Dict[str, Any]:
+        """
+        Return a received envelope (or batch) with handles replaced by names.
+
+        Raises:
+            KeyError: for a handle this session never assigned
+        """
+        resolved = dict(envelope)
+        for kind, members in MEMBERS.items():
+            for member in members:
+                value = resolved.get(member)
+                if isinstance(value, int) and not isinstance(value, bool):
+                    resolved[member] = self.names[kind][value]
+        if isinstance(resolved.get("messages"), list):
+            resolved["messages"] = [self.resolve(element) if isinstance(element, dict) else element
+                                    for element in resolved["messages"]]
+        return resolved
+
+    def compact(self, envelope: Dict[str, Any], assign: bool = True) -> Tuple[Optional[Dict[str, Any]], Dict[str, Any]]:
+        """
+        Prepare an envelope (or batch) for sending on a binary encoding.
+
+        Args:
+            envelope: Envelope with names as strings
+            assign: Give names that have no handle yet a new one
+
+        Returns:
+            (intern frame to send first, or None; envelope with handles)
+        """
+        definitions: Dict[str, Dict[str, int]] = {kind: {} for kind in MEMBERS}
+        compacted = self._compact(envelope, assign, definitions)
+        if not any(definitions.values()):
+            return None, compacted
+        frame: Dict[str, Any] = {"type": "intern"}
+        frame.update({kind: names for kind, names in definitions.items() if names})
+        return frame, compacted
+
+    def _compact(self, envelope: Dict[str, Any], assign: bool,
+                 definitions: Dict[str, Dict[str, int]]) -> Dict[str, Any]:
+        compacted = dict(envelope)
+        for kind, members in MEMBERS.items():
+            for member in members:
+                name = compacted.get(member)
+                if not isinstance(name, str):
+                    continue
+                handle = self.handles[kind].get(name)
+                if handle is None and assign:
+                    handle = self._assign(kind, name)
+                    if handle is not None:
+                        definitions[kind][name] = handle
+                if handle is not None:
+                    compacted[member] = handle
+        if isinstance(compacted.get("messages"), list):
+            compacted["messages"] = [self._compact(element, assign, definitions) if isinstance(element, dict)
+                                     else element for element in compacted["messages"]]
+        return compacted
@@ -16,13 +16,50 @@ logging.basicConfig(level=logging.INFO,
                     format='%(asctime)s - %(name)s - %(levelname)s - %(message)s')
 logger = logging.getLogger(__name__)
 
+# Wire encodings a peer may advertise in its registration message, most
+# preferred first. Binary encodings carry the same fields as to_dict().
+SUPPORTED_ENCODINGS = ['cbor', 'msgpack', 'json']
+
+def negotiate_encoding(offered: List[str]) -> str:
+    """
+    Pick the encoding to use with a peer.
+    
+    Args:
+        offered: Encodings advertised by the peer, most preferred first
+        
+    Returns:
+        The first offered encoding this side supports, or 'json'
+    """
+    for encoding in offered:
+        if encoding in SUPPORTED_ENCODINGS:
+            if encoding == 'json':
+                return encoding
+            try:
+                _binary_codec(encoding)
+                return encoding
+            except ImportError:
+                continue
+    return 'json'
+
+def _binary_codec(encoding: str):
+    """Return the (dumps, loads) pair for a binary encoding."""
+    if encoding == 'cbor':
+        import cbor2
+        return cbor2.dumps, cbor2.loads
+    if encoding == 'msgpack':
+        import msgpack
+        return (lambda data: msgpack.packb(data, use_bin_type=True),
+                lambda data: msgpack.unpackb(data, raw=False))
+    raise ValueError(f"Unsupported encoding: {encoding}")
+
 class UAP_Message:
     """Message for the ReGenNexus Core protocol."""
     
     def __init__(self, sender: str, recipient: str, intent: str, 
                 payload: Dict[str, Any], message_id: Optional[str] = None,
                 timestamp: Optional[float] = None, encrypted: bool = False,
-                signature: Optional[str] = None, ttl: Optional[int] = None):
+                signature: Optional[str] = None, ttl: Optional[int] = None,
+                reply_to: Optional[str] = None, ts_ns: Optional[int] = None):
         """
         Initialize a UAP message.
         
@@ -36,16 +73,23 @@ class UAP_Message:
             encrypted: Whether the message is encrypted
             signature: Optional cryptographic signature
             ttl: Optional time-to-live in seconds
+            reply_to: Optional id of the request this message answers
+            ts_ns: Optional creation time in integer nanoseconds since the epoch
+                (derived from timestamp if only that is given)
         """
         self.sender = sender
         self.recipient = recipient
         self.intent = intent
         self.payload = payload
         self.id = message_id or str(uuid.uuid4())
-        self.timestamp = timestamp or time.time()
+        if ts_ns is None:
+            ts_ns = int(timestamp * 1_000_000_000) if timestamp else time.time_ns()
+        self.ts_ns = ts_ns
+        self.timestamp = timestamp or ts_ns / 1_000_000_000
         self.encrypted = encrypted
         self.signature = signature
         self.ttl = ttl
+        self.reply_to = reply_to
     
     @classmethod
     def from_dict(cls, data: Dict[str, Any]) -> 'UAP_Message':
@@ -74,7 +118,9 @@ class UAP_Message:
             timestamp=data.get('timestamp'),
             encrypted=data.get('encrypted', False),
             signature=data.get('signature'),
-            ttl=data.get('ttl')
+            ttl=data.get('ttl'),
+            reply_to=data.get('reply_to'),
+            ts_ns=data.get('ts_ns')
         )
     
     def to_dict(self) -> Dict[str, Any]:
@@ -90,7 +136,8 @@ class UAP_Message:
             'recipient': self.recipient,
             'intent': self.intent,
             'payload': self.payload,
-            'timestamp': self.timestamp
+            'timestamp': self.timestamp,
+            'ts_ns': self.ts_ns
         }
         
         if self.encrypted:
@@ -102,6 +149,9 @@ class UAP_Message:
         if self.ttl is not None:
             result['ttl'] = self.ttl
             
+        if self.reply_to:
+            result['reply_to'] = self.reply_to
+            
         return result
     
     def to_json(self) -> str:
@@ -127,6 +177,66 @@ class UAP_Message:
         data = json.loads(json_str)
         return cls.from_dict(data)
     
+    def to_bytes(self, encoding: str = 'json') -> bytes:
+        """
+        Serialize the message for the wire.
+        
+        Args:
+            encoding: One of SUPPORTED_ENCODINGS
+            
+        Returns:
+            Encoded message; JSON is returned as UTF-8 bytes
+        """
+        if encoding == 'json':
+            return self.to_json().encode('utf-8')
+        dumps, _ = _binary_codec(encoding)
+        return dumps(self.to_dict())
+    
+    @classmethod
+    def from_bytes(cls, data: Union[bytes, str], encoding: Optional[str] = None) -> 'UAP_Message':
+        """
+        Create a message from a wire frame.
+        
+        Args:
+            data: Frame contents; text frames may be passed as str
+            encoding: Encoding of the frame, detected from the first byte if omitted
+            
+        Returns:
+            UAP_Message instance
+        """
+        if isinstance(data, str):
+            return cls.from_json(data)
+        if encoding is None:
+            lead = data[0] if data else 0
+            if 0xA0 <= lead <= 0xBF:
+                encoding = 'cbor'
+            elif 0x80 <= lead <= 0x8F or lead in (0xDE, 0xDF):
+                encoding = 'msgpack'
+            else:
+                encoding = 'json'
+        if encoding == 'json':
+            return cls.from_json(data.decode('utf-8'))
+        _, loads = _binary_codec(encoding)
+        return cls.from_dict(loads(data))
+    
+    @classmethod
+    def unpack_frame(cls, data: Dict[str, Any]) -> List['UAP_Message']:
+        """
+        Unpack a decoded frame into messages.
+        
+        Senders may coalesce several envelopes into one frame of the form
+        {"type": "batch", "messages": [...]}; any other frame is a single envelope.
+        
+        Args:
+            data: Decoded frame
+            
+        Returns:
+            List of UAP_Message instances, in the order they were sent
+        """
+        if data.get('type') == 'batch':
+            return [cls.from_dict(item) for item in data.get('messages', [])]
+        return [cls.from_dict(data)]
+    
     def is_expired(self) -> bool:
         """
         Check if the message has expired.
@@ -137,7 +247,8 @@ class UAP_Message:
         if self.ttl is None:
             return False
             
-        return time.time() > self.timestamp + self.ttl
+        # ts_ns avoids the float rounding of timestamp at sub-second TTLs
+        return time.time_ns() > self.ts_ns + int(self.ttl * 1_000_000_000)
     
     def is_broadcast(self) -> bool:
         """
@@ -201,7 +312,8 @@ def create_response(request: UAP_Message, intent: str, payload: Dict[str, Any])
         recipient=request.sender,
         intent=intent,
         payload=payload,
-        message_id=f"response-{request.id}"
+        message_id=f"response-{request.id}",
+        reply_to=request.id
     )
 
 def create_error_response(request: UAP_Message, error_code: str, error_message: str) -> UAP_Message:
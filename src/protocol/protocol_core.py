@@ -6,10 +6,11 @@ providing message handling, entity management, and secure communication.
 """
 
 import asyncio
+import hashlib
 import uuid
 import json
 import logging
-from typing import Dict, List, Optional, Callable, Any, Tuple
+from typing import Dict, List, Optional, Callable, Any, Tuple, Iterable, Set
 
 # Import security components
 from regennexus.security.security import SecurityManager
@@ -254,6 +255,16 @@ class ProtocolCore:
         """
         self.entities = {}
         self.security_manager = SecurityManager(security_level=security_level)
+        # Intents each entity asked for; entities without an entry get everything
+        self.subscriptions: Dict[str, Set[str]] = {}
+        # Host id and same-host transports each entity registered with
+        self.transports: Dict[str, Tuple[str, Set[str]]] = {}
+        # Type, capabilities and metadata of each registered entity, and the
+        # entities that asked for changes to be pushed to them; the version
+        # goes up by one with every change
+        self.directory: Dict[str, Dict[str, Any]] = {}
+        self.directory_watchers: Set[str] = set()
+        self.directory_version = 0
         
     async def register_entity(self, entity: Entity):
         """
@@ -265,16 +276,287 @@ class ProtocolCore:
         self.entities[entity.id] = entity
         logger.info(f"Entity registered: {entity.id}")
         
-    async def unregister_entity(self, entity_id: str):
+    async def unregister_entity(self, entity_id: str) -> List[Tuple[str, Dict[str, Any]]]:
         """
         Unregister an entity from the protocol.
         
         Args:
             entity_id: Identifier of the entity to unregister
+            
+        Returns:
+            (recipient, frame) pairs telling same-host peers to close their
+            channels to it and directory watchers that it is gone; whatever
+            release_transports() already returned is not repeated
         """
         if entity_id in self.entities:
             del self.entities[entity_id]
+            self.subscriptions.pop(entity_id, None)
             logger.info(f"Entity unregistered: {entity_id}")
+        return self.release_transports(entity_id) + self.release_directory(entity_id)
+    
+    def set_subscriptions(self, entity_id: str, intents: Optional[Iterable[str]]):
+        """
+        Replace the set of intents routed to an entity.
+        
+        Args:
+            entity_id: Identifier of the subscribing entity
+            intents: Intents to deliver, or None to deliver everything
+        """
+        if intents is None:
+            self.subscriptions.pop(entity_id, None)
+        else:
+            self.subscriptions[entity_id] = set(intents)
+        logger.debug(f"Subscriptions for {entity_id}: {self.subscriptions.get(entity_id, 'all')}")
+    
+    def subscribe(self, entity_id: str, intents: Iterable[str]):
+        """
+        Add intents to an entity's subscriptions.
+        
+        An entity that had no subscriptions (and so received everything)
+        starts filtering with just these intents.
+        
+        Args:
+            entity_id: Identifier of the subscribing entity
+            intents: Intents to add
+        """
+        self.subscriptions.setdefault(entity_id, set()).update(intents)
+    
+    def unsubscribe(self, entity_id: str, intents: Iterable[str]):
+        """
+        Remove intents from an entity's subscriptions.
+        
+        Args:
+            entity_id: Identifier of the subscribing entity
+            intents: Intents to remove
+        """
+        if entity_id in self.subscriptions:
+            self.subscriptions[entity_id].difference_update(intents)
+    
+    def apply_subscription_frame(self, entity_id: str, frame: Dict[str, Any]) -> bool:
+        """
+        Apply a subscription update received from an entity's connection.
+        
+        A registration frame replaces the set with its "intents" list (no
+        list means everything); subscribe and unsubscribe frames change it
+        incrementally.
+        
+        Args:
+            entity_id: Identifier of the sending entity
+            frame: Decoded frame
+            
+        Returns:
+            True if the frame was a registration or subscription update
+        """
+        kind = frame.get("type")
+        if kind == "registration":
+            self.set_subscriptions(entity_id, frame.get("intents"))
+        elif kind == "subscribe":
+            self.subscribe(entity_id, frame.get("intents", []))
+        elif kind == "unsubscribe":
+            self.unsubscribe(entity_id, frame.get("intents", []))
+        else:
+            return False
+        return True
+    
+    @staticmethod
+    def shm_segment_name(entity_a: str, entity_b: str) -> str:
+        """
+        Name of the shared memory segment between two entities.
+        
+        Args:
+            entity_a: One entity
+            entity_b: The other entity
+            
+        Returns:
+            A POSIX shared memory name, the same whichever order they come in
+        """
+        first, second = sorted((entity_a, entity_b))
+        digest = hashlib.sha1(f"{first}\0{second}".encode("utf-8")).hexdigest()
+        return f"/uap-{digest[:32]}"
+    
+    def register_transports(self, entity_id: str, frame: Dict[str, Any]) -> List[Tuple[str, Dict[str, Any]]]:
+        """
+        Record the same-host transports from a registration frame and offer
+        them to the entities already registered on the same host.
+        
+        The entity whose id sorts first creates the segment; both sides get
+        a transport_offer naming it. Envelopes between the two may then go
+        over shared memory, while the registry connection stays up for
+        everything else.
+        
+        Args:
+            entity_id: Identifier of the registering entity
+            frame: Its registration frame
+            
+        Returns:
+            (recipient, frame) pairs for the registry to send
+        """
+        host_id = frame.get("host_id")
+        offered = set(frame.get("transports") or [])
+        if not host_id or "shm" not in offered:
+            self.transports.pop(entity_id, None)
+            return []
+        self.transports[entity_id] = (host_id, offered)
+        
+        offers = []
+        for peer, (peer_host, peer_transports) in self.transports.items():
+            if peer == entity_id or peer_host != host_id or "shm" not in peer_transports:
+                continue
+            segment = self.shm_segment_name(entity_id, peer)
+            for side, other in ((entity_id, peer), (peer, entity_id)):
+                offers.append((side, {
+                    "type": "transport_offer",
+                    "transport": "shm",
+                    "peer": other,
+                    "segment": segment,
+                    "initiator": side < other
+                }))
+        return offers
+    
+    def release_transports(self, entity_id: str) -> List[Tuple[str, Dict[str, Any]]]:
+        """
+        Forget an entity's transports when its connection closes.
+        
+        Args:
+            entity_id: Identifier of the departing entity
+            
+        Returns:
+            (recipient, frame) pairs telling its same-host peers to close
+            their channels to it
+        """
+        entry = self.transports.pop(entity_id, None)
+        if entry is None:
+            return []
+        return [(peer, {"type": "transport_close", "transport": "shm", "peer": entity_id})
+                for peer, (peer_host, _) in self.transports.items() if peer_host == entry[0]]
+    
+    def find_entities(self, entity_type: Optional[str] = None,
+                      capabilities: Optional[Iterable[str]] = None) -> List[Dict[str, Any]]:
+        """
+        Find registered entities in the directory.
+        
+        Args:
+            entity_type: Optional entity type to filter by
+            capabilities: Optional capabilities an entity must all have
+            
+        Returns:
+            Directory entries of the matching entities, with their "entity_id"
+        """
+        required = set(capabilities or [])
+        return [dict(entry, entity_id=entity_id) for entity_id, entry in sorted(self.directory.items())
+                if (entity_type is None or entry["entity_type"] == entity_type)
+                and required.issubset(entry["capabilities"])]
+    
+    def directory_snapshot(self) -> Dict[str, Any]:
+        """The directory frame giving a watcher the whole directory."""
+        return {
+            "type": "directory",
+            "version": self.directory_version,
+            "snapshot": True,
+            "entities": {entity_id: dict(entry) for entity_id, entry in self.directory.items()}
+        }
+    
+    def _directory_changed(self, changes: Dict[str, Optional[Dict[str, Any]]]) -> List[Tuple[str, Dict[str, Any]]]:
+        self.directory_version += 1
+        frame = {"type": "directory", "version": self.directory_version, "entities": changes}
+        return [(watcher, frame) for watcher in sorted(self.directory_watchers)]
+    
+    def apply_directory_frame(self, entity_id: str, frame: Dict[str, Any]) -> List[Tuple[str, Dict[str, Any]]]:
+        """
+        Apply a frame received from an entity's connection to the directory.
+        
+        A registration or capabilities frame sets the entity's entry, and
+        every watcher gets a delta if it changed. A registration with
+        "discovery" makes the entity a watcher and gets it a snapshot, as
+        does a directory_sync frame from a watcher that missed a delta.
+        
+        Args:
+            entity_id: Identifier of the sending entity
+            frame: Decoded frame
+            
+        Returns:
+            (recipient, frame) pairs for the registry to send, in order
+        """
+        kind = frame.get("type")
+        if kind == "directory_sync":
+            return [(entity_id, self.directory_snapshot())] if entity_id in self.directory_watchers else []
+        if kind not in ("registration", "capabilities"):
+            return []
+        
+        outgoing = []
+        entry = {
+            "entity_type": frame.get("entity_type") or "client",
+            "capabilities": sorted(set(frame.get("capabilities") or [])),
+            "metadata": frame.get("metadata") or {}
+        }
+        if self.directory.get(entity_id) != entry:
+            self.directory[entity_id] = entry
+            outgoing.extend(self._directory_changed({entity_id: entry}))
+        if kind == "registration":
+            if frame.get("discovery"):
+                self.directory_watchers.add(entity_id)
+                outgoing.append((entity_id, self.directory_snapshot()))
+            else:
+                self.directory_watchers.discard(entity_id)
+        return outgoing
+    
+    def release_directory(self, entity_id: str) -> List[Tuple[str, Dict[str, Any]]]:
+        """
+        Remove an entity from the directory when its last connection closes.
+        
+        Args:
+            entity_id: Identifier of the departing entity
+            
+        Returns:
+            (recipient, frame) pairs telling the watchers it is gone
+        """
+        self.directory_watchers.discard(entity_id)
+        if self.directory.pop(entity_id, None) is None:
+            return []
+        return self._directory_changed({entity_id: None})
+    
+    def fanout_recipients(self, envelope: Dict[str, Any]) -> List[str]:
+        """
+        Recipients of an envelope, expanding the "*" of broadcasts and multicasts.
+        
+        An envelope addressed to "*" goes to the registered entities in its
+        "recipients" list, or to every registered entity but the sender
+        without one. The registry forwards it to each of them without the
+        list, and may serialize it once for all of them.
+        
+        Args:
+            envelope: Decoded envelope
+            
+        Returns:
+            Identifiers of the entities to deliver to
+        """
+        recipient = envelope.get("recipient")
+        if recipient != "*":
+            return [recipient] if recipient in self.entities else []
+        listed = envelope.get("recipients")
+        if listed is None:
+            return [entity_id for entity_id in self.entities if entity_id != envelope.get("sender")]
+        return [entity_id for entity_id in dict.fromkeys(listed) if entity_id in self.entities]
+    
+    def accepts(self, entity_id: str, message: Message) -> bool:
+        """
+        Check whether an entity wants a message.
+        
+        Replies (a reply_to in the metadata, or an id from create_response())
+        are always delivered, since the requester matches them by id rather
+        than by intent.
+        
+        Args:
+            entity_id: Identifier of the recipient
+            message: The message to check
+            
+        Returns:
+            True if the message should be delivered
+        """
+        intents = self.subscriptions.get(entity_id)
+        if intents is None or message.intent in intents:
+            return True
+        return bool(message.metadata.get("reply_to")) or message.id.startswith("response-")
         
     async def route_message(self, message: Message, context: Optional[Dict[str, Any]] = None) -> Optional[Message]:
         """
@@ -291,6 +573,11 @@ class ProtocolCore:
             logger.warning(f"Recipient not found: {message.recipient_id}")
             return None
         
+        # Dropped here so unsubscribed intents never cost the recipient anything
+        if not self.accepts(message.recipient_id, message):
+            logger.debug(f"Dropping message {message.id}: {message.recipient_id} is not subscribed to {message.intent}")
+            return None
+        
         recipient = self.entities[message.recipient_id]
         ctx = context or {}
         
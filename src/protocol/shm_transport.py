@@ -0,0 +1,360 @@
+"""
+ReGenNexus Core - Shared-Memory Transport
+
+This module implements the same-host shared-memory channel the registry
+offers to peers that registered the same host_id (see docs/core_protocol.md).
+It maps the POSIX shared memory segment laid out by the C++ client's
+ShmChannel: a 64-byte header, then one single-producer single-consumer ring
+per direction, each a 192-byte control block followed by the ring data.
+Envelopes are carried unchanged; only the transport differs.
+"""
+
+import ctypes
+import ctypes.util
+import errno
+import logging
+import mmap
+import os
+import platform
+import struct
+import threading
+import time
+from typing import Optional, Tuple, Union
+
+logger = logging.getLogger(__name__)
+
+MAGIC = 0x4D504155  # "UAPM"
+VERSION = 1
+DEFAULT_RING_BYTES = 8 * 1024 * 1024
+
+HEADER_SIZE = 64
+CONTROL_SIZE = 192
+RECORD_HEADER = 8
+WRAP_MARKER = 0xFFFFFFFF
+
+STATE_ATTACHED = 1
+STATE_CLOSED = 2
+KIND_TEXT = 1
+KIND_BINARY = 2
+
+# Offsets within the header and within a ring's control block
+_MAGIC, _VERSION, _RING_BYTES, _STATE, _PID = 0, 4, 8, 16, 24
+_HEAD, _TAIL, _DOORBELL, _SLEEPING = 0, 64, 128, 132
+
+_FUTEX_WAIT, _FUTEX_WAKE = 0, 1
+_SYS_FUTEX = {"x86_64": 202, "aarch64": 98, "armv7l": 240}.get(platform.machine())
+
+_libc = ctypes.CDLL(None, use_errno=True)
+
+# libatomic gives the ordering the C++ side relies on; without it plain
+# aligned loads and stores are used, which are atomic on the supported CPUs
+_atomic_path = ctypes.util.find_library("atomic")
+_libatomic = ctypes.CDLL(_atomic_path) if _atomic_path else None
+_SEQ_CST = 5
+
+
+def _atomic(name, restype, *argtypes):
+    # Bound here: inside the class, the double underscore would be mangled
+    if _libatomic is None:
+        return None
+    function = getattr(_libatomic, name)
+    function.restype = restype
+    function.argtypes = [ctypes.c_void_p, *argtypes, ctypes.c_int]
+    return function
+
+
+_atomic_load_8 = _atomic("__atomic_load_8", ctypes.c_uint64)
+_atomic_store_8 = _atomic("__atomic_store_8", None, ctypes.c_uint64)
+_atomic_load_4 = _atomic("__atomic_load_4", ctypes.c_uint32)
+_atomic_store_4 = _atomic("__atomic_store_4", None, ctypes.c_uint32)
+_atomic_fetch_add_4 = _atomic("__atomic_fetch_add_4", ctypes.c_uint32, ctypes.c_uint32)
+
+
+def segment_size(ring_bytes: int) -> int:
+    """Total size of a segment with the given ring size."""
+    return HEADER_SIZE + 2 * (CONTROL_SIZE + ring_bytes)
+
+
+def _record_size(length: int) -> int:
+    return (RECORD_HEADER + length + 7) & ~7
+
+
+def _shm_path(name: str) -> str:
+    # shm_open() names map to files under /dev/shm on Linux
+    return "/dev/shm/" + name.lstrip("/")
+
+
+class ShmChannel:
+    """
+    One end of a shared-memory channel to a peer on the same host.
+
+    The initiator creates the segment and unlinks it once the peer has
+    attached; the other side opens it. Sends from several threads are
+    serialized; receive() should be called from one thread only.
+    """
+
+    def __init__(self, name: str, initiator: bool, ring_bytes: int = DEFAULT_RING_BYTES):
+        """
+        Initialize the channel.
+
+        Args:
+            name: Segment name from the registry's transport_offer
+            initiator: Whether this side creates the segment
+            ring_bytes: Size of each ring when creating the segment
+        """
+        self.name = name
+        self.side = 0 if initiator else 1
+        self.ring_bytes = max(4096, (ring_bytes + 7) & ~7)
+        self.mapping: Optional[mmap.mmap] = None
+        self.unlinked = False
+        self.send_lock = threading.Lock()
+        self._anchor = None
+        self._base = 0
+
+    def open(self, timeout: float = 5.0) -> bool:
+        """
+        Create or map the segment and mark this side attached.
+
+        Args:
+            timeout: How long the non-initiating side waits for the segment
+
+        Returns:
+            Boolean indicating success
+        """
+        try:
+            if self.side == 0:
+                self._create()
+            elif not self._open_existing(timeout):
+                logger.warning(f"Shared memory segment {self.name} never appeared")
+                return False
+            struct.pack_into("<i", self.mapping, _PID + 4 * self.side, os.getpid())
+            self._store32(_STATE + 4 * self.side, STATE_ATTACHED)
+            logger.info(f"Shared memory channel {self.name} mapped ({self.ring_bytes} bytes per ring)")
+            return True
+        except OSError as e:
+            logger.error(f"Error opening shared memory channel {self.name}: {e}")
+            self.close()
+            return False
+
+    @property
+    def ready(self) -> bool:
+        """Whether both sides are attached."""
+        if self.mapping is None:
+            return False
+        attached = self._load32(_STATE + 4 * (1 - self.side)) == STATE_ATTACHED
+        if attached and self.side == 0 and not self.unlinked:
+            self._unlink()
+        return attached and self._load32(_STATE + 4 * self.side) == STATE_ATTACHED
+
+    def send(self, frame: Union[str, bytes], binary: bool = False,
+             block: bool = True, timeout: Optional[float] = None) -> bool:
+        """
+        Write one envelope to the peer.
+
+        Args:
+            frame: Serialized envelope (JSON text, or a binary envelope)
+            binary: Whether frame is a binary envelope
+            block: Whether to wait for room when the ring is full
+            timeout: Longest wait for room, or None for no limit
+
+        Returns:
+            True if written; False if the ring was full, the frame too large
+            or the peer gone, in which case the registry can still carry it
+        """
+        data = frame.encode("utf-8") if isinstance(frame, str) else frame
+        size = self.ring_bytes
+        need = _record_size(len(data))
+        with self.send_lock:
+            if not self.ready or need > size // 2:
+                return False
+
+            control = self._ring(self.side)
+            ring = control + CONTROL_SIZE
+            head = self._load64(control + _HEAD)
+            offset = head % size
+            skip = size - offset if size - offset < need else 0
+            deadline = None if timeout is None else time.monotonic() + timeout
+            while size - (head - self._load64(control + _TAIL)) < skip + need:
+                if not block or (deadline is not None and time.monotonic() > deadline) or not self.ready:
+                    return False
+                time.sleep(0.0001)
+
+            if skip:
+                struct.pack_into("<II", self.mapping, ring + offset, WRAP_MARKER, 0)
+                head += skip
+                offset = 0
+            struct.pack_into("<II", self.mapping, ring + offset, len(data),
+                             KIND_BINARY if binary else KIND_TEXT)
+            start = ring + offset + RECORD_HEADER
+            self.mapping[start:start + len(data)] = data
+            self._store64(control + _HEAD, head + need)
+
+            if self._load32(control + _SLEEPING):
+                self._add32(control + _DOORBELL)
+                self._futex(control + _DOORBELL, _FUTEX_WAKE, 1)
+            return True
+
+    def receive(self, timeout: Optional[float] = None) -> Optional[Tuple[bytes, bool]]:
+        """
+        Read the next envelope from the peer.
+
+        Args:
+            timeout: Longest wait, or None to wait until one arrives
+
+        Returns:
+            The envelope bytes and whether it is binary, or None on timeout
+            or once the channel is closed
+        """
+        size = self.ring_bytes
+        deadline = None if timeout is None else time.monotonic() + timeout
+        while self.mapping is not None:
+            control = self._ring(1 - self.side)
+            ring = control + CONTROL_SIZE
+            tail = self._load64(control + _TAIL)
+            head = self._load64(control + _HEAD)
+            if head == tail:
+                remaining = None if deadline is None else deadline - time.monotonic()
+                if remaining is not None and remaining <= 0:
+                    return None
+                bell = self._load32(control + _DOORBELL)
+                self._store32(control + _SLEEPING, 1)
+                if self._load64(control + _HEAD) == tail:
+                    wait = 0.2 if remaining is None else min(remaining, 0.2)
+                    self._futex(control + _DOORBELL, _FUTEX_WAIT, bell, wait)
+                self._store32(control + _SLEEPING, 0)
+                if self.side == 0:
+                    # Drops the segment's name once the peer has it mapped
+                    self.ready  # noqa: B018
+                continue
+
+            offset = tail % size
+            length, kind = struct.unpack_from("<II", self.mapping, ring + offset)
+            if length == WRAP_MARKER:
+                self._store64(control + _TAIL, tail + size - offset)
+                continue
+            # The peer's counters and lengths are not trusted: a record must
+            # lie within the ring and within what has been written
+            if RECORD_HEADER + length > size - offset or _record_size(length) > head - tail:
+                logger.error(f"Shared memory channel {self.name} has a corrupt record; closing it")
+                self.close()
+                return None
+            start = ring + offset + RECORD_HEADER
+            data = bytes(self.mapping[start:start + length])
+            self._store64(control + _TAIL, tail + _record_size(length))
+            return data, kind == KIND_BINARY
+        return None
+
+    def close(self):
+        """Mark this side closed and unmap the segment."""
+        if self.mapping is None:
+            return
+        self._store32(_STATE + 4 * self.side, STATE_CLOSED)
+        if self.side == 0 and not self.unlinked:
+            self._unlink()
+        self._unmap()
+
+    def _create(self):
+        path = _shm_path(self.name)
+        try:
+            os.unlink(path)
+        except FileNotFoundError:
+            pass
+        fd = os.open(path, os.O_RDWR | os.O_CREAT | os.O_EXCL, 0o600)
+        try:
+            os.ftruncate(fd, segment_size(self.ring_bytes))
+            self._map(fd, segment_size(self.ring_bytes))
+        finally:
+            os.close(fd)
+        struct.pack_into("<I", self.mapping, _VERSION, VERSION)
+        struct.pack_into("<Q", self.mapping, _RING_BYTES, self.ring_bytes)
+        # The peer waits for the magic before reading anything else
+        self._store32(_MAGIC, MAGIC)
+
+    def _open_existing(self, timeout: float) -> bool:
+        path = _shm_path(self.name)
+        deadline = time.monotonic() + timeout
+        while True:
+            try:
+                fd = os.open(path, os.O_RDWR)
+            except FileNotFoundError:
+                fd = -1
+            if fd >= 0:
+                try:
+                    actual = os.fstat(fd).st_size
+                    if actual >= segment_size(0):
+                        self._map(fd, actual)
+                        magic, version, ring_bytes = struct.unpack_from("<IIQ", self.mapping, 0)
+                        if magic == MAGIC:
+                            if version != VERSION or actual != segment_size(ring_bytes):
+                                raise OSError(errno.EPROTO, "unsupported segment layout")
+                            self.ring_bytes = ring_bytes
+                            return True
+                        self._unmap()
+                finally:
+                    os.close(fd)
+            if time.monotonic() > deadline:
+                return False
+            time.sleep(0.01)
+
+    def _map(self, fd: int, size: int):
+        self.mapping = mmap.mmap(fd, size, mmap.MAP_SHARED, mmap.PROT_READ | mmap.PROT_WRITE)
+        # Keeps the mapping exported for as long as its address is in use
+        self._anchor = ctypes.c_char.from_buffer(self.mapping)
+        self._base = ctypes.addressof(self._anchor)
+
+    def _unmap(self):
+        mapping, self.mapping = self.mapping, None
+        self._anchor = None
+        self._base = 0
+        mapping.close()
+
+    def _unlink(self):
+        try:
+            os.unlink(_shm_path(self.name))
+        except FileNotFoundError:
+            pass
+        self.unlinked = True
+
+    def _ring(self, index: int) -> int:
+        return HEADER_SIZE + index * (CONTROL_SIZE + self.ring_bytes)
+
+    def _load64(self, offset: int) -> int:
+        if _libatomic:
+            return _atomic_load_8(ctypes.c_void_p(self._base + offset), _SEQ_CST)
+        return struct.unpack_from("<Q", self.mapping, offset)[0]
+
+    def _store64(self, offset: int, value: int):
+        if _libatomic:
+            _atomic_store_8(ctypes.c_void_p(self._base + offset), ctypes.c_uint64(value), _SEQ_CST)
+        else:
+            struct.pack_into("<Q", self.mapping, offset, value)
+
+    def _load32(self, offset: int) -> int:
+        if _libatomic:
+            return _atomic_load_4(ctypes.c_void_p(self._base + offset), _SEQ_CST)
+        return struct.unpack_from("<I", self.mapping, offset)[0]
+
+    def _store32(self, offset: int, value: int):
+        if _libatomic:
+            _atomic_store_4(ctypes.c_void_p(self._base + offset), ctypes.c_uint32(value), _SEQ_CST)
+        else:
+            struct.pack_into("<I", self.mapping, offset, value)
+
+    def _add32(self, offset: int):
+        if _libatomic:
+            _atomic_fetch_add_4(ctypes.c_void_p(self._base + offset), ctypes.c_uint32(1), _SEQ_CST)
+        else:
+            self._store32(offset, (self._load32(offset) + 1) & 0xFFFFFFFF)
+
+    def _futex(self, offset: int, op: int, value: int, timeout: Optional[float] = None):
+        if _SYS_FUTEX is None:
+            # Unknown architecture: fall back to polling
+            if op == _FUTEX_WAIT:
+                time.sleep(min(timeout or 0.001, 0.001))
+            return
+        spec = None
+        if timeout is not None:
+            spec = (ctypes.c_long * 2)(int(timeout), int((timeout % 1) * 1e9))
+        _libc.syscall(ctypes.c_long(_SYS_FUTEX), ctypes.c_void_p(self._base + offset),
+                      ctypes.c_int(op), ctypes.c_uint32(value), spec, None, ctypes.c_int(0))
+
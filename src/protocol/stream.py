@@ -0,0 +1,280 @@
+"""
+ReGenNexus Core - Streams
+
+This module implements the Python side of chunked streams (see
+docs/core_protocol.md): StreamSender cuts bytes into "stream" frames within
+the window the receiver grants, and StreamReceiver puts incoming frames back
+in order and produces the "stream_credit" frames that keep senders going.
+Frames are plain dicts with the stream data as bytes; json_frame() converts
+one for a JSON text connection.
+"""
+
+import base64
+import time
+import uuid
+from dataclasses import dataclass, field
+from typing import Any, Dict, List, Optional, Tuple
+
+DEFAULT_CHUNK_BYTES = 64 * 1024
+DEFAULT_WINDOW_BYTES = 1024 * 1024
+
+# Chunks held while an earlier one is missing before the stream is cancelled
+MAX_EARLY_CHUNKS = 64
+
+# Seconds a received stream may go without a frame before it is aborted
+DEFAULT_IDLE_TIMEOUT = 30.0
+
+
+def json_frame(frame: Dict[str, Any]) -> Dict[str, Any]:
+    """Return frame with its data base64-encoded, for JSON text encoding."""
+    data = frame.get("data")
+    if isinstance(data, (bytes, bytearray, memoryview)):
+        frame = dict(frame, data=base64.b64encode(data).decode("ascii"))
+    return frame
+
+
+def _frame_data(frame: Dict[str, Any]) -> bytes:
+    data = frame.get("data")
+    if data is None:
+        return b""
+    if isinstance(data, str):
+        return base64.b64decode(data)
+    return bytes(data)
+
+
+class StreamSender:
+    """The sending end of one stream."""
+
+    def __init__(self, sender: str, recipient: str, intent: str,
+                 header: Optional[Dict[str, Any]] = None,
+                 chunk_bytes: int = DEFAULT_CHUNK_BYTES,
+                 window_bytes: int = DEFAULT_WINDOW_BYTES):
+        """
+        Initialize the stream.
+
+        Args:
+            sender: Our entity id
+            recipient: Receiving entity
+            intent: Intent the receiver's stream handler is registered for
+            header: Payload handed to the receiver before any data
+            chunk_bytes: Largest chunk per frame
+            window_bytes: Bytes that may be sent before being acknowledged
+        """
+        self.id = str(uuid.uuid4())
+        self.sender = sender
+        self.recipient = recipient
+        self.intent = intent
+        self.header = header or {}
+        self.chunk_bytes = max(1, chunk_bytes)
+        self.window_bytes = max(window_bytes, self.chunk_bytes)
+        self.next_seq = 0
+        self.sent = 0
+        self.acknowledged = 0
+        self.finished = False
+        self.cancel_reason: Optional[str] = None
+
+    def _frame(self, **fields) -> Dict[str, Any]:
+        frame = {
+            "type": "stream",
+            "id": str(uuid.uuid4()),
+            "sender": self.sender,
+            "recipient": self.recipient,
+            "intent": self.intent,
+            "stream": self.id,
+            "seq": self.next_seq,
+            "ts_ns": time.time_ns(),
+        }
+        frame.update(fields)
+        self.next_seq += 1
+        return frame
+
+    def open_frame(self) -> Dict[str, Any]:
+        """The first frame, carrying the header; send it before any data."""
+        return self._frame(payload=self.header, window=self.window_bytes)
+
+    def available(self) -> int:
+        """Bytes that may be sent now."""
+        if self.finished:
+            return 0
+        return self.acknowledged + self.window_bytes - self.sent
+
+    def data_frames(self, data: bytes) -> Tuple[List[Dict[str, Any]], bytes]:
+        """
+        Cut data into frames the window allows.
+
+        Args:
+            data: Bytes to send
+
+        Returns:
+            The frames to send now and the bytes that must wait for credit
+        """
+        frames = []
+        view = memoryview(data)
+        while view and self.available() > 0:
+            size = min(len(view), self.chunk_bytes, self.available())
+            frames.append(self._frame(data=bytes(view[:size])))
+            self.sent += size
+            view = view[size:]
+        return frames, bytes(view)
+
+    def end_frame(self) -> Dict[str, Any]:
+        """The last frame of a stream that completed."""
+        self.finished = True
+        return self._frame(end=True)
+
+    def abort_frame(self, reason: str = "Aborted by sender") -> Dict[str, Any]:
+        """The last frame of a stream given up on."""
+        self.finished = True
+        return self._frame(abort=reason)
+
+    def apply_credit(self, frame: Dict[str, Any]):
+        """
+        Apply a stream_credit frame from the receiver.
+
+        Args:
+            frame: Decoded frame whose "stream" is this stream's id
+        """
+        self.acknowledged = max(self.acknowledged, int(frame.get("received", 0)))
+        if frame.get("cancel"):
+            self.finished = True
+            self.cancel_reason = frame["cancel"]
+
+
+@dataclass
+class StreamEvent:
+    """One chunk of a received stream, in order."""
+    stream_id: str
+    sender: str
+    intent: str
+    header: Dict[str, Any]
+    data: bytes
+    ended: bool = False
+    aborted: bool = False
+    abort_reason: str = ""
+
+
+@dataclass
+class _InboundStream:
+    sender: str
+    intent: str
+    header: Dict[str, Any] = field(default_factory=dict)
+    next_seq: int = 0
+    window: int = 0
+    received: int = 0
+    acknowledged: int = 0
+    early: Dict[int, Dict[str, Any]] = field(default_factory=dict)
+    last_activity: float = field(default_factory=time.monotonic)
+
+
+class StreamReceiver:
+    """Reassembles the streams addressed to one entity."""
+
+    def __init__(self, entity_id: str, idle_timeout: float = DEFAULT_IDLE_TIMEOUT):
+        """
+        Initialize the receiver.
+
+        Args:
+            entity_id: Our entity id, the sender of credit frames
+            idle_timeout: Seconds without a frame after which a stream is
+                aborted, checked whenever a new stream opens
+        """
+        self.entity_id = entity_id
+        self.idle_timeout = idle_timeout
+        self.streams: Dict[Tuple[str, str], _InboundStream] = {}
+
+    def feed(self, frame: Dict[str, Any]) -> Tuple[List[StreamEvent], List[Dict[str, Any]]]:
+        """
+        Take one stream frame.
+
+        Args:
+            frame: Decoded frame with type "stream"
+
+        Returns:
+            Events now deliverable in order, after those of any streams
+            that timed out, and credit frames to send back
+        """
+        key = (frame.get("sender", ""), frame["stream"])
+        seq = int(frame["seq"])
+        expired = []
+        state = self.streams.get(key)
+        if state is None:
+            # Only the opening frame starts a stream; anything else belongs
+            # to one that has finished, been cancelled or timed out
+            if seq != 0:
+                return [], []
+            expired = self._take_idle_streams()
+            state = self.streams[key] = _InboundStream(sender=key[0], intent=frame.get("intent", ""))
+        state.last_activity = time.monotonic()
+        events, credits = self._feed(key, state, seq, frame)
+        return expired + events, credits
+
+    def _feed(self, key, state: _InboundStream, seq: int,
+              frame: Dict[str, Any]) -> Tuple[List[StreamEvent], List[Dict[str, Any]]]:
+        if seq < state.next_seq:
+            return [], []
+        if seq > state.next_seq:
+            if len(state.early) >= MAX_EARLY_CHUNKS:
+                return [], [self.cancel(key[0], key[1], "Too many chunks out of order")]
+            state.early[seq] = frame
+            return [], []
+
+        events = []
+        while frame is not None:
+            events.append(self._deliver(key, state, frame))
+            if events[-1].ended or events[-1].aborted:
+                del self.streams[key]
+                return events, []
+            frame = state.early.pop(state.next_seq, None)
+
+        credits = []
+        if state.window and state.received - state.acknowledged >= max(state.window // 4, 1):
+            state.acknowledged = state.received
+            credits.append(self._credit(key[0], key[1], state.received))
+        return events, credits
+
+    def cancel(self, sender: str, stream_id: str, reason: str) -> Dict[str, Any]:
+        """
+        Stop receiving a stream.
+
+        Returns:
+            The credit frame that tells the sender to stop
+        """
+        state = self.streams.pop((sender, stream_id), None)
+        return self._credit(sender, stream_id, state.received if state else 0, reason)
+
+    def _take_idle_streams(self) -> List[StreamEvent]:
+        cutoff = time.monotonic() - self.idle_timeout
+        idle = [key for key, state in self.streams.items() if state.last_activity < cutoff]
+        events = []
+        for key in idle:
+            state = self.streams.pop(key)
+            events.append(StreamEvent(stream_id=key[1], sender=state.sender, intent=state.intent,
+                                      header=state.header, data=b"", aborted=True, abort_reason="Timed out"))
+        return events
+
+    def _deliver(self, key, state: _InboundStream, frame: Dict[str, Any]) -> StreamEvent:
+        if state.next_seq == 0:
+            state.header = frame.get("payload") or {}
+            state.window = int(frame.get("window", 0))
+        state.next_seq += 1
+        data = _frame_data(frame)
+        state.received += len(data)
+        return StreamEvent(stream_id=key[1], sender=state.sender, intent=state.intent,
+                           header=state.header, data=data, ended=bool(frame.get("end")),
+                           aborted=bool(frame.get("abort")), abort_reason=frame.get("abort", ""))
+
+    def _credit(self, recipient: str, stream_id: str, received: int,
+                cancel: Optional[str] = None) -> Dict[str, Any]:
+        frame = {
+            "type": "stream_credit",
+            "id": str(uuid.uuid4()),
+            "sender": self.entity_id,
+            "recipient": recipient,
+            "reply_to": stream_id,
+            "stream": stream_id,
+            "received": received,
+            "ts_ns": time.time_ns(),
+        }
+        if cancel:
+            frame["cancel"] = cancel
+        return frame
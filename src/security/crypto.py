@@ -25,11 +25,16 @@ logger = logging.getLogger(__name__)
 class CryptoManager:
     """Cryptography manager for ReGenNexus Core."""
     
+    # Keys kept per pair of entities for epochs above 0, as the C++ client
+    # does; older epochs are derived again if a message still needs one
+    MAX_EPOCH_KEYS = 4
+    
     def __init__(self):
         """Initialize the crypto manager."""
         self.private_keys = {}  # entity_id -> private_key
         self.public_keys = {}   # entity_id -> public_key
-        self.shared_keys = {}   # (local_id, remote_id) -> shared_key
+        self.shared_keys = {}   # (local_id, remote_id[, epoch]) -> shared_key
+        self.key_epochs = {}    # (local_id, remote_id) -> epochs above 0 in shared_keys
     
     async def generate_keypair(self, entity_id: str) -> Tuple[bytes, bytes]:
         """
@@ -143,20 +148,23 @@ class CryptoManager:
             logger.error(f"Error importing public key: {e}")
             return False
     
-    async def derive_shared_key(self, local_id: str, remote_id: str) -> Optional[bytes]:
+    async def derive_shared_key(self, local_id: str, remote_id: str,
+                                epoch: int = 0) -> Optional[bytes]:
         """
         Derive a shared key between two entities.
         
         Args:
             local_id: Local entity ID
             remote_id: Remote entity ID
+            epoch: Key epoch; peers that rekey (such as the C++ client) send
+                   'key_epoch' with their messages, and epochs above 0 salt HKDF
             
         Returns:
             Derived shared key or None if error
         """
         try:
             # Check if we already have a shared key
-            key_pair = (local_id, remote_id)
+            key_pair = (local_id, remote_id) if epoch == 0 else (local_id, remote_id, epoch)
             if key_pair in self.shared_keys:
                 return self.shared_keys[key_pair]
             
@@ -180,12 +188,18 @@ class CryptoManager:
             derived_key = HKDF(
                 algorithm=hashes.SHA384(),
                 length=32,  # 256 bits for AES-256
-                salt=None,
+                salt=epoch.to_bytes(8, 'big') if epoch else None,
                 info=b'ReGenNexus-ECDH-Key'
             ).derive(shared_secret)
             
-            # Store shared key
+            # Store shared key, evicting the lowest epoch beyond the limit
             self.shared_keys[key_pair] = derived_key
+            if epoch:
+                epochs = self.key_epochs.setdefault((local_id, remote_id), [])
+                epochs.append(epoch)
+                if len(epochs) > self.MAX_EPOCH_KEYS:
+                    epochs.sort()
+                    del self.shared_keys[(local_id, remote_id, epochs.pop(0))]
             
             logger.debug(f"Derived shared key between {local_id} and {remote_id}")
             return derived_key
@@ -330,7 +344,8 @@ class CryptoManager:
                 raise ValueError("Encrypted message has no sender")
             
             # Derive shared key
-            shared_key = await self.derive_shared_key(recipient_id, sender_id)
+            shared_key = await self.derive_shared_key(recipient_id, sender_id,
+                                                      int(encrypted_message.get('key_epoch', 0)))
             if not shared_key:
                 raise ValueError(f"Could not derive shared key between {recipient_id} and {sender_id}")
             
@@ -345,8 +360,11 @@ class CryptoManager:
             if not decrypted_json:
                 raise ValueError("Could not decrypt message")
             
-            # Parse JSON
+            # Parse JSON; the key only vouches for the outer sender
             decrypted_message = json.loads(decrypted_json)
+            inner_sender = decrypted_message.get('sender', sender_id) if isinstance(decrypted_message, dict) else sender_id
+            if inner_sender != sender_id:
+                raise ValueError(f"Encrypted message from {sender_id} claims to be from {inner_sender}")
             
             logger.debug(f"Decrypted message from {sender_id} to {recipient_id}")
             return decrypted_message
@@ -15,7 +15,6 @@ from typing import Dict, Tuple, Optional, Any, List
 from Crypto.PublicKey import RSA, ECC
 from Crypto.Cipher import AES, PKCS1_OAEP
 from Crypto.Random import get_random_bytes
-from Crypto.Protocol.DiffieHellman import DHParameterNumbers
 from Crypto.Hash import SHA384
 from Crypto.Signature import DSS
 from Crypto.Util.Padding import pad, unpad
@@ -0,0 +1,18 @@
+"""
+Test configuration for ReGenNexus Core.
+
+The sources under src/ are imported as the regennexus package, as they are
+once installed (see Dockerfile.core), so the tests run from a checkout
+without installing anything.
+"""
+
+import os
+import sys
+import types
+
+SRC = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))), "src")
+
+if "regennexus" not in sys.modules:
+    package = types.ModuleType("regennexus")
+    package.__path__ = [SRC]
+    sys.modules["regennexus"] = package
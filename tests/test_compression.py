@@ -0,0 +1,128 @@
+"""Tests for dictionary compression of frames."""
+
+import json
+import os
+import struct
+
+import pytest
+
+pytest.importorskip("zstandard")
+
+from regennexus.protocol.compression import (MAX_DECOMPRESSED_BYTES, ZSTD_MAGIC, FrameCompressor, dictionary_id,
+                                             is_compressed, negotiate_compression, train_dictionary)
+
+DICT_ID = 4242
+
+
+def telemetry(i):
+    return json.dumps({
+        "id": f"01a13d2e-{i:04x}-7000-8000-{i * 7919:012x}",
+        "type": "message",
+        "sender": f"sensor-{i % 12}",
+        "recipient": "collector",
+        "intent": "telemetry.reading",
+        "ts_ns": 1760000000000000000 + i * 1000003,
+        "payload": {"temperature": 20 + (i % 50) / 10, "humidity": 40 + i % 30, "unit": "celsius"},
+    }, separators=(",", ":"))
+
+
+@pytest.fixture(scope="module")
+def dictionary():
+    samples = [telemetry(i).encode("utf-8") for i in range(2000)]
+    return train_dictionary(samples, size=2048, dict_id=DICT_ID)
+
+
+def test_trained_dictionary_carries_its_id(dictionary):
+    assert dictionary_id(dictionary) == DICT_ID
+
+
+def test_text_frame_round_trip(dictionary):
+    compressor = FrameCompressor([dictionary], dictionary=DICT_ID, threshold=64)
+    frame = telemetry(5000)
+
+    compressed = compressor.compress(frame)
+
+    assert is_compressed(compressed)
+    assert compressed[:4] == ZSTD_MAGIC
+    assert len(compressed) < len(frame)
+    assert compressor.decompress(compressed) == frame
+
+
+def test_binary_frame_round_trip(dictionary):
+    compressor = FrameCompressor([dictionary], dictionary=DICT_ID, threshold=64)
+    # Stands in for a CBOR envelope: map header, then repetitive content
+    frame = b"\xa7" + telemetry(7).encode("utf-8") * 2
+
+    restored = compressor.decompress(compressor.compress(frame))
+
+    assert isinstance(restored, bytes)
+    assert restored == frame
+
+
+def test_dictionary_beats_plain_zstd_on_small_frames(dictionary):
+    with_dictionary = FrameCompressor([dictionary], dictionary=DICT_ID, threshold=0)
+    frame = telemetry(6000).encode("utf-8")
+
+    import zstandard
+    plain = zstandard.ZstdCompressor(level=3).compress(frame)
+
+    assert len(with_dictionary.compress(frame)) < len(plain)
+
+
+def test_small_and_incompressible_frames_are_sent_as_they_are(dictionary):
+    compressor = FrameCompressor([dictionary], dictionary=DICT_ID, threshold=128)
+    assert compressor.compress('{"type":"ping"}') == '{"type":"ping"}'
+
+    noise = os.urandom(512)
+    assert compressor.compress(noise) == noise
+
+
+def test_receiving_side_needs_the_dictionary(dictionary):
+    sender = FrameCompressor([dictionary], dictionary=DICT_ID, threshold=0)
+    compressed = sender.compress(telemetry(1))
+
+    receiver = FrameCompressor([dictionary])
+    assert receiver.compress(telemetry(1)) == telemetry(1)
+    assert receiver.decompress(compressed) == telemetry(1)
+
+    with pytest.raises(ValueError):
+        FrameCompressor([]).decompress(compressed)
+
+
+def test_uncompressed_frames_pass_through(dictionary):
+    compressor = FrameCompressor([dictionary])
+    assert compressor.decompress('{"type":"ping"}') == '{"type":"ping"}'
+    assert compressor.decompress(b"\xa1\x64type") == b"\xa1\x64type"
+    assert not is_compressed('{"type":"ping"}')
+
+
+def test_frames_without_a_usable_size_are_rejected(dictionary):
+    compressor = FrameCompressor([dictionary])
+
+    # Single-segment header declaring a terabyte, then one empty last block
+    declared = ZSTD_MAGIC + b"\xe0" + struct.pack("<Q", 1 << 40) + b"\x01\x00\x00"
+    with pytest.raises(ValueError):
+        compressor.decompress(declared)
+
+    over = ZSTD_MAGIC + b"\xe0" + struct.pack("<Q", MAX_DECOMPRESSED_BYTES + 1) + b"\x01\x00\x00"
+    with pytest.raises(ValueError):
+        compressor.decompress(over)
+
+    import zstandard
+    unsized = zstandard.ZstdCompressor(write_content_size=False).compress(telemetry(3).encode("utf-8"))
+    with pytest.raises(ValueError):
+        compressor.decompress(unsized)
+
+
+def test_unknown_dictionary_is_rejected(dictionary):
+    with pytest.raises(ValueError):
+        FrameCompressor([dictionary], dictionary=DICT_ID + 1)
+
+
+def test_negotiation_picks_the_first_shared_dictionary():
+    dictionaries = {7: b"", 9: b""}
+    assert negotiate_compression({"algorithm": "zstd", "dictionaries": [3, 9, 7]}, dictionaries) == \
+        {"algorithm": "zstd", "dictionary": 9}
+    assert negotiate_compression({"algorithm": "zstd", "dictionaries": [3]}, dictionaries) is None
+    assert negotiate_compression({"algorithm": "lz4", "dictionaries": [7]}, dictionaries) is None
+    assert negotiate_compression(None, dictionaries) is None
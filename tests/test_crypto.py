@@ -0,0 +1,55 @@
+"""Tests for CryptoManager's shared keys and envelope decryption."""
+
+import asyncio
+
+import pytest
+
+pytest.importorskip("cryptography")
+
+from regennexus.security.crypto import CryptoManager
+
+
+def crypto_for(*entity_ids):
+    crypto = CryptoManager()
+    for entity_id in entity_ids:
+        asyncio.run(crypto.generate_keypair(entity_id))
+    return crypto
+
+
+def test_epoch_keys_are_bounded_per_pair():
+    crypto = crypto_for("alice", "bob")
+    first = asyncio.run(crypto.derive_shared_key("bob", "alice", 1))
+    for epoch in range(2, 11):
+        assert asyncio.run(crypto.derive_shared_key("bob", "alice", epoch)) is not None
+
+    kept = sorted(key[2] for key in crypto.shared_keys if len(key) == 3)
+    assert kept == [7, 8, 9, 10]
+    # Evicted epochs are derived again, to the same key
+    assert asyncio.run(crypto.derive_shared_key("bob", "alice", 1)) == first
+    assert len([key for key in crypto.shared_keys if len(key) == 3]) == CryptoManager.MAX_EPOCH_KEYS
+
+
+def test_epoch_zero_key_is_kept():
+    crypto = crypto_for("alice", "bob")
+    base = asyncio.run(crypto.derive_shared_key("bob", "alice"))
+    for epoch in range(1, 20):
+        asyncio.run(crypto.derive_shared_key("bob", "alice", epoch))
+    assert crypto.shared_keys[("bob", "alice")] == base
+
+
+def test_decrypt_returns_the_inner_envelope():
+    crypto = crypto_for("alice", "bob")
+    message = {"id": "m1", "sender": "alice", "recipient": "bob", "intent": "ping", "payload": {}}
+    encrypted = asyncio.run(crypto.encrypt_message("alice", "bob", message))
+    assert encrypted["encrypted"] is True
+
+    assert asyncio.run(crypto.decrypt_message("bob", encrypted)) == message
+
+
+def test_decrypt_rejects_a_spoofed_inner_sender():
+    crypto = crypto_for("alice", "bob", "carol")
+    # alice holds a valid key with bob but claims to be carol inside
+    message = {"id": "m1", "sender": "carol", "recipient": "bob", "intent": "ping", "payload": {}}
+    encrypted = asyncio.run(crypto.encrypt_message("alice", "bob", message))
+
+    assert asyncio.run(crypto.decrypt_message("bob", encrypted)) is None
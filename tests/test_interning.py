@@ -0,0 +1,118 @@
+"""Tests for the registry side of interned names."""
+
+import pytest
+
+from regennexus.protocol.interning import MAX_HANDLE, SessionNames
+
+
+def envelope(sender="camera-1", recipient="planner", intent="frame"):
+    return {"type": "message", "sender": sender, "recipient": recipient, "intent": intent,
+            "payload": {"value": 1}}
+
+
+def test_fresh_names_get_sequential_handles():
+    names = SessionNames()
+
+    definitions = names.accept({"entities": {"camera-1": None, "planner": None}, "intents": {"frame": None}})
+
+    assert definitions == {"entities": {"camera-1": 0, "planner": 1}, "intents": {"frame": 0}}
+
+
+def test_known_names_keep_their_handle():
+    names = SessionNames()
+    names.accept({"entities": {"camera-1": None}})
+
+    assert names.accept({"entities": {"camera-1": None}}) == {"entities": {"camera-1": 0}, "intents": {}}
+    assert names.accept({"entities": {"camera-1": 5}}) == {"entities": {"camera-1": 0}, "intents": {}}
+
+
+def test_reconnect_keeps_proposed_handles():
+    # A new session after a reconnect: the client proposes the handles its
+    # queued frames may still carry
+    names = SessionNames()
+
+    definitions = names.accept({"entities": {"fresh": None, "camera-1": 1, "planner": 0},
+                                "intents": {"frame": 3}})
+
+    assert definitions == {"entities": {"camera-1": 1, "planner": 0, "fresh": 2}, "intents": {"frame": 3}}
+    assert names.resolve({"sender": 1, "recipient": 0, "intent": 3}) == \
+        {"sender": "camera-1", "recipient": "planner", "intent": "frame"}
+
+
+def test_conflicting_or_invalid_proposals_get_new_handles():
+    names = SessionNames()
+    names.accept({"entities": {"camera-1": 0}})
+
+    definitions = names.accept({"entities": {"planner": 0, "huge": MAX_HANDLE + 1, "negative": -1}})
+
+    assert definitions["entities"] == {"planner": 1, "huge": 2, "negative": 3}
+
+
+def test_invalid_names_are_skipped():
+    names = SessionNames()
+    assert names.accept({"entities": {"": None}, "intents": None}) == {"entities": {}, "intents": {}}
+
+
+def test_handles_run_out_at_the_limit():
+    names = SessionNames()
+    names.accept({"intents": {f"intent-{i}": None for i in range(MAX_HANDLE + 1)}})
+
+    assert names.accept({"intents": {"one-too-many": None}}) == {"entities": {}, "intents": {}}
+    frame, compacted = names.compact(envelope(intent="one-too-many"))
+    assert compacted["intent"] == "one-too-many"
+    assert "intents" not in frame
+
+
+def test_compact_sends_definitions_once():
+    names = SessionNames()
+
+    frame, compacted = names.compact(envelope())
+
+    assert frame == {"type": "intern", "entities": {"camera-1": 0, "planner": 1}, "intents": {"frame": 0}}
+    assert compacted == {"type": "message", "sender": 0, "recipient": 1, "intent": 0, "payload": {"value": 1}}
+
+    frame, again = names.compact(envelope())
+    assert frame is None
+    assert again == compacted
+
+
+def test_compact_without_assigning():
+    names = SessionNames()
+    names.accept({"entities": {"camera-1": None}})
+
+    frame, compacted = names.compact(envelope(), assign=False)
+
+    assert frame is None
+    assert compacted["sender"] == 0
+    assert compacted["recipient"] == "planner"
+    assert compacted["intent"] == "frame"
+
+
+def test_batches_round_trip():
+    names = SessionNames()
+    batch = {"type": "batch", "messages": [envelope(), envelope(sender="camera-2", intent="depth"), "junk"]}
+
+    frame, compacted = names.compact(batch)
+
+    assert frame["entities"] == {"camera-1": 0, "planner": 1, "camera-2": 2}
+    assert [message["intent"] for message in compacted["messages"][:2]] == [0, 1]
+    assert compacted["messages"][2] == "junk"
+    assert names.resolve(compacted) == batch
+
+
+def test_resolve_leaves_strings_and_booleans_alone():
+    names = SessionNames()
+    names.accept({"entities": {"camera-1": None}})
+
+    assert names.resolve(envelope()) == envelope()
+    assert names.resolve({"sender": True}) == {"sender": True}
+
+
+def test_resolve_rejects_unassigned_handles():
+    names = SessionNames()
+    names.accept({"entities": {"camera-1": None}})
+
+    with pytest.raises(KeyError):
+        names.resolve({"sender": 0, "recipient": 4})
+    with pytest.raises(KeyError):
+        names.resolve({"intent": 0})
@@ -0,0 +1,97 @@
+"""Tests for the registry-side bookkeeping in ProtocolCore."""
+
+import asyncio
+
+import pytest
+
+pytest.importorskip("Crypto")
+
+from regennexus.protocol.protocol_core import Entity, ProtocolCore
+
+
+def register(core, entity_id, capabilities=(), discovery=False):
+    """Register an entity the way the registry does on a registration frame."""
+    asyncio.run(core.register_entity(Entity(entity_id)))
+    return core.apply_directory_frame(entity_id, {
+        "type": "registration",
+        "entity_type": "device",
+        "capabilities": list(capabilities),
+        "discovery": discovery,
+    })
+
+
+def test_unregister_removes_the_directory_entry():
+    core = ProtocolCore()
+    register(core, "watcher", discovery=True)
+    register(core, "camera-1", ["camera"])
+    assert [entry["entity_id"] for entry in core.find_entities(capabilities=["camera"])] == ["camera-1"]
+
+    outgoing = asyncio.run(core.unregister_entity("camera-1"))
+
+    assert core.find_entities(capabilities=["camera"]) == []
+    assert "camera-1" not in core.directory_snapshot()["entities"]
+    assert outgoing == [("watcher", {"type": "directory", "version": core.directory_version,
+                                     "entities": {"camera-1": None}})]
+
+
+def test_unregister_stops_watching():
+    core = ProtocolCore()
+    register(core, "watcher", discovery=True)
+    asyncio.run(core.unregister_entity("watcher"))
+
+    assert "watcher" not in core.directory_watchers
+    assert register(core, "camera-1", ["camera"]) == []
+
+
+def register_shm(core, entity_id, host_id="host-a"):
+    """Register an entity that offers shared memory, returning the offers."""
+    register(core, entity_id, discovery=True)
+    return core.register_transports(entity_id, {"host_id": host_id, "transports": ["shm"]})
+
+
+TRANSPORT_CLOSE = ("peer-1", {"type": "transport_close", "transport": "shm", "peer": "camera-1"})
+
+
+def test_unregister_closes_same_host_transports():
+    core = ProtocolCore()
+    register_shm(core, "peer-1")
+    register_shm(core, "elsewhere", host_id="host-b")
+    assert len(register_shm(core, "camera-1")) == 2
+
+    outgoing = asyncio.run(core.unregister_entity("camera-1"))
+
+    assert outgoing[0] == TRANSPORT_CLOSE
+    assert sorted(recipient for recipient, _ in outgoing[1:]) == ["elsewhere", "peer-1"]
+    assert all(frame["type"] == "directory" for _, frame in outgoing[1:])
+    assert "camera-1" not in core.transports
+
+
+def test_release_transports_before_unregister():
+    core = ProtocolCore()
+    register_shm(core, "peer-1")
+    register_shm(core, "camera-1")
+
+    assert core.release_transports("camera-1") == [TRANSPORT_CLOSE]
+    outgoing = asyncio.run(core.unregister_entity("camera-1"))
+
+    assert [frame["type"] for _, frame in outgoing] == ["directory"]
+
+
+def test_release_transports_after_unregister():
+    core = ProtocolCore()
+    register_shm(core, "peer-1")
+    register_shm(core, "camera-1")
+
+    outgoing = asyncio.run(core.unregister_entity("camera-1"))
+
+    assert TRANSPORT_CLOSE in outgoing
+    assert core.release_transports("camera-1") == []
+
+
+def test_unregister_unknown_entity_sends_nothing():
+    core = ProtocolCore()
+    register(core, "watcher", discovery=True)
+    version = core.directory_version
+
+    assert asyncio.run(core.unregister_entity("nobody")) == []
+    assert core.directory_version == version
@@ -0,0 +1,60 @@
+"""Tests for stream reassembly on the receiving side."""
+
+from regennexus.protocol.stream import StreamReceiver, StreamSender
+
+
+def opened(receiver, sender):
+    events, _ = receiver.feed(sender.open_frame())
+    return events
+
+
+def test_chunks_are_reordered():
+    sender = StreamSender("camera-1", "planner", "file", header={"name": "blob.bin"}, window_bytes=1000)
+    receiver = StreamReceiver("planner")
+    assert [event.header for event in opened(receiver, sender)] == [{"name": "blob.bin"}]
+    frames, _ = sender.data_frames(b"abcdef")
+    last = sender.end_frame()
+
+    assert receiver.feed(last) == ([], [])
+    events, _ = receiver.feed(frames[0])
+
+    assert [(event.data, event.ended) for event in events] == [(b"abcdef", False), (b"", True)]
+    assert receiver.streams == {}
+
+
+def test_frames_before_the_opening_frame_are_dropped():
+    sender = StreamSender("camera-1", "planner", "file")
+    receiver = StreamReceiver("planner")
+    opening = sender.open_frame()
+    frames, _ = sender.data_frames(b"late")
+
+    assert receiver.feed(frames[0]) == ([], [])
+    assert receiver.streams == {}
+    assert [event.data for event in receiver.feed(opening)[0]] == [b""]
+
+
+def test_stragglers_after_cancel_are_dropped():
+    sender = StreamSender("camera-1", "planner", "file")
+    receiver = StreamReceiver("planner")
+    opened(receiver, sender)
+    frames, _ = sender.data_frames(b"data")
+
+    credit = receiver.cancel("camera-1", sender.id, "Disk full")
+
+    assert credit["cancel"] == "Disk full"
+    assert receiver.feed(frames[0]) == ([], [])
+    assert receiver.streams == {}
+
+
+def test_idle_streams_time_out_when_another_opens():
+    receiver = StreamReceiver("planner", idle_timeout=30.0)
+    idle = StreamSender("camera-1", "planner", "file")
+    opened(receiver, idle)
+    receiver.streams[("camera-1", idle.id)].last_activity -= 60
+
+    fresh = StreamSender("camera-2", "planner", "file")
+    events = opened(receiver, fresh)
+
+    assert [(event.stream_id, event.aborted, event.abort_reason) for event in events] == \
+        [(idle.id, True, "Timed out"), (fresh.id, False, "")]
+    assert list(receiver.streams) == [("camera-2", fresh.id)]